@@ -1346,6 +1346,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.flash_attn = true;
         }
     ).set_env("LLAMA_ARG_FLASH_ATTN"));
+    add_opt(common_arg(
+        {"--decode-pipeline"},
+        string_format("build the graph of the next ubatch while the current one is computed [EXPERIMENTAL] (default: %s)", params.decode_pipeline ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.decode_pipeline = true;
+        }
+    ).set_env("LLAMA_ARG_DECODE_PIPELINE"));
     add_opt(common_arg(
         {"-p", "--prompt"}, "PROMPT",
         "prompt to start generation with; for system message, use -sys",
@@ -2060,6 +2067,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-sink"}, "N",
+        string_format("streaming KV cache: number of attention sink tokens kept at the start of each sequence (default: %d)", params.n_kv_sink),
+        [](common_params & params, int value) {
+            params.n_kv_sink = value;
+        }
+    ).set_env("LLAMA_ARG_KV_SINK"));
+    add_opt(common_arg(
+        {"--kv-window"}, "N",
+        string_format("streaming KV cache: number of most recent tokens kept for each sequence, older tokens are evicted instead of shifting the context\n"
+                      "(default: %d, 0 = rest of the context when --kv-sink is set, the streaming KV cache is disabled if both are 0)", params.n_kv_window),
+        [](common_params & params, int value) {
+            params.n_kv_window = value;
+        }
+    ).set_env("LLAMA_ARG_KV_WINDOW"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2324,6 +2346,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         }
         // we define this arg on both COMMON and EXPORT_LORA, so when showing help message of export-lora, it will be categorized as "example-specific" arg
     ).set_examples({LLAMA_EXAMPLE_COMMON, LLAMA_EXAMPLE_EXPORT_LORA}));
+    add_opt(common_arg(
+        {"--model-lora"}, "NAME", "FNAME",
+        "serve a fine-tune of the model under NAME, selected with the \"model\" field of the requests\n"
+        "the LoRA adapter FNAME is loaded on first use (can be repeated to serve multiple fine-tunes)",
+        [](common_params & params, const std::string & name, const std::string & fname) {
+            params.models_lora.push_back({ name, fname });
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--model-lora-budget"}, "N",
+        string_format("max memory in MiB of the loaded fine-tunes (with their F32 copies for batching), the least recently used ones are unloaded (default: %d, 0 = unlimited)", params.models_lora_budget),
+        [](common_params & params, int value) {
+            params.models_lora_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_LORA_BUDGET"));
     add_opt(common_arg(
         {"--control-vector"}, "FNAME",
         "add a control vector\nnote: this argument can be repeated to add multiple control vectors",
@@ -2616,6 +2653,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             key_file.close();
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--api-key-weight"}, "KEY", "WEIGHT",
+        "share of the slots given to the requests of an API key when requests are waiting for a slot (default: 1, can be repeated)",
+        [](common_params & params, const std::string & key, const std::string & weight) {
+            params.api_key_weights[key] = std::stof(weight);
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"--ssl-key-file"}, "FNAME",
         "path to file a PEM-encoded SSL private key",
@@ -2652,6 +2696,28 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens to process per iteration while other requests are generating tokens,\n"
+                      "bounds the inter-token latency under mixed load (default: %d, 0 = batch size)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--queue-max"}, "N",
+        string_format("max number of requests waiting for a slot, further requests are rejected with 503 (default: %d, 0 = unlimited)", params.n_queue_max),
+        [](common_params & params, int value) {
+            params.n_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_QUEUE_MAX"));
+    add_opt(common_arg(
+        {"--queue-timeout"}, "N",
+        string_format("max time in ms a request can wait for a slot, requests expected to wait longer are rejected with 503 (default: %d, 0 = unlimited)", params.queue_timeout),
+        [](common_params & params, int value) {
+            params.queue_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_QUEUE_TIMEOUT"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2691,6 +2757,27 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--kv-disk-cache"}, "PATH",
+        "directory of a persistent KV cache of the prompts, restored when a new prompt shares a long prefix with a stored one (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_disk_cache_path = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_DISK_CACHE"));
+    add_opt(common_arg(
+        {"--kv-disk-cache-size"}, "N",
+        string_format("max size in MiB of the KV disk cache, the least recently used prompts are evicted (default: %d)", params.kv_disk_cache_size),
+        [](common_params & params, int value) {
+            params.kv_disk_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_DISK_CACHE_SIZE"));
+    add_opt(common_arg(
+        {"--kv-disk-cache-min"}, "N",
+        string_format("min number of tokens of the prompts stored in the KV disk cache, and of the prefixes restored from it (default: %d)", params.kv_disk_cache_min),
+        [](common_params & params, int value) {
+            params.kv_disk_cache_min = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_DISK_CACHE_MIN"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
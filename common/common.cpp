@@ -1036,6 +1036,15 @@ void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adap
     }
 }
 
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora) {
+    llama_clear_adapter_lora_seq(ctx, seq_id);
+    for (auto & la : lora) {
+        if (la.scale != 0.0f) {
+            llama_set_adapter_lora_seq(ctx, la.ptr, seq_id, la.scale);
+        }
+    }
+}
+
 struct llama_model_params common_model_params_to_llama(common_params & params) {
     auto mparams = llama_model_default_params();
 
@@ -1094,11 +1103,14 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_kv_sink         = params.n_kv_sink;
+    cparams.n_kv_window       = params.n_kv_window;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
     cparams.no_perf           = params.no_perf;
+    cparams.decode_pipeline   = params.decode_pipeline;
 
     if (params.reranking) {
         cparams.embeddings    = true;
@@ -1247,6 +1259,48 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+                  const struct llama_vocab * vocab,
+          const std::vector<std::string> & texts,
+                                     bool   add_special,
+                                     bool   parse_special,
+                                      int   n_threads) {
+    const int32_t n_texts = texts.size();
+
+    std::vector<const char *> text_ptrs(n_texts);
+    std::vector<int32_t>      text_lens(n_texts);
+
+    // upper limit for the number of tokens, as in common_tokenize
+    std::vector<std::vector<llama_token>> result(n_texts);
+    std::vector<llama_token *> token_ptrs(n_texts);
+    std::vector<int32_t>       n_tokens_max(n_texts);
+    std::vector<int32_t>       n_tokens(n_texts);
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        text_ptrs[i] = texts[i].data();
+        text_lens[i] = texts[i].length();
+        result[i].resize(texts[i].length() + 2 * add_special);
+        token_ptrs[i]   = result[i].data();
+        n_tokens_max[i] = result[i].size();
+    }
+
+    if (llama_tokenize_batch(vocab, text_ptrs.data(), text_lens.data(), n_texts, token_ptrs.data(), n_tokens_max.data(), n_tokens.data(), add_special, parse_special, n_threads) < 0) {
+        // tokenize again the texts that did not fit
+        for (int32_t i = 0; i < n_texts; ++i) {
+            if (n_tokens[i] < 0) {
+                result[i] = common_tokenize(vocab, texts[i], add_special, parse_special);
+                n_tokens[i] = result[i].size();
+            }
+        }
+    }
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        result[i].resize(n_tokens[i]);
+    }
+
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
@@ -1254,19 +1308,44 @@ std::string common_token_to_piece(const struct llama_context * ctx, llama_token
 }
 
 std::string common_token_to_piece(const struct llama_vocab * vocab, llama_token token, bool special) {
-    std::string piece;
-    piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
-    const int n_chars = llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, special);
-    if (n_chars < 0) {
-        piece.resize(-n_chars);
-        int check = llama_token_to_piece(vocab, token, &piece[0], piece.size(), 0, special);
-        GGML_ASSERT(check == -n_chars);
-    }
-    else {
-        piece.resize(n_chars);
+    return std::string(common_token_piece(vocab, token, special));
+}
+
+std::string_view common_token_piece(const struct llama_vocab * vocab, llama_token token, bool special) {
+    int32_t len = 0;
+    const char * piece = llama_vocab_get_piece(vocab, token, special, &len);
+    return std::string_view(piece, len);
+}
+
+common_detokenizer::common_detokenizer(const struct llama_vocab * vocab, bool special) : vocab(vocab), special(special) {
+}
+
+std::string_view common_detokenizer::push(llama_token token, bool special_tok) {
+    buf += common_token_piece(vocab, token, special_tok);
+
+    // find the start of the last character and check if all of its bytes are there
+    size_t n_end = buf.size();
+    for (size_t i = 1; i <= 4 && i <= buf.size() - n_done; ++i) {
+        const uint8_t c = buf[buf.size() - i];
+        if ((c & 0xC0) == 0x80) {
+            continue; // continuation byte
+        }
+        const size_t n_bytes = (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        if (n_bytes > i) {
+            n_end = buf.size() - i;
+        }
+        break;
     }
 
-    return piece;
+    const size_t n_prev = n_done;
+    n_done = std::max(n_done, n_end);
+
+    return std::string_view(buf).substr(n_prev, n_done - n_prev);
+}
+
+void common_detokenizer::reset() {
+    buf.clear();
+    n_done = 0;
 }
 
 std::string common_detokenize(const struct llama_context * ctx, const std::vector<llama_token> & tokens, bool special) {
@@ -1276,8 +1355,14 @@ std::string common_detokenize(const struct llama_context * ctx, const std::vecto
 }
 
 std::string common_detokenize(const struct llama_vocab * vocab, const std::vector<llama_token> & tokens, bool special) {
+    // the text is at most as long as the pieces of the tokens
+    size_t n_text = 0;
+    for (const llama_token token : tokens) {
+        n_text += common_token_piece(vocab, token, special).size();
+    }
+
     std::string text;
-    text.resize(std::max(text.capacity(), tokens.size()));
+    text.resize(std::max(text.capacity(), n_text));
     int32_t n_chars = llama_detokenize(vocab, tokens.data(), (int32_t)tokens.size(), &text[0], (int32_t)text.size(), false, special);
     if (n_chars < 0) {
         text.resize(-n_chars);
@@ -4,8 +4,10 @@
 
 #include "llama-cpp.h"
 
+#include <map>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
 
@@ -32,6 +34,12 @@ struct common_adapter_lora_info {
     struct llama_adapter_lora * ptr;
 };
 
+// a fine-tune of the base model, served by the server under its own name
+struct common_model_lora {
+    std::string name;
+    std::string path; // path to the LoRA adapter
+};
+
 using llama_tokens = std::vector<llama_token>;
 
 // build info
@@ -236,6 +244,8 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t n_kv_sink             =     0; // streaming KV cache: number of attention sink tokens
+    int32_t n_kv_window           =     0; // streaming KV cache: number of most recent tokens (0 = rest of the context)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -320,6 +330,7 @@ struct common_params {
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
+    bool decode_pipeline   = false; // build the next ubatch graph while computing the current one
     bool ctx_shift         = true;  // context shift on inifinite text generation
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
@@ -357,6 +368,9 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_prefill_budget = 0;          // max prompt tokens per server iteration while other slots are generating (0 = n_batch)
+    int32_t n_queue_max    = 0;            // max number of requests waiting for a slot (0 = unlimited)
+    int32_t queue_timeout  = 0;            // max time in ms a request waits for a slot (0 = unlimited)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -366,6 +380,7 @@ struct common_params {
     common_reasoning_format reasoning_format = COMMON_REASONING_FORMAT_DEEPSEEK;
 
     std::vector<std::string> api_keys;
+    std::map<std::string, float> api_key_weights; // share of the slots of each API key when requests are queued (default: 1)
 
     std::string ssl_file_key  = "";                                                                         // NOLINT
     std::string ssl_file_cert = "";                                                                         // NOLINT
@@ -380,8 +395,15 @@ struct common_params {
 
     std::string slot_save_path;
 
+    std::string kv_disk_cache_path;       // directory of the persistent prompt KV cache (empty = disabled)
+    int32_t     kv_disk_cache_size = 4096; // max size of the KV disk cache in MiB
+    int32_t     kv_disk_cache_min  = 256;  // min number of tokens of the prompts stored in the KV disk cache
+
     float slot_prompt_similarity = 0.5f;
 
+    std::vector<common_model_lora> models_lora; // fine-tunes selected with the "model" field of the requests
+    int32_t models_lora_budget = 0;             // max memory of the loaded fine-tunes in MiB (0 = unlimited)
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -543,6 +565,9 @@ struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_p
 // clear LoRA adapters from context, then apply new list of adapters
 void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adapter_lora_info> & lora);
 
+// apply the adapters only to the tokens of a sequence (replaces the previous adapters of the sequence)
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora);
+
 //
 // Batch utils
 //
@@ -584,6 +609,14 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenize the texts on n_threads threads (<= 0 for all the cores), same result as common_tokenize on each of them
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+                  const struct llama_vocab * vocab,
+          const std::vector<std::string> & texts,
+                                     bool   add_special,
+                                     bool   parse_special = false,
+                                      int   n_threads = 0);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string common_token_to_piece(
@@ -609,6 +642,41 @@ std::string common_detokenize(
         const std::vector<llama_token> & tokens,
                                   bool   special = true);
 
+// the piece of a token, read in place from the vocab (see llama_vocab_get_piece)
+std::string_view common_token_piece(
+          const struct llama_vocab * vocab,
+                       llama_token   token,
+                       bool          special = true);
+
+// incremental detokenizer for streaming generated tokens
+// the pieces are appended to the text in place, and push() returns the new text as soon as it ends on a
+// complete UTF-8 character, so a multi-byte character split across tokens is never handed out in parts
+struct common_detokenizer {
+    common_detokenizer(const struct llama_vocab * vocab, bool special = true);
+
+    // append the piece of the token and return the newly completed text - empty while a character is incomplete
+    // the view is valid until the next call
+    std::string_view push(llama_token token) { return push(token, special); }
+
+    // same, overriding the rendering of special tokens for this token
+    std::string_view push(llama_token token, bool special_tok);
+
+    // the text of all the tokens so far, including an incomplete character at the end
+    const std::string & text() const { return buf; }
+
+    // the incomplete UTF-8 character at the end of the text, if any
+    std::string_view pending() const { return std::string_view(buf).substr(n_done); }
+
+    void reset();
+
+private:
+    const struct llama_vocab * vocab;
+    const bool special;
+
+    std::string buf;
+    size_t n_done = 0; // length of the text that ends on a complete character
+};
+
 //
 // KV cache utils
 //
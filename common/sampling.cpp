@@ -111,14 +111,7 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
-
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-
-        const int n_vocab = llama_vocab_n_tokens(vocab);
-
+    void set_logits(const float * logits, int n_vocab) {
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -127,6 +120,15 @@ struct common_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // apply the sampling chain on the logits, the candidates of the full vocabulary are filled only when needed
+    void apply_chain(const float * logits, int n_vocab) {
+        cur.resize(n_vocab);
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+
+        llama_sampler_apply_logits(chain, logits, n_vocab, &cur_p);
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -338,18 +340,23 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+static int common_n_vocab(const struct llama_context * ctx) {
+    return llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+}
 
+static llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by set_logits or apply_chain
 
     if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
-    }
+        gsmpl->set_logits(logits, n_vocab);
 
-    llama_sampler_apply(chain, &cur_p);
+        llama_sampler_apply(grmr,  &cur_p);
+        llama_sampler_apply(chain, &cur_p);
+    } else {
+        gsmpl->apply_chain(logits, n_vocab);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
@@ -374,7 +381,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -384,6 +391,43 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    return common_sampler_sample_logits(gsmpl, llama_get_logits_ith(ctx, idx), common_n_vocab(ctx), grammar_first);
+}
+
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n       = gsmpls.size();
+    const int n_vocab = common_n_vocab(ctx);
+
+    std::vector<llama_token> result(n, LLAMA_TOKEN_NULL);
+
+    // the logits are looked up on this thread, since it synchronizes the context
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; ++i) {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    struct sample_data {
+        const std::vector<common_sampler *> & gsmpls;
+        const std::vector<const float *>    & logits;
+        std::vector<llama_token>            & result;
+
+        int  n_vocab;
+        bool grammar_first;
+    } data = { gsmpls, logits, result, n_vocab, grammar_first };
+
+    // the samplers run on the worker threads of the context
+    llama_parallel_for(ctx, n, [](int32_t i, void * user_data) {
+        auto & data = *(sample_data *) user_data;
+
+        data.result[i] = common_sampler_sample_logits(data.gsmpls[i], data.logits[i], data.n_vocab, data.grammar_first);
+    }, &data);
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -60,6 +60,11 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// sample a token with each of the samplers, gsmpls[i] from the idxs[i]-th output of the last evaluation
+// the samplers must be distinct, they are run in parallel on the worker threads of the context (llama_parallel_for)
+// the tokens are not accepted, as with common_sampler_sample
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
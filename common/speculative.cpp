@@ -276,3 +276,274 @@ llama_tokens common_speculative_gen_draft(
 
     return result;
 }
+
+//
+// batched drafting
+//
+
+struct common_speculative_batch {
+    struct llama_context * ctx;
+
+    llama_batch batch;
+
+    int32_t n_ctx_seq; // max cells of a sequence
+
+    // per sequence
+    std::vector<struct common_sampler *> smpls;
+    std::vector<llama_tokens>            prompts; // tokens in the draft KV cache
+};
+
+struct common_speculative_batch * common_speculative_batch_init(
+        struct llama_context * ctx_dft,
+        int32_t n_seq) {
+    auto * result = new common_speculative_batch {
+        /* .ctx       = */ ctx_dft,
+        /* .batch     = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
+        /* .n_ctx_seq = */ (int32_t) llama_n_ctx(ctx_dft) / n_seq,
+        /* .smpls     = */ {},
+        /* .prompts   = */ std::vector<llama_tokens>(n_seq),
+    };
+
+    // same sampler as common_speculative_init
+    common_params_sampling params;
+    params.no_perf = false;
+
+    params.top_k = 10;
+
+    params.samplers = {
+        COMMON_SAMPLER_TYPE_TOP_K,
+    };
+
+    for (int32_t s = 0; s < n_seq; ++s) {
+        result->smpls.push_back(common_sampler_init(llama_get_model(ctx_dft), params));
+    }
+
+    return result;
+}
+
+void common_speculative_batch_free(struct common_speculative_batch * spec) {
+    if (spec == nullptr) {
+        return;
+    }
+
+    for (auto * smpl : spec->smpls) {
+        common_sampler_free(smpl);
+    }
+
+    llama_batch_free(spec->batch);
+
+    delete spec;
+}
+
+void common_speculative_gen_drafts(
+        struct common_speculative_batch * spec,
+        std::vector<common_speculative_seq> & seqs) {
+    auto & batch = spec->batch;
+    auto & ctx   = spec->ctx;
+
+    const int32_t n_batch = llama_n_batch(ctx);
+
+    struct seq_state {
+        bool      active = false;
+        int32_t   i_batch = -1;
+        llama_pos n_past  = 0;
+    };
+
+    std::vector<seq_state> states(seqs.size());
+
+    // on failure, forget the draft state of all the sequences
+    const auto fail = [&](int ret) {
+        LOG_WRN("%s: failed to decode the draft batch, ret = %d\n", __func__, ret);
+
+        for (auto & s : seqs) {
+            llama_kv_self_seq_rm(ctx, s.seq_id, -1, -1);
+            spec->prompts[s.seq_id].clear();
+            s.draft.clear();
+        }
+    };
+
+    common_batch_clear(batch);
+
+    // reuse as much as possible from the draft KV cache of each sequence and queue the new tokens of its prompt
+    for (size_t j = 0; j < seqs.size(); ++j) {
+        auto & s = seqs[j];
+
+        const llama_tokens & prompt_tgt = *s.prompt;
+
+        llama_tokens & prompt = spec->prompts[s.seq_id];
+
+        s.draft.clear();
+
+        int reuse_i = 0;
+        int reuse_n = 0;
+
+        const int n_ctx = spec->n_ctx_seq - s.params.n_draft;
+
+        const int i_start = std::max<int>(0, (int) prompt_tgt.size() - n_ctx);
+
+        for (int i = 0; i < (int) prompt.size(); ++i) {
+            int cur = 0;
+            while (i_start + cur < (int) prompt_tgt.size() &&
+                   i       + cur < (int) prompt.size() &&
+                   prompt_tgt[i_start + cur] == prompt[i + cur]) {
+                cur++;
+            }
+
+            if ((cur >= s.params.n_reuse || n_ctx >= (int) prompt_tgt.size()) && cur > reuse_n) {
+                reuse_i = i;
+                reuse_n = cur;
+            }
+        }
+
+        if (reuse_n == 0) {
+            llama_kv_self_seq_rm(ctx, s.seq_id, -1, -1);
+
+            prompt.clear();
+        } else {
+            // a previous draft was discarded, but the target model agreed with it
+            if (reuse_i + reuse_n < (int) prompt.size() && prompt[reuse_i + reuse_n] == s.id_last) {
+                for (int i = reuse_i + reuse_n + 1; i < (int) prompt.size(); ++i) {
+                    s.draft.push_back(prompt[i]);
+
+                    if (s.params.n_draft <= (int) s.draft.size()) {
+                        break;
+                    }
+                }
+
+                continue;
+            }
+
+            if (reuse_i > 0) {
+                llama_kv_self_seq_rm (ctx, s.seq_id, 0, reuse_i);
+                llama_kv_self_seq_add(ctx, s.seq_id, reuse_i, -1, -reuse_i);
+
+                prompt.erase(prompt.begin(), prompt.begin() + reuse_i);
+            }
+
+            if (reuse_n < (int) prompt.size()) {
+                llama_kv_self_seq_rm (ctx, s.seq_id, reuse_n, -1);
+
+                prompt.erase(prompt.begin() + reuse_n, prompt.end());
+            }
+        }
+
+        for (size_t i = i_start + reuse_n; i < prompt_tgt.size(); ++i) {
+            if (batch.n_tokens == n_batch) {
+                const int ret = llama_decode(ctx, batch);
+                if (ret != 0) {
+                    fail(ret);
+                    return;
+                }
+
+                common_batch_clear(batch);
+            }
+
+            common_batch_add(batch, prompt_tgt[i], i - i_start, { s.seq_id }, false);
+
+            prompt.push_back(prompt_tgt[i]);
+        }
+
+        states[j].active = s.params.n_draft > 0;
+    }
+
+    int n_active = 0;
+    for (const auto & st : states) {
+        n_active += st.active;
+    }
+
+    if (n_active == 0) {
+        if (batch.n_tokens > 0) {
+            const int ret = llama_decode(ctx, batch);
+            if (ret != 0) {
+                fail(ret);
+            }
+        }
+        return;
+    }
+
+    if (batch.n_tokens + n_active > n_batch) {
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            fail(ret);
+            return;
+        }
+
+        common_batch_clear(batch);
+    }
+
+    // evaluate the last token of each sequence
+    for (size_t j = 0; j < seqs.size(); ++j) {
+        if (!states[j].active) {
+            continue;
+        }
+
+        auto & s = seqs[j];
+
+        llama_tokens & prompt = spec->prompts[s.seq_id];
+
+        states[j].n_past  = prompt.size();
+        states[j].i_batch = batch.n_tokens;
+
+        common_batch_add(batch, s.id_last, states[j].n_past, { s.seq_id }, true);
+
+        prompt.push_back(s.id_last);
+
+        common_sampler_reset(spec->smpls[s.seq_id]);
+    }
+
+    // sample the drafts of all the sequences, one position at a time
+    while (true) {
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            fail(ret);
+            return;
+        }
+
+        for (size_t j = 0; j < seqs.size(); ++j) {
+            if (!states[j].active) {
+                continue;
+            }
+
+            auto & s = seqs[j];
+
+            auto * smpl = spec->smpls[s.seq_id];
+
+            common_sampler_sample(smpl, ctx, states[j].i_batch, true);
+
+            const auto * cur_p = common_sampler_get_candidates(smpl);
+
+            const llama_token id = cur_p->data[0].id;
+
+            common_sampler_accept(smpl, id, true);
+
+            s.draft.push_back(id);
+
+            // only collect very high-confidence draft tokens
+            if (s.params.n_draft <= (int) s.draft.size() || cur_p->data[0].p < s.params.p_min) {
+                states[j].active = false;
+            }
+        }
+
+        common_batch_clear(batch);
+
+        for (size_t j = 0; j < seqs.size(); ++j) {
+            if (!states[j].active) {
+                continue;
+            }
+
+            auto & s = seqs[j];
+
+            const llama_token id = s.draft.back();
+
+            states[j].i_batch = batch.n_tokens;
+
+            common_batch_add(batch, id, states[j].n_past + s.draft.size(), { s.seq_id }, true);
+
+            spec->prompts[s.seq_id].push_back(id);
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+    }
+}
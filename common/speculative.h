@@ -26,3 +26,32 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+//
+// batched drafting
+//
+
+// drafting for multiple sequences of a shared draft context (one seq_id per sequence)
+// all the sequences are evaluated together, with a single llama_decode per drafted position
+struct common_speculative_batch;
+
+struct common_speculative_seq {
+    llama_seq_id seq_id;
+
+    struct common_speculative_params params;
+
+    const llama_tokens * prompt; // target prompt of the sequence
+    llama_token          id_last;
+
+    llama_tokens draft; // output
+};
+
+// n_seq - number of sequences of the draft context, each of them can use up to n_ctx / n_seq cells
+struct common_speculative_batch * common_speculative_batch_init(struct llama_context * ctx_dft, int32_t n_seq);
+
+void common_speculative_batch_free(struct common_speculative_batch * spec);
+
+// sample up to params.n_draft tokens for each of the sequences using the draft model
+void common_speculative_gen_drafts(
+        struct common_speculative_batch * spec,
+        std::vector<common_speculative_seq> & seqs);
@@ -488,6 +488,14 @@ int main(int argc, char ** argv) {
       //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * grp_attn_n"); // NOLINT
         LOG_INF("self-extend: n_ctx_train = %d, grp_attn_n = %d, grp_attn_w = %d\n", n_ctx_train, ga_n, ga_w);
     }
+
+    // the KV cache evicts the old tokens (see --kv-sink, --kv-window)
+    // note: the context can turn the streaming policy off, so query the effective one
+    const bool kv_streaming = llama_n_kv_window(ctx) > 0;
+
+    if (kv_streaming) {
+        LOG_INF("streaming KV cache: n_kv_sink = %u, n_kv_window = %u\n", llama_n_kv_sink(ctx), llama_n_kv_window(ctx));
+    }
     LOG_INF("\n");
 
     if (params.interactive) {
@@ -584,8 +592,9 @@ int main(int argc, char ** argv) {
                 // if we run out of context:
                 // - take the n_keep first tokens from the original prompt (via n_past)
                 // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+                // not needed with the streaming KV cache, which evicts the old tokens by itself
 
-                if (n_past + (int) embd.size() >= n_ctx) {
+                if (n_past + (int) embd.size() >= n_ctx && !kv_streaming) {
                     if (!params.ctx_shift){
                         LOG_DBG("\n\n%s: context full and context shift is disabled => stopping\n", __func__);
                         break;
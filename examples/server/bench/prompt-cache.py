@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+Load test for the server prompt cache: many users sharing the same system prompt.
+
+Each user sends a few requests made of the shared system prompt, a user-specific prefix and a new question.
+The script reports the request latency and the fraction of prompt tokens that were served from the KV cache
+(`tokens_evaluated` minus `timings.prompt_n` in the completion response).
+
+Example:
+
+    llama-server -m model.gguf -c 16384 -np 8 --port 8080
+    python prompt-cache.py --url http://localhost:8080 --n-users 32 --n-requests 4 --concurrency 8
+"""
+
+from __future__ import annotations
+
+import argparse
+import random
+import sys
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+from statistics import mean
+
+import requests
+
+
+WORDS = (
+    "the quick brown fox jumps over a lazy dog while seven wizards quietly judge boxing matches "
+    "between sphinxes of black quartz and the jackdaws love my big sphinx of quartz"
+).split()
+
+
+def random_text(rng: random.Random, n_words: int) -> str:
+    return " ".join(rng.choice(WORDS) for _ in range(n_words))
+
+
+def percentile(values: list[float], p: float) -> float:
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = min(len(values) - 1, max(0, int(round(p / 100.0 * (len(values) - 1)))))
+    return values[k]
+
+
+def main(args_in: list[str] | None = None) -> None:
+    parser = argparse.ArgumentParser(description="Server prompt cache load test with a shared system prompt")
+    parser.add_argument("--url",            type=str,   help="Server url", default="http://localhost:8080")
+    parser.add_argument("--n-users",        type=int,   help="Number of users", default=32)
+    parser.add_argument("--n-requests",     type=int,   help="Number of requests per user", default=4)
+    parser.add_argument("--concurrency",    type=int,   help="Number of concurrent requests", default=8)
+    parser.add_argument("--system-words",   type=int,   help="Number of words in the shared system prompt", default=400)
+    parser.add_argument("--user-words",     type=int,   help="Number of words in the prefix of each user", default=100)
+    parser.add_argument("--question-words", type=int,   help="Number of words in each question", default=20)
+    parser.add_argument("--n-predict",      type=int,   help="Number of tokens to predict", default=16)
+    parser.add_argument("--seed",           type=int,   help="Random seed", default=42)
+    parser.add_argument("--timeout",        type=float, help="Request timeout in seconds", default=600.0)
+
+    args = parser.parse_args(args_in)
+
+    rng = random.Random(args.seed)
+
+    system_prompt = "System: " + random_text(rng, args.system_words) + "\n"
+    user_prompts  = [f"User {i}: " + random_text(rng, args.user_words) + "\n" for i in range(args.n_users)]
+
+    # interleave the users, so that consecutive requests rarely come from the same user
+    jobs = []
+    for r in range(args.n_requests):
+        for u in range(args.n_users):
+            jobs.append((u, system_prompt + user_prompts[u] + "Question: " + random_text(rng, args.question_words) + "\nAnswer:"))
+
+    lock      = threading.Lock()
+    latencies = []
+    n_prompt  = 0
+    n_cached  = 0
+    n_errors  = 0
+
+    def run(job):
+        nonlocal n_prompt, n_cached, n_errors
+        _, prompt = job
+        t0 = time.time()
+        try:
+            res = requests.post(f"{args.url}/completion", json={
+                "prompt":       prompt,
+                "n_predict":    args.n_predict,
+                "cache_prompt": True,
+                "temperature":  0.0,
+            }, timeout=args.timeout)
+            res.raise_for_status()
+            data = res.json()
+        except Exception as e:
+            with lock:
+                n_errors += 1
+            print(f"request failed: {e}", file=sys.stderr)
+            return
+        dt = time.time() - t0
+        with lock:
+            latencies.append(dt)
+            n_prompt += data["tokens_evaluated"]
+            n_cached += data["tokens_evaluated"] - data["timings"]["prompt_n"]
+
+    t_start = time.time()
+    with ThreadPoolExecutor(max_workers=args.concurrency) as executor:
+        list(executor.map(run, jobs))
+    t_total = time.time() - t_start
+
+    print(f"requests:       {len(latencies)} ok, {n_errors} failed, {t_total:.2f} s, {len(latencies) / t_total:.2f} req/s")
+    if latencies:
+        print(f"latency:        mean {mean(latencies):.3f} s, p50 {percentile(latencies, 50):.3f} s, p99 {percentile(latencies, 99):.3f} s")
+    if n_prompt > 0:
+        print(f"prompt tokens:  {n_prompt} total, {n_cached} cached ({100.0 * n_cached / n_prompt:.1f}%)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""
+Load test for the streaming formats of the server: many concurrent streams with `stream_format` set to `sse` or `binary`.
+
+The script reports the number of tokens per second delivered to the clients and, when the pid of the server is given,
+the CPU time used by the server per 1000 delivered tokens.
+
+Example:
+
+    llama-server -m model.gguf -c 65536 -np 500 --threads-http 512 --port 8080
+    python stream-format.py --url http://localhost:8080 --n-streams 500 --format sse --pid $(pidof llama-server)
+    python stream-format.py --url http://localhost:8080 --n-streams 500 --format binary --pid $(pidof llama-server)
+"""
+
+from __future__ import annotations
+
+import argparse
+import json
+import os
+import struct
+import sys
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import requests
+
+
+def server_cpu_seconds(pid: int) -> float:
+    # utime + stime of the process, see proc(5)
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def read_sse(res) -> int:
+    n_tokens = 0
+    for line in res.iter_lines():
+        if line.startswith(b"data: "):
+            data = json.loads(line[6:])
+            n_tokens += len(data.get("tokens", []))
+    return n_tokens
+
+
+def read_binary(res) -> int:
+    n_tokens = 0
+    buf = b""
+    for chunk in res.iter_content(chunk_size=None):
+        buf += chunk
+        while len(buf) >= 4:
+            (size,) = struct.unpack_from("<I", buf, 0)
+            if len(buf) < 4 + size:
+                break
+            frame = buf[4:4 + size]
+            buf = buf[4 + size:]
+            if frame[0] == 1:
+                (n,) = struct.unpack_from("<I", frame, 9)
+                n_tokens += n
+            elif frame[0] == 3:
+                raise RuntimeError(frame[1:].decode())
+    return n_tokens
+
+
+def main(args_in: list[str] | None = None) -> None:
+    parser = argparse.ArgumentParser(description="Server streaming format load test")
+    parser.add_argument("--url",       type=str,   help="Server url", default="http://localhost:8080")
+    parser.add_argument("--format",    type=str,   help="Stream format", choices=["sse", "binary"], default="binary")
+    parser.add_argument("--n-streams", type=int,   help="Number of concurrent streams", default=500)
+    parser.add_argument("--n-predict", type=int,   help="Number of tokens to predict per stream", default=64)
+    parser.add_argument("--n-probs",   type=int,   help="Number of token probabilities per token", default=0)
+    parser.add_argument("--pid",       type=int,   help="Pid of the server, to report its CPU time", default=None)
+    parser.add_argument("--timeout",   type=float, help="Request timeout in seconds", default=600.0)
+
+    args = parser.parse_args(args_in)
+
+    lock     = threading.Lock()
+    n_tokens = 0
+    n_errors = 0
+
+    def run(i: int) -> None:
+        nonlocal n_tokens, n_errors
+        try:
+            res = requests.post(f"{args.url}/completion", json={
+                "prompt":        f"Stream {i}: once upon a time",
+                "n_predict":     args.n_predict,
+                "n_probs":       args.n_probs,
+                "ignore_eos":    True,
+                "stream":        True,
+                "stream_format": args.format,
+                "cache_prompt":  False,
+            }, stream=True, timeout=args.timeout)
+            res.raise_for_status()
+            n = read_sse(res) if args.format == "sse" else read_binary(res)
+        except Exception as e:
+            with lock:
+                n_errors += 1
+            print(f"request failed: {e}", file=sys.stderr)
+            return
+        with lock:
+            n_tokens += n
+
+    cpu_start = server_cpu_seconds(args.pid) if args.pid else 0.0
+    t_start = time.time()
+    with ThreadPoolExecutor(max_workers=args.n_streams) as executor:
+        list(executor.map(run, range(args.n_streams)))
+    t_total = time.time() - t_start
+    cpu_total = server_cpu_seconds(args.pid) - cpu_start if args.pid else 0.0
+
+    print(f"streams:    {args.n_streams - n_errors} ok, {n_errors} failed, format {args.format}")
+    print(f"tokens:     {n_tokens} in {t_total:.2f} s, {n_tokens / t_total:.1f} tokens/s")
+    if args.pid and n_tokens > 0:
+        print(f"server CPU: {cpu_total:.2f} s, {1000.0 * cpu_total / n_tokens:.3f} s per 1000 tokens")
+
+
+if __name__ == "__main__":
+    main()
@@ -24,13 +24,29 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <filesystem>
+#include <fstream>
 #include <memory>
+#include <map>
 #include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <fcntl.h>
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+        #endif
+    #endif
+#endif
+
 using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
@@ -97,6 +113,7 @@ struct slot_params {
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // mininum line indentation for the generated text in number of whitespace characters
+    int32_t priority  =  0; // prompts of requests with a higher priority are processed first
 
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
@@ -165,6 +182,7 @@ struct slot_params {
             {"max_tokens",                n_predict}, // User configured n_predict
             {"n_keep",                    n_keep},
             {"n_discard",                 n_discard},
+            {"priority",                  priority},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
@@ -214,6 +232,13 @@ struct server_task {
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
+    // used by the admission control of server_queue
+    std::string client;            // API key of the request, the slots are shared fairly between the clients
+    int64_t     t_queued   = 0;    // us, set by server_queue::post() when the task is first queued
+    int64_t     t_deadline = 0;    // us, the task fails if it did not get a slot by then (0 = no deadline)
+    double      vt_finish  = -1.0; // virtual finish time in the weighted fair queue, set when the task is deferred
+    int32_t     n_waiting  = -1;   // tasks waiting for a slot at the arrival of the task, observed once by the metrics
+
     server_task(server_task_type type) : type(type) {}
 
     static slot_params params_from_json_cmpl(
@@ -241,6 +266,7 @@ struct server_task {
         params.n_indent         = json_value(data, "n_indent",           defaults.n_indent);
         params.n_keep           = json_value(data, "n_keep",             defaults.n_keep);
         params.n_discard        = json_value(data, "n_discard",          defaults.n_discard);
+        params.priority         = json_value(data, "priority",           defaults.priority);
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
@@ -466,6 +492,20 @@ struct server_task {
         std::string model_name = params_base.model_alias.empty() ? DEFAULT_OAICOMPAT_MODEL : params_base.model_alias;
         params.oaicompat_model = json_value(data, "model", model_name);
 
+        // with fine-tunes, the "model" field selects the model: only the base model and its fine-tunes are served
+        if (!params_base.models_lora.empty() && params.oaicompat_model != model_name) {
+            const std::string id_base = params_base.model_alias.empty() ? params_base.model.path : params_base.model_alias;
+
+            bool served = params.oaicompat_model == id_base;
+            for (const auto & entry : params_base.models_lora) {
+                served = served || params.oaicompat_model == entry.name;
+            }
+
+            if (!served) {
+                throw std::runtime_error("Error: model '" + params.oaicompat_model + "' is not served, only the base model '" + id_base + "' and its fine-tunes are (see /v1/models)");
+            }
+        }
+
         return params;
     }
 
@@ -531,6 +571,11 @@ struct server_task_result {
         return -1;
     }
     virtual json to_json() = 0;
+    // append the result to a binary stream (see binary_frame_type), the default is a frame with the JSON of the result
+    virtual void to_binary(binary_frame_writer & writer) {
+        writer.begin(BINARY_FRAME_FINAL);
+        writer.buf.append(to_json().dump(-1, ' ', false, json::error_handler_t::replace));
+    }
     virtual ~server_task_result() = default;
 };
 
@@ -878,6 +923,28 @@ struct server_task_result_cmpl_partial : server_task_result {
         return false; // in stream mode, partial responses are not considered stop
     }
 
+    // compact token frame, without building a JSON tree
+    virtual void to_binary(binary_frame_writer & writer) override {
+        writer.begin(BINARY_FRAME_TOKENS);
+        writer.put_i32(index);
+        writer.put_i32(n_decoded);
+        writer.put_u32(tokens.size());
+        for (const llama_token tok : tokens) {
+            writer.put_i32(tok);
+        }
+        writer.put_str(content);
+        writer.put_u32(prob_output.probs.size());
+        if (!prob_output.probs.empty()) {
+            // same values as the JSON: probabilities with post_sampling_probs, log-probabilities otherwise
+            const auto value = [&](float p) { return post_sampling_probs ? p : completion_token_output::logarithm(p); };
+            writer.put_f32(value(prob_output.prob));
+            for (const auto & p : prob_output.probs) {
+                writer.put_i32(p.tok);
+                writer.put_f32(value(p.prob));
+            }
+        }
+    }
+
     virtual json to_json() override {
         switch (oaicompat) {
             case OAICOMPAT_TYPE_NONE:
@@ -1128,6 +1195,38 @@ struct server_task_result_error : server_task_result {
     }
 };
 
+// cumulative histogram, as exposed by the Prometheus metrics
+struct server_histogram {
+    std::vector<double>   bounds; // upper bounds of the buckets, the last bucket is +Inf
+    std::vector<uint64_t> counts;
+
+    double   sum   = 0.0;
+    uint64_t count = 0;
+
+    server_histogram() = default;
+    server_histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    void observe(double value) {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        counts[i]++;
+        sum += value;
+        count++;
+    }
+
+    void to_prometheus(std::stringstream & out, const std::string & name, const std::string & help) const {
+        out << "# HELP llamacpp:" << name << " " << help << "\n"
+            << "# TYPE llamacpp:" << name << " histogram\n";
+
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            cumulative += counts[i];
+            out << "llamacpp:" << name << "_bucket{le=\"" << (i < bounds.size() ? string_format("%g", bounds[i]) : "+Inf") << "\"} " << cumulative << "\n";
+        }
+        out << "llamacpp:" << name << "_sum "   << sum   << "\n"
+            << "llamacpp:" << name << "_count " << count << "\n";
+    }
+};
+
 struct server_task_result_metrics : server_task_result {
     int n_idle_slots;
     int n_processing_slots;
@@ -1152,6 +1251,25 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    double t_itl_p50 = 0.0; // ms
+    double t_itl_p99 = 0.0; // ms
+
+    uint64_t n_rejected_total = 0;
+    uint64_t n_expired_total  = 0;
+
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+
+    uint64_t n_kv_disk_hits            = 0;
+    uint64_t n_kv_disk_misses          = 0;
+    uint64_t n_kv_disk_tokens_restored = 0;
+    uint64_t n_kv_disk_bytes_written   = 0;
+    uint64_t n_kv_disk_evicted         = 0;
+    uint64_t kv_disk_size              = 0; // bytes
+
+    server_histogram h_queue_wait;
+    server_histogram h_queue_depth;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1176,6 +1294,22 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "t_itl_p50",                       t_itl_p50 },
+            { "t_itl_p99",                       t_itl_p99 },
+
+            { "n_rejected_total",                n_rejected_total },
+            { "n_expired_total",                 n_expired_total },
+
+            { "n_draft_total",                   n_draft_total },
+            { "n_draft_accepted_total",          n_draft_accepted_total },
+
+            { "n_kv_disk_hits",                  n_kv_disk_hits },
+            { "n_kv_disk_misses",                n_kv_disk_misses },
+            { "n_kv_disk_tokens_restored",       n_kv_disk_tokens_restored },
+            { "n_kv_disk_bytes_written",         n_kv_disk_bytes_written },
+            { "n_kv_disk_evicted",               n_kv_disk_evicted },
+            { "kv_disk_size",                    kv_disk_size },
+
             { "kv_cache_tokens_count",           kv_cache_tokens_count },
             { "kv_cache_used_cells",             kv_cache_used_cells },
 
@@ -1241,12 +1375,12 @@ struct server_slot {
     // only used for completion/embedding/infill/rerank
     server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
 
-    llama_batch batch_spec = {};
-
     llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
+    llama_context * ctx_dft = nullptr; // shared by the slots, each slot uses its own sequence
 
-    common_speculative * spec = nullptr;
+    // draft tokens, verified in the main batch after the sampled token
+    llama_tokens drafted;
+    bool         drafted_discarded = false; // the draft was evaluated but not verified, its KV cache must be removed
 
     std::vector<common_adapter_lora_info> lora;
 
@@ -1275,14 +1409,11 @@ struct server_slot {
     // input prompt tokens
     llama_tokens prompt_tokens;
 
-    size_t last_nl_pos = 0;
-
-    std::string  generated_text;
-    llama_tokens generated_tokens;
-
+    // note: the generated text is assembled by the output stage (server_output_stage)
     llama_tokens cache_tokens;
 
-    std::vector<completion_token_output> generated_token_probs;
+    // the state of the sequence is stored in the KV disk cache once the slots are idle
+    bool kv_disk_store = false;
 
     bool has_next_token = true;
     bool has_new_line   = false;
@@ -1301,10 +1432,10 @@ struct server_slot {
     common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
 
     // stats
-    size_t n_sent_text        = 0; // number of sent text character
-
+    int64_t t_start_task = 0; // us, when the task was assigned to the slot
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token; // time of the last generated token(s), for the inter-token latency
 
     double t_prompt_processing; // ms
     double t_token_generation;  // ms
@@ -1319,18 +1450,16 @@ struct server_slot {
         SLT_DBG(*this, "%s", "\n");
 
         n_prompt_tokens    = 0;
-        last_nl_pos        = 0;
-        generated_text     = "";
         has_new_line       = false;
         truncated          = false;
         stop               = STOP_TYPE_NONE;
         stopping_word      = "";
         n_past             = 0;
-        n_sent_text        = 0;
         task_type          = SERVER_TASK_TYPE_COMPLETION;
+        kv_disk_store      = false;
 
-        generated_tokens.clear();
-        generated_token_probs.clear();
+        drafted.clear();
+        drafted_discarded = false;
 
         // clear speculative decoding stats
         n_draft_total = 0;
@@ -1341,9 +1470,10 @@ struct server_slot {
         return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
     }
 
+    // note: slots with different lora adapters can be batched if the adapters they do not share can be applied per sequence
     bool can_batch_with(server_slot & other_slot) const {
         return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+            && are_lora_batchable(lora, other_slot.lora);
     }
 
     bool has_budget(const common_params & global_params) {
@@ -1370,14 +1500,6 @@ struct server_slot {
         return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
     }
 
-    void add_token(const completion_token_output & token) {
-        if (!is_processing()) {
-            SLT_WRN(*this, "%s", "slot is not processing\n");
-            return;
-        }
-        generated_token_probs.push_back(token);
-    }
-
     void release() {
         if (is_processing()) {
             SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
@@ -1410,35 +1532,6 @@ struct server_slot {
         return timings;
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
-
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = find_partial_stop_string(word, text);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     void print_timings() const {
         const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
         const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
@@ -1484,339 +1577,1725 @@ struct server_slot {
                     {"stopping_word",  stopping_word},
                 }
             },
+            {"draft",
+                {
+                    {"n_drafted",            n_draft_total},
+                    {"n_accepted",           n_draft_accepted},
+                    {"acceptance_rate",      n_draft_total > 0 ? (double) n_draft_accepted / n_draft_total : 0.0},
+                    {"predicted_per_second", t_token_generation > 0 ? 1e3 / t_token_generation * n_decoded : 0.0},
+                }
+            },
         };
     }
 };
 
-struct server_metrics {
-    int64_t t_start = 0;
-
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total       = 0;
-    uint64_t n_tokens_predicted_total        = 0;
-    uint64_t t_tokens_generation_total       = 0;
+// a fine-tune of the base model, selected by the "model" field of the requests
+// it shares the (mmap'd) weights of the base model and adds a LoRA adapter, loaded on demand
+struct server_model_lora {
+    std::string name;
+    std::string path;
 
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing       = 0;
+    size_t  size        = 0; // size of the adapter file, loaded entirely in memory
+    size_t  size_seq    = 0; // size of the F32 copy of the adapter while it is applied per sequence
+    int64_t t_last_used = 0;
 
-    uint64_t n_tokens_predicted  = 0;
-    uint64_t t_tokens_generation = 0;
+    llama_adapter_lora_ptr adapter;
 
-    uint64_t n_decode_total     = 0;
-    uint64_t n_busy_slots_total = 0;
+    // the adapter is loaded by a background thread, the tasks of the fine-tune wait for it
+    // note: guarded by server_context::mutex_models_lora, except the thread
+    std::thread              loader;
+    bool                     loading = false;
+    llama_adapter_lora_ptr   adapter_loaded; // result of the loader, nullptr if it failed
+    std::vector<server_task> tasks_waiting;
+};
 
-    void init() {
-        t_start = ggml_time_us();
-    }
+// radix tree over the prompts cached in the KV cache of the slots
+// each slot is indexed by a prefix of its cache_tokens that is known to be in the KV cache
+struct server_prompt_cache {
+    struct node {
+        llama_tokens  tokens; // edge from the parent
+        std::set<int> ids;    // slots that hold the prefix ending at this node
 
-    void on_prompt_eval(const server_slot & slot) {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
-        t_prompt_processing             += slot.t_prompt_processing;
-        t_prompt_processing_total       += slot.t_prompt_processing;
-    }
+        std::map<llama_token, std::unique_ptr<node>> children;
+    };
 
-    void on_prediction(const server_slot & slot) {
-        n_tokens_predicted_total   += slot.n_decoded;
-        n_tokens_predicted         += slot.n_decoded;
-        t_tokens_generation        += slot.t_token_generation;
-        t_tokens_generation_total  += slot.t_token_generation;
-    }
+    node root;
 
-    void on_decoded(const std::vector<server_slot> & slots) {
-        n_decode_total++;
-        for (const auto & slot : slots) {
-            if (slot.is_processing()) {
-                n_busy_slots_total++;
-            }
-        }
-    }
+    std::map<int, llama_tokens> entries; // indexed tokens of each slot
 
-    void reset_bucket() {
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing       = 0;
-        n_tokens_predicted        = 0;
-        t_tokens_generation       = 0;
+    void clear() {
+        root.ids.clear();
+        root.children.clear();
+        entries.clear();
     }
-};
 
-struct server_queue {
-    int id = 0;
-    bool running;
+    void insert(int id, const llama_tokens & tokens) {
+        remove(id);
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        if (tokens.empty()) {
+            return;
+        }
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        node * cur = &root;
+        size_t i = 0;
 
-    // callback functions
-    std::function<void(server_task)> callback_new_task;
-    std::function<void(void)>        callback_update_slots;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->tokens.assign(tokens.begin() + i, tokens.end());
+                child->ids.insert(id);
+                cur->children[tokens[i]] = std::move(child);
+                break;
+            }
 
-    // Add a new task to the end of the queue
-    int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
-        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
-    }
+            node * child = it->second.get();
 
-    // multi-task version of post()
-    int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < tokens.size() && child->tokens[n] == tokens[i + n]) {
+                n++;
             }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
-        }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+            if (n < child->tokens.size()) {
+                // split the edge, so that the prefix ends at a node
+                auto mid = std::make_unique<node>();
+                mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + n);
+                mid->ids = child->ids;
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + n);
+                mid->children[child->tokens[0]] = std::move(it->second);
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task)> callback) {
-        callback_new_task = std::move(callback);
-    }
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
-    }
+            child->ids.insert(id);
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            cur = child;
+            i  += n;
         }
-        condition_tasks.notify_one();
-    }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+        entries[id] = tokens;
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+    void remove(int id) {
+        auto it_entry = entries.find(id);
+        if (it_entry == entries.end()) {
+            return;
+        }
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        const llama_tokens & tokens = it_entry->second;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = queue_tasks.front();
-                queue_tasks.pop_front();
-                lock.unlock();
+        node * cur = &root;
+        size_t i = 0;
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
-            }
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+            node * child = it->second.get();
+            child->ids.erase(id);
 
-            callback_update_slots();
+            i += child->tokens.size();
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+            if (child->ids.empty()) {
+                // the ids of the descendants are a subset of the ids of the node
+                cur->children.erase(it);
+                break;
             }
+
+            cur = child;
         }
+
+        entries.erase(it_entry);
     }
 
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id_target == id_target;
+    // find the longest prefix of the prompt that is held by a slot accepted by the filter
+    // returns the length of the prefix and sets id to the slot, or -1 if none
+    template <typename F>
+    size_t find(const llama_tokens & prompt, const F & filter, int & id) const {
+        const auto first = [&](const node & nd) {
+            for (int i : nd.ids) {
+                if (filter(i)) {
+                    return i;
+                }
+            }
+            return -1;
         };
-        queue_tasks.erase(
-            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-            queue_tasks.end());
-        queue_tasks_deferred.erase(
-            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-            queue_tasks_deferred.end());
-    }
-};
 
-struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+        id = -1;
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        size_t n_best = 0;
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        const node * cur = &root;
+        size_t i = 0;
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        while (i < prompt.size()) {
+            auto it = cur->children.find(prompt[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+            const node * child = it->second.get();
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+            size_t n = 0;
+            while (n < child->tokens.size() && i + n < prompt.size() && child->tokens[n] == prompt[i + n]) {
+                n++;
+            }
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            const int id_cur = first(*child);
+            if (id_cur < 0) {
+                break;
+            }
+
+            id     = id_cur;
+            n_best = i + n;
+
+            if (n < child->tokens.size()) {
+                break;
+            }
+
+            cur = child;
+            i  += n;
+        }
+
+        return n_best;
+    }
+};
+
+// read-only view of a file, mapped in memory when the platform supports it
+struct server_mapped_file {
+    const uint8_t * data = nullptr;
+    size_t          size = 0;
+
+    server_mapped_file(const std::string & path) {
+#if defined(_POSIX_MAPPED_FILES)
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = (const uint8_t *) addr;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        if (!f) {
+            return;
+        }
+        buf.resize(f.tellg());
+        f.seekg(0);
+        if (f.read((char *) buf.data(), buf.size())) {
+            data = buf.data();
+            size = buf.size();
+        }
+#endif
+    }
+
+    ~server_mapped_file() {
+#if defined(_POSIX_MAPPED_FILES)
+        if (data) {
+            munmap(addr, size);
+        }
+#endif
+    }
+
+    server_mapped_file(const server_mapped_file &) = delete;
+    server_mapped_file & operator=(const server_mapped_file &) = delete;
+
+private:
+#if defined(_POSIX_MAPPED_FILES)
+    void * addr = MAP_FAILED;
+#else
+    std::vector<uint8_t> buf;
+#endif
+};
+
+// persistent KV cache of the prompts, content-addressed on disk
+// each entry holds the state of a sequence after the prefill of a prompt, in a file named after a hash of the
+// model fingerprint, the LoRA adapters and the tokens of the prompt
+// the entries are written by a background thread and mapped back in memory when a new prompt shares a long
+// prefix with one of them, so that restarts of the server and reuse of the slots do not require a new prefill
+struct server_kv_disk_cache {
+    static constexpr uint32_t MAGIC   = 0x43564b4c; // "LKVC"
+    static constexpr uint32_t VERSION = 1;
+
+    struct entry {
+        std::string path;
+
+        uint64_t hash    = 0;
+        uint64_t variant = 0; // LoRA adapters of the sequence
+        size_t   size    = 0; // bytes of the file
+        size_t   offset  = 0; // offset of the state of the sequence in the file
+
+        int64_t t_last_used = 0;
+    };
+
+    struct job {
+        uint64_t     hash;
+        uint64_t     variant;
+        llama_tokens tokens;
+
+        std::vector<uint8_t> data;
+    };
+
+    std::string dir;
+
+    size_t   size_max    = 0; // bytes
+    size_t   n_min       = 0; // min tokens of the prompts that are stored and of the prefixes that are restored
+    uint64_t fingerprint = 0;
+
+    // stats
+    uint64_t n_hits            = 0;
+    uint64_t n_misses          = 0;
+    uint64_t n_tokens_restored = 0;
+    uint64_t n_bytes_written   = 0;
+    uint64_t n_evicted         = 0;
+
+    size_t size_total = 0;
+
+    // guards all of the above that is updated by the writer, the entries and the index
+    std::mutex mutex;
+
+    std::map<int, entry>              entries;
+    std::unordered_map<uint64_t, int> ids;     // hash -> entry
+    std::unordered_set<uint64_t>      pending; // hashes queued for writing
+
+    server_prompt_cache index; // tokens of the entries
+
+    int id_next = 0;
+
+    std::deque<job>         jobs;
+    std::condition_variable condition_jobs;
+
+    bool running = false;
+
+    std::thread worker;
+
+    ~server_kv_disk_cache() {
+        stop();
+    }
+
+    bool enabled() const {
+        return !dir.empty();
+    }
+
+    static uint64_t hash_bytes(uint64_t h, const void * data, size_t n) {
+        // FNV-1a
+        const uint8_t * p = (const uint8_t *) data;
+        for (size_t i = 0; i < n; i++) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    static uint64_t hash_str(uint64_t h, const std::string & s) {
+        return hash_bytes(h, s.data(), s.size());
+    }
+
+    template <typename T>
+    static uint64_t hash_val(uint64_t h, const T & v) {
+        return hash_bytes(h, &v, sizeof(v));
+    }
+
+    uint64_t hash_tokens(uint64_t variant, const llama_tokens & tokens) const {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        h = hash_val(h, fingerprint);
+        h = hash_val(h, variant);
+        return hash_bytes(h, tokens.data(), tokens.size()*sizeof(llama_token));
+    }
+
+    bool init(const std::string & path, size_t size_max_mib, size_t n_min, uint64_t fingerprint) {
+        std::string path_dir = path;
+        while (path_dir.size() > 1 && path_dir.back() == DIRECTORY_SEPARATOR) {
+            path_dir.pop_back();
+        }
+
+        // note: the trailing separator is required to create the last directory of the path
+        if (!fs_create_directory_with_parents(path_dir + DIRECTORY_SEPARATOR)) {
+            SRV_ERR("failed to create the KV disk cache directory '%s'\n", path_dir.c_str());
+            return false;
+        }
+
+        this->dir         = path_dir;
+        this->size_max    = size_max_mib*1024*1024;
+        this->n_min       = std::max<size_t>(n_min, 1);
+        this->fingerprint = fingerprint;
+
+        // index the entries of the model left by previous runs
+        std::error_code ec;
+        for (const auto & it : std::filesystem::directory_iterator(dir, ec)) {
+            if (!it.is_regular_file(ec) || it.path().extension() != ".kvc") {
+                continue;
+            }
+
+            const std::string fname = it.path().string();
+
+            std::ifstream f(fname, std::ios::binary);
+
+            uint32_t magic   = 0;
+            uint32_t version = 0;
+            uint64_t fp      = 0;
+            uint64_t variant = 0;
+            uint64_t n_tokens = 0;
+
+            f.read((char *) &magic,    sizeof(magic));
+            f.read((char *) &version,  sizeof(version));
+            f.read((char *) &fp,       sizeof(fp));
+            f.read((char *) &variant,  sizeof(variant));
+            f.read((char *) &n_tokens, sizeof(n_tokens));
+
+            if (!f || magic != MAGIC || version != VERSION || fp != fingerprint) {
+                continue; // other model or format
+            }
+
+            llama_tokens tokens(n_tokens);
+            f.read((char *) tokens.data(), n_tokens*sizeof(llama_token));
+            if (!f) {
+                continue;
+            }
+
+            entry e;
+            e.path        = fname;
+            e.hash        = hash_tokens(variant, tokens);
+            e.variant     = variant;
+            e.size        = it.file_size(ec);
+            e.offset      = header_size(n_tokens);
+            e.t_last_used = it.last_write_time(ec).time_since_epoch().count();
+
+            if (ec || e.size <= e.offset || ids.count(e.hash)) {
+                continue;
+            }
+
+            add(std::move(e), tokens);
+        }
+
+        evict(-1);
+
+        SRV_INF("KV disk cache '%s': %zu entries, %.2f MiB\n", dir.c_str(), entries.size(), size_total/1024.0/1024.0);
+
+        running = true;
+        worker  = std::thread([this]() { loop(); });
+
+        return true;
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+            condition_jobs.notify_one();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // queue the state of the sequence for writing, if the prompt is not already stored
+    // note: the state is copied by the caller thread, only the write happens in the background, so the server calls
+    //       this when its slots are idle
+    void store(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens, uint64_t variant) {
+        if (tokens.size() < n_min) {
+            return;
+        }
+
+        const uint64_t hash = hash_tokens(variant, tokens);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            auto it = ids.find(hash);
+            if (it != ids.end()) {
+                touch(entries.at(it->second));
+                return;
+            }
+
+            if (pending.count(hash)) {
+                return;
+            }
+        }
+
+        const size_t size = llama_state_seq_get_size(ctx, seq_id);
+        if (size == 0 || header_size(tokens.size()) + size > size_max) {
+            return;
+        }
+
+        job j;
+        j.hash    = hash;
+        j.variant = variant;
+        j.tokens  = tokens;
+        j.data.resize(size);
+
+        if (llama_state_seq_get_data(ctx, j.data.data(), size, seq_id) != size) {
+            SRV_WRN("failed to get the state of sequence %d\n", seq_id);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        pending.insert(hash);
+        jobs.push_back(std::move(j));
+        condition_jobs.notify_one();
+    }
+
+    // restore the longest stored prefix of the prompt in the sequence, if it is longer than n_past by at least n_min tokens
+    // returns the length of the restored prefix, 0 if none, or -1 if the restore failed and the sequence was cleared
+    int32_t restore(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & prompt, uint64_t variant, size_t n_past) {
+        if (prompt.size() < n_past + n_min) {
+            return 0;
+        }
+
+        entry e;
+        size_t n_match = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            int id = -1;
+            n_match = index.find(prompt, [&](int i) { return entries.at(i).variant == variant; }, id);
+
+            if (id < 0 || n_match < n_past + n_min) {
+                n_misses++;
+                return 0;
+            }
+
+            e = entries.at(id);
+            touch(entries.at(id));
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        bool ok = false;
+        {
+            server_mapped_file file(e.path);
+            if (file.data && file.size == e.size) {
+                ok = llama_state_seq_set_data(ctx, file.data + e.offset, file.size - e.offset, seq_id) > 0;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (!ok) {
+            SRV_WRN("failed to restore '%s' in sequence %d, removing it\n", e.path.c_str(), seq_id);
+            n_misses++;
+
+            // the entry is corrupt, or its file was changed or removed behind the cache
+            auto it = ids.find(e.hash);
+            if (it != ids.end()) {
+                remove(entries.find(it->second));
+            }
+
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+            return -1;
+        }
+
+        SRV_INF("restored %zu tokens from '%s' in sequence %d in %.2f ms\n", n_match, e.path.c_str(), seq_id, (ggml_time_us() - t_start)/1e3);
+
+        n_hits++;
+        n_tokens_restored += n_match;
+
+        return n_match;
+    }
+
+private:
+    static size_t header_size(size_t n_tokens) {
+        return 2*sizeof(uint32_t) + 3*sizeof(uint64_t) + n_tokens*sizeof(llama_token);
+    }
+
+    // requires the lock
+    void add(entry && e, const llama_tokens & tokens) {
+        const int id = id_next++;
+
+        size_total += e.size;
+        ids[e.hash] = id;
+        index.insert(id, tokens);
+        entries[id] = std::move(e);
+    }
+
+    // requires the lock
+    void touch(entry & e) {
+        std::error_code ec;
+        const auto t = std::filesystem::file_time_type::clock::now();
+        std::filesystem::last_write_time(e.path, t, ec);
+        e.t_last_used = t.time_since_epoch().count();
+    }
+
+    // remove the least recently used entries until the cache fits, except the entry id_keep
+    // requires the lock
+    void evict(int id_keep) {
+        while (size_total > size_max) {
+            auto lru = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->first != id_keep && (lru == entries.end() || it->second.t_last_used < lru->second.t_last_used)) {
+                    lru = it;
+                }
+            }
+            if (lru == entries.end()) {
+                break;
+            }
+
+            SRV_DBG("evicted '%s'\n", lru->second.path.c_str());
+
+            remove(lru);
+
+            n_evicted++;
+        }
+    }
+
+    // remove the entry and its file
+    // requires the lock
+    void remove(std::map<int, entry>::iterator it) {
+        std::error_code ec;
+        std::filesystem::remove(it->second.path, ec);
+
+        size_total -= it->second.size;
+        ids.erase(it->second.hash);
+        index.remove(it->first);
+        entries.erase(it);
+    }
+
+    void loop() {
+        while (true) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition_jobs.wait(lock, [&]{
+                    return !jobs.empty() || !running;
+                });
+                if (jobs.empty()) {
+                    return; // terminated
+                }
+                j = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            entry e;
+            e.hash    = j.hash;
+            e.variant = j.variant;
+            e.path    = dir + DIRECTORY_SEPARATOR + string_format("%016" PRIx64 ".kvc", j.hash);
+            e.offset  = header_size(j.tokens.size());
+            e.size    = e.offset + j.data.size();
+
+            // write to a temporary file first, so that readers never see a partial entry
+            const std::string path_tmp = e.path + string_format(".%" PRId64 ".tmp", ggml_time_us());
+
+            bool ok = false;
+            {
+                std::ofstream f(path_tmp, std::ios::binary | std::ios::trunc);
+
+                const uint64_t n_tokens = j.tokens.size();
+
+                f.write((const char *) &MAGIC,       sizeof(MAGIC));
+                f.write((const char *) &VERSION,     sizeof(VERSION));
+                f.write((const char *) &fingerprint, sizeof(fingerprint));
+                f.write((const char *) &e.variant,   sizeof(e.variant));
+                f.write((const char *) &n_tokens,    sizeof(n_tokens));
+                f.write((const char *) j.tokens.data(), n_tokens*sizeof(llama_token));
+                f.write((const char *) j.data.data(), j.data.size());
+                f.close();
+
+                ok = !f.fail();
+            }
+
+            std::error_code ec;
+            if (ok) {
+                std::filesystem::rename(path_tmp, e.path, ec);
+                ok = !ec;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+
+            pending.erase(j.hash);
+
+            if (!ok) {
+                SRV_WRN("failed to write '%s'\n", e.path.c_str());
+                std::filesystem::remove(path_tmp, ec);
+                continue;
+            }
+
+            SRV_DBG("stored %zu tokens in '%s', %.2f MiB\n", j.tokens.size(), e.path.c_str(), e.size/1024.0/1024.0);
+
+            n_bytes_written += e.size;
+
+            e.t_last_used = std::filesystem::file_time_type::clock::now().time_since_epoch().count();
+
+            const int id = id_next;
+            add(std::move(e), j.tokens);
+            evict(id);
+        }
+    }
+};
+
+struct server_metrics {
+    int64_t t_start = 0;
+
+    uint64_t n_prompt_tokens_processed_total = 0;
+    uint64_t t_prompt_processing_total       = 0;
+    uint64_t n_tokens_predicted_total        = 0;
+    uint64_t t_tokens_generation_total       = 0;
+
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t t_prompt_processing       = 0;
+
+    uint64_t n_tokens_predicted  = 0;
+    uint64_t t_tokens_generation = 0;
+
+    uint64_t n_decode_total     = 0;
+    uint64_t n_busy_slots_total = 0;
+
+    // speculative decoding
+    uint64_t n_draft_total          = 0; // drafted tokens
+    uint64_t n_draft_accepted_total = 0; // drafted tokens accepted by the target model
+
+    // inter-token latencies (us) of the most recent generated tokens (ring buffer)
+    static constexpr size_t n_itl_window = 4096;
+
+    std::vector<int64_t> t_itl;
+    size_t               i_itl = 0;
+
+    // admission control
+    uint64_t n_expired_total = 0; // requests that did not get a slot before their deadline
+
+    server_histogram h_queue_wait;  // seconds between the arrival of a request and the start of its processing
+    server_histogram h_queue_depth; // number of requests waiting for a slot, at the arrival of each request
+
+    void init() {
+        t_start = ggml_time_us();
+        t_itl.reserve(n_itl_window);
+
+        h_queue_wait  = server_histogram({ 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 });
+        h_queue_depth = server_histogram({ 0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024 });
+    }
+
+    void on_task_queued(size_t n_waiting) {
+        h_queue_depth.observe(n_waiting);
+    }
+
+    void on_task_launched(const server_task & task) {
+        h_queue_wait.observe((ggml_time_us() - task.t_queued) / 1e6);
+    }
+
+    void on_prompt_eval(const server_slot & slot) {
+        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
+        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
+        t_prompt_processing             += slot.t_prompt_processing;
+        t_prompt_processing_total       += slot.t_prompt_processing;
+    }
+
+    void on_prediction(const server_slot & slot) {
+        n_tokens_predicted_total   += slot.n_decoded;
+        n_tokens_predicted         += slot.n_decoded;
+        t_tokens_generation        += slot.t_token_generation;
+        t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_total              += slot.n_draft_total;
+        n_draft_accepted_total     += slot.n_draft_accepted;
+    }
+
+    // record the latency of n tokens generated at t_now by the slot, amortised over the tokens
+    void on_tokens_generated(server_slot & slot, int64_t t_now, int n) {
+        const int64_t t_per_token = (t_now - slot.t_last_token) / std::max(n, 1);
+
+        for (int i = 0; i < n; ++i) {
+            if (t_itl.size() < n_itl_window) {
+                t_itl.push_back(t_per_token);
+            } else {
+                t_itl[i_itl] = t_per_token;
+            }
+            i_itl = (i_itl + 1) % n_itl_window;
+        }
+
+        slot.t_last_token = t_now;
+    }
+
+    // p in [0, 100], in ms
+    double itl_percentile(double p) const {
+        if (t_itl.empty()) {
+            return 0.0;
+        }
+
+        std::vector<int64_t> tmp = t_itl;
+
+        const size_t k = std::min(tmp.size() - 1, (size_t) (p / 100.0 * (tmp.size() - 1) + 0.5));
+        std::nth_element(tmp.begin(), tmp.begin() + k, tmp.end());
+
+        return tmp[k] / 1e3;
+    }
+
+    void on_decoded(const std::vector<server_slot> & slots) {
+        n_decode_total++;
+        for (const auto & slot : slots) {
+            if (slot.is_processing()) {
+                n_busy_slots_total++;
+            }
+        }
+    }
+
+    void reset_bucket() {
+        n_prompt_tokens_processed = 0;
+        t_prompt_processing       = 0;
+        n_tokens_predicted        = 0;
+        t_tokens_generation       = 0;
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // admission control
+    int32_t n_slots     = 1;
+    int32_t n_queue_max = 0; // max number of tasks waiting for a slot (0 = unlimited)
+
+    double t_task_avg = 0.0; // ms, moving average of the time a task holds a slot
+
+    uint64_t n_rejected_total = 0;
+
+    // weighted fair queueing of the deferred tasks between the clients
+    std::unordered_map<std::string, float>  client_weights;
+    std::unordered_map<std::string, double> client_vt_finish;
+    double vt = 0.0; // virtual time
+
+    // callback functions
+    std::function<void(server_task)> callback_new_task;
+    std::function<void(void)>        callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us(); // note: kept when a task is posted again, e.g. after its adapter was loaded
+        }
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task.id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> & tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (task.t_queued == 0) {
+                task.t_queued = ggml_time_us();
+            }
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        if (task.vt_finish < 0.0) {
+            // each task of a client costs 1 / weight of virtual time, starting when the previous task of the client finishes
+            const auto it = client_weights.find(task.client);
+            const float weight = it != client_weights.end() ? it->second : 1.0f;
+
+            double & vt_client = client_vt_finish[task.client];
+            vt_client = std::max(vt, vt_client) + 1.0 / weight;
+
+            task.vt_finish = vt_client;
+        }
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Add the tasks of a request if they can be queued
+    // the capacity is checked in the same critical section as the post, so that concurrent requests cannot exceed it
+    // returns false if the queue is full or if the estimated wait (ms) exceeds the timeout (ms, 0 = no timeout)
+    bool post_admitted(std::vector<server_task> & tasks, int32_t timeout, int64_t & t_wait) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const size_t n_waiting = get_n_waiting();
+
+        // the slots are busy when tasks are waiting, one is released every t_task_avg / n_slots ms on average
+        t_wait = queue_tasks_deferred.empty() ? 0 : (int64_t) ((n_waiting + tasks.size()) * t_task_avg / n_slots);
+
+        if ((n_queue_max > 0 && n_waiting + tasks.size() > (size_t) n_queue_max) || (timeout > 0 && t_wait > timeout)) {
+            n_rejected_total++;
+            return false;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        for (auto & task : tasks) {
+            GGML_ASSERT(task.id != -1);
+            QUE_DBG("new task, id = %d/%d, admitted\n", task.id, (int) tasks.size());
+            task.t_queued  = t_now;
+            task.n_waiting = n_waiting;
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+
+        return true;
+    }
+
+    // Update the average time a task holds a slot, call when a slot is released
+    void on_task_done(double t_task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        t_task_avg = t_task_avg == 0.0 ? t_task : 0.9*t_task_avg + 0.1*t_task;
+    }
+
+    uint64_t get_n_rejected_total() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return n_rejected_total;
+    }
+
+    // Remove the deferred tasks that did not get a slot before their deadline
+    std::vector<server_task> pop_expired_tasks() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const int64_t t_now = ggml_time_us();
+
+        std::vector<server_task> expired;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end();) {
+            if (it->t_deadline > 0 && it->t_deadline <= t_now) {
+                expired.push_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        return expired;
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task with the earliest virtual finish time is moved, so that the clients share the slots according to their weights
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const int64_t t_now = ggml_time_us();
+
+        auto next = queue_tasks_deferred.end();
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ++it) {
+            if (it->t_deadline > 0 && it->t_deadline <= t_now) {
+                continue; // removed by pop_expired_tasks()
+            }
+            if (next == queue_tasks_deferred.end() || it->vt_finish < next->vt_finish) {
+                next = it;
+            }
+        }
+        if (next != queue_tasks_deferred.end()) {
+            vt = std::max(vt, next->vt_finish);
+            queue_tasks.emplace_back(std::move(*next));
+            queue_tasks_deferred.erase(next);
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = queue_tasks.front();
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    // wake up at the earliest deadline of the deferred tasks, to fail them in time
+                    int64_t t_deadline = 0;
+                    for (const auto & task : queue_tasks_deferred) {
+                        if (task.t_deadline > 0 && (t_deadline == 0 || task.t_deadline < t_deadline)) {
+                            t_deadline = task.t_deadline;
+                        }
+                    }
+                    const auto pred = [&]{
+                        return (!queue_tasks.empty() || !running);
+                    };
+                    if (t_deadline > 0) {
+                        condition_tasks.wait_for(lock, std::chrono::microseconds(std::max<int64_t>(0, t_deadline - ggml_time_us())), pred);
+                    } else {
+                        condition_tasks.wait(lock, pred);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // number of requests waiting for a slot, queued or deferred
+    // note: the queue also holds the internal tasks of the main loop, they are not counted
+    size_t get_n_waiting() const {
+        const auto is_request = [](const server_task & task) {
+            return task.type == SERVER_TASK_TYPE_COMPLETION || task.type == SERVER_TASK_TYPE_INFILL ||
+                   task.type == SERVER_TASK_TYPE_EMBEDDING  || task.type == SERVER_TASK_TYPE_RERANK;
+        };
+
+        return std::count_if(queue_tasks.begin(),          queue_tasks.end(),          is_request) +
+               std::count_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), is_request);
+    }
+
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id_target == id_target;
+        };
+        queue_tasks.erase(
+            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+            queue_tasks.end());
+        queue_tasks_deferred.erase(
+            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
+            queue_tasks_deferred.end());
+    }
+};
+
+// unbounded single-producer/single-consumer queue of results, with a wakeup for the consumer
+// the producer is the main loop, the consumer is the HTTP thread waiting for the task(s)
+struct server_result_channel {
+    struct node {
+        server_task_result_ptr result;
+        std::atomic<node *>    next { nullptr };
+    };
+
+    node * head; // owned by the consumer (sentinel)
+    node * tail; // owned by the producer
+
+    // set by the consumer while it sleeps, so that the producer only takes the mutex when needed
+    std::atomic<bool> sleeping { false };
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    server_result_channel() : head(new node), tail(head) {}
+
+    ~server_result_channel() {
+        while (head != nullptr) {
+            node * next = head->next.load(std::memory_order_relaxed);
+            delete head;
+            head = next;
+        }
+    }
+
+    // producer side
+    void push(server_task_result_ptr && result) {
+        node * n = new node;
+        n->result = std::move(result);
+
+        tail->next.store(n, std::memory_order_seq_cst);
+        tail = n;
+
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+    }
+
+    // consumer side, returns nullptr if the channel is empty
+    server_task_result_ptr pop() {
+        node * next = head->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return nullptr;
+        }
+
+        server_task_result_ptr result = std::move(next->result);
+        delete head;
+        head = next;
+
+        return result;
+    }
+
+    // consumer side, returns false if the timeout is reached before a result is available
+    bool wait(int timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_seq_cst);
+
+        const auto has_result = [&] { return head->next.load(std::memory_order_seq_cst) != nullptr; };
+
+        bool ok = true;
+        if (timeout < 0) {
+            cv.wait(lock, has_result);
+        } else {
+            ok = cv.wait_for(lock, std::chrono::seconds(timeout), has_result);
+        }
+
+        sleeping.store(false, std::memory_order_relaxed);
+
+        return ok;
+    }
+};
+
+struct server_response {
+    // one channel per waiting request, shared by all of its tasks
+    // the lock is only taken exclusively when tasks are added or removed - results are published under a shared lock
+    std::unordered_map<int, std::shared_ptr<server_result_channel>> channels;
+
+    std::shared_mutex mutex_channels;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        std::unique_lock<std::shared_mutex> lock(mutex_channels);
+
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) channels.size());
+        channels[id_task] = std::make_shared<server_result_channel>();
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto channel = std::make_shared<server_result_channel>();
+
+        std::unique_lock<std::shared_mutex> lock(mutex_channels);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) channels.size());
+            channels[task.id] = channel;
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    // the pending results are released together with the channel, once all of its tasks are removed
+    void remove_waiting_task_id(int id_task) {
+        std::shared_ptr<server_result_channel> channel;
+
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_channels);
+
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) channels.size());
+
+            auto it = channels.find(id_task);
+            if (it != channels.end()) {
+                channel = std::move(it->second);
+                channels.erase(it);
+            }
+        }
+
+        // the channel (if not shared) is destroyed here, outside of the lock
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::vector<std::shared_ptr<server_result_channel>> removed;
+        removed.reserve(id_tasks.size());
+
+        std::unique_lock<std::shared_mutex> lock(mutex_channels);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) channels.size());
+
+            auto it = channels.find(id_task);
+            if (it != channels.end()) {
+                removed.push_back(std::move(it->second));
+                channels.erase(it);
+            }
         }
+
+        lock.unlock();
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        return recv_impl(id_tasks, -1);
     }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+    // same as recv(), but have timeout in seconds
+    // if timeout is reached, nullptr is returned
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
+        return recv_impl(id_tasks, timeout);
+    }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                return res->id == id_task;
-            }),
-            queue_results.end());
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr && result) {
+        SRV_DBG("sending result for task id = %d\n", result->id);
+
+        std::shared_lock<std::shared_mutex> lock(mutex_channels);
+
+        auto it = channels.find(result->id);
+        if (it != channels.end()) {
+            SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+            it->second->push(std::move(result));
+        }
+    }
+
+private:
+    std::shared_ptr<server_result_channel> get_channel(const std::unordered_set<int> & id_tasks) {
+        std::shared_lock<std::shared_mutex> lock(mutex_channels);
 
         for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+            auto it = channels.find(id_task);
+            if (it != channels.end()) {
+                return it->second;
+            }
         }
+
+        return nullptr;
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+    // timeout < 0 waits indefinitely
+    server_task_result_ptr recv_impl(const std::unordered_set<int> & id_tasks, int timeout) {
+        auto channel = get_channel(id_tasks);
+        if (channel == nullptr) {
+            // none of the tasks is waiting - the results would have been dropped by send()
+            GGML_ASSERT(timeout >= 0 && "recv() on tasks that are not waiting");
+            std::this_thread::sleep_for(std::chrono::seconds(timeout));
+            return nullptr;
+        }
 
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
+        while (true) {
+            server_task_result_ptr res = channel->pop();
+            if (res != nullptr) {
+                // skip stale results of tasks that were removed from this request (e.g. cancelled)
+                if (id_tasks.find(res->id) != id_tasks.end()) {
                     return res;
                 }
+                continue;
+            }
+
+            if (!channel->wait(timeout)) {
+                return nullptr;
             }
         }
 
         // should never reach here
     }
+};
+
+// output stage of the completions: detokenization, stop strings and results of the generated tokens
+// it runs on its own thread and receives the events of the slots in order, so that the main loop only has to decode and sample
+// a stop found by the stage (stop string, indentation or time limit) is picked up by the main loop before the next decode of
+// the slot: the main loop waits for the stage to process the last token of the slots that can be stopped by the stage
+struct server_output_stage {
+    enum event_type {
+        EVENT_START,  // a slot starts a completion task
+        EVENT_TOKEN,  // a token generated by a slot
+        EVENT_RESULT, // a result of a task, completed by the stage (if it belongs to a slot) and sent
+    };
+
+    struct event {
+        event_type type;
+
+        int id_slot = -1;
+        int id_task = -1;
+
+        // EVENT_START
+        int index = 0;
+        std::shared_ptr<const slot_params> params;
+
+        // EVENT_TOKEN
+        completion_token_output tkn; // the text of the token and of its probs is set by the stage
+        result_timings timings;
+        int32_t n_decoded       = 0;
+        int32_t n_prompt_tokens = 0;
+        bool    over_time       = false; // the generation exceeded t_max_predict_ms
+
+        // EVENT_RESULT
+        server_task_result_ptr result;
+        llama_tokens prompt_tokens; // detokenized into the final result
+    };
+
+    // state of the task generated by a slot
+    struct task_state {
+        int id_task = -1;
+        int index   = 0;
+
+        std::shared_ptr<const slot_params> params;
+
+        bool        stopped = false; // a stop was found, the next tokens are discarded
+        stop_type   stop    = STOP_TYPE_NONE;
+        std::string stopping_word;
+
+        std::string generated_text;
+        size_t      n_sent_text  = 0;
+        size_t      last_nl_pos  = 0;
+        bool        has_new_line = false;
+
+        int32_t n_decoded = 0; // tokens processed by the stage
+
+        llama_tokens generated_tokens;
+        std::vector<completion_token_output> generated_token_probs;
+
+        size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
+            size_t stop_pos = std::string::npos;
+
+            for (const std::string & word : params->antiprompt) {
+                size_t pos;
+
+                if (is_full_stop) {
+                    const size_t tmp      = word.size() + last_token_size;
+                    const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+
+                    pos = text.find(word, from_pos);
+                } else {
+                    // otherwise, partial stop
+                    pos = find_partial_stop_string(word, text);
+                }
+
+                if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
+                    if (is_full_stop) {
+                        stopped       = true;
+                        stop          = STOP_TYPE_WORD;
+                        stopping_word = word;
+                    }
+                    stop_pos = pos;
+                }
+            }
+
+            return stop_pos;
+        }
+    };
+
+    const llama_vocab * vocab = nullptr;
+
+    bool special = false; // render the special tokens
+
+    server_response * queue_results = nullptr;
+
+    std::vector<task_state> states; // per slot
+
+    // per slot: the generated text of the task, held back while it ends on an incomplete UTF-8 character
+    std::vector<common_detokenizer> detoks;
+
+    // per slot: the id of the task stopped by the stage (-1 if none), and the number of tokens it generated up to
+    // the token that stopped it
+    std::vector<std::atomic<int>>     id_tasks_stopped;
+    std::vector<std::atomic<int32_t>> n_decoded_stopped;
+
+    // per slot: has_new_line and stopping_word of the task, reported by /slots
+    struct slot_info {
+        bool        has_new_line = false;
+        std::string stopping_word;
+    };
+
+    std::vector<slot_info> infos;
+
+    std::mutex mutex_infos;
+
+    std::deque<event> events;
+
+    std::mutex              mutex_events;
+    std::condition_variable condition_events;
+
+    bool running = false;
+
+    std::thread worker;
+
+    ~server_output_stage() {
+        stop();
+    }
+
+    void start(const llama_vocab * vocab, bool special, server_response * queue_results, size_t n_slots) {
+        this->vocab         = vocab;
+        this->special       = special;
+        this->queue_results = queue_results;
+
+        states.assign(n_slots, {});
+        infos .assign(n_slots, {});
+
+        detoks.clear();
+        detoks.reserve(n_slots);
+        for (size_t i = 0; i < n_slots; ++i) {
+            detoks.emplace_back(vocab, special);
+        }
+
+        id_tasks_stopped  = std::vector<std::atomic<int>>(n_slots);
+        n_decoded_stopped = std::vector<std::atomic<int32_t>>(n_slots);
+        for (auto & id : id_tasks_stopped) {
+            id.store(-1);
+        }
+
+        running = true;
+        worker  = std::thread([this]() { loop(); });
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_events);
+            running = false;
+            condition_events.notify_one();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    void push(event && ev) {
+        std::unique_lock<std::mutex> lock(mutex_events);
+        events.push_back(std::move(ev));
+        condition_events.notify_one();
+    }
+
+    // all the results of the main loop go through the stage, so that it is the only producer of the result channels
+    void send(server_task_result_ptr && result, int id_slot = -1, llama_tokens && prompt_tokens = {}) {
+        event ev;
+        ev.type          = EVENT_RESULT;
+        ev.id_slot       = id_slot;
+        ev.id_task       = result->id;
+        ev.result        = std::move(result);
+        ev.prompt_tokens = std::move(prompt_tokens);
+
+        push(std::move(ev));
+    }
+
+    // called by the main loop: true if the stage found a stop in the task of the slot
+    // n_decoded is the number of generated tokens up to the one that stopped the task, the stage lags behind the
+    // main loop, so the slot may have generated more tokens since
+    bool is_stopped(int id_slot, int id_task, int32_t & n_decoded) const {
+        if (id_tasks_stopped[id_slot].load(std::memory_order_acquire) != id_task) {
+            return false;
+        }
+
+        n_decoded = n_decoded_stopped[id_slot].load(std::memory_order_relaxed);
+
+        return true;
+    }
+
+    // called by the main loop: has_new_line and stopping_word of the task of the slot, as far as the stage got
+    void get_info(int id_slot, bool & has_new_line, std::string & stopping_word) {
+        std::lock_guard<std::mutex> lock(mutex_infos);
+
+        has_new_line  = infos[id_slot].has_new_line;
+        stopping_word = infos[id_slot].stopping_word;
+    }
+
+private:
+    void loop() {
+        std::deque<event> batch;
 
-    // same as recv(), but have timeout in seconds
-    // if timeout is reached, nullptr is returned
-    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
         while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
+            {
+                std::unique_lock<std::mutex> lock(mutex_events);
+                condition_events.wait(lock, [&]{
+                    return !events.empty() || !running;
+                });
+                if (events.empty()) {
+                    return; // terminated
+                }
+                batch.swap(events);
+            }
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
+            for (auto & ev : batch) {
+                switch (ev.type) {
+                    case EVENT_START:  process_start (ev); break;
+                    case EVENT_TOKEN:  process_token (ev); break;
+                    case EVENT_RESULT: process_result(ev); break;
                 }
             }
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
+            batch.clear();
+        }
+    }
+
+    void process_start(event & ev) {
+        task_state & st = states[ev.id_slot];
+
+        st = task_state();
+        st.id_task = ev.id_task;
+        st.index   = ev.index;
+        st.params  = std::move(ev.params);
+
+        detoks[ev.id_slot].reset();
+
+        id_tasks_stopped[ev.id_slot].store(-1, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(mutex_infos);
+        infos[ev.id_slot] = slot_info();
+    }
+
+    void process_token(event & ev) {
+        task_state & st = states[ev.id_slot];
+        if (st.id_task != ev.id_task || st.stopped) {
+            return; // cancelled task, or token sampled after a stop
+        }
+
+        const slot_params & params = *st.params;
+
+        completion_token_output & result = ev.tkn;
+
+        const bool special_tok = special || params.sampling.preserved_tokens.find(result.tok) != params.sampling.preserved_tokens.end();
+
+        // the text completed by the token - empty while the token ends inside a UTF-8 character
+        const std::string_view token_str = detoks[ev.id_slot].push(result.tok, special_tok);
+
+        result.text_to_send = token_str;
+        for (auto & prob : result.probs) {
+            prob.txt = common_token_piece(vocab, prob.tok, special);
+        }
+
+        st.n_decoded = ev.n_decoded;
+
+        st.generated_text += token_str;
+        if (params.return_tokens) {
+            st.generated_tokens.push_back(result.tok);
+        }
+
+        // check if the token only added to an incomplete UTF-8 character
+        bool incomplete = token_str.empty() && !detoks[ev.id_slot].pending().empty();
+
+        // search stop word and delete it
+        if (!incomplete) {
+            size_t pos = std::min(st.n_sent_text, st.generated_text.size());
+
+            const std::string str_test = st.generated_text.substr(pos);
+            bool send_text = true;
+
+            size_t stop_pos = st.find_stopping_strings(str_test, token_str.size(), true);
+            if (stop_pos != std::string::npos) {
+                st.generated_text.erase(
+                    st.generated_text.begin() + pos + stop_pos,
+                    st.generated_text.end());
+                pos = std::min(st.n_sent_text, st.generated_text.size());
+            } else {
+                stop_pos = st.find_stopping_strings(str_test, token_str.size(), false);
+                send_text = stop_pos == std::string::npos;
+            }
+
+            // check if there is any token to predict
+            if (send_text) {
+                // no send the stop word in the response
+                result.text_to_send = st.generated_text.substr(pos, std::string::npos);
+                st.n_sent_text += result.text_to_send.size();
+                // add the token to slot queue and cache
+            } else {
+                result.text_to_send = "";
+            }
+
+            st.generated_token_probs.push_back(result);
+            if (params.stream) {
+                send_partial_response(st, ev);
             }
         }
 
-        // should never reach here
+        if (st.has_new_line) {
+            // require that each new line has a whitespace prefix (i.e. indentation) of at least params.n_indent
+            if (params.n_indent > 0) {
+                // check the current indentation
+                // TODO: improve by not doing it more than once for each new line
+                if (st.last_nl_pos > 0) {
+                    size_t pos = st.last_nl_pos;
+
+                    int n_indent = 0;
+                    while (pos < st.generated_text.size() && (st.generated_text[pos] == ' ' || st.generated_text[pos] == '\t')) {
+                        n_indent++;
+                        pos++;
+                    }
+
+                    if (pos < st.generated_text.size() && n_indent < params.n_indent) {
+                        st.stopped = true;
+                        st.stop    = STOP_TYPE_LIMIT;
+
+                        // cut the last line
+                        st.generated_text.erase(pos, std::string::npos);
+
+                        SRV_DBG("task %d stopped by indentation limit, n_decoded = %d, n_indent = %d\n", st.id_task, st.n_decoded, n_indent);
+                    }
+                }
+
+                // find the next new line
+                {
+                    const size_t pos = st.generated_text.find('\n', st.last_nl_pos);
+
+                    if (pos != std::string::npos) {
+                        st.last_nl_pos = pos + 1;
+                    }
+                }
+            }
+        }
+
+        // check if there is a new line in the generated text
+        if (result.text_to_send.find('\n') != std::string::npos) {
+            st.has_new_line = true;
+
+            // if we have seen a new line, we stop after a certain time limit, but only upon another new line
+            if (ev.over_time && !st.stopped) {
+                st.stopped = true;
+                st.stop    = STOP_TYPE_LIMIT;
+
+                SRV_DBG("task %d stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", st.id_task, st.n_decoded, (int) params.t_max_predict_ms);
+            }
+        }
+
+        if (st.has_new_line || st.stopped) {
+            std::lock_guard<std::mutex> lock(mutex_infos);
+            infos[ev.id_slot].has_new_line  = st.has_new_line;
+            infos[ev.id_slot].stopping_word = st.stopping_word;
+        }
+
+        if (st.stopped) {
+            n_decoded_stopped[ev.id_slot].store(st.n_decoded, std::memory_order_relaxed);
+            id_tasks_stopped [ev.id_slot].store(st.id_task,   std::memory_order_release);
+        }
     }
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+    void send_partial_response(const task_state & st, const event & ev) {
+        const slot_params & params = *st.params;
+
+        auto res = std::make_unique<server_task_result_cmpl_partial>();
+
+        res->id      = st.id_task;
+        res->index   = st.index;
+        res->content = ev.tkn.text_to_send;
+        res->tokens  = { ev.tkn.tok };
+
+        res->n_decoded           = ev.n_decoded;
+        res->n_prompt_tokens     = ev.n_prompt_tokens;
+        res->post_sampling_probs = params.post_sampling_probs;
+
+        res->verbose           = params.verbose;
+        res->oaicompat         = params.oaicompat;
+        res->oaicompat_model   = params.oaicompat_model;
+        res->oaicompat_cmpl_id = params.oaicompat_cmpl_id;
+
+        // populate res.probs_output
+        if (params.sampling.n_probs > 0) {
+            res->prob_output = ev.tkn; // copy the token probs
+        }
+
+        // populate timings if this is final response or timings_per_token is enabled
+        if (st.stop != STOP_TYPE_NONE || params.timings_per_token) {
+            res->timings = ev.timings;
+        }
+
+        queue_results->send(std::move(res));
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr && result) {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+    void process_result(event & ev) {
+        if (ev.id_slot < 0) {
+            queue_results->send(std::move(ev.result));
+            return;
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        task_state & st = states[ev.id_slot];
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
+        auto * res = dynamic_cast<server_task_result_cmpl_final *>(ev.result.get());
+        if (res != nullptr && st.id_task == ev.id_task) {
+            if (!st.stopped) {
+                // the text ends with the bytes of the last tokens, even if they do not complete a character
+                st.generated_text += detoks[ev.id_slot].pending();
+            }
+
+            res->content       = std::move(st.generated_text);
+            res->tokens        = std::move(st.generated_tokens);
+            res->prompt        = common_detokenize(vocab, ev.prompt_tokens, true);
+            res->has_new_line  = st.has_new_line;
+            res->stopping_word = st.stopping_word;
+
+            if (st.stopped) {
+                // the tokens sampled after the stop were discarded
+                // note: an EOS on the token of the stop takes precedence, as before the stage existed
+                if (res->n_decoded > st.n_decoded || res->stop != STOP_TYPE_EOS) {
+                    res->stop = st.stop;
+                }
+                // the main loop rolls them back from the KV cache of the slot
+                if (res->n_decoded > st.n_decoded) {
+                    res->n_tokens_cached -= res->n_decoded - st.n_decoded;
+                }
+                res->n_decoded = st.n_decoded;
             }
+
+            // populate res.probs_output
+            if (st.params->sampling.n_probs > 0) {
+                if (!st.params->stream && res->stop == STOP_TYPE_WORD) {
+                    const llama_tokens stop_word_toks = common_tokenize(vocab, st.stopping_word, false);
+
+                    size_t safe_offset = std::min(st.generated_token_probs.size(), stop_word_toks.size());
+                    res->probs_output = std::vector<completion_token_output>(
+                            st.generated_token_probs.begin(),
+                            st.generated_token_probs.end() - safe_offset);
+                } else {
+                    res->probs_output = std::move(st.generated_token_probs);
+                }
+            }
+        }
+
+        if (st.id_task == ev.id_task) {
+            st = task_state();
         }
+
+        queue_results->send(std::move(ev.result));
     }
 };
 
@@ -1832,9 +3311,11 @@ struct server_context {
 
     const llama_vocab * vocab = nullptr;
 
-    llama_model * model_dft = nullptr;
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
 
-    llama_context_params cparams_dft;
+    // drafts of all the slots, generated with a single draft batch
+    common_speculative_batch * spec = nullptr;
 
     llama_batch batch = {};
 
@@ -1844,13 +3325,42 @@ struct server_context {
 
     int32_t n_ctx; // total context for all clients / slots
 
+    bool kv_streaming = false; // the KV cache evicts the old tokens, no context shift is needed
+
+    // prompts cached by the slots, used to select a slot and to copy cached prefixes between slots
+    server_prompt_cache prompt_cache;
+
+    bool prompt_cache_copy = false; // cached prefixes can be copied from other slots with llama_kv_self_seq_cp
+
+    // prompts cached on disk, restored across restarts of the server
+    server_kv_disk_cache kv_disk_cache;
+
+    // fine-tunes of the base model, unloaded in LRU order when their memory exceeds models_lora_budget
+    std::vector<server_model_lora> models_lora;
+
+    size_t models_lora_budget = 0; // bytes, 0 = unlimited
+
+    std::mutex mutex_models_lora;
+
     // slots / clients
     std::vector<server_slot> slots;
+
+    // slots in the order in which their prompts are processed (reused across iterations)
+    std::vector<server_slot *> slots_prompt;
+
+    // slots that can share the current batch
+    std::vector<server_slot *> slots_batched;
+
+    // adapters applied to the whole context, shared by the slots of the last batch
+    std::vector<common_adapter_lora_info> lora_ctx;
     json default_generation_settings_for_props;
 
     server_queue    queue_tasks;
     server_response queue_results;
 
+    // detokenization, stop strings and results, off the main loop (declared after queue_results, so that it is stopped first)
+    server_output_stage output;
+
     server_metrics metrics;
 
     // Necessary similarity of prompt for slot selection
@@ -1859,21 +3369,65 @@ struct server_context {
     common_chat_templates_ptr chat_templates;
 
     ~server_context() {
+        for (auto & entry : models_lora) {
+            if (entry.loader.joinable()) {
+                entry.loader.join();
+            }
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             common_sampler_free(slot.smpl);
             slot.smpl = nullptr;
+        }
+
+        common_speculative_batch_free(spec);
+
+        llama_batch_free(batch);
+    }
+
+    // the KV cache of a prompt depends on the content of the model and on the type and layout of the KV cache
+    // the content of the model is identified by its GGUF metadata and by the path, size and modification time of its
+    // file, so that a model converted or quantized again at the same path does not reuse the entries of the old one
+    uint64_t model_fingerprint() const {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        char buf[1024];
+        for (int32_t i = 0; i < llama_model_meta_count(model); i++) {
+            if (llama_model_meta_key_by_index(model, i, buf, sizeof(buf)) >= 0) {
+                h = server_kv_disk_cache::hash_str(h, buf);
+            }
+            if (llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf)) >= 0) {
+                h = server_kv_disk_cache::hash_str(h, buf);
+            }
+        }
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+        std::error_code ec;
+        const std::filesystem::path path = std::filesystem::absolute(params_base.model.path, ec);
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+        h = server_kv_disk_cache::hash_str(h, path.string());
+        h = server_kv_disk_cache::hash_val(h, (uint64_t) std::filesystem::file_size(path, ec));
+        h = server_kv_disk_cache::hash_val(h, (int64_t) std::filesystem::last_write_time(path, ec).time_since_epoch().count());
 
-            llama_batch_free(slot.batch_spec);
-        }
+        h = server_kv_disk_cache::hash_val(h, llama_model_size(model));
+        h = server_kv_disk_cache::hash_val(h, llama_model_n_params(model));
+        h = server_kv_disk_cache::hash_val(h, params_base.cache_type_k);
+        h = server_kv_disk_cache::hash_val(h, params_base.cache_type_v);
+        h = server_kv_disk_cache::hash_val(h, params_base.flash_attn);
 
-        llama_batch_free(batch);
+        return h;
+    }
+
+    // the LoRA adapters applied to a sequence change its KV cache
+    static uint64_t lora_fingerprint(const std::vector<common_adapter_lora_info> & lora) {
+        uint64_t h = 0;
+        for (const auto & la : lora) {
+            if (la.scale != 0.0f) {
+                h = server_kv_disk_cache::hash_str(h ? h : 0xcbf29ce484222325ULL, la.path);
+                h = server_kv_disk_cache::hash_val(h, la.scale);
+            }
+        }
+        return h;
     }
 
     bool load_model(const common_params & params) {
@@ -1895,9 +3449,36 @@ struct server_context {
 
         n_ctx = llama_n_ctx(ctx);
 
+        // note: the context can turn the streaming policy off, so query the effective one
+        kv_streaming = llama_n_kv_window(ctx) > 0;
+
+        // the cells of a recurrent model hold the state of the whole sequence
+        // with the streaming KV cache, the cached prefixes are evicted over time
+        prompt_cache_copy = !kv_streaming && !llama_model_is_recurrent(model);
+
+        if (!params_base.kv_disk_cache_path.empty()) {
+            if (!prompt_cache_copy) {
+                SRV_WRN("%s", "the KV disk cache is not supported with recurrent models or the streaming KV cache, disabling it\n");
+            } else if (!kv_disk_cache.init(params_base.kv_disk_cache_path, params_base.kv_disk_cache_size, params_base.kv_disk_cache_min, model_fingerprint())) {
+                return false;
+            }
+        }
+
         add_bos_token = llama_vocab_get_add_bos(vocab);
         has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
 
+        for (const auto & entry : params_base.models_lora) {
+            SRV_INF("serving fine-tune '%s' (LoRA adapter '%s')\n", entry.name.c_str(), entry.path.c_str());
+
+            server_model_lora model_lora;
+            model_lora.name = entry.name;
+            model_lora.path = entry.path;
+
+            models_lora.push_back(std::move(model_lora));
+        }
+
+        models_lora_budget = (size_t) params_base.models_lora_budget * 1024 * 1024;
+
         if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
             SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
 
@@ -1905,9 +3486,11 @@ struct server_context {
 
             params_dft.devices      = params_base.speculative.devices;
             params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
             params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+
+            // a single draft context for all the slots, with a sequence per slot
+            params_dft.n_ctx        = (params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx) * params_base.n_parallel;
+            params_dft.n_parallel   = params_base.n_parallel;
 
             // force F16 KV cache for the draft model for extra performance
             params_dft.cache_type_k = GGML_TYPE_F16;
@@ -1928,13 +3511,9 @@ struct server_context {
                 return false;
             }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+            ctx_dft = llama_init_dft.context.get();
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
-
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
+            spec = common_speculative_batch_init(ctx_dft, params_base.n_parallel);
         }
 
         chat_templates = common_chat_templates_init(model, params_base.chat_template);
@@ -1962,27 +3541,14 @@ struct server_context {
             slot.n_ctx = n_ctx_slot;
             slot.n_predict = params_base.n_predict;
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
-
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
-
-                slot.spec = common_speculative_init(slot.ctx_dft);
-                if (slot.spec == nullptr) {
-                    SRV_ERR("%s", "failed to create speculator\n");
-                    return;
-                }
-            }
+            slot.ctx_dft = ctx_dft;
 
             SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
 
             slot.params.sampling = params_base.sampling;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id) {
+                queue_tasks.on_task_done((ggml_time_us() - slots[id].t_start_task) / 1e3);
                 queue_tasks.pop_deferred_task();
             };
 
@@ -2003,6 +3569,12 @@ struct server_context {
         }
 
         metrics.init();
+
+        output.start(vocab, params_base.special, &queue_results, slots.size());
+
+        queue_tasks.n_slots        = params_base.n_parallel;
+        queue_tasks.n_queue_max    = params_base.n_queue_max;
+        queue_tasks.client_weights = { params_base.api_key_weights.begin(), params_base.api_key_weights.end() };
     }
 
     server_slot * get_slot_by_id(int id) {
@@ -2018,38 +3590,25 @@ struct server_context {
     server_slot * get_available_slot(const server_task & task) {
         server_slot * ret = nullptr;
 
-        // find the slot that has at least n% prompt similarity
+        // find the available slot that holds the longest prefix of the prompt, with at least n% prompt similarity
         if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
-            float similarity = 0;
-
-            for (server_slot & slot : slots) {
-                // skip the slot if it is not available
-                if (slot.is_processing()) {
-                    continue;
-                }
+            int id_slot = -1;
 
-                // skip the slot if it does not contains cached tokens
-                if (slot.cache_tokens.empty()) {
-                    continue;
-                }
+            const size_t n_match = prompt_cache.find(task.prompt_tokens, [&](int id) {
+                return !slots[id].is_processing();
+            }, id_slot);
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+            if (id_slot >= 0) {
+                server_slot & slot = slots[id_slot];
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+                // fraction of the common prefix length compared to the current slot's prompt length
+                const float similarity = static_cast<float>(n_match) / std::max<size_t>(1, slot.cache_tokens.size());
 
-                // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
-                    similarity = cur_similarity;
+                if (similarity > slot_prompt_similarity) {
                     ret = &slot;
-                }
-            }
 
-            if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+                    SLT_DBG(*ret, "selected slot by prefix similarity, n_match = %zu, similarity = %f\n", n_match, similarity);
+                }
             }
         }
 
@@ -2077,37 +3636,224 @@ struct server_context {
         return ret;
     }
 
-    bool can_be_detokenized(const struct llama_context * ctx, const std::vector<llama_token> & tokens) {
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-        const int32_t n_vocab = llama_vocab_n_tokens(vocab);
-        for (const auto & token : tokens) {
-            if (token < 0 || token >= n_vocab) {
+    server_model_lora * model_lora_find(const std::string & name) {
+        for (auto & entry : models_lora) {
+            if (entry.name == name) {
+                return &entry;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // check if the adapter of the fine-tune selected by the task is loaded
+    // otherwise the adapter is loaded by a background thread, which posts the task again once it is done, so that
+    // the main loop keeps serving the other tasks in the meantime
+    // returns false if the task waits for the adapter, or if the adapter cannot be loaded (the task is failed)
+    bool model_lora_ready(server_task & task) {
+        server_model_lora * entry = model_lora_find(task.params.oaicompat_model);
+        if (entry == nullptr || entry->adapter) {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_models_lora);
+
+        if (entry->loading) {
+            entry->tasks_waiting.push_back(std::move(task));
+            return false;
+        }
+
+        if (entry->loader.joinable()) {
+            // the loader is done
+            entry->loader.join();
+
+            entry->adapter = std::move(entry->adapter_loaded);
+            if (!entry->adapter) {
+                send_error(task, "failed to load model '" + entry->name + "'", ERROR_TYPE_SERVER);
                 return false;
             }
+
+            std::error_code ec;
+            entry->size = std::filesystem::file_size(entry->path, ec);
+            if (ec) {
+                entry->size = 0;
+            }
+
+            // the fine-tune is applied per sequence when it shares a batch with other models
+            entry->size_seq = llama_adapter_lora_seq_size(entry->adapter.get());
+
+            SRV_INF("loaded fine-tune '%s' (%.2f MiB + %.2f MiB per sequence)\n", entry->name.c_str(),
+                    entry->size / 1024.0 / 1024.0, entry->size_seq / 1024.0 / 1024.0);
+
+            return true;
+        }
+
+        SRV_INF("loading fine-tune '%s' from '%s'\n", entry->name.c_str(), entry->path.c_str());
+
+        entry->loading = true;
+        entry->tasks_waiting.push_back(std::move(task));
+
+        entry->loader = std::thread([this, entry]() {
+            const int64_t t_start = ggml_time_us();
+
+            llama_adapter_lora_ptr adapter(llama_adapter_lora_init(model, entry->path.c_str()));
+            if (!adapter) {
+                SRV_ERR("failed to load fine-tune '%s' from '%s'\n", entry->name.c_str(), entry->path.c_str());
+            } else {
+                SRV_DBG("loaded fine-tune '%s' in %.2f ms\n", entry->name.c_str(), (ggml_time_us() - t_start) / 1e3);
+            }
+
+            std::vector<server_task> tasks;
+            {
+                std::unique_lock<std::mutex> lock(mutex_models_lora);
+
+                entry->loading        = false;
+                entry->adapter_loaded = std::move(adapter);
+
+                tasks = std::move(entry->tasks_waiting);
+                entry->tasks_waiting.clear();
+            }
+
+            // the first task takes the adapter in the main loop
+            queue_tasks.post(tasks, true);
+        });
+
+        return false;
+    }
+
+    // cancel a task that waits for the adapter of its fine-tune
+    void model_lora_cancel(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_models_lora);
+
+        for (auto & entry : models_lora) {
+            auto & tasks = entry.tasks_waiting;
+            tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [&](const server_task & task) {
+                return task.id == id_task;
+            }), tasks.end());
+        }
+    }
+
+    // add the LoRA adapter of the fine-tune selected by the "model" field to the params
+    // note: the adapter was loaded by model_lora_ready() before the task got its slot
+    bool model_lora_select(slot_params & params) {
+        server_model_lora * entry = model_lora_find(params.oaicompat_model);
+        if (entry == nullptr) {
+            // the base model
+            return true;
+        }
+
+        if (!entry->adapter) {
+            return false;
         }
+
+        entry->t_last_used = ggml_time_us();
+
+        params.lora.push_back({ entry->path, 1.0f, entry->adapter.get() });
+
+        model_lora_evict(entry);
+
         return true;
     }
 
+    bool model_lora_in_use(const server_model_lora & entry) const {
+        for (const auto & slot : slots) {
+            if (!slot.is_processing()) {
+                continue;
+            }
+            for (const auto & lora : slot.lora) {
+                if (lora.ptr == entry.adapter.get()) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // unload the least recently used fine-tunes that are not in use, until the loaded ones fit in the budget
+    void model_lora_evict(const server_model_lora * keep) {
+        if (models_lora_budget == 0) {
+            return;
+        }
+
+        while (true) {
+            size_t size_total = 0;
+            for (const auto & entry : models_lora) {
+                if (entry.adapter) {
+                    size_total += entry.size + entry.size_seq;
+                }
+            }
+
+            if (size_total <= models_lora_budget) {
+                break;
+            }
+
+            server_model_lora * lru = nullptr;
+            for (auto & entry : models_lora) {
+                if (!entry.adapter || &entry == keep || model_lora_in_use(entry)) {
+                    continue;
+                }
+                if (lru == nullptr || entry.t_last_used < lru->t_last_used) {
+                    lru = &entry;
+                }
+            }
+
+            if (lru == nullptr) {
+                SRV_WRN("the loaded fine-tunes (%.2f MiB) exceed the budget (%.2f MiB), but all of them are in use\n",
+                        size_total / 1024.0 / 1024.0, models_lora_budget / 1024.0 / 1024.0);
+                break;
+            }
+
+            SRV_INF("unloading fine-tune '%s' (%.2f MiB)\n", lru->name.c_str(), (lru->size + lru->size_seq) / 1024.0 / 1024.0);
+
+            // the idle slots that used the adapter cannot reuse their KV cache anymore
+            for (auto & slot : slots) {
+                bool uses = false;
+                for (const auto & lora : slot.lora) {
+                    uses = uses || lora.ptr == lru->adapter.get();
+                }
+                if (uses) {
+                    prompt_cache.remove(slot.id);
+                    slot.cache_tokens.clear();
+                    slot.lora = params_base.lora_adapters;
+                }
+            }
+
+            llama_rm_adapter_lora(ctx, lru->adapter.get());
+            lora_ctx.erase(std::remove_if(lora_ctx.begin(), lora_ctx.end(), [&](const common_adapter_lora_info & la) {
+                return la.ptr == lru->adapter.get();
+            }), lora_ctx.end());
+            lru->adapter.reset();
+        }
+    }
+
     bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        rollback_stopped_tokens(slot);
+
+        // the KV cache of the slot is about to change
+        prompt_cache.remove(slot.id);
+
         slot.reset();
         slot.id_task       = task.id;
         slot.index         = task.index;
         slot.task_type     = task.type;
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
+        slot.t_start_task  = ggml_time_us();
+
+        metrics.on_task_launched(task);
+
+        if (!model_lora_select(slot.params)) {
+            send_error(task, "failed to load model '" + slot.params.oaicompat_model + "'", ERROR_TYPE_SERVER);
+            return false;
+        }
 
-        if (!are_lora_equal(task.params.lora, slot.lora)) {
+        if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
             slot.cache_tokens.clear();
-            slot.lora = task.params.lora;
+            slot.lora = slot.params.lora;
         }
 
-        bool can_detokenize = can_be_detokenized(ctx, slot.prompt_tokens);
-        if (!can_detokenize) {
-            send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
-            return false;
-        }
         SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
@@ -2121,11 +3867,16 @@ struct server_context {
         }
 
         {
-            if (slot.smpl != nullptr) {
-                common_sampler_free(slot.smpl);
-            }
+            // the previous sampler is freed after the new one is created, so that a grammar used by consecutive
+            // requests keeps its compiled state
+            common_sampler * smpl_prev = slot.smpl;
 
             slot.smpl = common_sampler_init(model, slot.params.sampling);
+
+            if (smpl_prev != nullptr) {
+                common_sampler_free(smpl_prev);
+            }
+
             if (slot.smpl == nullptr) {
                 // for now, the only error that may happen here is invalid grammar
                 send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
@@ -2133,172 +3884,233 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
+        slot.state = SLOT_STATE_STARTED;
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
-        }
+        if (!slot.is_non_causal()) {
+            server_output_stage::event ev;
+            ev.type    = server_output_stage::EVENT_START;
+            ev.id_slot = slot.id;
+            ev.id_task = slot.id_task;
+            ev.index   = slot.index;
+            ev.params  = std::make_shared<const slot_params>(slot.params);
 
-        slot.state = SLOT_STATE_STARTED;
+            output.push(std::move(ev));
+        }
 
         SLT_INF(slot, "%s", "processing task\n");
 
         return true;
     }
 
+    // copy the states of the sequences of the last prompts to the KV disk cache
+    // note: the copy blocks the decoding, so it waits for the slots to be idle, and a slot that starts another task
+    //       before drops its state
+    void kv_disk_cache_store() {
+        for (auto & slot : slots) {
+            if (slot.kv_disk_store) {
+                slot.kv_disk_store = false;
+
+                // the KV cache holds the prompt and the generated tokens, except the last one
+                kv_disk_cache.store(ctx, slot.id, slot.cache_tokens, lora_fingerprint(slot.lora));
+            }
+        }
+    }
+
     void kv_cache_clear() {
         SRV_DBG("%s", "clearing KV cache\n");
 
         // clear the entire KV cache
         llama_kv_self_clear(ctx);
+        prompt_cache.clear();
         clean_kv_cache = false;
     }
 
+    // the text of the token, the stop strings and the streamed results are handled by the output stage
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
 
-        slot.generated_text += token_str;
-        if (slot.params.return_tokens) {
-            slot.generated_tokens.push_back(result.tok);
-        }
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+        // check the limits
+        if (slot.n_decoded > 0 && !slot.has_budget(params_base)) {
+            slot.stop           = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
 
-        // search stop word and delete it
-        if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
+            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+        }
 
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool send_text = true;
+        // if context shift is disabled, we stop when it reaches the context limit
+        // (the streaming KV cache evicts the old tokens instead)
+        if (slot.n_past >= slot.n_ctx && !kv_streaming) {
+            slot.truncated      = true;
+            slot.stop           = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
-            if (stop_pos != std::string::npos) {
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
-                send_text = stop_pos == std::string::npos;
-            }
+            SLT_DBG(slot, "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = %d, n_ctx = %d\n",
+                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
+        }
 
-            // check if there is any token to predict
-            if (send_text) {
-                // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
-                slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
-            } else {
-                result.text_to_send = "";
-            }
+        if (llama_vocab_is_eog(vocab, result.tok)) {
+            slot.stop           = STOP_TYPE_EOS;
+            slot.has_next_token = false;
 
-            slot.add_token(result);
-            if (slot.params.stream) {
-                send_partial_response(slot, result);
-            }
+            SLT_DBG(slot, "%s", "stopped by EOS\n");
         }
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
+        const auto n_ctx_train = llama_model_n_ctx_train(model);
 
-        // check the limits
-        if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params_base)) {
+        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
+            slot.truncated      = true;
             slot.stop           = STOP_TYPE_LIMIT;
-            slot.has_next_token = false;
+            slot.has_next_token = false; // stop prediction
 
-            SLT_DBG(slot, "stopped by limit, n_decoded = %d, n_predict = %d\n", slot.n_decoded, slot.params.n_predict);
+            SLT_WRN(slot,
+                    "n_predict (%d) is set for infinite generation. "
+                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
+                    slot.params.n_predict, n_ctx_train);
         }
 
-        if (slot.has_new_line) {
-            // require that each new line has a whitespace prefix (i.e. indentation) of at least slot.params.n_indent
-            if (slot.params.n_indent > 0) {
-                // check the current indentation
-                // TODO: improve by not doing it more than once for each new line
-                if (slot.last_nl_pos > 0) {
-                    size_t pos = slot.last_nl_pos;
+        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d\n", slot.n_decoded, slot.n_remaining, result.tok);
 
-                    int n_indent = 0;
-                    while (pos < slot.generated_text.size() && (slot.generated_text[pos] == ' ' || slot.generated_text[pos] == '\t')) {
-                        n_indent++;
-                        pos++;
-                    }
+        server_output_stage::event ev;
+        ev.type            = server_output_stage::EVENT_TOKEN;
+        ev.id_slot         = slot.id;
+        ev.id_task         = slot.id_task;
+        ev.tkn             = std::move(result);
+        ev.n_decoded       = slot.n_decoded;
+        ev.n_prompt_tokens = slot.n_prompt_tokens;
+        ev.over_time       = slot.params.t_max_predict_ms > 0 && (ggml_time_us() - slot.t_start_generation > 1000.0f*slot.params.t_max_predict_ms);
+        ev.timings         = slot.get_timings();
 
-                    if (pos < slot.generated_text.size() && n_indent < slot.params.n_indent) {
-                        slot.stop           = STOP_TYPE_LIMIT;
-                        slot.has_next_token = false;
+        output.push(std::move(ev));
 
-                        // cut the last line
-                        slot.generated_text.erase(pos, std::string::npos);
+        return slot.has_next_token; // continue
+    }
 
-                        SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded, n_indent);
-                    }
-                }
+    // verify the draft of the slot, evaluated in the batch after its sampled token (at index idx)
+    void process_draft(server_slot & slot, int idx) {
+        std::vector<int> idxs(slot.drafted.size() + 1);
+        for (size_t i = 0; i < idxs.size(); ++i) {
+            idxs[i] = idx + i;
+        }
 
-                // find the next new line
-                {
-                    const size_t pos = slot.generated_text.find('\n', slot.last_nl_pos);
+        // the accepted tokens from the draft, followed by a token sampled by the target model
+        const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, idxs, slot.drafted);
 
-                    if (pos != std::string::npos) {
-                        slot.last_nl_pos = pos + 1;
-                    }
-                }
+        slot.i_batch = -1;
+
+        slot.n_past += ids.size() - 1;
+
+        const int64_t t_current = ggml_time_us();
+
+        metrics.on_tokens_generated(slot, t_current, ids.size());
+
+        slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+
+        // update how many tokens out of draft was accepted
+        slot.n_draft_accepted += ids.size() - 1;
+
+        slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+
+        llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+        SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) slot.drafted.size(), slot.n_past);
+
+        slot.drafted.clear();
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            completion_token_output result;
+
+            result.tok  = ids[i];
+            result.prob = 1.0f; // set later
+
+            slot.n_decoded += 1;
+
+            if (!process_token(result, slot)) {
+                // release slot because of stop condition
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                break;
             }
         }
+    }
 
-        // check if there is a new line in the generated text
-        if (result.text_to_send.find('\n') != std::string::npos) {
-            slot.has_new_line = true;
+    // draft the next tokens of all the generating slots with a single draft batch
+    void gen_drafts() {
+        std::vector<common_speculative_seq> seqs;
+        std::vector<server_slot *>          seqs_slot;
 
-            // if we have seen a new line, we stop after a certain time limit, but only upon another new line
-            if (slot.params.t_max_predict_ms > 0 && (ggml_time_us() - slot.t_start_generation > 1000.0f*slot.params.t_max_predict_ms)) {
-                slot.stop           = STOP_TYPE_LIMIT;
-                slot.has_next_token = false;
+        for (auto & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING || !slot.can_speculate()) {
+                continue;
+            }
 
-                SLT_DBG(slot, "stopped by time limit, n_decoded = %d, t_max_predict_ms = %d ms\n", slot.n_decoded, (int) slot.params.t_max_predict_ms);
+            // the probs of the drafted tokens are not computed
+            if (slot.params.sampling.n_probs > 0) {
+                continue;
             }
-        }
 
-        // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx) {
-            slot.truncated      = true;
-            slot.stop           = STOP_TYPE_LIMIT;
-            slot.has_next_token = false;
+            // determine the max draft that fits the current slot state
+            int n_draft_max = slot.params.speculative.n_max;
 
-            SLT_DBG(slot, "stopped due to running out of context capacity, n_past = %d, n_prompt_tokens = %d, n_decoded = %d, n_ctx = %d\n",
-                    slot.n_decoded, slot.n_prompt_tokens, slot.n_past, slot.n_ctx);
-        }
+            // note: n_past is not yet increased for the `id` token sampled above
+            //       also, need to leave space for 1 extra token to allow context shifts
+            n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
 
-        if (llama_vocab_is_eog(vocab, result.tok)) {
-            slot.stop           = STOP_TYPE_EOS;
-            slot.has_next_token = false;
+            if (slot.n_remaining > 0) {
+                n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+            }
 
-            SLT_DBG(slot, "%s", "stopped by EOS\n");
+            SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+            if (n_draft_max < slot.params.speculative.n_min) {
+                SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+
+                continue;
+            }
+
+            common_speculative_seq seq;
+            seq.seq_id         = slot.id;
+            seq.params.n_draft = n_draft_max;
+            seq.params.n_reuse = llama_n_ctx(ctx_dft) / params_base.n_parallel - slot.params.speculative.n_max;
+            seq.params.p_min   = slot.params.speculative.p_min;
+            seq.prompt         = &slot.cache_tokens;
+            seq.id_last        = slot.sampled;
+
+            seqs.push_back(std::move(seq));
+            seqs_slot.push_back(&slot);
+        }
+
+        if (seqs.empty()) {
+            return;
         }
 
-        const auto n_ctx_train = llama_model_n_ctx_train(model);
+        common_speculative_gen_drafts(spec, seqs);
 
-        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
-            slot.truncated      = true;
-            slot.stop           = STOP_TYPE_LIMIT;
-            slot.has_next_token = false; // stop prediction
+        for (size_t i = 0; i < seqs.size(); ++i) {
+            server_slot & slot = *seqs_slot[i];
 
-            SLT_WRN(slot,
-                    "n_predict (%d) is set for infinite generation. "
-                    "Limiting generated tokens to n_ctx_train (%d) to avoid EOS-less generation infinite loop\n",
-                    slot.params.n_predict, n_ctx_train);
-        }
+            llama_tokens & draft = seqs[i].draft;
 
-        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
+            // keep track of total number of tokens generated in the draft
+            slot.n_draft_total += draft.size();
 
-        return slot.has_next_token; // continue
+            // ignore small drafts
+            if (slot.params.speculative.n_min > (int) draft.size()) {
+                SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+                continue;
+            }
+
+            slot.drafted = std::move(draft);
+        }
     }
 
-    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
+    // note: the text of the tokens is set by the output stage
+    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, int idx) {
         size_t n_probs = slot.params.sampling.n_probs;
         size_t n_vocab = llama_vocab_n_tokens(vocab);
         if (post_sampling) {
@@ -2318,7 +4130,7 @@ struct server_context {
             for (size_t i = 0; i < std::min(max_probs, n_probs); i++) {
                 result.probs.push_back({
                     cur_p->data[i].id,
-                    common_token_to_piece(ctx, cur_p->data[i].id, special),
+                    "",
                     cur_p->data[i].p
                 });
             }
@@ -2340,7 +4152,7 @@ struct server_context {
             for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
                 result.probs.push_back({
                     cur[i].id,
-                    common_token_to_piece(ctx, cur[i].id, special),
+                    "",
                     cur[i].p
                 });
             }
@@ -2352,10 +4164,10 @@ struct server_context {
     }
 
     void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
-        send_error(slot.id_task, error, type);
+        send_error(slot.id_task, error, type, slot.id);
     }
 
-    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+    void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER, const int id_slot = -1) {
         SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
 
         auto res = std::make_unique<server_task_result_error>();
@@ -2363,57 +4175,23 @@ struct server_context {
         res->err_type = type;
         res->err_msg  = error;
 
-        queue_results.send(std::move(res));
-    }
-
-    void send_partial_response(server_slot & slot, const completion_token_output & tkn) {
-        auto res = std::make_unique<server_task_result_cmpl_partial>();
-
-        res->id      = slot.id_task;
-        res->index   = slot.index;
-        res->content = tkn.text_to_send;
-        res->tokens  = { tkn.tok };
-
-        res->n_decoded           = slot.n_decoded;
-        res->n_prompt_tokens     = slot.n_prompt_tokens;
-        res->post_sampling_probs = slot.params.post_sampling_probs;
-
-        res->verbose           = slot.params.verbose;
-        res->oaicompat         = slot.params.oaicompat;
-        res->oaicompat_model   = slot.params.oaicompat_model;
-        res->oaicompat_cmpl_id = slot.params.oaicompat_cmpl_id;
-
-        // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0) {
-            res->prob_output = tkn; // copy the token probs
-        }
-
-        // populate timings if this is final response or timings_per_token is enabled
-        if (slot.stop != STOP_TYPE_NONE || slot.params.timings_per_token) {
-            res->timings = slot.get_timings();
-        }
-
-        queue_results.send(std::move(res));
+        output.send(std::move(res), id_slot);
     }
 
+    // the text, the tokens and the probs of the result are set by the output stage
     void send_final_response(server_slot & slot) {
         auto res = std::make_unique<server_task_result_cmpl_final>();
         res->id              = slot.id_task;
         res->id_slot         = slot.id;
 
         res->index           = slot.index;
-        res->content         = std::move(slot.generated_text);
-        res->tokens          = std::move(slot.generated_tokens);
         res->timings         = slot.get_timings();
-        res->prompt          = common_detokenize(ctx, slot.prompt_tokens, true);
         res->response_fields = std::move(slot.params.response_fields);
 
         res->truncated           = slot.truncated;
         res->n_decoded           = slot.n_decoded;
         res->n_prompt_tokens     = slot.n_prompt_tokens;
         res->n_tokens_cached     = slot.n_past;
-        res->has_new_line        = slot.has_new_line;
-        res->stopping_word       = slot.stopping_word;
         res->stop                = slot.stop;
         res->post_sampling_probs = slot.params.post_sampling_probs;
 
@@ -2423,25 +4201,10 @@ struct server_context {
         res->oaicompat_model       = slot.params.oaicompat_model;
         res->oaicompat_cmpl_id     = slot.params.oaicompat_cmpl_id;
         res->oaicompat_chat_format = slot.params.oaicompat_chat_format;
-        // populate res.probs_output
-        if (slot.params.sampling.n_probs > 0) {
-            if (!slot.params.stream && slot.stop == STOP_TYPE_WORD) {
-                const llama_tokens stop_word_toks = common_tokenize(ctx, slot.stopping_word, false);
-
-                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
-                res->probs_output = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end() - safe_offset);
-            } else {
-                res->probs_output = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end());
-            }
-        }
 
         res->generation_params = slot.params; // copy the parameters
 
-        queue_results.send(std::move(res));
+        output.send(std::move(res), slot.id, llama_tokens(slot.prompt_tokens));
     }
 
     void send_embedding(const server_slot & slot, const llama_batch & batch) {
@@ -2484,7 +4247,7 @@ struct server_context {
 
         SLT_DBG(slot, "%s", "sending embeddings\n");
 
-        queue_results.send(std::move(res));
+        output.send(std::move(res));
     }
 
     void send_rerank(const server_slot & slot, const llama_batch & batch) {
@@ -2515,7 +4278,7 @@ struct server_context {
 
         SLT_DBG(slot, "sending rerank result, res.score = %f\n", res->score);
 
-        queue_results.send(std::move(res));
+        output.send(std::move(res));
     }
 
     //
@@ -2628,6 +4391,16 @@ struct server_context {
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
                 {
+                    if (task.n_waiting >= 0) {
+                        // first time the task is processed (not coming from the deferred queue)
+                        metrics.on_task_queued(task.n_waiting);
+                        task.n_waiting = -1;
+                    }
+
+                    if (!model_lora_ready(task)) {
+                        break;
+                    }
+
                     const int id_slot = task.id_selected_slot;
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
@@ -2652,6 +4425,8 @@ struct server_context {
                 } break;
             case SERVER_TASK_TYPE_CANCEL:
                 {
+                    model_lora_cancel(task.id_target);
+
                     // release slot linked with the task id
                     for (auto & slot : slots) {
                         if (slot.id_task == task.id_target) {
@@ -2708,10 +4483,32 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->t_itl_p50 = metrics.itl_percentile(50);
+                    res->t_itl_p99 = metrics.itl_percentile(99);
+
+                    res->n_rejected_total = queue_tasks.get_n_rejected_total();
+                    res->n_expired_total  = metrics.n_expired_total;
+
+                    res->n_draft_total          = metrics.n_draft_total;
+                    res->n_draft_accepted_total = metrics.n_draft_accepted_total;
+                    res->h_queue_wait     = metrics.h_queue_wait;
+                    res->h_queue_depth    = metrics.h_queue_depth;
+
+                    {
+                        std::unique_lock<std::mutex> lock(kv_disk_cache.mutex);
+
+                        res->n_kv_disk_hits            = kv_disk_cache.n_hits;
+                        res->n_kv_disk_misses          = kv_disk_cache.n_misses;
+                        res->n_kv_disk_tokens_restored = kv_disk_cache.n_tokens_restored;
+                        res->n_kv_disk_bytes_written   = kv_disk_cache.n_bytes_written;
+                        res->n_kv_disk_evicted         = kv_disk_cache.n_evicted;
+                        res->kv_disk_size              = kv_disk_cache.size_total;
+                    }
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
-                    queue_results.send(std::move(res));
+                    output.send(std::move(res));
                 } break;
             case SERVER_TASK_TYPE_SLOT_SAVE:
                 {
@@ -2747,7 +4544,7 @@ struct server_context {
                     res->n_tokens = token_count;
                     res->n_bytes  = nwrite;
                     res->t_ms     = t_save_ms;
-                    queue_results.send(std::move(res));
+                    output.send(std::move(res));
                 } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
                 {
@@ -2769,6 +4566,9 @@ struct server_context {
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
+                    prompt_cache.remove(slot->id);
+                    slot->kv_disk_store = false;
+
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
@@ -2779,6 +4579,8 @@ struct server_context {
                     }
                     slot->cache_tokens.resize(token_count);
 
+                    prompt_cache.insert(slot->id, slot->cache_tokens);
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -2790,7 +4592,7 @@ struct server_context {
                     res->n_tokens = token_count;
                     res->n_bytes  = nread;
                     res->t_ms     = t_restore_ms;
-                    queue_results.send(std::move(res));
+                    output.send(std::move(res));
                 } break;
             case SERVER_TASK_TYPE_SLOT_ERASE:
                 {
@@ -2811,24 +4613,86 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->kv_disk_store = false;
+                    prompt_cache.remove(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
                     res->id_slot  = id_slot;
                     res->n_erased = n_erased;
-                    queue_results.send(std::move(res));
+                    output.send(std::move(res));
                 } break;
             case SERVER_TASK_TYPE_SET_LORA:
                 {
                     params_base.lora_adapters = std::move(task.set_lora);
                     auto res = std::make_unique<server_task_result_apply_lora>();
                     res->id = task.id;
-                    queue_results.send(std::move(res));
+                    output.send(std::move(res));
                 } break;
         }
     }
 
+    // roll back the tokens generated by the slot after the token that stopped its task in the output stage
+    // returns true if the output stage stopped the task of the slot
+    bool rollback_stopped_tokens(server_slot & slot) {
+        int32_t n_decoded = 0;
+        if (!output.is_stopped(slot.id, slot.id_task, n_decoded)) {
+            return false;
+        }
+
+        // the last sampled token is not in the KV cache yet, the stopping one is not kept either
+        if (slot.n_decoded > n_decoded) {
+            const int32_t n_discard = slot.n_decoded - n_decoded;
+
+            SLT_DBG(slot, "rolling back %d tokens generated after the stop\n", n_discard);
+
+            slot.n_past   -= n_discard;
+            slot.n_decoded = n_decoded;
+
+            if (slot.params.cache_prompt) {
+                slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+            }
+
+            llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+        }
+
+        return true;
+    }
+
+    // release the slots stopped by the output stage (stop string, indentation or time limit)
+    // the main loop does not wait for the stage: a slot keeps generating until the stage reports its stop, usually one
+    // token later, and the tokens generated after the stopping one are rolled back
+    // note: a slot can also reach another stop before the report, its tokens are then rolled back when it is launched
+    //       with the next task
+    void release_stopped_slots() {
+        for (auto & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+
+            output.get_info(slot.id, slot.has_new_line, slot.stopping_word);
+
+            if (rollback_stopped_tokens(slot)) {
+                slot.has_next_token = false;
+
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+            }
+        }
+    }
+
     void update_slots() {
+        // fail the requests that did not get a slot before their deadline
+        for (auto & task : queue_tasks.pop_expired_tasks()) {
+            SRV_WRN("task %d did not get a slot before its deadline\n", task.id);
+            send_error(task, "request timed out while waiting for a slot", ERROR_TYPE_UNAVAILABLE);
+            metrics.n_expired_total++;
+        }
+
+        release_stopped_slots();
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2842,6 +4706,9 @@ struct server_context {
 
             if (all_idle) {
                 SRV_INF("%s", "all slots are idle\n");
+
+                kv_disk_cache_store();
+
                 if (clean_kv_cache) {
                     kv_cache_clear();
                 }
@@ -2861,7 +4728,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx && !kv_streaming) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -2877,6 +4744,8 @@ struct server_context {
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
+                prompt_cache.remove(slot.id);
+
                 llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
                 llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
 
@@ -2900,9 +4769,7 @@ struct server_context {
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
-        auto accept_special_token = [&](server_slot & slot, llama_token token) {
-            return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
-        };
+        slots_batched.clear();
 
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
@@ -2917,6 +4784,8 @@ struct server_context {
                 continue;
             }
 
+            slots_batched.push_back(&slot);
+
             slot.i_batch = batch.n_tokens;
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
@@ -2927,17 +4796,48 @@ struct server_context {
                 slot.cache_tokens.push_back(slot.sampled);
             }
 
-            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, truncated = %d\n",
-                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), slot.truncated);
+            // the draft of the slot is verified in the same batch, its outputs must fit in the first view of the batch
+            if (!slot.drafted.empty()) {
+                if (batch.n_tokens + slot.drafted.size() <= llama_n_batch(ctx)) {
+                    for (size_t i = 0; i < slot.drafted.size(); ++i) {
+                        common_batch_add(batch, slot.drafted[i], slot.n_past + i, { slot.id }, true);
+                    }
+                } else {
+                    slot.drafted.clear();
+                }
+            }
+
+            SLT_DBG(slot, "slot decode token, n_ctx = %d, n_past = %d, n_cache_tokens = %d, n_drafted = %d, truncated = %d\n",
+                    slot.n_ctx, slot.n_past, (int) slot.cache_tokens.size(), (int) slot.drafted.size(), slot.truncated);
         }
 
         // process in chunks of params.n_batch
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
-        // next, batch any pending prompts without exceeding n_batch
+        // cap the prompt tokens of this iteration while other slots are generating, to bound their inter-token latency
+        int32_t n_batch_prompt = n_batch;
+        if (batch.n_tokens > 0 && params_base.n_prefill_budget > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + params_base.n_prefill_budget);
+        }
+
+        // process the pending prompts by decreasing priority, then in the order of arrival
+        slots_prompt.clear();
+        for (auto & slot : slots) {
+            slots_prompt.push_back(&slot);
+        }
+        std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+            if (a->params.priority != b->params.priority) {
+                return a->params.priority > b->params.priority;
+            }
+            return a->id_task < b->id_task;
+        });
+
+        // next, batch any pending prompts without exceeding n_batch_prompt
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (auto * slot_ptr : slots_prompt) {
+                auto & slot = *slot_ptr;
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2945,6 +4845,10 @@ struct server_context {
                     } else if (!slot_batched->can_batch_with(slot)) {
                         continue;
                     }
+
+                    if (std::find(slots_batched.begin(), slots_batched.end(), &slot) == slots_batched.end()) {
+                        slots_batched.push_back(&slot);
+                    }
                 }
 
                 // this slot still has a prompt to be processed
@@ -3039,10 +4943,49 @@ struct server_context {
                                 GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
                             }
 
+                            // once a sequence outgrows the streaming KV cache, its old tokens are evicted and its sinks are moved,
+                            // so the cached tokens no longer describe the cache of the slot and must not be reused
+                            if (kv_streaming && slot.cache_tokens.size() > (size_t) (llama_n_kv_sink(ctx) + llama_n_kv_window(ctx))) {
+                                SLT_INF(slot, "the streaming KV cache evicted %zu cached tokens, not reusing the cached prompt\n",
+                                        slot.cache_tokens.size() - llama_n_kv_sink(ctx) - llama_n_kv_window(ctx));
+
+                                slot.cache_tokens.clear();
+                            }
+
                             if (slot.params.cache_prompt) {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                // copy a longer cached prefix from another slot
+                                if (prompt_cache_copy) {
+                                    int id_src = -1;
+
+                                    const size_t n_match = prompt_cache.find(prompt_tokens, [&](int id) {
+                                        return id != slot.id && are_lora_equal(slots[id].lora, slot.lora);
+                                    }, id_src);
+
+                                    if (id_src >= 0 && n_match > (size_t) slot.n_past) {
+                                        SLT_INF(slot, "copying cached prefix from slot %d, n_match = %zu, n_past = %d\n", id_src, n_match, slot.n_past);
+
+                                        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                                        llama_kv_self_seq_cp(ctx, id_src, slot.id, -1, n_match);
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+                                        slot.n_past = n_match;
+                                    }
+                                }
+
+                                // restore a longer cached prefix from disk
+                                if (kv_disk_cache.enabled()) {
+                                    const int32_t n_restored = kv_disk_cache.restore(ctx, slot.id, prompt_tokens, lora_fingerprint(slot.lora), slot.n_past);
+                                    if (n_restored != 0) {
+                                        const int32_t n_keep = std::max(n_restored, 0);
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_keep);
+                                        slot.n_past = n_keep;
+                                    }
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3100,6 +5043,7 @@ struct server_context {
                     }
 
                     // non-causal tasks require to fit the entire prompt in the physical batch
+                    // note: not subject to n_batch_prompt, as they cannot be split across iterations
                     if (slot.is_non_causal()) {
                         // cannot fit the prompt in the current batch - will try next iter
                         if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
@@ -3122,7 +5066,7 @@ struct server_context {
                     slot.cache_tokens.resize(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < (slot.is_non_causal() ? n_batch : n_batch_prompt)) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -3161,7 +5105,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -3177,8 +5121,37 @@ struct server_context {
         if (slot_batched) {
             // make sure we're in the right embedding mode
             llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
+
+            // the adapters with the same scale in all the slots of the batch (e.g. --lora) are applied to the context,
+            // the other ones only to the sequences of their slots
+            std::vector<common_adapter_lora_info> lora_shared;
+            for (const auto & la : slot_batched->lora) {
+                bool shared = true;
+                for (const auto * slot : slots_batched) {
+                    shared = shared && lora_scale(slot->lora, la.ptr) == la.scale;
+                }
+                if (shared) {
+                    lora_shared.push_back(la);
+                }
+            }
+
+            if (!are_lora_equal(lora_shared, lora_ctx)) {
+                common_set_adapter_lora(ctx, lora_shared);
+                lora_ctx = lora_shared;
+            }
+
+            std::vector<common_adapter_lora_info> lora_seq;
+            for (auto & slot : slots) {
+                lora_seq.clear();
+                if (std::find(slots_batched.begin(), slots_batched.end(), &slot) != slots_batched.end()) {
+                    for (const auto & la : slot.lora) {
+                        if (lora_scale(lora_shared, la.ptr) != la.scale) {
+                            lora_seq.push_back(la);
+                        }
+                    }
+                }
+                common_set_adapter_lora_seq(ctx, slot.id, lora_seq);
+            }
         }
 
         // process the created batch of tokens
@@ -3218,6 +5191,38 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // sample the next token of all the generating slots of this view together
+            std::vector<llama_token> ids(slots.size(), LLAMA_TOKEN_NULL);
+            {
+                std::vector<common_sampler *> smpls;
+                std::vector<int>              idxs;
+                std::vector<int>              id_slots;
+
+                for (auto & slot : slots) {
+                    if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                        continue;
+                    }
+
+                    const bool is_generating = slot.state == SLOT_STATE_GENERATING ||
+                        (slot.state == SLOT_STATE_DONE_PROMPT && slot.task_type != SERVER_TASK_TYPE_EMBEDDING && slot.task_type != SERVER_TASK_TYPE_RERANK);
+
+                    // the drafts are verified with process_draft
+                    const bool is_draft = !slot.drafted.empty() && slot.i_batch + (int) slot.drafted.size() < (int) (i + n_tokens);
+
+                    if (is_generating && !is_draft) {
+                        smpls.push_back(slot.smpl);
+                        idxs.push_back(slot.i_batch - i);
+                        id_slots.push_back(slot.id);
+                    }
+                }
+
+                const auto sampled = common_sampler_sample_batch(smpls, ctx, idxs);
+
+                for (size_t j = 0; j < sampled.size(); ++j) {
+                    ids[id_slots[j]] = sampled[j];
+                }
+            }
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3241,13 +5246,30 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // the prompt is now in the KV cache and can be reused by other requests
+                    prompt_cache.insert(slot.id, slot.cache_tokens);
+
+                    slot.kv_disk_store = kv_disk_cache.enabled() && slot.params.cache_prompt;
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
                 const int tok_idx = slot.i_batch - i;
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                if (!slot.drafted.empty()) {
+                    if (slot.i_batch + (int) slot.drafted.size() < (int) (i + n_tokens)) {
+                        process_draft(slot, tok_idx);
+                        continue; // continue loop of slots
+                    }
+
+                    // the draft ended up in the next view of the batch (smaller batch size after a failed decode)
+                    slot.drafted.clear();
+                    slot.drafted_discarded = true;
+                }
+
+                const llama_token id = ids[slot.id];
+                GGML_ASSERT(id != LLAMA_TOKEN_NULL);
 
                 slot.i_batch = -1;
 
@@ -3259,19 +5281,21 @@ struct server_context {
 
                 if (slot.n_decoded == 1) {
                     slot.t_start_generation = t_current;
+                    slot.t_last_token       = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                } else {
+                    metrics.on_tokens_generated(slot, t_current, 1);
                 }
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
                 completion_token_output result;
                 result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
                 result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
 
                 if (slot.params.sampling.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
+                    populate_token_probs(slot, result, slot.params.post_sampling_probs, tok_idx);
                 }
 
                 if (!process_token(result, slot)) {
@@ -3283,102 +5307,21 @@ struct server_context {
                     continue;
                 }
             }
+        }
 
-            // do speculative decoding
-            for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
-                    continue;
-                }
-
-                if (slot.state != SLOT_STATE_GENERATING) {
-                    continue;
-                }
-
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
-
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
-
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
-
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
-
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
-
-                    continue;
-                }
-
-                llama_token id = slot.sampled;
-
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
-
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
-
-                // keep track of total number of tokens generated in the draft
-                slot.n_draft_total += draft.size();
-
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
-
-                    continue;
-                }
-
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
-
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
-                }
-
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
-
-                llama_decode(ctx, slot.batch_spec);
-
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
-
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
-
-                // update how many tokens out of draft was accepted
-                slot.n_draft_accepted += ids.size() - 1;
-
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
-
+        for (auto & slot : slots) {
+            if (slot.drafted_discarded) {
                 llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+                slot.drafted_discarded = false;
+            }
+        }
 
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
-
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
-
-                    // TODO: set result.probs
-
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
-                }
+        // draft the next tokens of the slots, verified with their sampled token in the next batch
+        if (spec != nullptr) {
+            // do not draft for the slots stopped by the output stage
+            release_stopped_slots();
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
-            }
+            gen_drafts();
         }
 
         SRV_DBG("%s", "run slots completed\n");
@@ -3600,6 +5543,43 @@ int main(int argc, char ** argv) {
         return httplib::Server::HandlerResponse::Unhandled;
     });
 
+    //
+    // Admission control
+    //
+
+    // tag the tasks of a request with the client and the deadline, and post them if they can be queued
+    // the request is rejected with 503 and a Retry-After header when the queue is full or the wait is expected to exceed its deadline
+    const auto post_tasks = [&ctx_server, &params, &res_error](const httplib::Request & req, const json & data, std::vector<server_task> & tasks, httplib::Response & res) {
+        const int32_t timeout = json_value(data, "queue_timeout", params.queue_timeout);
+
+        // the API key identifies the client, see middleware_validate_api_key
+        std::string client = req.get_header_value("Authorization");
+        if (client.rfind("Bearer ", 0) == 0) {
+            client = client.substr(7);
+        }
+
+        const int64_t t_deadline = timeout > 0 ? ggml_time_us() + 1000ll * timeout : 0;
+
+        for (auto & task : tasks) {
+            task.client     = client;
+            task.t_deadline = t_deadline;
+        }
+
+        // note: the waiting ids are added first, so that no result of the tasks is missed
+        ctx_server.queue_results.add_waiting_tasks(tasks);
+
+        int64_t t_wait = 0;
+        if (!ctx_server.queue_tasks.post_admitted(tasks, timeout, t_wait)) {
+            ctx_server.queue_results.remove_waiting_task_ids(server_task::get_list_id(tasks));
+
+            res.set_header("Retry-After", std::to_string(std::max<int64_t>(1, (t_wait + 999) / 1000)));
+            res_error(res, format_error_response(string_format("server is overloaded, estimated wait for a slot is %.1f s", t_wait / 1e3), ERROR_TYPE_UNAVAILABLE));
+            return false;
+        }
+
+        return true;
+    };
+
     //
     // Route handlers (or controllers)
     //
@@ -3699,6 +5679,42 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "requests_rejected_total"},
+                    {"help",  "Number of requests rejected because the queue was full or the wait exceeded their deadline."},
+                    {"value",  res_metrics->n_rejected_total}
+            }, {
+                    {"name",  "requests_expired_total"},
+                    {"help",  "Number of requests that did not get a slot before their deadline."},
+                    {"value",  res_metrics->n_expired_total}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of tokens drafted for speculative decoding."},
+                    {"value",  res_metrics->n_draft_total}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the target model."},
+                    {"value",  res_metrics->n_draft_accepted_total}
+            }, {
+                    {"name",  "kv_disk_cache_hits_total"},
+                    {"help",  "Number of prompts whose prefix was restored from the KV disk cache."},
+                    {"value",  res_metrics->n_kv_disk_hits}
+            }, {
+                    {"name",  "kv_disk_cache_misses_total"},
+                    {"help",  "Number of prompts looked up in the KV disk cache without a usable prefix."},
+                    {"value",  res_metrics->n_kv_disk_misses}
+            }, {
+                    {"name",  "kv_disk_cache_tokens_restored_total"},
+                    {"help",  "Number of prompt tokens restored from the KV disk cache instead of being processed."},
+                    {"value",  res_metrics->n_kv_disk_tokens_restored}
+            }, {
+                    {"name",  "kv_disk_cache_bytes_written_total"},
+                    {"help",  "Number of bytes written to the KV disk cache."},
+                    {"value",  res_metrics->n_kv_disk_bytes_written}
+            }, {
+                    {"name",  "kv_disk_cache_evictions_total"},
+                    {"help",  "Number of entries evicted from the KV disk cache."},
+                    {"value",  res_metrics->n_kv_disk_evicted}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3724,6 +5740,22 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "inter_token_latency_p50_seconds"},
+                    {"help",  "Median inter-token latency over the most recent generated tokens."},
+                    {"value",  res_metrics->t_itl_p50 / 1.e3}
+            },{
+                    {"name",  "inter_token_latency_p99_seconds"},
+                    {"help",  "99th percentile inter-token latency over the most recent generated tokens."},
+                    {"value",  res_metrics->t_itl_p99 / 1.e3}
+            },{
+                    {"name",  "kv_disk_cache_hit_ratio"},
+                    {"help",  "Ratio of the KV disk cache lookups that restored a prefix."},
+                    {"value",  (double) res_metrics->n_kv_disk_hits / std::max<uint64_t>(res_metrics->n_kv_disk_hits + res_metrics->n_kv_disk_misses, 1)}
+            },{
+                    {"name",  "kv_disk_cache_bytes"},
+                    {"help",  "Size of the KV disk cache."},
+                    {"value",  res_metrics->kv_disk_size}
             }}}
         };
 
@@ -3744,6 +5776,9 @@ int main(int argc, char ** argv) {
             }
         }
 
+        res_metrics->h_queue_wait .to_prometheus(prometheus, "queue_wait_seconds", "Time requests waited for a slot.");
+        res_metrics->h_queue_depth.to_prometheus(prometheus, "queue_depth",        "Number of requests waiting for a slot, observed at the arrival of each request.");
+
         res.set_header("Process-Start-Time-Unix", std::to_string(res_metrics->t_start));
 
         res.set_content(prometheus.str(), "text/plain; version=0.0.4");
@@ -3893,10 +5928,10 @@ int main(int argc, char ** argv) {
 
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok](
+    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok, &post_tasks](
             server_task_type type,
             json & data,
-            std::function<bool()> is_connection_closed,
+            const httplib::Request & req,
             httplib::Response & res,
             oaicompat_type oaicompat) {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
@@ -3917,6 +5952,10 @@ int main(int argc, char ** argv) {
             std::vector<llama_tokens> tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
             tasks.reserve(tokenized_prompts.size());
             for (size_t i = 0; i < tokenized_prompts.size(); i++) {
+                if (!validate_tokens(ctx_server.vocab, tokenized_prompts[i])) {
+                    throw std::runtime_error("Prompt contains invalid tokens");
+                }
+
                 server_task task = server_task(type);
 
                 task.id    = ctx_server.queue_tasks.get_new_id();
@@ -3941,12 +5980,16 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(tasks);
+        if (!post_tasks(req, data, tasks, res)) {
+            return;
+        }
 
         bool stream = json_value(data, "stream", false);
         const auto task_ids = server_task::get_list_id(tasks);
 
+        // the binary stream format is only available for the non-OAI-compat endpoints
+        const bool stream_binary = stream && oaicompat == OAICOMPAT_TYPE_NONE && json_value(data, "stream_format", std::string("sse")) == "binary";
+
         if (!stream) {
             ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
                 if (results.size() == 1) {
@@ -3962,9 +6005,30 @@ int main(int argc, char ** argv) {
                 }
             }, [&](const json & error_data) {
                 res_error(res, error_data);
-            }, is_connection_closed);
+            }, req.is_connection_closed);
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        } else if (stream_binary) {
+            const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
+                binary_frame_writer writer;
+                ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+                    result->to_binary(writer);
+                    // sending failed (HTTP connection closed), cancel the generation
+                    return writer.write(sink);
+                }, [&](const json & error_data) {
+                    binary_frame_json(sink, writer, BINARY_FRAME_ERROR, error_data);
+                }, [&sink]() {
+                    return !sink.is_writable();
+                });
+                sink.done();
+                return false;
+            };
+
+            auto on_complete = [task_ids, &ctx_server] (bool) {
+                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            };
+
+            res.set_chunked_content_provider("application/octet-stream", chunked_content_provider, on_complete);
         } else {
             const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
@@ -4007,7 +6071,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_NONE);
     };
@@ -4017,7 +6081,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_COMPLETION);
     };
@@ -4094,7 +6158,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_INFILL,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_NONE); // infill is not OAI compatible
     };
@@ -4112,7 +6176,7 @@ int main(int argc, char ** argv) {
         return handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
             data,
-            req.is_connection_closed,
+            req,
             res,
             OAICOMPAT_TYPE_CHAT);
     };
@@ -4125,11 +6189,13 @@ int main(int argc, char ** argv) {
     };
 
     const auto handle_models = [&params, &ctx_server, &res_ok](const httplib::Request &, httplib::Response & res) {
+        const std::string id_base = params.model_alias.empty() ? params.model.path : params.model_alias;
+
         json models = {
             {"object", "list"},
             {"data", {
                 {
-                    {"id",       params.model_alias.empty() ? params.model.path : params.model_alias},
+                    {"id",       id_base},
                     {"object",   "model"},
                     {"created",  std::time(0)},
                     {"owned_by", "llamacpp"},
@@ -4138,6 +6204,17 @@ int main(int argc, char ** argv) {
              }}
         };
 
+        // fine-tunes of the base model
+        for (const auto & entry : params.models_lora) {
+            models["data"].push_back({
+                {"id",       entry.name},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+                {"parent",   id_base},
+            });
+        }
+
         res_ok(res, models);
     };
 
@@ -4194,7 +6271,7 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_embeddings_impl = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
+    const auto handle_embeddings_impl = [&ctx_server, &res_error, &res_ok, &post_tasks](const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
         const json body = json::parse(req.body);
 
         if (oaicompat != OAICOMPAT_TYPE_NONE && llama_pooling_type(ctx_server.ctx) == LLAMA_POOLING_TYPE_NONE) {
@@ -4232,6 +6309,10 @@ int main(int argc, char ** argv) {
                 res_error(res, format_error_response("Input content cannot be empty", ERROR_TYPE_INVALID_REQUEST));
                 return;
             }
+            if (!validate_tokens(ctx_server.vocab, tokens)) {
+                res_error(res, format_error_response("Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
         }
 
         // create and queue the task
@@ -4252,8 +6333,9 @@ int main(int argc, char ** argv) {
                 tasks.push_back(task);
             }
 
-            ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            if (!post_tasks(req, body, tasks, res)) {
+                return;
+            }
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
@@ -4290,7 +6372,7 @@ int main(int argc, char ** argv) {
         handle_embeddings_impl(req, res, OAICOMPAT_TYPE_EMBEDDING);
     };
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_rerank = [&ctx_server, &res_error, &res_ok, &post_tasks](const httplib::Request & req, httplib::Response & res) {
         if (!ctx_server.params_base.reranking || ctx_server.params_base.embedding) {
             res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -4348,8 +6430,9 @@ int main(int argc, char ** argv) {
                 tasks.push_back(task);
             }
 
-            ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(tasks);
+            if (!post_tasks(req, body, tasks, res)) {
+                return;
+            }
 
             // get the result
             std::unordered_set<int> task_ids = server_task::get_list_id(tasks);
@@ -0,0 +1,154 @@
+import threading
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.n_ctx = 2048
+    server.n_predict = None # no limit for the blocker
+    server.temperature = 0.0
+    server.server_metrics = True
+    server.n_threads_http = 16 # the waiting requests hold their HTTP thread
+
+
+def complete(n_predict: int = 8, api_key: str | None = None, queue_timeout: int | None = None) -> ServerResponse:
+    data = {
+        "prompt": "Once upon a time",
+        "n_predict": n_predict,
+    }
+    if queue_timeout is not None:
+        data["queue_timeout"] = queue_timeout
+    return server.make_request("POST", "/completion", data=data, headers={
+        "Authorization": f"Bearer {api_key}" if api_key else None,
+    })
+
+
+def start_blocker() -> requests.Response:
+    # an endless request that holds the only slot while the other requests arrive, until its connection is closed
+    res = requests.post(f"http://{server.server_host}:{server.server_port}/completion", stream=True, json={
+        "prompt": "Once upon a time",
+        "n_predict": 1000000,
+        "ignore_eos": True,
+        "stream": True,
+    })
+    # note: a generator of the lines closes the connection when it is deleted, read the first event directly
+    assert res.raw.read(6) == b"data: "
+    return res
+
+
+def wait_for_metric(name: str, value: float):
+    while server.get_metrics()[name] < value:
+        time.sleep(0.01)
+
+
+def test_queue_full():
+    global server
+    server.queue_max = 2
+    server.start()
+    blocker = start_blocker()
+
+    # the capacity is reserved in the same critical section as the post, concurrent requests cannot exceed it
+    results = []
+    threads = [threading.Thread(target=lambda: results.append(complete())) for _ in range(6)]
+    for thread in threads:
+        thread.start()
+    wait_for_metric("requests_rejected_total", 6 - server.queue_max)
+    wait_for_metric("requests_deferred", server.queue_max)
+
+    blocker.close()
+    for thread in threads:
+        thread.join()
+
+    accepted = [res for res in results if res.status_code == 200]
+    rejected = [res for res in results if res.status_code == 503]
+    assert len(accepted) == server.queue_max
+    assert len(rejected) == 6 - server.queue_max
+    for res in rejected:
+        assert "overloaded" in res.body["error"]["message"]
+        assert int(res.headers["Retry-After"]) >= 1
+
+    metrics = server.get_metrics()
+    assert metrics["requests_rejected_total"] == len(rejected)
+
+    # the queue depth is sampled at the arrival of each admitted request: 0 for the blocker, then 0 and 1
+    assert metrics["queue_depth_count"] == 1 + server.queue_max
+    assert metrics["queue_depth_sum"] == 1
+
+
+def test_queue_timeout_expired():
+    global server
+    server.queue_timeout = 200
+    server.start()
+    blocker = start_blocker()
+
+    # no wait is estimated before a request was served, the request is admitted and expires while waiting
+    res = complete()
+    assert res.status_code == 503
+    assert "timed out while waiting" in res.body["error"]["message"]
+    blocker.close()
+
+    metrics = server.get_metrics()
+    assert metrics["requests_expired_total"] == 1
+    assert metrics["requests_rejected_total"] == 0
+
+
+def test_queue_timeout_estimated_wait():
+    global server
+    server.start()
+
+    # a first request gives the average time a task holds a slot
+    assert complete(32).status_code == 200
+
+    blocker = start_blocker()
+    waiting = threading.Thread(target=complete)
+    waiting.start()
+    wait_for_metric("requests_deferred", 1)
+
+    # the wait is estimated from the requests ahead, the request is rejected at arrival
+    res = complete(queue_timeout=1)
+    assert res.status_code == 503
+    assert "estimated wait" in res.body["error"]["message"]
+    assert int(res.headers["Retry-After"]) >= 1
+
+    blocker.close()
+    waiting.join()
+    assert server.get_metrics()["requests_rejected_total"] == 1
+
+
+def test_api_key_weight():
+    global server
+    server.api_key_weights = [("key-a", 3), ("key-b", 1)]
+    server.start()
+    blocker = start_blocker()
+
+    # the requests of key-b arrive first, those of key-a get 3 times the share of the slot
+    order = []
+    lock = threading.Lock()
+
+    def worker(api_key: str):
+        res = complete(32, api_key)
+        assert res.status_code == 200
+        with lock:
+            order.append(api_key)
+
+    threads = []
+    for i, api_key in enumerate(["key-b"]*4 + ["key-a"]*4):
+        thread = threading.Thread(target=worker, args=(api_key,))
+        thread.start()
+        threads.append(thread)
+        wait_for_metric("requests_deferred", i + 1)
+
+    blocker.close()
+    for thread in threads:
+        thread.join()
+
+    assert len(order) == 8
+    assert order[:5].count("key-a") == 4
+    assert order[5:] == ["key-b"]*3
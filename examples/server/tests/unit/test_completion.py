@@ -196,6 +196,76 @@ def test_cache_vs_nocache_prompt():
     assert res_cache.body["content"] == res_no_cache.body["content"]
 
 
+def test_completion_stop_string():
+    global server
+    server.n_slots = 1
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 32,
+        "temperature": 0.0,
+        "cache_prompt": True,
+        "return_tokens": True,
+    }
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+    tokens = res.body["tokens"]
+
+    # stop on a word in the middle of the generated text
+    words = content.split()
+    stop = words[len(words) // 2]
+    res = server.make_request("POST", "/completion", data={**data, "stop": [stop]})
+    assert res.status_code == 200
+    assert res.body["content"] == content[:content.index(stop)]
+    assert res.body["stop_type"] == "word"
+    assert res.body["stopping_word"] == stop
+
+    # the tokens generated after the stopping one are not counted nor kept in the cache
+    n_predicted = res.body["tokens_predicted"]
+    assert res.body["tokens"] == tokens[:n_predicted]
+    assert res.body["tokens_cached"] == res.body["tokens_evaluated"] + n_predicted - 1
+
+    # the cache of the slot ends at the stop, the next request continues from it
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    assert res.body["content"] == content
+
+
+def test_completion_prompt_cache_across_slots():
+    global server
+    server.n_slots = 2
+    server.start()
+    system_prompt = "You are a helpful assistant who tells short stories about animals in the forest. " * 3
+    data = {
+        "temperature": 0.0,
+        "n_predict": 8,
+        "cache_prompt": True,
+    }
+
+    # the prompt is cached by slot 0
+    res = server.make_request("POST", "/completion", data={**data, "prompt": system_prompt + "Tell me about a fox.", "id_slot": 0})
+    assert res.status_code == 200
+    n_prompt = res.body["timings"]["prompt_n"]
+
+    # slot 1 copies the shared prefix from slot 0 instead of evaluating it
+    res = server.make_request("POST", "/completion", data={**data, "prompt": system_prompt + "Tell me about a bear.", "id_slot": 1})
+    assert res.status_code == 200
+    assert res.body["id_slot"] == 1
+    assert res.body["timings"]["prompt_n"] < n_prompt // 2
+
+    # the copied prefix gives the same result as a prompt evaluated entirely
+    res_nocache = server.make_request("POST", "/completion", data={**data, "prompt": system_prompt + "Tell me about a bear.", "cache_prompt": False})
+    assert res_nocache.status_code == 200
+    assert res_nocache.body["content"] == res.body["content"]
+
+    # a slot is selected by the longest cached prefix of the prompt
+    res = server.make_request("POST", "/completion", data={**data, "prompt": system_prompt + "Tell me about a fox. The end."})
+    assert res.status_code == 200
+    assert res.body["id_slot"] == 0
+    assert res.body["timings"]["prompt_n"] < 8
+
+
 def test_completion_with_tokens_input():
     global server
     server.temperature = 0.0
@@ -294,6 +364,61 @@ def test_completion_parallel_slots(n_slots: int, n_requests: int):
         # assert match_regex(re_content, res.body["content"])
 
 
+def test_completion_parallel_streams():
+    global server
+    server.n_slots = 4
+    server.temperature = 0.0
+    server.start()
+
+    PROMPTS = [f"Story number {i}. Once upon a time" for i in range(12)]
+
+    # each stream only receives the results of its own task, in order
+    def stream(i: int):
+        events = list(server.make_stream_request("POST", "/completion", data={
+            "prompt": PROMPTS[i],
+            "n_predict": 4 + i,
+            "ignore_eos": True,
+            "stream": True,
+        }))
+        assert [event["tokens_predicted"] for event in events[:-1]] == list(range(1, 5 + i))
+        assert events[-1]["stop"] == True
+        assert events[-1]["prompt"].endswith(PROMPTS[i])
+        assert events[-1]["timings"]["predicted_n"] == 4 + i
+        return True
+
+    # the tasks of a multi-prompt request share the result channel of the request
+    def stream_multi():
+        events = list(server.make_stream_request("POST", "/completion", data={
+            "prompt": PROMPTS[:3],
+            "n_predict": 6,
+            "ignore_eos": True,
+            "stream": True,
+        }))
+        for index in range(3):
+            assert [event["tokens_predicted"] for event in events if event["index"] == index and not event["stop"]] == list(range(1, 7))
+        assert sum(1 for event in events if event["stop"]) == 3
+        return True
+
+    # a stream that is closed early is cancelled without disturbing the others
+    def stream_cancelled():
+        url = f"http://{server.server_host}:{server.server_port}/completion"
+        res = requests.post(url, stream=True, json={
+            "prompt": PROMPTS[0],
+            "n_predict": 256,
+            "ignore_eos": True,
+            "stream": True,
+        })
+        assert res.raw.read(6) == b"data: "
+        res.close()
+        return True
+
+    tasks = [(stream, (i,)) for i in range(len(PROMPTS))]
+    tasks.append((stream_multi, ()))
+    tasks.append((stream_cancelled, ()))
+    results = parallel_function_calls(tasks)
+    assert all(results)
+
+
 @pytest.mark.parametrize(
     "prompt,n_predict,response_fields",
     [
@@ -380,6 +505,61 @@ def test_n_probs_stream():
                     assert "bytes" in prob and type(prob["bytes"]) == list
 
 
+def test_completion_stream_binary():
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "temperature": 0.0,
+        "n_predict": 8,
+    }
+    res_sse = list(server.make_stream_request("POST", "/completion", data={**data, "stream": True}))
+    res_binary = list(server.make_binary_stream_request("POST", "/completion", data=data))
+
+    # one token frame per token, then the final response as in the last event
+    frames = [frame for frame in res_binary if frame["frame"] == "tokens"]
+    assert len(frames) == len(res_sse) - 1
+    for i, (frame, event) in enumerate(zip(frames, res_sse)):
+        assert frame["index"] == 0
+        assert frame["tokens_predicted"] == i + 1
+        assert frame["tokens"] == event["tokens"]
+        assert frame["probs"] == []
+    assert b"".join(frame["content"] for frame in frames).decode("utf-8") == "".join(event["content"] for event in res_sse)
+
+    final = res_binary[-1]
+    assert final["frame"] == "final"
+    assert final["stop"] == True
+    assert final["timings"]["predicted_n"] == res_sse[-1]["timings"]["predicted_n"]
+    assert final["stop_type"] == res_sse[-1]["stop_type"]
+
+
+@pytest.mark.parametrize("post_sampling_probs", [False, True])
+def test_n_probs_stream_binary(post_sampling_probs: bool):
+    global server
+    server.start()
+    data = {
+        "prompt": "I believe the meaning of life is",
+        "n_probs": 10,
+        "temperature": 0.0,
+        "n_predict": 5,
+        "post_sampling_probs": post_sampling_probs,
+    }
+    res_sse = [event for event in server.make_stream_request("POST", "/completion", data={**data, "stream": True}) if not event["stop"]]
+    res_binary = [frame for frame in server.make_binary_stream_request("POST", "/completion", data=data) if frame["frame"] == "tokens"]
+
+    # the same values as the JSON: probabilities with post_sampling_probs, log-probabilities otherwise
+    key, key_top = ("prob", "top_probs") if post_sampling_probs else ("logprob", "top_logprobs")
+    assert len(res_binary) == len(res_sse) == 5
+    for frame, event in zip(res_binary, res_sse):
+        tok = event["completion_probabilities"][0]
+        assert frame["tokens"] == [tok["id"]]
+        assert frame["prob"] == pytest.approx(tok[key], abs=1e-5)
+        assert len(frame["probs"]) == len(tok[key_top]) == 10
+        for (id, prob), top in zip(frame["probs"], tok[key_top]):
+            assert id == top["id"]
+            assert prob == pytest.approx(top[key], abs=1e-5)
+
+
 def test_n_probs_post_sampling():
     global server
     server.start()
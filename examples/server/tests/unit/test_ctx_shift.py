@@ -65,3 +65,17 @@ def test_ctx_shift_disabled_long_prompt():
     assert res.status_code != 200
     assert "error" in res.body
     assert "exceeds the available context size" in res.body["error"]["message"]
+
+
+def test_ctx_shift_disabled_long_prompt_stream_binary():
+    global server
+    server.disable_ctx_shift = True
+    server.start()
+    res = list(server.make_binary_stream_request("POST", "/completion", data={
+        "n_predict": 64,
+        "prompt": LONG_TEXT,
+    }))
+    # the error is sent as the only frame of the stream
+    assert len(res) == 1
+    assert res[0]["frame"] == "error"
+    assert "exceeds the available context size" in res[0]["message"]
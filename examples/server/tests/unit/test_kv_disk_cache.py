@@ -0,0 +1,167 @@
+import os
+import shutil
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+KV_DISK_CACHE = "./tmp/kv-disk-cache"
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.n_predict = 4
+    server.temperature = 0.0
+    server.server_metrics = True
+    server.kv_disk_cache = KV_DISK_CACHE
+    server.kv_disk_cache_min = 16
+    shutil.rmtree(KV_DISK_CACHE, ignore_errors=True)
+
+
+def make_prompt(i: int, n_repeat: int = 4) -> str:
+    return f"Story number {i}. " + "Once upon a time, there was a little girl who liked to play in the park. " * n_repeat
+
+
+def complete(prompt: str) -> int:
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    return res.body["timings"]["prompt_n"]
+
+
+def wait_for_write(n_bytes_written: float = 0):
+    # the states are copied once the slots are idle, and written in the background
+    for _ in range(100):
+        if server.get_metrics()["kv_disk_cache_bytes_written_total"] > n_bytes_written:
+            return
+        time.sleep(0.1)
+    raise TimeoutError("no state was written to the KV disk cache")
+
+
+def test_kv_disk_cache_hit_after_restart():
+    global server
+    server.start()
+    n_prompt = complete(make_prompt(0))
+    wait_for_write()
+
+    # the entries of the previous run are indexed at start
+    server.stop()
+    server.start()
+    assert server.get_metrics()["kv_disk_cache_bytes"] > 0
+
+    # only the tokens after the stored prefix are processed
+    n_processed = complete(make_prompt(0) + "The end.")
+    assert n_processed < n_prompt
+
+    metrics = server.get_metrics()
+    assert metrics["kv_disk_cache_hits_total"] == 1
+    assert metrics["kv_disk_cache_tokens_restored_total"] > n_prompt - n_processed
+
+
+def test_kv_disk_cache_miss():
+    global server
+    server.start()
+    complete(make_prompt(0))
+    wait_for_write()
+
+    server.stop()
+    server.start()
+
+    # a prompt that does not share a prefix with the stored one is processed entirely
+    n_prompt = complete("A different story. " * 8)
+    assert n_prompt > server.kv_disk_cache_min
+
+    metrics = server.get_metrics()
+    assert metrics["kv_disk_cache_hits_total"] == 0
+    assert metrics["kv_disk_cache_misses_total"] >= 1
+    assert metrics["kv_disk_cache_tokens_restored_total"] == 0
+
+
+def test_kv_disk_cache_min_tokens():
+    global server
+    server.kv_disk_cache_min = 4096
+    server.start()
+    complete(make_prompt(0))
+    complete(make_prompt(1))
+
+    # the prompts are shorter than --kv-disk-cache-min, they are not stored
+    time.sleep(1)
+    assert server.get_metrics()["kv_disk_cache_bytes_written_total"] == 0
+
+
+def test_kv_disk_cache_eviction():
+    global server
+    server.kv_disk_cache_size = 1 # MiB
+    server.n_ctx = 2048
+    server.start()
+
+    n_stored = 0
+    while server.get_metrics()["kv_disk_cache_evictions_total"] == 0:
+        assert n_stored < 32, "the KV disk cache did not evict any entry"
+        n_bytes_written = server.get_metrics()["kv_disk_cache_bytes_written_total"]
+        complete(make_prompt(n_stored, 20))
+        wait_for_write(n_bytes_written)
+        n_stored += 1
+
+    metrics = server.get_metrics()
+    assert metrics["kv_disk_cache_bytes"] <= 1024*1024
+
+    # the least recently used entry is evicted first, the last one is kept
+    server.stop()
+    server.start()
+    complete(make_prompt(0, 20) + "The end.")
+    assert server.get_metrics()["kv_disk_cache_hits_total"] == 0
+    complete(make_prompt(n_stored - 1, 20) + "The end.")
+    assert server.get_metrics()["kv_disk_cache_hits_total"] == 1
+
+
+def test_kv_disk_cache_fingerprint_mismatch():
+    global server
+    server.start()
+    model_path = server.make_request("GET", "/props").body["model_path"]
+    n_prompt = complete(make_prompt(0))
+    wait_for_write()
+    server.stop()
+
+    # the entries of another KV cache type are not used
+    server.ctk = "f32"
+    server.start()
+    assert server.get_metrics()["kv_disk_cache_bytes"] == 0
+    assert complete(make_prompt(0) + "The end.") > n_prompt
+    server.stop()
+
+    # nor the entries of a model file that was written again at the same path
+    server.ctk = None
+    os.utime(model_path)
+    server.start()
+    assert server.get_metrics()["kv_disk_cache_bytes"] == 0
+    assert complete(make_prompt(0) + "The end.") > n_prompt
+    assert server.get_metrics()["kv_disk_cache_hits_total"] == 0
+
+
+def test_kv_disk_cache_corrupt_entry():
+    global server
+    server.start()
+    n_prompt = complete(make_prompt(0))
+    wait_for_write()
+
+    server.stop()
+    server.start()
+    assert server.get_metrics()["kv_disk_cache_bytes"] > 0
+
+    # an entry that fails to restore is processed again and removed from the cache
+    fnames = [fname for fname in os.listdir(KV_DISK_CACHE) if fname.endswith(".kvc")]
+    for fname in fnames:
+        with open(os.path.join(KV_DISK_CACHE, fname), "r+b") as f:
+            f.truncate(64)
+    assert complete(make_prompt(0) + "The end.") > n_prompt
+
+    metrics = server.get_metrics()
+    assert metrics["kv_disk_cache_hits_total"] == 0
+    assert metrics["kv_disk_cache_misses_total"] == 1
+    assert not any(os.path.exists(os.path.join(KV_DISK_CACHE, fname)) for fname in fnames)
@@ -66,6 +66,73 @@ def test_lora_per_request():
         assert match_regex(re_test, res.body["content"])
 
 
+def test_model_lora():
+    server = ServerPreset.stories15m_moe()
+    server.n_slots = 2
+    server.model_lora = [("shakespeare", download_file(LORA_FILE_URL))]
+    server.start()
+
+    # the fine-tune is listed after the base model
+    res = server.make_request("GET", "/v1/models")
+    assert res.status_code == 200
+    assert [model["id"] for model in res.body["data"]] == [server.model_alias, "shakespeare"]
+    assert res.body["data"][1]["parent"] == server.model_alias
+
+    # the adapter of the fine-tune is loaded in the background while the base model is served
+    model_config = [
+        ( server.model_alias, "(little|girl|three|years|old)+" ),
+        ( "shakespeare",      "(eye|love|glass|sun)+" ),
+        ( server.model_alias, "(little|girl|three|years|old)+" ),
+        ( "shakespeare",      "(eye|love|glass|sun)+" ),
+    ]
+
+    tasks = [(
+        server.make_request,
+        ("POST", "/completion", {
+            "model": model,
+            "prompt": "Look in thy glass",
+            "seed": 42,
+            "temperature": 0.0,
+        })
+    ) for model, _ in model_config]
+    results = parallel_function_calls(tasks)
+
+    assert all([res.status_code == 200 for res in results])
+    for res, (_, re_test) in zip(results, model_config):
+        assert match_regex(re_test, res.body["content"])
+
+
+def test_model_lora_not_served():
+    server = ServerPreset.stories15m_moe()
+    server.model_lora = [
+        ("shakespeare", download_file(LORA_FILE_URL)),
+        ("missing",     "./tmp/missing-lora.gguf"),
+    ]
+    server.start()
+
+    # a model with another base cannot be served by the fine-tunes
+    res = server.make_request("POST", "/completion", data={
+        "model": "llama-3",
+        "prompt": "Look in thy glass",
+    })
+    assert res.status_code == 400
+    assert "not served" in res.body["error"]["message"]
+
+    # a fine-tune whose adapter cannot be loaded fails its requests only
+    res = server.make_request("POST", "/completion", data={
+        "model": "missing",
+        "prompt": "Look in thy glass",
+    })
+    assert res.status_code == 500
+    assert "failed to load" in res.body["error"]["message"]
+
+    res = server.make_request("POST", "/completion", data={
+        "model": server.model_alias,
+        "prompt": "Look in thy glass",
+    })
+    assert res.status_code == 200
+
+
 @pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
 def test_with_big_model():
     server = ServerProcess()
@@ -0,0 +1,116 @@
+import threading
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+LONG_PROMPT = "Once upon a time, there was a little girl who liked to play in the park with her friends. " * 20
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 4096
+    server.n_batch = 512
+    server.n_predict = None # no limit for the generating stream
+    server.temperature = 0.0
+    server.server_metrics = True
+
+
+class GeneratingStream:
+    """
+    An endless stream that generates tokens in the background until it is closed, and counts them.
+    """
+    def __init__(self):
+        self.n_tokens = 0
+        self.res = requests.post(f"http://{server.server_host}:{server.server_port}/completion", stream=True, json={
+            "prompt": "Once upon a time",
+            "n_predict": 1000000,
+            "ignore_eos": True,
+            "stream": True,
+        })
+        self.thread = threading.Thread(target=self.read)
+        self.thread.start()
+        while self.n_tokens == 0:
+            time.sleep(0.01)
+
+    def read(self):
+        try:
+            for line in self.res.iter_lines():
+                if line.startswith(b"data: "):
+                    self.n_tokens = json.loads(line[6:])["tokens_predicted"]
+        except (requests.exceptions.ConnectionError, AttributeError):
+            pass # closed
+
+    def close(self):
+        self.res.close()
+        self.thread.join()
+
+
+def first_token(prompt: str, priority: int = 0) -> int:
+    # returns the number of prompt tokens, once the first token of the completion is received
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 1,
+        "priority": priority,
+    })
+    assert res.status_code == 200
+    return res.body["timings"]["prompt_n"]
+
+
+@pytest.mark.parametrize("prefill_budget", [None, 16])
+def test_prefill_budget(prefill_budget: int | None):
+    global server
+    server.n_slots = 2
+    server.prefill_budget = prefill_budget
+    server.start()
+    stream = GeneratingStream()
+
+    n_generated = stream.n_tokens
+    n_prompt = first_token(LONG_PROMPT)
+    n_generated = stream.n_tokens - n_generated
+    stream.close()
+
+    if prefill_budget:
+        # the prompt is processed in chunks of the budget, each one with a token of the generating stream
+        assert n_generated >= n_prompt // prefill_budget - 2
+    else:
+        # the prompt is processed in one batch, the generating stream waits for it
+        assert n_generated < n_prompt // 16 - 2
+
+    # the inter-token latency of the generating stream is reported
+    metrics = server.get_metrics()
+    assert 0 < metrics["inter_token_latency_p50_seconds"] <= metrics["inter_token_latency_p99_seconds"]
+
+
+def test_priority():
+    global server
+    server.n_slots = 3
+    server.prefill_budget = 16
+    server.start()
+    stream = GeneratingStream()
+
+    # the prompt of the request with the higher priority is processed first, although it arrived last
+    order = []
+    lock = threading.Lock()
+
+    def worker(name: str, priority: int):
+        first_token(f"{name}. {LONG_PROMPT}", priority)
+        with lock:
+            order.append(name)
+
+    threads = [
+        threading.Thread(target=worker, args=("low", 0)),
+        threading.Thread(target=worker, args=("high", 1)),
+    ]
+    for i, thread in enumerate(threads):
+        thread.start()
+        while server.get_metrics()["requests_processing"] < 2 + i and not order:
+            time.sleep(0.001)
+    for thread in threads:
+        thread.join()
+    stream.close()
+
+    assert order == ["high", "low"]
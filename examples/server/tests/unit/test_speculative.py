@@ -124,3 +124,61 @@ def test_multi_requests_parallel(n_slots: int, n_requests: int):
     for res in results:
         assert res.status_code == 200
         assert match_regex("(wise|kind|owl|answer)+", res.body["content"])
+
+
+def test_multi_requests_parallel_draft_batched():
+    global server
+    create_server()
+    server.n_slots = 4
+    server.server_slots = True
+    server.server_metrics = True
+    server.start()
+    PROMPTS = [
+        "I believe the meaning of life is",
+        "Once upon a time, there was a little girl",
+        "The sky is blue and",
+        "Write a very long story about a cat",
+    ]
+    tasks = []
+    for prompt in PROMPTS:
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": prompt,
+            "temperature": 0.0,
+            "top_k": 1,
+            "n_predict": 32,
+        })))
+    # the slots that request the probabilities do not speculate
+    tasks.append((server.make_request, ("POST", "/completion", {
+        "prompt": PROMPTS[0],
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+        "n_probs": 1,
+    })))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+
+    # the drafts of all the slots are verified in the main batch, each slot reports its own acceptance
+    n_drafted = 0
+    n_accepted = 0
+    for res in results[:len(PROMPTS)]:
+        timings = res.body["timings"]
+        assert timings["draft_n"] > 0
+        assert 0 <= timings["draft_n_accepted"] <= timings["draft_n"]
+        n_drafted += timings["draft_n"]
+        n_accepted += timings["draft_n_accepted"]
+    assert "draft_n" not in results[-1].body["timings"]
+
+    # speculative decoding does not change the result of a greedy request
+    assert results[-1].body["content"] == results[0].body["content"]
+
+    metrics = server.get_metrics()
+    assert metrics["draft_tokens_total"] == n_drafted
+    assert metrics["draft_tokens_accepted_total"] == n_accepted
+
+    for slot in server.make_request("GET", "/slots").body:
+        draft = slot["draft"]
+        assert 0 <= draft["n_accepted"] <= draft["n_drafted"]
+        if draft["n_drafted"] > 0:
+            assert draft["acceptance_rate"] == pytest.approx(draft["n_accepted"] / draft["n_drafted"])
@@ -9,6 +9,7 @@ import re
 import json
 import sys
 import requests
+import struct
 import time
 from concurrent.futures import ThreadPoolExecutor, as_completed
 from typing import (
@@ -55,6 +56,7 @@ class ServerProcess:
     model_file: str | None = None
     model_draft: str | None = None
     n_threads: int | None = None
+    n_threads_http: int | None = None
     n_gpu_layer: int | None = None
     n_batch: int | None = None
     n_ubatch: int | None = None
@@ -78,7 +80,13 @@ class ServerProcess:
     pooling: str | None = None
     draft: int | None = None
     api_key: str | None = None
+    api_key_weights: List[Tuple[str, float]] | None = None
+    queue_max: int | None = None
+    prefill_budget: int | None = None
+    queue_timeout: int | None = None
     lora_files: List[str] | None = None
+    model_lora: List[Tuple[str, str]] | None = None
+    model_lora_budget: int | None = None
     disable_ctx_shift: int | None = False
     draft_min: int | None = None
     draft_max: int | None = None
@@ -88,6 +96,9 @@ class ServerProcess:
     chat_template: str | None = None
     chat_template_file: str | None = None
     server_path: str | None = None
+    kv_disk_cache: str | None = None
+    kv_disk_cache_size: int | None = None
+    kv_disk_cache_min: int | None = None
 
     # session variables
     process: subprocess.Popen | None = None
@@ -135,6 +146,8 @@ class ServerProcess:
             server_args.extend(["--ubatch-size", self.n_ubatch])
         if self.n_threads:
             server_args.extend(["--threads", self.n_threads])
+        if self.n_threads_http:
+            server_args.extend(["--threads-http", self.n_threads_http])
         if self.n_gpu_layer:
             server_args.extend(["--n-gpu-layers", self.n_gpu_layer])
         if self.draft is not None:
@@ -176,10 +189,24 @@ class ServerProcess:
         if self.lora_files:
             for lora_file in self.lora_files:
                 server_args.extend(["--lora", lora_file])
+        if self.model_lora:
+            for name, lora_file in self.model_lora:
+                server_args.extend(["--model-lora", name, lora_file])
+        if self.model_lora_budget:
+            server_args.extend(["--model-lora-budget", self.model_lora_budget])
         if self.disable_ctx_shift:
             server_args.extend(["--no-context-shift"])
         if self.api_key:
             server_args.extend(["--api-key", self.api_key])
+        if self.api_key_weights:
+            for key, weight in self.api_key_weights:
+                server_args.extend(["--api-key-weight", key, weight])
+        if self.prefill_budget:
+            server_args.extend(["--prefill-budget", self.prefill_budget])
+        if self.queue_max:
+            server_args.extend(["--queue-max", self.queue_max])
+        if self.queue_timeout:
+            server_args.extend(["--queue-timeout", self.queue_timeout])
         if self.draft_max:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
@@ -194,6 +221,12 @@ class ServerProcess:
             server_args.extend(["--chat-template", self.chat_template])
         if self.chat_template_file:
             server_args.extend(["--chat-template-file", self.chat_template_file])
+        if self.kv_disk_cache:
+            server_args.extend(["--kv-disk-cache", self.kv_disk_cache])
+        if self.kv_disk_cache_size:
+            server_args.extend(["--kv-disk-cache-size", self.kv_disk_cache_size])
+        if self.kv_disk_cache_min:
+            server_args.extend(["--kv-disk-cache-min", self.kv_disk_cache_min])
 
         args = [str(arg) for arg in [server_path, *server_args]]
         print(f"tests: starting server with: {' '.join(args)}")
@@ -270,6 +303,20 @@ class ServerProcess:
         print("Response from server", json.dumps(result.body, indent=2))
         return result
 
+    def get_metrics(self) -> dict[str, float]:
+        """
+        Return the samples of the Prometheus metrics (requires --metrics), by name without the "llamacpp:" prefix.
+        """
+        url = f"http://{self.server_host}:{self.server_port}/metrics"
+        response = requests.get(url)
+        assert response.status_code == 200
+        metrics = {}
+        for line in response.text.splitlines():
+            if line.startswith("llamacpp:"):
+                name, value = line[len("llamacpp:"):].rsplit(" ", 1)
+                metrics[name] = float(value)
+        return metrics
+
     def make_stream_request(
         self,
         method: str,
@@ -291,6 +338,69 @@ class ServerProcess:
                 print("Partial response from server", json.dumps(data, indent=2))
                 yield data
 
+    def make_binary_stream_request(
+        self,
+        method: str,
+        path: str,
+        data: dict | None = None,
+        headers: dict | None = None,
+    ) -> Iterator[dict]:
+        """
+        Stream with "stream_format": "binary" and yield the frames, see the server README for their layout.
+        The token frames are decoded into a dict with "frame" set to "tokens", the final and error frames into their JSON
+        with "frame" set to "final" or "error".
+        """
+        url = f"http://{self.server_host}:{self.server_port}{path}"
+        if method == "POST":
+            response = requests.post(url, headers=headers, json={**(data or {}), "stream": True, "stream_format": "binary"}, stream=True)
+        else:
+            raise ValueError(f"Unimplemented method: {method}")
+        assert response.headers["Content-Type"] == "application/octet-stream"
+        buf = b""
+        for chunk in response.iter_content(chunk_size=None):
+            buf += chunk
+            while len(buf) >= 4:
+                (size,) = struct.unpack_from("<I", buf, 0)
+                if len(buf) < 4 + size:
+                    break
+                frame = buf[4:4 + size]
+                buf = buf[4 + size:]
+                if frame[0] == 1:
+                    index, tokens_predicted, n_tokens = struct.unpack_from("<iiI", frame, 1)
+                    offset = 13
+                    tokens = list(struct.unpack_from(f"<{n_tokens}i", frame, offset))
+                    offset += 4*n_tokens
+                    (n_bytes,) = struct.unpack_from("<I", frame, offset)
+                    offset += 4
+                    content = frame[offset:offset + n_bytes]
+                    offset += n_bytes
+                    (n_probs,) = struct.unpack_from("<I", frame, offset)
+                    offset += 4
+                    res = {
+                        "frame": "tokens",
+                        "index": index,
+                        "tokens_predicted": tokens_predicted,
+                        "tokens": tokens,
+                        "content": content,
+                        "probs": [],
+                    }
+                    if n_probs > 0:
+                        (res["prob"],) = struct.unpack_from("<f", frame, offset)
+                        offset += 4
+                        for _ in range(n_probs):
+                            res["probs"].append(struct.unpack_from("<if", frame, offset))
+                            offset += 8
+                    assert offset == size
+                elif frame[0] == 2:
+                    res = {"frame": "final", **json.loads(frame[1:])}
+                elif frame[0] == 3:
+                    res = {"frame": "error", **json.loads(frame[1:])}
+                else:
+                    raise ValueError(f"Unknown frame type: {frame[0]}")
+                print("Binary frame from server", res)
+                yield res
+        assert buf == b""
+
 
 server_instances: Set[ServerProcess] = set()
 
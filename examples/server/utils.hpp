@@ -221,6 +221,17 @@ static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * voca
     return result;
 }
 
+// check that the tokens of a prompt are in the vocab, so that they can be detokenized
+static bool validate_tokens(const llama_vocab * vocab, const llama_tokens & tokens) {
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    for (const auto & token : tokens) {
+        if (token < 0 || token >= n_vocab) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // return the last index of character that can form a valid string
 // if the last character is potentially cut in half, return the index before the cut
 // if validate_utf8(text) == text.size(), then the whole text is valid utf8
@@ -492,9 +503,11 @@ static size_t find_partial_stop_string(const std::string &stop, const std::strin
 // TODO: reuse llama_detokenize
 template <class Iter>
 static std::string tokens_to_str(llama_context * ctx, Iter begin, Iter end) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
     std::string ret;
     for (; begin != end; ++begin) {
-        ret += common_token_to_piece(ctx, *begin);
+        ret += common_token_piece(vocab, *begin);
     }
 
     return ret;
@@ -527,6 +540,76 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+//
+// binary stream utils
+//
+
+// frames of the binary stream format ("stream_format": "binary")
+// each frame is: u32 size of the rest of the frame, u8 frame type, payload
+// all the numbers are little-endian
+enum binary_frame_type : uint8_t {
+    BINARY_FRAME_TOKENS = 1, // i32 index, i32 n_decoded, u32 n_tokens, i32 tokens[n_tokens], u32 n_bytes, u8 content[n_bytes],
+                             // u32 n_probs, if n_probs > 0: f32 prob, { i32 token, f32 prob }[n_probs]
+    BINARY_FRAME_FINAL  = 2, // JSON of the final response
+    BINARY_FRAME_ERROR  = 3, // JSON of the error
+};
+
+// builds the frames in a buffer that is reused by all the frames of a stream
+struct binary_frame_writer {
+    std::string buf;
+
+    binary_frame_writer() {
+        buf.reserve(256);
+    }
+
+    void begin(binary_frame_type type) {
+        buf.clear();
+        buf.append(sizeof(uint32_t), '\0'); // size, set by write()
+        put_u8(type);
+    }
+
+    void put_u8(uint8_t v) {
+        buf.push_back((char) v);
+    }
+
+    void put_i32(int32_t v) {
+        put_raw(&v, sizeof(v));
+    }
+
+    void put_u32(uint32_t v) {
+        put_raw(&v, sizeof(v));
+    }
+
+    void put_f32(float v) {
+        put_raw(&v, sizeof(v));
+    }
+
+    void put_str(const std::string & str) {
+        put_u32(str.size());
+        buf.append(str);
+    }
+
+    void put_raw(const void * data, size_t size) {
+        static_assert(sizeof(float) == sizeof(uint32_t), "unexpected float size");
+        // note: the host is assumed to be little-endian, as for GGUF files
+        buf.append((const char *) data, size);
+    }
+
+    bool write(httplib::DataSink & sink) {
+        const uint32_t size = buf.size() - sizeof(uint32_t);
+        memcpy(&buf[0], &size, sizeof(size));
+
+        return sink.write(buf.data(), buf.size());
+    }
+};
+
+static bool binary_frame_json(httplib::DataSink & sink, binary_frame_writer & writer, binary_frame_type type, const json & data) {
+    writer.begin(type);
+    writer.buf.append(data.dump(-1, ' ', false, json::error_handler_t::replace));
+
+    return writer.write(sink);
+}
+
 //
 // OAI utils
 //
@@ -888,6 +971,32 @@ static bool are_lora_equal(
     return true;
 }
 
+// scale of an adapter in a list of adapters (0.0f if it is not in the list)
+static float lora_scale(
+        const std::vector<common_adapter_lora_info> & lora,
+        const llama_adapter_lora * ptr) {
+    for (const auto & la : lora) {
+        if (la.ptr == ptr) {
+            return la.scale;
+        }
+    }
+    return 0.0f;
+}
+
+// the adapters with a different scale in l1 and l2 must be applied per sequence to batch l1 with l2
+static bool are_lora_batchable(
+        const std::vector<common_adapter_lora_info> & l1,
+        const std::vector<common_adapter_lora_info> & l2) {
+    for (const auto * l : { &l1, &l2 }) {
+        for (const auto & la : *l) {
+            if (lora_scale(l1, la.ptr) != lora_scale(l2, la.ptr) && !llama_adapter_lora_supports_seq(la.ptr)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 // parse lora config from JSON request, returned a copy of lora_base with updated scale
 static std::vector<common_adapter_lora_info> parse_lora_request(
         const std::vector<common_adapter_lora_info> & lora_base,
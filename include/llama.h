@@ -41,10 +41,10 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 11
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
 
 #ifdef __cplusplus
 extern "C" {
@@ -343,6 +343,12 @@ extern "C" {
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
 
+        // streaming KV cache: keep the first n_kv_sink tokens and the last n_kv_window tokens of each sequence
+        // older tokens are evicted, so that a sequence can be decoded indefinitely without context shifts
+        // enabled if any of the two is > 0, n_kv_window = 0 uses the remaining context of the sequence [EXPERIMENTAL]
+        uint32_t n_kv_sink;        // number of attention sink tokens
+        uint32_t n_kv_window;      // number of most recent tokens
+
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
 
@@ -356,6 +362,7 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool decode_pipeline; // build the graph of the next ubatch while the current one is computed [EXPERIMENTAL]
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -473,6 +480,11 @@ extern "C" {
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
 
+    // effective streaming KV cache policy of the context (see n_kv_sink and n_kv_window in llama_context_params)
+    // the cache can disable it (e.g. if the model does not support K-shift) - llama_n_kv_window() returns 0 in that case
+    LLAMA_API uint32_t llama_n_kv_sink  (const struct llama_context * ctx);
+    LLAMA_API uint32_t llama_n_kv_window(const struct llama_context * ctx);
+
     DEPRECATED(LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model), "use llama_model_n_ctx_train instead");
     DEPRECATED(LLAMA_API int32_t llama_n_embd     (const struct llama_model * model), "use llama_model_n_embd instead");
     DEPRECATED(LLAMA_API int32_t llama_n_layer    (const struct llama_model * model), "use llama_model_n_layer instead");
@@ -563,6 +575,14 @@ extern "C" {
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_adapter_lora_free(struct llama_adapter_lora * adapter);
 
+    // Returns false if the adapter modifies the token embeddings or MoE experts, which cannot be applied per sequence
+    // (see llama_set_adapter_lora_seq) - use llama_set_adapter_lora for such adapters
+    LLAMA_API bool llama_adapter_lora_supports_seq(const struct llama_adapter_lora * adapter);
+
+    // Size in bytes of the F32 copy of the adapter made by the context while it is applied per sequence
+    // (0 if it cannot be applied per sequence) - the copy is zero-padded to the max rank of the adapters in use
+    LLAMA_API size_t llama_adapter_lora_seq_size(const struct llama_adapter_lora * adapter);
+
     // The following functions operate on a llama_context, hence the naming: llama_verb_...
 
     // Add a loaded LoRA adapter to given context
@@ -572,7 +592,7 @@ extern "C" {
             struct llama_adapter_lora * adapter,
             float scale);
 
-    // Remove a specific LoRA adapter from given context
+    // Remove a specific LoRA adapter from given context (including the sequences it was added to)
     // Return -1 if the adapter is not present in the context
     LLAMA_API int32_t llama_rm_adapter_lora(
             struct llama_context * ctx,
@@ -581,6 +601,22 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the tokens of a single sequence (multi-LoRA batching)
+    // Sequences with different adapters can be decoded in the same batch, on top of the adapters of the context
+    // The adapters are applied to the matrix multiplications of the layers, but not to the token embeddings and MoE experts
+    // seq_id must be in [0, n_seq_max), use scale 0.0f to remove the adapter from the sequence
+    // Return -1 if seq_id is invalid or the adapter is not supported per sequence (see llama_adapter_lora_supports_seq)
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove the per-sequence LoRA adapters of a sequence (seq_id < 0 : all sequences)
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -948,6 +984,15 @@ extern "C" {
     // Get the number of threads used for prompt and batch processing (multiple token).
     LLAMA_API int32_t llama_n_threads_batch(struct llama_context * ctx);
 
+    // Call fn(i, user_data) for i in [0, n) on the worker threads of the context, using up to llama_n_threads() threads
+    // The threads are created on first use and reused by the next calls, the calls of fn must be independent
+    // Useful to parallelize work across the sequences outside of the library, e.g. sampling (see llama_sampler_sample_batch)
+    LLAMA_API void llama_parallel_for(
+            struct llama_context * ctx,
+                         int32_t   n,
+                            void (*fn)(int32_t i, void * user_data),
+                            void * user_data);
+
     // Set whether the model is in embeddings mode or not
     // If true, embeddings will be returned but logits will not
     LLAMA_API void llama_set_embeddings(struct llama_context * ctx, bool embeddings);
@@ -981,6 +1026,24 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Keep only the k largest logits of each output (0 = keep the full rows, default)
+    // The selection is done on the host while extracting the outputs in llama_decode(), so that only k entries per
+    // output are stored and reordered. With the output layer on the CPU, the rows are read in place from the compute
+    // buffer. With the output layer on a GPU, the full rows are still copied to the host before the selection: the
+    // mode then saves the host-side storage and reordering only, not the device-to-host transfer.
+    // While enabled, llama_get_logits() and llama_get_logits_ith() return NULL.
+    LLAMA_API void llama_set_logits_top_k(struct llama_context * ctx, int32_t k);
+
+    // Number of entries per output returned by llama_get_logits_top_k_ith()
+    // This is the k at the time of the last llama_decode() (or of the loaded state), 0 if the outputs are full logits
+    LLAMA_API int32_t llama_n_logits_top_k(const struct llama_context * ctx);
+
+    // Top-k logits for the ith token, sorted by descending logit
+    // llama_token_data.p is the probability of the token over the full vocabulary (i.e. logf(p) is the logprob)
+    // shape: [llama_n_logits_top_k(ctx)] (1-dimensional)
+    // returns NULL for invalid ids or when the top-k logits are not enabled.
+    LLAMA_API llama_token_data * llama_get_logits_top_k_ith(struct llama_context * ctx, int32_t i);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -1083,6 +1146,26 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert a batch of texts into tokens on n_threads threads - same result as llama_tokenize() on each text.
+    /// A single long text is split on word boundaries and its chunks are tokenized in parallel.
+    /// The threads belong to the vocab: they are created on first use and reused by the next calls.
+    /// A call made while another one is running on the threads of the vocab tokenizes on the calling thread only.
+    /// @param tokens tokens[i] receives the tokens of texts[i] and must hold n_tokens_max[i] tokens
+    /// @param n_tokens n_tokens[i] receives the number of tokens of texts[i], negative if they do not fit (see llama_tokenize())
+    /// @param n_threads The number of threads, <= 0 to use all the cores
+    /// @return Returns 0 on success, -1 if the tokens of some of the texts did not fit
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_vocab * vocab,
+                     const char ** texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token ** tokens,
+                   const int32_t * n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1096,6 +1179,15 @@ extern "C" {
                                int32_t   lstrip,
                                   bool   special);
 
+    // Token Id -> Piece, without copying: the same text as llama_token_to_piece() with lstrip = 0.
+    // The returned string is owned by the vocab and is null-terminated, but use the length written to len
+    // since pieces may contain null bytes.
+    LLAMA_API const char * llama_vocab_get_piece(
+              const struct llama_vocab * vocab,
+                           llama_token   token,
+                                  bool   special,
+                               int32_t * len);
+
     /// @details Convert the provided tokens into text (inverse of llama_tokenize()).
     /// @param text The char pointer must be large enough to hold the resulting text.
     /// @return Returns the number of chars/bytes on success, no more than text_len_max.
@@ -1308,7 +1400,8 @@ extern "C" {
                             size_t num_trigger_tokens);
 
 
-    /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
+    /// NOTE: The cost of apply is proportional to the number of distinct tokens in the window when the candidates are laid out by token id (e.g. the full vocabulary),
+    ///       and to the number of candidates otherwise.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
                              int32_t   penalty_last_n,   // last n tokens to penalize (0 = disable penalty, -1 = context size)
                                float   penalty_repeat,   // 1.0 = disabled
@@ -1369,6 +1462,29 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Apply the sampler to the logits of all the tokens of the vocabulary
+    //
+    // Equivalent to initializing cur_p from the logits and calling llama_sampler_apply, but for the sampler chains
+    // whose first effective sampler is top-k or min-p, the candidates are selected directly from the logits
+    // cur_p->data must have room for n_vocab candidates, the other fields of cur_p are set by the call
+    LLAMA_API void llama_sampler_apply_logits(
+            struct llama_sampler * smpl,
+                     const float * logits,
+                         int32_t   n_vocab,
+          llama_token_data_array * cur_p);
+
+    /// @details Sample and accept a token for each of the n given outputs of the last evaluation
+    //
+    // tokens[i] is sampled by smpls[i] from the idxs[i]-th output, as with llama_sampler_sample
+    // The samplers must be distinct objects: they are run in parallel on the worker threads of the context (see llama_parallel_for)
+    // When the top-k logits output is enabled (llama_set_logits_top_k), the tokens are sampled from the top-k candidates
+    LLAMA_API void llama_sampler_sample_batch(
+            struct llama_sampler ** smpls,
+            struct llama_context  * ctx,
+                   const int32_t  * idxs,
+                     llama_token  * tokens,
+                         int32_t    n);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -1407,6 +1523,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of times a ggml compute graph had been reused
     };
 
     struct llama_perf_sampler_data {
@@ -4,8 +4,10 @@
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <map>
 #include <cassert>
+#include <cstring>
 #include <stdexcept>
 
 // vec
@@ -145,6 +147,29 @@ llama_adapter_lora_weight * llama_adapter_lora::get_weight(ggml_tensor * w) {
     return nullptr;
 }
 
+bool llama_adapter_lora::supports_seq() const {
+    for (const auto & it : ab_map) {
+        if (it.second.a->ne[2] > 1 || it.first.find("token_embd") != std::string::npos) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t llama_adapter_lora::seq_size() const {
+    if (!supports_seq()) {
+        return 0;
+    }
+
+    size_t size = 0;
+    for (const auto & it : ab_map) {
+        size += (ggml_nelements(it.second.a) + ggml_nelements(it.second.b))*sizeof(float);
+    }
+
+    return size;
+}
+
 static void llama_adapter_lora_init_impl(llama_model & model, const char * path_lora, llama_adapter_lora & adapter) {
     LLAMA_LOG_INFO("%s: loading lora adapter from '%s' ...\n", __func__, path_lora);
 
@@ -380,3 +405,290 @@ llama_adapter_lora * llama_adapter_lora_init(llama_model * model, const char * p
 void llama_adapter_lora_free(llama_adapter_lora * adapter) {
     delete adapter;
 }
+
+bool llama_adapter_lora_supports_seq(const llama_adapter_lora * adapter) {
+    return adapter->supports_seq();
+}
+
+size_t llama_adapter_lora_seq_size(const llama_adapter_lora * adapter) {
+    return adapter->seq_size();
+}
+
+//
+// llama_adapter_lora_seq
+//
+
+void llama_adapter_lora_seq::init(uint32_t n_seq_max) {
+    seqs.assign(n_seq_max, {});
+    seqs_ids.assign(n_seq_max, {});
+}
+
+bool llama_adapter_lora_seq::set(llama_adapter_lora * adapter, llama_seq_id seq_id, float scale) {
+    if (seq_id < 0 || (size_t) seq_id >= seqs.size()) {
+        return false;
+    }
+
+    if (scale != 0.0f && !adapter->supports_seq()) {
+        LLAMA_LOG_ERROR("%s: the adapter modifies the token embeddings or MoE experts, it cannot be applied per sequence\n", __func__);
+        return false;
+    }
+
+    auto & seq = seqs[seq_id];
+
+    auto it = std::find_if(seq.begin(), seq.end(), [&](const auto & entry) { return entry.first == adapter; });
+
+    if (scale == 0.0f) {
+        if (it != seq.end()) {
+            seq.erase(it);
+        }
+    } else if (it != seq.end()) {
+        it->second = scale;
+    } else {
+        seq.emplace_back(adapter, scale);
+    }
+
+    return true;
+}
+
+void llama_adapter_lora_seq::clear(llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        for (auto & seq : seqs) {
+            seq.clear();
+        }
+    } else if ((size_t) seq_id < seqs.size()) {
+        seqs[seq_id].clear();
+    }
+}
+
+bool llama_adapter_lora_seq::remove(llama_adapter_lora * adapter) {
+    for (auto & seq : seqs) {
+        seq.erase(std::remove_if(seq.begin(), seq.end(), [&](const auto & entry) { return entry.first == adapter; }), seq.end());
+    }
+
+    if (std::find(adapters.begin(), adapters.end(), adapter) != adapters.end()) {
+        // the adapter may be freed next - the stack will be rebuilt without it
+        adapters.clear();
+        ab_map.clear();
+        ctxs.clear();
+        bufs.clear();
+
+        return true;
+    }
+
+    return false;
+}
+
+bool llama_adapter_lora_seq::prepare() {
+    std::vector<llama_adapter_lora *> used;
+
+    int32_t n_used_cur = 0;
+
+    for (const auto & seq : seqs) {
+        n_used_cur = std::max(n_used_cur, (int32_t) seq.size());
+
+        for (const auto & entry : seq) {
+            if (std::find(used.begin(), used.end(), entry.first) == used.end()) {
+                used.push_back(entry.first);
+            }
+        }
+    }
+
+    bool changed = n_used_cur != n_used;
+
+    n_used = n_used_cur;
+
+    // keep the current stack if it already holds all the used adapters
+    bool stacked = true;
+    for (auto * adapter : used) {
+        if (std::find(adapters.begin(), adapters.end(), adapter) == adapters.end()) {
+            stacked = false;
+            break;
+        }
+    }
+
+    if (!stacked || (used.empty() && !adapters.empty())) {
+        adapters = std::move(used);
+        stack();
+
+        changed = true;
+    }
+
+    for (size_t s = 0; s < seqs.size(); ++s) {
+        seqs_ids[s].clear();
+        for (const auto & entry : seqs[s]) {
+            seqs_ids[s].push_back(std::find(adapters.begin(), adapters.end(), entry.first) - adapters.begin());
+        }
+    }
+
+    return changed;
+}
+
+void llama_adapter_lora_seq::stack() {
+    ab_map.clear();
+    ctxs.clear();
+    bufs.clear();
+
+    if (adapters.empty()) {
+        return;
+    }
+
+    const int64_t n_adapters = adapters.size();
+
+    struct stack_info {
+        int64_t n_in  = 0;
+        int64_t n_out = 0;
+        int64_t r_max = 0;
+
+        ggml_backend_buffer_type_t buft = nullptr;
+    };
+
+    // the weights modified by any of the adapters
+    std::map<std::string, stack_info> infos;
+
+    for (const auto * adapter : adapters) {
+        // note: set() only accepts the adapters that support per-sequence application
+        GGML_ASSERT(adapter->supports_seq());
+
+        for (const auto & it : adapter->ab_map) {
+            const std::string & name = it.first;
+            const llama_adapter_lora_weight & w = it.second;
+
+            auto & info = infos[name];
+
+            info.n_in  = w.a->ne[0];
+            info.n_out = w.b->ne[1];
+            info.r_max = std::max(info.r_max, w.a->ne[1]);
+            info.buft  = ggml_backend_buffer_get_type(w.a->buffer);
+        }
+    }
+
+    // contexts for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ 2*infos.size()*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context * buft_ctx = ggml_init(params);
+            if (!buft_ctx) {
+                return nullptr;
+            }
+            ctx_map[buft] = buft_ctx;
+            ctxs.emplace_back(buft_ctx);
+            return buft_ctx;
+        }
+        return it->second;
+    };
+
+    for (const auto & it : infos) {
+        const auto & info = it.second;
+
+        ggml_context * ctx = ctx_for_buft(info.buft);
+        if (!ctx) {
+            throw std::runtime_error("failed to create ggml context for the per-sequence LoRA adapters");
+        }
+
+        ggml_tensor * a = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, info.n_in,  info.r_max, n_adapters);
+        ggml_tensor * b = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, info.r_max, info.n_out, n_adapters);
+
+        ggml_format_name(a, "%s.lora_a_seq", it.first.c_str());
+        ggml_format_name(b, "%s.lora_b_seq", it.first.c_str());
+
+        ab_map[it.first] = llama_adapter_lora_weight(a, b);
+    }
+
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first) };
+        if (!buf) {
+            throw std::runtime_error("failed to allocate buffer for the per-sequence LoRA adapters");
+        }
+        LLAMA_LOG_INFO("%s: %10s per-sequence LoRA buffer size = %8.2f MiB (%d adapters)\n", __func__,
+                ggml_backend_buffer_name(buf.get()), ggml_backend_buffer_get_size(buf.get())/1024.0/1024.0, (int) n_adapters);
+        bufs.emplace_back(std::move(buf));
+    }
+
+    // copy the adapters into the stacks, converted to F32 and zero-padded to r_max
+    std::vector<uint8_t> raw;
+    std::vector<float>   src;
+    std::vector<float>   dst_a;
+    std::vector<float>   dst_b;
+
+    auto read_f32 = [&](const ggml_tensor * t) {
+        raw.resize(ggml_nbytes(t));
+        src.resize(ggml_nelements(t));
+        ggml_backend_tensor_get(t, raw.data(), 0, raw.size());
+        if (t->type == GGML_TYPE_F32) {
+            memcpy(src.data(), raw.data(), raw.size());
+        } else {
+            ggml_get_type_traits(t->type)->to_float(raw.data(), src.data(), src.size());
+        }
+    };
+
+    for (auto & it : ab_map) {
+        const auto & info = infos.at(it.first);
+
+        dst_a.assign(ggml_nelements(it.second.a), 0.0f);
+        dst_b.assign(ggml_nelements(it.second.b), 0.0f);
+
+        for (int64_t k = 0; k < n_adapters; ++k) {
+            const auto pos = adapters[k]->ab_map.find(it.first);
+            if (pos == adapters[k]->ab_map.end()) {
+                continue;
+            }
+
+            const llama_adapter_lora_weight & w = pos->second;
+
+            const int64_t r     = w.a->ne[1];
+            const float   alpha = adapters[k]->alpha;
+            const float   scale = alpha ? alpha / r : 1.0f;
+
+            // a: [n_in, r] -> rows [0, r) of [n_in, r_max]
+            read_f32(w.a);
+            std::copy(src.begin(), src.end(), dst_a.begin() + k*info.n_in*info.r_max);
+
+            // b: [r, n_out] -> columns [0, r) of [r_max, n_out]
+            read_f32(w.b);
+            for (int64_t o = 0; o < info.n_out; ++o) {
+                for (int64_t i = 0; i < r; ++i) {
+                    dst_b[k*info.r_max*info.n_out + o*info.r_max + i] = scale*src[o*r + i];
+                }
+            }
+        }
+
+        ggml_backend_tensor_set(it.second.a, dst_a.data(), 0, ggml_nbytes(it.second.a));
+        ggml_backend_tensor_set(it.second.b, dst_b.data(), 0, ggml_nbytes(it.second.b));
+    }
+}
+
+const llama_adapter_lora_weight * llama_adapter_lora_seq::get_weight(const ggml_tensor * w) const {
+    const auto pos = ab_map.find(w->name);
+    if (pos != ab_map.end()) {
+        return &pos->second;
+    }
+
+    return nullptr;
+}
+
+void llama_adapter_lora_seq::get_ids(llama_seq_id seq_id, int32_t * ids, float * scales) const {
+    for (int32_t j = 0; j < n_used; ++j) {
+        ids[j]    = 0;
+        scales[j] = 0.0f;
+    }
+
+    if (seq_id < 0 || (size_t) seq_id >= seqs.size()) {
+        return;
+    }
+
+    const auto & seq = seqs[seq_id];
+
+    // note: the sequences are stacked by prepare()
+    const size_t n = std::min({ seq.size(), seqs_ids[seq_id].size(), (size_t) n_used });
+
+    for (size_t j = 0; j < n; ++j) {
+        ids[j]    = seqs_ids[seq_id][j];
+        scales[j] = seq[j].second;
+    }
+}
@@ -71,6 +71,65 @@ struct llama_adapter_lora {
     ~llama_adapter_lora() = default;
 
     llama_adapter_lora_weight * get_weight(ggml_tensor * w);
+
+    // false if the adapter modifies the token embeddings or the MoE experts, which cannot be applied per sequence
+    bool supports_seq() const;
+
+    // size of the F32 copy of the adapter stacked for the sequences (before the padding to the max rank)
+    size_t seq_size() const;
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+//
+// llama_adapter_lora_seq
+//
+
+// LoRA adapters applied to the tokens of individual sequences (multi-LoRA batching)
+// the adapters used by the sequences are stacked along a third dimension, so that a single ggml_mul_mat_id
+// applies the adapters of each token of a ubatch
+struct llama_adapter_lora_seq {
+    void init(uint32_t n_seq_max);
+
+    // scale == 0.0f removes the adapter from the sequence
+    // returns false if seq_id is out of range or the adapter does not support per-sequence application
+    bool set(llama_adapter_lora * adapter, llama_seq_id seq_id, float scale);
+
+    // seq_id < 0 : all the sequences
+    void clear(llama_seq_id seq_id);
+
+    // remove the adapter from all the sequences and drop the stacked weights that contain it
+    // returns true if the stacked weights were dropped
+    bool remove(llama_adapter_lora * adapter);
+
+    // stack the adapters used by the sequences, if they are not already stacked
+    // returns true if the graphs need to be rebuilt
+    bool prepare();
+
+    // stacked weights: a [n_in, r_max, n_adapters], b [r_max, n_out, n_adapters]
+    // the alpha / rank factor of each adapter is folded into b
+    const llama_adapter_lora_weight * get_weight(const ggml_tensor * w) const;
+
+    // the stack indices [n_used] and scales [n_used] of the adapters of a sequence (padded with zero scales)
+    void get_ids(llama_seq_id seq_id, int32_t * ids, float * scales) const;
+
+    // max number of adapters of a sequence (0 - no per-sequence adapters)
+    int32_t n_used = 0;
+
+private:
+    void stack();
+
+    // per sequence: adapter and scale
+    std::vector<std::vector<std::pair<llama_adapter_lora *, float>>> seqs;
+
+    // per sequence: index of each adapter in the stack
+    std::vector<std::vector<int32_t>> seqs_ids;
+
+    // stack index -> adapter
+    std::vector<llama_adapter_lora *> adapters;
+
+    std::unordered_map<std::string, llama_adapter_lora_weight> ab_map;
+
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+};
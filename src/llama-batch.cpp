@@ -2,6 +2,8 @@
 
 #include <cstring>
 #include <algorithm>
+#include <tuple>
+#include <unordered_map>
 
 llama_ubatch llama_sbatch::reserve_ubatch(size_t n_ubatch, bool has_embd) {
     // clear empty sequences
@@ -189,6 +191,37 @@ llama_ubatch llama_sbatch::split_seq(size_t n_ubatch) {
     return ubatch;
 }
 
+llama_ubatch llama_sbatch::split_mixed(size_t n_ubatch) {
+    n_ubatch = n_tokens < n_ubatch ? n_tokens : n_ubatch;
+    llama_ubatch ubatch = reserve_ubatch(n_ubatch, /* has_embd */ batch->embd != nullptr);
+    ubatch.equal_seqs = false;
+    if (!seq.empty()) {
+        llama_sbatch_seq & s = seq[0];
+        GGML_ASSERT(seq.size() == 1 && s.n_seq_id == 0); // don't mix with other splits
+        // the tokens are not contiguous in the batch, so they are copied
+        for (size_t i = 0; i < n_ubatch; ++i) {
+            const int64_t id = ids[s.offset + i];
+            if (batch->token) {
+                ubatch.token[i] = batch->token[id];
+            } else {
+                memcpy(ubatch.embd + n_embd*i, batch->embd + n_embd*id, n_embd*sizeof(float));
+            }
+            ubatch.pos[i]      = batch->pos[id];
+            ubatch.n_seq_id[i] = batch->n_seq_id[id];
+            ubatch.seq_id[i]   = batch->seq_id[id];
+            ubatch.output[i]   = logits_all || batch->logits[id];
+            if (ubatch.output[i]) { out_ids.push_back(id); }
+        }
+        ubatch.n_tokens     = n_ubatch;
+        ubatch.n_seq_tokens = 1;
+        ubatch.n_seqs       = n_ubatch; // virtual sequences, as for simple splits
+        s.offset += n_ubatch;
+        s.length -= n_ubatch;
+        n_tokens -= n_ubatch;
+    }
+    return ubatch;
+}
+
 void llama_sbatch::from_batch(const llama_batch & batch, size_t n_embd, bool simple_split, bool logits_all) {
     GGML_ASSERT(batch.n_tokens >= 0);
     this->batch = &batch;
@@ -273,6 +306,25 @@ void llama_sbatch::from_batch(const llama_batch & batch, size_t n_embd, bool sim
             );
 }
 
+void llama_sbatch::from_batch_mixed(const llama_batch & batch, const std::vector<int64_t> & ids, size_t n_embd, bool logits_all) {
+    GGML_ASSERT(batch.n_tokens >= 0 && ids.size() == (size_t) batch.n_tokens);
+    GGML_ASSERT(batch.pos && batch.n_seq_id && batch.seq_id && batch.logits);
+    this->batch = &batch;
+    this->n_embd = n_embd;
+    this->logits_all = logits_all;
+
+    n_tokens = batch.n_tokens;
+    this->ids = ids;
+    out_ids.clear();
+
+    seq.resize(1);
+    llama_sbatch_seq & s = seq[0];
+    s.n_seq_id = 0;
+    s.seq_id = nullptr;
+    s.offset = 0;
+    s.length = n_tokens;
+}
+
 llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0) {
     batch = in_batch;
     GGML_ASSERT(batch.n_tokens > 0);
@@ -305,6 +357,84 @@ llama_batch_allocr::llama_batch_allocr(struct llama_batch in_batch, llama_pos p0
     }
 }
 
+bool llama_batch_allocr::split_mixed() {
+    // a single sequence (e.g. a plain prompt) has nothing to reorder
+    bool multi_seq = false;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        if (batch.n_seq_id[i] != 1) {
+            return false;
+        }
+        multi_seq = multi_seq || batch.seq_id[i][0] != batch.seq_id[0][0];
+    }
+
+    if (!multi_seq) {
+        return false;
+    }
+
+    struct seq_info {
+        int32_t   n_tokens = 0;
+        llama_pos pos_min  = 0;
+    };
+
+    std::unordered_map<llama_seq_id, seq_info> seqs;
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const llama_seq_id s = batch.seq_id[i][0];
+        auto it = seqs.find(s);
+        if (it == seqs.end()) {
+            seqs[s] = { 1, batch.pos[i] };
+        } else {
+            it->second.n_tokens += 1;
+            it->second.pos_min = std::min(it->second.pos_min, batch.pos[i]);
+        }
+    }
+
+    // only batches that mix single-token decodes with prompts benefit from the reordering
+    bool has_decode = false;
+    bool has_prompt = false;
+    for (const auto & it : seqs) {
+        has_decode = has_decode || it.second.n_tokens == 1;
+        has_prompt = has_prompt || it.second.n_tokens >  1;
+    }
+
+    if (!has_decode || !has_prompt) {
+        return false;
+    }
+
+    // sort key of each token: decode tokens first, then by KV position of the sequence, then by sequence
+    struct token_key {
+        bool         prompt;
+        llama_pos    pos_min;
+        llama_seq_id seq_id;
+        llama_pos    pos;
+
+        bool operator<(const token_key & other) const {
+            return std::tie(prompt, pos_min, seq_id, pos) < std::tie(other.prompt, other.pos_min, other.seq_id, other.pos);
+        }
+    };
+
+    std::vector<token_key> keys(batch.n_tokens);
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const llama_seq_id s  = batch.seq_id[i][0];
+        const seq_info & info = seqs.at(s);
+
+        keys[i] = { info.n_tokens > 1, info.pos_min, s, batch.pos[i] };
+    }
+
+    ids_mixed.resize(batch.n_tokens);
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        ids_mixed[i] = i;
+    }
+
+    std::stable_sort(ids_mixed.begin(), ids_mixed.end(),
+            [&](int64_t a, int64_t b) {
+                return keys[a] < keys[b];
+            }
+    );
+
+    return true;
+}
+
 //
 // interface implementation
 //
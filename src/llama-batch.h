@@ -70,7 +70,13 @@ struct llama_sbatch {
     // sequence-wise split
     llama_ubatch split_seq(size_t n_ubatch);
 
+    // continuous batching split, the tokens are taken in the order of ids (see llama_batch_allocr::split_mixed)
+    llama_ubatch split_mixed(size_t n_ubatch);
+
     void from_batch(const llama_batch & batch, size_t n_embd, bool simple_split = false, bool logits_all = false);
+
+    // prepare a batch for split_mixed
+    void from_batch_mixed(const llama_batch & batch, const std::vector<int64_t> & ids, size_t n_embd, bool logits_all = false);
 };
 
 // temporary allocate memory for the input batch if needed
@@ -83,6 +89,17 @@ struct llama_batch_allocr {
     std::vector<llama_seq_id *> seq_id;
     std::vector<int8_t>         logits;
 
+    // token order for llama_sbatch::split_mixed
+    std::vector<int64_t> ids_mixed;
+
     // optionally fulfill the batch returned by llama_batch_get_one
     llama_batch_allocr(struct llama_batch in_batch, llama_pos p0);
+
+    // order the tokens for a continuous batching split:
+    // - the decode tokens (sequences with a single token in the batch) go first,
+    // - then the prompts of the other sequences, so that they fill the remaining ubatch capacity in chunks
+    // - within each group, the sequences are ordered by their position in the KV cache
+    // returns false if the batch does not mix decodes with prompts, or if it cannot be reordered (i.e. some tokens are shared
+    // between sequences) - the simple split is used in that case
+    bool split_mixed();
 };
@@ -7,9 +7,12 @@
 #include "llama-kv-cache.h"
 
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
+#include <future>
 #include <stdexcept>
 #include <cinttypes>
+#include <cmath>
 
 //
 // llama_context
@@ -38,6 +41,7 @@ llama_context::llama_context(
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.decode_pipeline  = params.decode_pipeline;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
 
@@ -52,6 +56,8 @@ llama_context::llama_context(
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
 
+    loras_seq.init(cparams.n_seq_max);
+
     auto rope_scaling_type = params.rope_scaling_type;
     if (rope_scaling_type == LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED) {
         rope_scaling_type = hparams.rope_scaling_type_train;
@@ -97,6 +103,27 @@ llama_context::llama_context(
 
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
 
+    cparams.n_kv_sink   = 0;
+    cparams.n_kv_window = 0;
+
+    if (params.n_kv_sink > 0 || params.n_kv_window > 0) {
+        if (params.n_kv_sink >= n_ctx_per_seq) {
+            LLAMA_LOG_WARN("%s: n_kv_sink (%u) >= n_ctx_per_seq (%u) -- streaming KV cache disabled\n", __func__, params.n_kv_sink, n_ctx_per_seq);
+        } else {
+            cparams.n_kv_sink   = params.n_kv_sink;
+            cparams.n_kv_window = n_ctx_per_seq - params.n_kv_sink;
+
+            if (params.n_kv_window > 0) {
+                if (params.n_kv_window > cparams.n_kv_window) {
+                    LLAMA_LOG_WARN("%s: n_kv_window (%u) does not fit in n_ctx_per_seq - n_kv_sink (%u) -- reducing it\n",
+                            __func__, params.n_kv_window, cparams.n_kv_window);
+                } else {
+                    cparams.n_kv_window = params.n_kv_window;
+                }
+            }
+        }
+    }
+
     LLAMA_LOG_INFO("%s: n_seq_max     = %u\n",   __func__, cparams.n_seq_max);
     LLAMA_LOG_INFO("%s: n_ctx         = %u\n",   __func__, cparams.n_ctx);
     LLAMA_LOG_INFO("%s: n_ctx_per_seq = %u\n",   __func__, n_ctx_per_seq);
@@ -107,6 +134,11 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale    = %g\n",   __func__, cparams.rope_freq_scale);
 
+    if (cparams.n_kv_window > 0) {
+        LLAMA_LOG_INFO("%s: n_kv_sink     = %u\n",   __func__, cparams.n_kv_sink);
+        LLAMA_LOG_INFO("%s: n_kv_window   = %u\n",   __func__, cparams.n_kv_window);
+    }
+
     if (n_ctx_per_seq < hparams.n_ctx_train) {
         LLAMA_LOG_WARN("%s: n_ctx_per_seq (%u) < n_ctx_train (%u) -- the full capacity of the model will not be utilized\n",
                 __func__, n_ctx_per_seq, hparams.n_ctx_train);
@@ -205,6 +237,10 @@ llama_context::llama_context(
             throw std::runtime_error("failed to initialize self-attention cache");
         }
 
+        // the cache can turn the streaming policy off (e.g. without K-shift support) - report the effective one
+        cparams.n_kv_sink   = kv_self->n_sink;
+        cparams.n_kv_window = kv_self->n_window;
+
         {
             const size_t memory_size_k = kv_self->size_k_bytes();
             const size_t memory_size_v = kv_self->size_v_bytes();
@@ -249,6 +285,11 @@ llama_context::llama_context(
         // buffer used to store the computation graph and the tensor meta data
         buf_compute_meta.resize(ggml_tensor_overhead()*max_nodes + ggml_graph_overhead_custom(max_nodes, false));
 
+        if (cparams.decode_pipeline) {
+            // second buffer for building the graph of the next ubatch while the current one is computed
+            buf_compute_meta_next.resize(buf_compute_meta.size());
+        }
+
         // TODO: move these checks to ggml_backend_sched
         // enabling pipeline parallelism in the scheduler increases memory usage, so it is only done when necessary
         bool pipeline_parallel =
@@ -282,6 +323,12 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // reuse the decode graph between ubatches of the same shape
+        // not supported with multiple copies of the scheduler inputs or with recurrent state
+        graph_reuse = !pipeline_parallel && !kv_self->recurrent && getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
+
+        LLAMA_LOG_INFO("%s: graph_reuse   = %d\n", __func__, graph_reuse);
     }
 
     // reserve worst-case graph
@@ -446,6 +493,14 @@ uint32_t llama_context::n_seq_max() const {
     return cparams.n_seq_max;
 }
 
+uint32_t llama_context::n_kv_sink() const {
+    return cparams.n_kv_sink;
+}
+
+uint32_t llama_context::n_kv_window() const {
+    return cparams.n_kv_window;
+}
+
 uint32_t llama_context::n_threads() const {
     return cparams.n_threads;
 }
@@ -454,6 +509,10 @@ uint32_t llama_context::n_threads_batch() const {
     return cparams.n_threads_batch;
 }
 
+int32_t llama_context::n_logits_top_k() const {
+    return logits_top_k_out;
+}
+
 llama_kv_cache * llama_context::get_kv_self() {
     return kv_self.get();
 }
@@ -520,7 +579,7 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
-    ggml_tensor * k_shift; // I32 [kv_size]
+    ggml_tensor * k_shift = nullptr; // I32 [kv_size]
 
     const llama_kv_cache_unified * kv_self;
 };
@@ -555,8 +614,29 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
 
     auto inp = std::make_unique<llm_graph_input_k_shift>(kv_self.get());
 
-    inp->k_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, cparams.n_ctx);
-    ggml_set_input(inp->k_shift);
+    // rotate only the runs of cells that moved (e.g. a single sequence rebased by the streaming KV cache)
+    // too many runs are merged into one, the cells in between have a shift of 0
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+
+    for (uint32_t i = 0; i < kv_self->size; ++i) {
+        if (kv_self->cells[i].delta == 0) {
+            continue;
+        }
+        if (!runs.empty() && runs.back().second == i) {
+            runs.back().second = i + 1;
+        } else {
+            runs.emplace_back(i, i + 1);
+        }
+    }
+
+    if (runs.size() > 16) {
+        runs = { { runs.front().first, runs.back().second } };
+    }
+
+    if (!runs.empty()) {
+        inp->k_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, cparams.n_ctx);
+        ggml_set_input(inp->k_shift);
+    }
 
     for (uint32_t il = 0; il < n_layer; ++il) {
         const int64_t n_head_kv    = hparams.n_head_kv(il);
@@ -571,16 +651,20 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
 
         ggml_tensor * rope_factors = kv_self->cbs.get_rope_factors(n_ctx_per_seq(), il);
 
-        ggml_tensor * k =
-            ggml_view_3d(ctx0, kv_self->k_l[il],
-                n_embd_head_k, n_head_kv, kv_self->size,
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                0);
+        for (const auto & [c0, c1] : runs) {
+            ggml_tensor * k =
+                ggml_view_3d(ctx0, kv_self->k_l[il],
+                    n_embd_head_k, n_head_kv, c1 - c0,
+                    ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
+                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*c0);
+
+            ggml_tensor * shift = ggml_view_1d(ctx0, inp->k_shift, c1 - c0, ggml_element_size(inp->k_shift)*c0);
 
-        ggml_tensor * cur = build_rope_shift(ctx0, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l, kv_self->k_l[il]->buffer);
+            ggml_tensor * cur = build_rope_shift(ctx0, k, shift, rope_factors, freq_base_l, freq_scale_l, kv_self->k_l[il]->buffer);
 
-        ggml_build_forward_expand(gf, cur);
+            ggml_build_forward_expand(gf, cur);
+        }
     }
 
     res->add_input(std::move(inp));
@@ -806,12 +890,18 @@ void llama_context::kv_self_update() {
         // simulate full KV cache
         kv_self->n = kv_self->size;
 
+        // the KV stores of the worst-case ubatch must fit after the head (the streaming KV cache shifts with a head > 0)
+        const uint32_t head_cur = kv_self->head;
+        kv_self->head = 0;
+
         llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
 
         auto * gf = graph_init();
         graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DEFAULT);
 
+        kv_self->head = head_cur;
+
         // initialize scheduler with the worst-case graph
         ggml_backend_sched_reset(sched.get());
         if (!ggml_backend_sched_reserve(sched.get(), gf)) {
@@ -869,6 +959,44 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+llama_token_data * llama_context::get_logits_top_k_ith(int32_t i) {
+    int32_t j = -1;
+
+    try {
+        if (logits_top_k_data.empty()) {
+            throw std::runtime_error("no top-k logits");
+        }
+
+        if (i < 0) {
+            j = n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+            }
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else {
+            j = output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
+        }
+
+        return logits_top_k_data.data() + j*logits_top_k_out;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return nullptr;
+#endif
+    }
+}
+
 float * llama_context::get_embeddings() {
     // reorder embeddings for backward compatibility
     output_reorder();
@@ -946,6 +1074,10 @@ void llama_context::set_n_threads(int32_t n_threads, int32_t n_threads_batch) {
     cparams.n_threads_batch = n_threads_batch;
 }
 
+void llama_context::parallel_for(size_t n, const std::function<void(size_t)> & f) {
+    workers.parallel_for(n, cparams.n_threads, f);
+}
+
 void llama_context::set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data) {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
@@ -965,18 +1097,30 @@ void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.warmup = value;
+
+    graph_reuse_reset();
+}
+
+void llama_context::set_logits_top_k(int32_t k) {
+    LLAMA_LOG_DEBUG("%s: k = %d\n", __func__, k);
+
+    logits_top_k = std::min(std::max(0, k), (int32_t) model.vocab.n_tokens());
 }
 
 void llama_context::set_adapter_lora(
@@ -984,16 +1128,29 @@ void llama_context::set_adapter_lora(
             float scale) {
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
+    auto pos = loras.find(adapter);
+    if (pos != loras.end() && pos->second == scale) {
+        return;
+    }
+
     loras[adapter] = scale;
+
+    graph_reuse_reset();
 }
 
 bool llama_context::rm_adapter_lora(
             llama_adapter_lora * adapter) {
     LLAMA_LOG_DEBUG("%s: adapter = %p\n", __func__, (void *) adapter);
 
+    // the adapter may be freed next
+    if (loras_seq.remove(adapter)) {
+        graph_reuse_reset();
+    }
+
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        graph_reuse_reset();
         return true;
     }
 
@@ -1003,7 +1160,42 @@ bool llama_context::rm_adapter_lora(
 void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
+    if (loras.empty()) {
+        return;
+    }
+
     loras.clear();
+
+    graph_reuse_reset();
+}
+
+bool llama_context::set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: adapter = %p, seq_id = %d, scale = %f\n", __func__, (void *) adapter, seq_id, scale);
+
+    // note: the graphs are rebuilt by prepare_adapter_lora_seq() only if the stacked adapters change
+    return loras_seq.set(adapter, seq_id, scale);
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    loras_seq.clear(seq_id);
+}
+
+bool llama_context::prepare_adapter_lora_seq() {
+    try {
+        if (loras_seq.prepare()) {
+            graph_reuse_reset();
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to stack the per-sequence LoRA adapters: %s\n", __func__, err.what());
+        return false;
+    }
+
+    return true;
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -1014,6 +1206,8 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    graph_reuse_reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
@@ -1070,6 +1264,10 @@ int llama_context::encode(llama_batch & inp_batch) {
 
     n_outputs = n_tokens;
 
+    if (!prepare_adapter_lora_seq()) {
+        return -2;
+    }
+
     //batch_manager->prepare(ubatch);
 
     ggml_backend_sched_reset(sched.get());
@@ -1219,6 +1417,28 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    // streaming KV cache: keep the positions in the cells bounded, then translate the positions of the batch to them
+    if (kv_self->n_window > 0) {
+        kv_self->stream_rebase();
+
+        if (!kv_self->pos_base.empty()) {
+            if (batch_allocr.pos.empty()) {
+                batch_allocr.pos.assign(batch.pos, batch.pos + n_tokens_all);
+            }
+
+            for (int64_t i = 0; i < n_tokens_all; ++i) {
+                batch_allocr.pos[i] -= kv_self->seq_pos_base(batch.seq_id[i][0]);
+
+                if (batch_allocr.pos[i] < 0) {
+                    LLAMA_LOG_ERROR("%s: the position of token %" PRId64 " is before the window of the streaming KV cache\n", __func__, i);
+                    return -1;
+                }
+            }
+
+            batch_allocr.batch.pos = batch_allocr.pos.data();
+        }
+    }
+
     if (t_compute_start_us == 0) {
         t_compute_start_us = ggml_time_us();
     }
@@ -1245,9 +1465,17 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     const bool logits_all = n_outputs_all == n_tokens_all;
 
-    sbatch.from_batch(batch, n_embd,
-            /* simple_split */ !kv_self->recurrent,
-            /* logits_all   */ logits_all);
+    // batches that do not fit in a single ubatch and that mix decodes with prompts are reordered, so that the decode
+    // tokens are computed first and the prompts of the other sequences are chunked into the remaining ubatch capacity
+    const bool split_mixed = !kv_self->recurrent && !embd_pooled && n_tokens_all > cparams.n_ubatch && batch_allocr.split_mixed();
+
+    if (split_mixed) {
+        sbatch.from_batch_mixed(batch, batch_allocr.ids_mixed, n_embd, logits_all);
+    } else {
+        sbatch.from_batch(batch, n_embd,
+                /* simple_split */ !kv_self->recurrent,
+                /* logits_all   */ logits_all);
+    }
 
     // reserve output buffer
     if (output_reserve(n_outputs_all) < n_outputs_all) {
@@ -1258,11 +1486,14 @@ int llama_context::decode(llama_batch & inp_batch) {
     // handle any pending defrags/shifts
     kv_self_update();
 
-    int64_t n_outputs_prev = 0;
+    if (!prepare_adapter_lora_seq()) {
+        return -2;
+    }
 
-    while (sbatch.n_tokens > 0) {
-        llama_ubatch ubatch = llama_ubatch();
+    int64_t n_outputs_prev = 0;
 
+    // split the next ubatch, count its outputs and find a KV cache slot for it
+    const auto ubatch_prepare = [&](llama_ubatch & ubatch, int32_t & n_outputs_new) -> bool {
         const auto & n_ubatch = cparams.n_ubatch;
 
         if (kv_self->recurrent) {
@@ -1274,58 +1505,118 @@ int llama_context::decode(llama_batch & inp_batch) {
                 // with equal-length sequences
                 ubatch = sbatch.split_equal(cparams.n_ubatch);
             }
+        } else if (split_mixed) {
+            ubatch = sbatch.split_mixed(n_ubatch);
         } else {
             ubatch = sbatch.split_simple(n_ubatch);
         }
 
         // count the outputs in this u_batch
-        {
-            int32_t n_outputs_new = 0;
+        n_outputs_new = 0;
 
-            if (n_outputs_all == n_tokens_all) {
-                n_outputs_new = ubatch.n_tokens;
-            } else {
-                GGML_ASSERT(ubatch.output);
-                for (uint32_t i = 0; i < ubatch.n_tokens; i++) {
-                    n_outputs_new += (int32_t) (ubatch.output[i] != 0);
-                }
+        if (n_outputs_all == n_tokens_all) {
+            n_outputs_new = ubatch.n_tokens;
+        } else {
+            GGML_ASSERT(ubatch.output);
+            for (uint32_t i = 0; i < ubatch.n_tokens; i++) {
+                n_outputs_new += (int32_t) (ubatch.output[i] != 0);
             }
-
-            // needs to happen before the graph is built
-            n_outputs = n_outputs_new;
         }
 
         // find KV slot
-        {
-            if (!kv_self->find_slot(ubatch)) {
-                LLAMA_LOG_WARN("%s: failed to find KV cache slot for ubatch of size %d\n", __func__, ubatch.n_tokens);
+        if (!kv_self->find_slot(ubatch)) {
+            LLAMA_LOG_WARN("%s: failed to find KV cache slot for ubatch of size %d\n", __func__, ubatch.n_tokens);
 
-                return 1;
-            }
+            return false;
+        }
 
-            if (!kv_self->recurrent) {
-                // a heuristic, to avoid attending the full cache if it is not yet utilized
-                // after enough generations, the benefit from this heuristic disappears
-                // if we start defragmenting the cache, the benefit from this will be more important
-                const uint32_t pad = kv_self->get_padding(cparams);
-                kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
-            }
+        if (!kv_self->recurrent) {
+            // a heuristic, to avoid attending the full cache if it is not yet utilized
+            // after enough generations, the benefit from this heuristic disappears
+            // if we start defragmenting the cache, the benefit from this will be more important
+            const uint32_t pad = kv_self->get_padding(cparams);
+            kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
-        ggml_backend_sched_reset(sched.get());
+        return true;
+    };
+
+    // build the graph of the next ubatch on a helper thread while the current ubatch is being computed
+    // - the simple and mixed splits do not need the sbatch buffers of the current ubatch after the inputs are set
+    // - without KQV offload, the graph build assigns backends in the scheduler directly
+    const bool pipeline = cparams.decode_pipeline && !kv_self->recurrent && cparams.offload_kqv;
+
+    llama_ubatch ubatch        = llama_ubatch();
+    int32_t      n_outputs_cur = 0;
+
+    if (!ubatch_prepare(ubatch, n_outputs_cur)) {
+        return 1;
+    }
+
+    ggml_cgraph * gf = nullptr;
+    llm_graph_result_ptr res;
+
+    // backend assignments made while building the graph of the next ubatch
+    sched_assignments assign_next;
+
+    graph_reuse_key gkey = {};
+
+    while (true) {
+        // needs to happen before the graph is built
+        n_outputs = n_outputs_cur;
+
+        gkey = graph_get_key(ubatch);
+
         ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
 
-        auto * gf = graph_init();
-        auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+        if (!res && gres_prev && gkey == gkey_prev) {
+            // same shape as the previous graph - it is still allocated in the scheduler, only the inputs need to be set
+            res = std::move(gres_prev);
+            gf  = gf_prev;
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+            n_reused++;
+        } else {
+            ggml_backend_sched_reset(sched.get());
 
-        ggml_backend_sched_alloc_graph(sched.get(), gf);
+            if (!res) {
+                gf  = graph_init();
+                res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+            } else {
+                // the graph was built ahead of time - apply the backend assignments now that the scheduler is reset
+                for (const auto & [tensor, backend] : assign_next) {
+                    ggml_backend_sched_set_tensor_backend(sched.get(), tensor, backend);
+                }
+            }
+
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+            ggml_backend_sched_alloc_graph(sched.get(), gf);
+        }
 
         res->set_inputs(&ubatch);
 
+        llama_ubatch  ubatch_next    = llama_ubatch();
+        int32_t       n_outputs_next = 0;
+        ggml_cgraph * gf_next        = nullptr;
+
+        std::future<llm_graph_result_ptr> res_next;
+
+        if (pipeline && sbatch.n_tokens > 0) {
+            if (!ubatch_prepare(ubatch_next, n_outputs_next)) {
+                return 1;
+            }
+
+            gf_next = graph_init(ctx_compute_next, buf_compute_meta_next);
+
+            assign_next.clear();
+
+            res_next = std::async(std::launch::async, [&]() {
+                return graph_build(ctx_compute_next.get(), gf_next, ubatch_next, LLM_GRAPH_TYPE_DECODER, n_outputs_next, &assign_next);
+            });
+        }
+
         const auto compute_status = graph_compute(gf, ubatch.n_tokens > 1);
         if (compute_status != GGML_STATUS_SUCCESS) {
             switch (compute_status) {
@@ -1339,6 +1630,9 @@ int llama_context::decode(llama_batch & inp_batch) {
             }
         }
 
+        // note: with the pipeline, the slot of the next ubatch is already in the cache - it is not computed yet
+        kv_self->ubatch_computed(res_next.valid() ? 1 : 0);
+
         // plot the computation graph in dot format (for debugging purposes)
         //if (n_past%100 == 0) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
@@ -1352,7 +1646,13 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
 
         // extract logits
-        if (t_logits && n_outputs > 0) {
+        if (t_logits && n_outputs > 0 && logits_top_k_out > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(n_outputs_prev + n_outputs <= n_outputs_all);
+
+            output_extract_top_k(backend_res, t_logits, n_outputs_prev, n_outputs);
+        } else if (t_logits && n_outputs > 0) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
             GGML_ASSERT(backend_res != nullptr);
             GGML_ASSERT(logits != nullptr);
@@ -1422,6 +1722,28 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
 
         n_outputs_prev += n_outputs;
+
+        if (res_next.valid()) {
+            res           = res_next.get();
+            gf            = gf_next;
+            ubatch        = ubatch_next;
+            n_outputs_cur = n_outputs_next;
+
+            std::swap(ctx_compute,      ctx_compute_next);
+            std::swap(buf_compute_meta, buf_compute_meta_next);
+
+            continue;
+        }
+
+        if (sbatch.n_tokens == 0) {
+            break;
+        }
+
+        if (!ubatch_prepare(ubatch, n_outputs_cur)) {
+            return 1;
+        }
+
+        res.reset();
     }
 
     // finalize the batch processing
@@ -1466,9 +1788,16 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
-    // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    if (graph_reuse) {
+        // keep the last graph allocated, so that the next ubatch with the same shape can skip the graph build
+        gres_prev = std::move(res);
+        gf_prev   = gf;
+        gkey_prev = gkey;
+    } else {
+        // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
+        // overlap with device computation.
+        ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1497,9 +1826,18 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
+    // with top-k logits, only k entries per output are kept
+    const bool has_logits_top_k = has_logits && logits_top_k > 0;
+    if (has_logits_top_k) {
+        has_logits = false;
+    }
+
     logits_size = has_logits ? n_vocab*n_outputs_max : 0;
     embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
 
+    logits_top_k_out = has_logits_top_k ? logits_top_k : 0;
+    logits_top_k_data.resize(logits_top_k_out*n_outputs_max);
+
     if (output_ids.empty()) {
         // init, never resized afterwards
         output_ids.resize(n_batch);
@@ -1575,6 +1913,12 @@ void llama_context::output_reorder() {
                     std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
                 }
             }
+            if (!logits_top_k_data.empty()) {
+                std::swap_ranges(
+                        logits_top_k_data.begin() +     i*logits_top_k_out,
+                        logits_top_k_data.begin() + (i + 1)*logits_top_k_out,
+                        logits_top_k_data.begin() + j_min*logits_top_k_out);
+            }
             if (embd_size > 0) {
                 for (uint32_t k = 0; k < n_embd; k++) {
                     std::swap(embd[i*n_embd + k], embd[j_min*n_embd + k]);
@@ -1589,6 +1933,75 @@ void llama_context::output_reorder() {
     }
 }
 
+void llama_context::output_extract_top_k(
+            ggml_backend_t   backend,
+               ggml_tensor * t_logits,
+                   int64_t   i0,
+                   int32_t   n) {
+    const int64_t n_vocab = model.vocab.n_tokens();
+    const int32_t k       = logits_top_k_out;
+
+    GGML_ASSERT(t_logits->ne[0] == n_vocab);
+    GGML_ASSERT((i0 + n)*k <= (int64_t) logits_top_k_data.size());
+
+    const char * rows    = nullptr;
+          size_t nb_row  = t_logits->nb[1];
+
+    if (ggml_backend_buffer_is_host(t_logits->buffer)) {
+        // read the rows directly from the compute buffer - the full rows are never copied
+        ggml_backend_synchronize(backend);
+        rows = (const char *) t_logits->data;
+    } else {
+        // the full rows are copied from the device: the selection is not part of the graph, as the argsort of the
+        // backends is limited to rows much shorter than the vocab
+        logits_staging.resize(n*n_vocab);
+        ggml_backend_tensor_get(t_logits, logits_staging.data(), 0, n*n_vocab*sizeof(float));
+        rows   = (const char *) logits_staging.data();
+        nb_row = n_vocab*sizeof(float);
+    }
+
+    // min-heap on the logit, so that the smallest of the current top-k is at the front
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    for (int32_t r = 0; r < n; ++r) {
+        const float * row = (const float *) (rows + r*nb_row);
+
+        llama_token_data * top = logits_top_k_data.data() + (i0 + r)*k;
+
+        float max_l = -INFINITY;
+        int32_t n_top = 0;
+
+        for (int64_t t = 0; t < n_vocab; ++t) {
+            const float l = row[t];
+
+            max_l = std::max(max_l, l);
+
+            if (n_top < k) {
+                top[n_top++] = { (llama_token) t, l, 0.0f };
+                std::push_heap(top, top + n_top, cmp);
+            } else if (l > top[0].logit) {
+                std::pop_heap(top, top + k, cmp);
+                top[k - 1] = { (llama_token) t, l, 0.0f };
+                std::push_heap(top, top + k, cmp);
+            }
+        }
+
+        // normalize over the full vocabulary
+        double sum = 0.0;
+        for (int64_t t = 0; t < n_vocab; ++t) {
+            sum += expf(row[t] - max_l);
+        }
+
+        std::sort_heap(top, top + k, cmp);
+
+        for (int32_t i = 0; i < k; ++i) {
+            top[i].p = expf(top[i].logit - max_l) / sum;
+        }
+    }
+}
+
 //
 // graph
 //
@@ -1598,15 +2011,41 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    return graph_init(ctx_compute, buf_compute_meta);
+}
+
+ggml_cgraph * llama_context::graph_init(ggml_context_ptr & ctx, std::vector<uint8_t> & buf) {
+    // the previous graph may live in this buffer and the scheduler is about to be used for another graph
+    graph_reuse_reset();
+
     ggml_init_params params = {
-        /*.mem_size   =*/ buf_compute_meta.size(),
-        /*.mem_buffer =*/ buf_compute_meta.data(),
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
         /*.no_alloc   =*/ true,
     };
 
-    ctx_compute.reset(ggml_init(params));
+    ctx.reset(ggml_init(params));
+
+    return ggml_new_graph_custom(ctx.get(), graph_max_nodes(), false);
+}
+
+llama_context::graph_reuse_key llama_context::graph_get_key(const llama_ubatch & ubatch) const {
+    return {
+        /*.equal_seqs   =*/ ubatch.equal_seqs,
+        /*.has_token    =*/ ubatch.token != nullptr,
+        /*.n_tokens     =*/ ubatch.n_tokens,
+        /*.n_seq_tokens =*/ ubatch.n_seq_tokens,
+        /*.n_seqs       =*/ ubatch.n_seqs,
+        /*.n_outputs    =*/ n_outputs,
+        /*.n_kv         =*/ kv_self->n,
+        /*.n_enc        =*/ cross.n_enc,
+        /*.sink_moves   =*/ kv_self->sink_moves,
+    };
+}
 
-    return ggml_new_graph_custom(ctx_compute.get(), graph_max_nodes(), false);
+void llama_context::graph_reuse_reset() {
+    gres_prev.reset();
+    gf_prev = nullptr;
 }
 
 llm_graph_result_ptr llama_context::graph_build(
@@ -1614,6 +2053,16 @@ llm_graph_result_ptr llama_context::graph_build(
              ggml_cgraph * gf,
       const llama_ubatch & ubatch,
             llm_graph_type gtype) {
+    return graph_build(ctx, gf, ubatch, gtype, n_outputs, nullptr);
+}
+
+llm_graph_result_ptr llama_context::graph_build(
+            ggml_context * ctx,
+             ggml_cgraph * gf,
+      const llama_ubatch & ubatch,
+            llm_graph_type gtype,
+                   int32_t n_outputs,
+       sched_assignments * deferred) {
     return model.build_graph(
             {
                 /*.ctx         =*/ ctx,
@@ -1625,10 +2074,11 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.backend_cpu =*/ backend_cpu,
                 /*.cvec        =*/ &cvec,
                 /*.loras       =*/ &loras,
+                /*.loras_seq   =*/ &loras_seq,
                 /*.memory      =*/ kv_self.get(),
                 /*.cross       =*/ &cross,
                 /*.n_outputs   =*/ n_outputs,
-                /*.cb          =*/ graph_get_cb(),
+                /*.cb          =*/ graph_get_cb(deferred),
             }, gf, gtype);
 }
 
@@ -1659,8 +2109,17 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
-llm_graph_cb llama_context::graph_get_cb() const {
-    return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
+llm_graph_cb llama_context::graph_get_cb(sched_assignments * deferred) const {
+    // the scheduler may be busy computing another graph - in that case only record the assignment
+    const auto set_tensor_backend = [this, deferred](ggml_tensor * cur, ggml_backend_t backend) {
+        if (deferred) {
+            deferred->emplace_back(cur, backend);
+        } else {
+            ggml_backend_sched_set_tensor_backend(sched.get(), cur, backend);
+        }
+    };
+
+    return [&, set_tensor_backend](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
             ggml_format_name(cur, "%s-%d", name, il);
         } else {
@@ -1670,7 +2129,7 @@ llm_graph_cb llama_context::graph_get_cb() const {
         if (!cparams.offload_kqv) {
             if (strcmp(name, "kqv_merged_cont") == 0) {
                 // all nodes between the KV store and the attention output are run on the CPU
-                ggml_backend_sched_set_tensor_backend(sched.get(), cur, backend_cpu);
+                set_tensor_backend(cur, backend_cpu);
             }
         }
 
@@ -1683,7 +2142,7 @@ llm_graph_cb llama_context::graph_get_cb() const {
                 for (const auto & backend : backends) {
                     if (ggml_backend_get_device(backend.get()) == dev_layer) {
                         if (ggml_backend_supports_op(backend.get(), cur)) {
-                            ggml_backend_sched_set_tensor_backend(sched.get(), cur, backend.get());
+                            set_tensor_backend(cur, backend.get());
                         }
                     }
                 }
@@ -2070,6 +2529,21 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
         }
     }
 
+    // write top-k logits
+    {
+        LLAMA_LOG_DEBUG("%s: - writing top-k logits\n", __func__);
+
+        const int32_t  top_k      = logits_top_k_out;
+        const uint64_t top_k_size = std::min((uint64_t) logits_top_k_data.size(), (uint64_t) n_outputs * top_k);
+
+        io.write(&top_k,      sizeof(top_k));
+        io.write(&top_k_size, sizeof(top_k_size));
+
+        if (top_k_size) {
+            io.write(logits_top_k_data.data(), top_k_size * sizeof(llama_token_data));
+        }
+    }
+
     // write embeddings
     {
         LLAMA_LOG_DEBUG("%s: - writing embeddings\n", __func__);
@@ -2151,6 +2625,27 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
         }
     }
 
+    // read top-k logits
+    {
+        LLAMA_LOG_DEBUG("%s: - reading top-k logits\n", __func__);
+
+        int32_t  top_k;
+        uint64_t top_k_size;
+        io.read_to(&top_k,      sizeof(top_k));
+        io.read_to(&top_k_size, sizeof(top_k_size));
+
+        if (top_k < 0 || top_k > (int32_t) model.vocab.n_tokens() || top_k_size != (uint64_t) n_outputs * top_k) {
+            throw std::runtime_error(format("invalid top-k logits (k = %d, size = %" PRIu64 ")", top_k, top_k_size));
+        }
+
+        // the outputs keep the k they were saved with, regardless of the current setting
+        if (top_k_size) {
+            logits_top_k_out = top_k;
+            logits_top_k_data.resize(std::max<size_t>(logits_top_k_data.size(), top_k_size));
+            io.read_to(logits_top_k_data.data(), top_k_size * sizeof(llama_token_data));
+        }
+    }
+
     // read embeddings
     {
         LLAMA_LOG_DEBUG("%s: - reading embeddings\n", __func__);
@@ -2202,6 +2697,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = std::max(0, n_reused);
 
     return data;
 }
@@ -2210,6 +2706,8 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+
+    n_reused = 0;
 }
 
 //
@@ -2235,6 +2733,8 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.n_kv_sink                   =*/ 0,
+        /*.n_kv_window                 =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -2244,6 +2744,7 @@ llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.decode_pipeline             =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -2316,6 +2817,14 @@ uint32_t llama_n_seq_max(const llama_context * ctx) {
     return ctx->n_seq_max();
 }
 
+uint32_t llama_n_kv_sink(const llama_context * ctx) {
+    return ctx->n_kv_sink();
+}
+
+uint32_t llama_n_kv_window(const llama_context * ctx) {
+    return ctx->n_kv_window();
+}
+
 const llama_model * llama_get_model(const llama_context * ctx) {
     return &ctx->get_model();
 }
@@ -2355,6 +2864,12 @@ int32_t llama_n_threads_batch(llama_context * ctx) {
     return ctx->n_threads_batch();
 }
 
+void llama_parallel_for(llama_context * ctx, int32_t n, void (*fn)(int32_t i, void * user_data), void * user_data) {
+    ctx->parallel_for(std::max(n, 0), [&](size_t i) {
+        fn((int32_t) i, user_data);
+    });
+}
+
 void llama_set_abort_callback(llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
     ctx->set_abort_callback(abort_callback, abort_callback_data);
 }
@@ -2371,6 +2886,10 @@ void llama_set_warmup(llama_context * ctx, bool warmup) {
     ctx->set_warmup(warmup);
 }
 
+void llama_set_logits_top_k(llama_context * ctx, int32_t k) {
+    ctx->set_logits_top_k(k);
+}
+
 void llama_synchronize(llama_context * ctx) {
     ctx->synchronize();
 }
@@ -2387,6 +2906,16 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_n_logits_top_k(const llama_context * ctx) {
+    return ctx->n_logits_top_k();
+}
+
+llama_token_data * llama_get_logits_top_k_ith(llama_context * ctx, int32_t i) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2428,6 +2957,20 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    return ctx->set_adapter_lora_seq(adapter, seq_id, scale) ? 0 : -1;
+}
+
+void llama_clear_adapter_lora_seq(
+            llama_context * ctx,
+            llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2824,6 +3367,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
@@ -1,18 +1,20 @@
 #pragma once
 
 #include "llama.h"
+#include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-cparams.h"
 #include "llama-graph.h"
 #include "llama-adapter.h"
+#include "llama-kv-cache.h"
 
 #include "ggml-cpp.h"
 
+#include <functional>
 #include <map>
 #include <vector>
 
 struct llama_model;
-struct llama_kv_cache;
 
 class llama_io_read_i;
 class llama_io_write_i;
@@ -34,10 +36,14 @@ struct llama_context {
     uint32_t n_batch()       const;
     uint32_t n_ubatch()      const;
     uint32_t n_seq_max()     const;
+    uint32_t n_kv_sink()     const;
+    uint32_t n_kv_window()   const;
 
     uint32_t n_threads()       const;
     uint32_t n_threads_batch() const;
 
+    int32_t n_logits_top_k() const;
+
           llama_kv_cache * get_kv_self();
     const llama_kv_cache * get_kv_self() const;
 
@@ -48,6 +54,8 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    llama_token_data * get_logits_top_k_ith(int32_t i);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -60,11 +68,15 @@ struct llama_context {
 
     void set_n_threads(int32_t n_threads, int32_t n_threads_batch);
 
+    // call f(i) for i in [0, n) on the worker threads of the context, using up to n_threads() threads
+    void parallel_for(size_t n, const std::function<void(size_t)> & f);
+
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
 
     void set_embeddings (bool value);
     void set_causal_attn(bool value);
     void set_warmup(bool value);
+    void set_logits_top_k(int32_t k);
 
     void set_adapter_lora(
             llama_adapter_lora * adapter,
@@ -75,6 +87,13 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    bool set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -141,14 +160,59 @@ private:
     // TODO: maybe remove this
     void output_reorder();
 
+    // stack the per-sequence LoRA adapters before computing a batch
+    bool prepare_adapter_lora_seq();
+
+    // select the top-k logits of n outputs from the logits tensor and store them at output index i0
+    void output_extract_top_k(
+            ggml_backend_t   backend,
+               ggml_tensor * t_logits,
+                   int64_t   i0,
+                   int32_t   n);
+
     //
     // graph
     //
 
     int32_t graph_max_nodes() const;
 
+    // the shape of a decode graph - graphs with equal keys are interchangeable
+    struct graph_reuse_key {
+        bool     equal_seqs;
+        bool     has_token;
+        uint32_t n_tokens;
+        uint32_t n_seq_tokens;
+        uint32_t n_seqs;
+        int32_t  n_outputs;
+        uint32_t n_kv;
+        int64_t  n_enc;
+
+        std::vector<llama_kv_cache_unified::sink_move> sink_moves; // the attention sinks rewritten by the graph (streaming KV cache)
+
+        bool operator==(const graph_reuse_key & other) const {
+            return equal_seqs   == other.equal_seqs   &&
+                   has_token    == other.has_token    &&
+                   n_tokens     == other.n_tokens     &&
+                   n_seq_tokens == other.n_seq_tokens &&
+                   n_seqs       == other.n_seqs       &&
+                   n_outputs    == other.n_outputs    &&
+                   n_kv         == other.n_kv         &&
+                   n_enc        == other.n_enc        &&
+                   sink_moves   == other.sink_moves;
+        }
+    };
+
+    graph_reuse_key graph_get_key(const llama_ubatch & ubatch) const;
+
+    // drop the previous graph (e.g. when the parameters that affect the graph change)
+    void graph_reuse_reset();
+
+    // backend assignments recorded while building a graph without touching the scheduler
+    using sched_assignments = std::vector<std::pair<ggml_tensor *, ggml_backend_t>>;
+
     // zero-out inputs and create the ctx_compute for the compute graph
     ggml_cgraph * graph_init();
+    ggml_cgraph * graph_init(ggml_context_ptr & ctx, std::vector<uint8_t> & buf);
 
     llm_graph_result_ptr graph_build(
             ggml_context * ctx,
@@ -156,12 +220,21 @@ private:
       const llama_ubatch & ubatch,
           llm_graph_type   gtype);
 
+    // thread-safe w.r.t. the scheduler when deferred != nullptr
+    llm_graph_result_ptr graph_build(
+            ggml_context * ctx,
+             ggml_cgraph * gf,
+      const llama_ubatch & ubatch,
+          llm_graph_type   gtype,
+                 int32_t   n_outputs,
+       sched_assignments * deferred);
+
     // returns the result of ggml_backend_sched_graph_compute_async execution
     ggml_status graph_compute(
             ggml_cgraph * gf,
                    bool   batched);
 
-    llm_graph_cb graph_get_cb() const;
+    llm_graph_cb graph_get_cb(sched_assignments * deferred = nullptr) const;
 
     // used by kv_self_update()
     ggml_tensor * build_rope_shift(
@@ -197,6 +270,7 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
+    llama_adapter_lora_seq loras_seq;
     llama_sbatch        sbatch;
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
@@ -210,6 +284,15 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // top-k logits output (2-dimensional array: [n_outputs][logits_top_k_out])
+    // used instead of the full logits when logits_top_k > 0
+    int32_t                       logits_top_k     = 0; // requested k, applies from the next decode
+    int32_t                       logits_top_k_out = 0; // k of the stored outputs
+    std::vector<llama_token_data> logits_top_k_data;
+
+    // staging buffer for logits that are not in host memory (used only with logits_top_k > 0)
+    std::vector<float> logits_staging;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -234,6 +317,9 @@ private:
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
 
+    // worker threads for the loops outside of the graphs (e.g. sampling)
+    llama_worker_pool workers;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -246,6 +332,16 @@ private:
     // memory buffers used to evaluate the model
     std::vector<uint8_t> buf_compute_meta;
 
+    // graph of the next ubatch, built while the current one is computed (decode_pipeline)
+    std::vector<uint8_t> buf_compute_meta_next;
+    ggml_context_ptr     ctx_compute_next;
+
+    // the last decode graph, still allocated in the scheduler
+    bool                 graph_reuse = false;
+    graph_reuse_key      gkey_prev   = {};
+    ggml_cgraph        * gf_prev     = nullptr;
+    llm_graph_result_ptr gres_prev;
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
@@ -262,4 +358,5 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_reused = 0; // number of times the previous graph was reused
 };
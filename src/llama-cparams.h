@@ -24,11 +24,15 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t n_kv_sink;
+    uint32_t n_kv_window; // 0 - streaming KV cache disabled
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool decode_pipeline;
     bool warmup;
 
     enum llama_pooling_type pooling_type;
@@ -6,7 +6,10 @@
 
 #include <cmath>
 #include <algorithm>
+#include <mutex>
 #include <stdexcept>
+#include <tuple>
+#include <unordered_set>
 
 //
 // helpers
@@ -29,10 +32,11 @@ static std::pair<uint32_t, const char *> decode_utf8(const char * src) {
 }
 
 static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
-        const std::string & src,
+        std::string_view src,
         llama_partial_utf8 partial_start) {
     static const int      lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
-    const char          * pos      = src.c_str();
+    const char          * pos      = src.data();
+    const char          * end      = src.data() + src.size();
     std::vector<uint32_t> code_points;
 
     // common english strings have the same number of codepoints and bytes. `+ 1` for the terminating 0.
@@ -41,7 +45,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     int      n_remain = partial_start.n_remain;
 
     // continue previous decode, if applicable
-    while (*pos != 0 && n_remain > 0) {
+    while (pos < end && *pos != 0 && n_remain > 0) {
         uint8_t next_byte = static_cast<uint8_t>(*pos);
         if ((next_byte >> 6) != 2) {
             // invalid sequence, abort
@@ -58,7 +62,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
     }
 
     // decode any subsequent utf-8 sequences, which may end in an incomplete one
-    while (*pos != 0) {
+    while (pos < end && *pos != 0) {
         uint8_t first_byte = static_cast<uint8_t>(*pos);
         uint8_t highbits   = first_byte >> 4;
         n_remain   = lookup[highbits] - 1;
@@ -74,7 +78,7 @@ static std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         value = first_byte & mask;
 
         ++pos;
-        while (*pos != 0 && n_remain > 0) {
+        while (pos < end && *pos != 0 && n_remain > 0) {
             value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
             ++pos;
             --n_remain;
@@ -683,16 +687,39 @@ static bool llama_grammar_match_partial_char(
     return !is_positive_char;
 }
 
+size_t llama_grammar_stack_hash::operator()(const llama_grammar_stack & stack) const {
+    size_t hash = stack.size();
+    for (const auto * pos : stack) {
+        hash ^= std::hash<const void *>{}(pos) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
+
+size_t llama_grammar_ids_hash::operator()(const std::vector<uint32_t> & ids) const {
+    size_t hash = ids.size();
+    for (const uint32_t id : ids) {
+        hash ^= std::hash<uint32_t>{}(id) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
+
+using llama_grammar_stack_set = std::unordered_set<llama_grammar_stack, llama_grammar_stack_hash>;
+
 // transforms a grammar pushdown stack into N possible stacks, all ending
 // at a character range (terminal element)
+// `seen` holds the stacks already expanded into new_stacks: the expansion of a stack only depends on the stack,
+// so a stack reached again through another alternate is skipped instead of being expanded into duplicates
 static void llama_grammar_advance_stack(
-        const llama_grammar_rules  & rules,
-        const llama_grammar_stack  & stack,
-              llama_grammar_stacks & new_stacks) {
+        const llama_grammar_rules     & rules,
+        const llama_grammar_stack     & stack,
+              llama_grammar_stacks    & new_stacks,
+              llama_grammar_stack_set & seen) {
+    if (!seen.insert(stack).second) {
+        return;
+    }
+
     if (stack.empty()) {
-        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-            new_stacks.emplace_back(stack);
-        }
+        new_stacks.emplace_back(stack);
         return;
     }
 
@@ -713,7 +740,7 @@ static void llama_grammar_advance_stack(
                     // if alternate is nonempty, add to stack
                     new_stack.push_back(subpos);
                 }
-                llama_grammar_advance_stack(rules, new_stack, new_stacks);
+                llama_grammar_advance_stack(rules, new_stack, new_stacks, seen);
                 while (!llama_grammar_is_end_of_sequence(subpos)) {
                     // scan to end of alternate def
                     subpos++;
@@ -730,10 +757,7 @@ static void llama_grammar_advance_stack(
         case LLAMA_GRETYPE_CHAR:
         case LLAMA_GRETYPE_CHAR_NOT:
         case LLAMA_GRETYPE_CHAR_ANY:
-            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
-                // only add the stack if it's not a duplicate of one we already have
-                new_stacks.emplace_back(stack);
-            }
+            new_stacks.emplace_back(stack);
             break;
         default:
             // end of alternate (LLAMA_GRETYPE_END, LLAMA_GRETYPE_ALT) or middle of char range
@@ -762,6 +786,136 @@ static llama_grammar_candidates llama_grammar_reject_candidates(
     return rejects;
 }
 
+//
+// compiled grammar: hash-consed stacks and memoized transitions
+//
+
+// max number of interned stacks, sets of stacks and cached masks, the cache is cleared when full
+static constexpr size_t LLAMA_GRAMMAR_CACHE_MAX_STACKS = 65536;
+static constexpr size_t LLAMA_GRAMMAR_CACHE_MAX_IDS    = 4096;
+static constexpr size_t LLAMA_GRAMMAR_CACHE_MAX_MASKS  = 256;
+
+static void llama_grammar_cache_trim(llama_grammar_cache & cache) {
+    if (cache.stacks.size() >= LLAMA_GRAMMAR_CACHE_MAX_STACKS || cache.sets.size() >= LLAMA_GRAMMAR_CACHE_MAX_IDS) {
+        cache = {};
+    }
+    if (cache.masks.size() >= LLAMA_GRAMMAR_CACHE_MAX_MASKS) {
+        cache.masks.clear();
+    }
+}
+
+static uint32_t llama_grammar_cache_stack_id(llama_grammar_cache & cache, const llama_grammar_stack & stack) {
+    auto it = cache.stack_ids.find(stack);
+    if (it == cache.stack_ids.end()) {
+        it = cache.stack_ids.emplace(stack, (uint32_t) cache.stacks.size()).first;
+        cache.stacks.push_back(&it->first);
+    }
+    return it->second;
+}
+
+static uint32_t llama_grammar_cache_set_id(llama_grammar_cache & cache, std::vector<uint32_t> && set) {
+    auto it = cache.ids.find(set);
+    if (it == cache.ids.end()) {
+        it = cache.ids.emplace(std::move(set), (uint32_t) cache.sets.size()).first;
+        cache.sets.push_back(&it->first);
+    }
+    return it->second;
+}
+
+static uint32_t llama_grammar_cache_id(llama_grammar_cache & cache, const llama_grammar_stacks & stacks) {
+    std::vector<uint32_t> set;
+    set.reserve(stacks.size());
+    for (const auto & stack : stacks) {
+        set.push_back(llama_grammar_cache_stack_id(cache, stack));
+    }
+    return llama_grammar_cache_set_id(cache, std::move(set));
+}
+
+// ids of the stacks after accepting the code point on top of a single stack
+static const std::vector<uint32_t> & llama_grammar_cache_stack_next(
+        const llama_grammar_rules & rules,
+        llama_grammar_cache       & cache,
+        uint32_t                    sid,
+        uint32_t                    chr) {
+    const uint64_t key = ((uint64_t) sid << 32) | chr;
+
+    auto it = cache.stack_next.find(key);
+    if (it != cache.stack_next.end()) {
+        return it->second;
+    }
+
+    const llama_grammar_stack & stack = *cache.stacks[sid];
+
+    llama_grammar_stacks stacks_new;
+
+    if (!stack.empty()) {
+        auto match = llama_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const llama_grammar_element * pos = match.second;
+
+            // update top of stack to next element, if any
+            llama_grammar_stack new_stack(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos)) {
+                new_stack.push_back(pos);
+            }
+            llama_grammar_stack_set seen;
+            llama_grammar_advance_stack(rules, new_stack, stacks_new, seen);
+        }
+    }
+
+    std::vector<uint32_t> next;
+    next.reserve(stacks_new.size());
+    for (const auto & stack_new : stacks_new) {
+        next.push_back(llama_grammar_cache_stack_id(cache, stack_new));
+    }
+
+    return cache.stack_next.emplace(key, std::move(next)).first->second;
+}
+
+// id of the set of stacks after accepting the code point, -1 if no stack accepts it
+static int32_t llama_grammar_cache_next(
+        const llama_grammar_rules & rules,
+        llama_grammar_cache       & cache,
+        uint32_t                    id,
+        uint32_t                    chr) {
+    const uint64_t key = ((uint64_t) id << 32) | chr;
+
+    const auto it = cache.next.find(key);
+    if (it != cache.next.end()) {
+        return it->second;
+    }
+
+    // union of the next stacks of each stack, in order and without duplicates (same as llama_grammar_accept)
+    std::vector<uint32_t> set;
+
+    if (cache.sets[id]->size() == 1) {
+        set = llama_grammar_cache_stack_next(rules, cache, cache.sets[id]->front(), chr);
+    } else {
+        std::vector<const std::vector<uint32_t> *> nexts;
+        nexts.reserve(cache.sets[id]->size());
+        for (const uint32_t sid : *cache.sets[id]) {
+            nexts.push_back(&llama_grammar_cache_stack_next(rules, cache, sid, chr));
+        }
+
+        // stack ids are dense, so a flag per stack is enough to deduplicate
+        std::vector<bool> seen(cache.stacks.size(), false);
+        for (const auto * next : nexts) {
+            for (const uint32_t sid_next : *next) {
+                if (!seen[sid_next]) {
+                    seen[sid_next] = true;
+                    set.push_back(sid_next);
+                }
+            }
+        }
+    }
+
+    const int32_t id_new = set.empty() ? -1 : (int32_t) llama_grammar_cache_set_id(cache, std::move(set));
+
+    cache.next.emplace(key, id_new);
+
+    return id_new;
+}
+
 static bool llama_grammar_detect_left_recursion(
         const llama_grammar_rules & rules,
         size_t rule_index,
@@ -825,8 +979,30 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
 
 void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
     llama_grammar_stacks stacks_new;
+
+    if (grammar->compiled) {
+        std::lock_guard<std::mutex> lock(grammar->shared->mutex);
+
+        auto & cache = grammar->shared->cache;
+
+        llama_grammar_cache_trim(cache);
+
+        const int32_t id = llama_grammar_cache_next(grammar->rules, cache, llama_grammar_cache_id(cache, grammar->stacks), chr);
+        if (id >= 0) {
+            stacks_new.reserve(cache.sets[id]->size());
+            for (const uint32_t sid : *cache.sets[id]) {
+                stacks_new.push_back(*cache.stacks[sid]);
+            }
+        }
+
+        grammar->stacks = std::move(stacks_new);
+        return;
+    }
+
     stacks_new.reserve(grammar->stacks.size());
 
+    llama_grammar_stack_set seen;
+
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
             continue;
@@ -841,7 +1017,7 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new, seen);
         }
     }
 
@@ -892,8 +1068,9 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
         stack_after.push_back(stack_pos_after);
     }
-    llama_grammar_stacks next_stacks;
-    llama_grammar_advance_stack(rules, stack_after, next_stacks);
+    llama_grammar_stacks    next_stacks;
+    llama_grammar_stack_set seen;
+    llama_grammar_advance_stack(rules, stack_after, next_stacks, seen);
 
     auto next_rejects = llama_grammar_reject_candidates(rules, next_stacks, next_candidates);
     for (const auto & tok : next_rejects) {
@@ -903,24 +1080,191 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
-////////////////////
+//
+// compiled grammar: vocab trie + allowed-token masks
+//
 
-struct llama_grammar * llama_grammar_init_impl(
-        const struct llama_vocab * vocab,
-        const llama_grammar_element ** rules,
-        size_t n_rules,
-        size_t start_rule_index) {
-    const llama_grammar_element * pos;
+struct llama_grammar_trie_entry {
+    std::vector<uint32_t> code_points; // without the terminating 0
+    llama_partial_utf8    partial_utf8;
+    llama_token           id;
+};
+
+// entries[order[lo..hi)] are sorted and share their first `depth` code points
+static void llama_grammar_trie_build(
+        llama_grammar_trie                          & trie,
+        const std::vector<llama_grammar_trie_entry> & entries,
+        const std::vector<uint32_t>                 & order,
+        uint32_t lo,
+        uint32_t hi,
+        size_t   depth,
+        uint32_t inode) {
+    uint32_t i = lo;
+
+    trie.nodes[inode].tok_begin = trie.tokens.size();
+    for (; i < hi && entries[order[i]].code_points.size() == depth; ++i) {
+        trie.tokens.push_back(entries[order[i]].id);
+        trie.partials.push_back(entries[order[i]].partial_utf8);
+    }
+    trie.nodes[inode].tok_end = trie.tokens.size();
 
-    // copy rule definitions into vectors
-    llama_grammar_rules vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
+    // allocate all the children first so that they are contiguous
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    const uint32_t child_begin = trie.nodes.size();
+    while (i < hi) {
+        const uint32_t cpt = entries[order[i]].code_points[depth];
+
+        uint32_t j = i + 1;
+        while (j < hi && entries[order[j]].code_points[depth] == cpt) {
+            ++j;
         }
-        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
+
+        trie.nodes.push_back({ cpt, 0, 0, 0, 0 });
+        ranges.emplace_back(i, j);
+        i = j;
+    }
+    trie.nodes[inode].child_begin = child_begin;
+    trie.nodes[inode].child_end   = trie.nodes.size();
+
+    for (size_t k = 0; k < ranges.size(); ++k) {
+        llama_grammar_trie_build(trie, entries, order, ranges[k].first, ranges[k].second, depth + 1, child_begin + k);
+    }
+}
+
+llama_grammar_trie llama_grammar_trie_init(const llama_vocab & vocab) {
+    const uint32_t n_vocab = vocab.n_tokens();
+
+    std::vector<llama_grammar_trie_entry> entries;
+    entries.reserve(n_vocab);
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        const std::string_view piece = vocab.token_to_piece(id);
+
+        if (vocab.is_eog(id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, {});
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+
+        decoded.first.pop_back();
+        entries.push_back({ std::move(decoded.first), decoded.second, (llama_token) id });
+    }
+
+    std::vector<uint32_t> order(entries.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return entries[a].code_points < entries[b].code_points;
+    });
+
+    llama_grammar_trie trie;
+    trie.n_vocab = n_vocab;
+    trie.nodes.push_back({ 0, 0, 0, 0, 0 });
+    trie.tokens.reserve(entries.size());
+    trie.partials.reserve(entries.size());
+
+    llama_grammar_trie_build(trie, entries, order, 0, order.size(), 0, 0);
+
+    return trie;
+}
+
+// marks the tokens below `inode` that are accepted by the set of stacks `id`
+// the whole subtree is skipped as soon as the code point leading to it is rejected
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules & rules,
+        const llama_grammar_trie  & trie,
+        llama_grammar_cache       & cache,
+        uint32_t                    inode,
+        uint32_t                    id,
+        std::vector<uint32_t>     & mask) {
+    const auto & node = trie.nodes[inode];
+
+    for (uint32_t i = node.tok_begin; i < node.tok_end; ++i) {
+        const auto & partial_utf8 = trie.partials[i];
+
+        // reached end of full codepoints in token, accept iff it does not end in a partial sequence
+        // or the partial sequence can satisfy one of the stacks
+        bool accept = partial_utf8.n_remain == 0;
+        if (!accept) {
+            for (const uint32_t sid : *cache.sets[id]) {
+                const auto & stack = *cache.stacks[sid];
+                if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial_utf8)) {
+                    accept = true;
+                    break;
+                }
+            }
+        }
+
+        if (accept) {
+            const llama_token token = trie.tokens[i];
+            mask[token >> 5] |= 1u << (token & 31);
+        }
+    }
+
+    for (uint32_t ic = node.child_begin; ic < node.child_end; ++ic) {
+        const int32_t id_next = llama_grammar_cache_next(rules, cache, id, trie.nodes[ic].cpt);
+        if (id_next >= 0) {
+            llama_grammar_trie_walk(rules, trie, cache, ic, id_next, mask);
+        }
+    }
+}
+
+// allowed-token mask of the current stacks, nullptr if it is not cached and `compute` is not set
+static std::shared_ptr<const std::vector<uint32_t>> llama_grammar_get_mask(const struct llama_grammar & grammar, bool compute) {
+    auto & shared = *grammar.shared;
+
+    std::lock_guard<std::mutex> lock(shared.mutex);
+
+    auto & cache = shared.cache;
+
+    if (!compute) {
+        std::vector<uint32_t> set;
+        set.reserve(grammar.stacks.size());
+        for (const auto & stack : grammar.stacks) {
+            const auto it = cache.stack_ids.find(stack);
+            if (it == cache.stack_ids.end()) {
+                return nullptr;
+            }
+            set.push_back(it->second);
+        }
+
+        const auto it_id = cache.ids.find(set);
+        if (it_id == cache.ids.end()) {
+            return nullptr;
+        }
+
+        const auto it = cache.masks.find(it_id->second);
+        return it == cache.masks.end() ? nullptr : it->second;
+    }
+
+    llama_grammar_cache_trim(cache);
+
+    const uint32_t id = llama_grammar_cache_id(cache, grammar.stacks);
+
+    auto it = cache.masks.find(id);
+    if (it == cache.masks.end()) {
+        const auto & trie = grammar.vocab->grammar_trie();
+
+        auto mask = std::make_shared<std::vector<uint32_t>>((trie.n_vocab + 31) / 32, 0);
+        llama_grammar_trie_walk(grammar.rules, trie, cache, 0, id, *mask);
+
+        it = cache.masks.emplace(id, std::move(mask)).first;
     }
 
+    return it->second;
+}
+
+////////////////////
+
+// checks the rules and builds the initial stacks, nullptr if the grammar is not supported
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_compile(llama_grammar_rules && vec_rules, size_t start_rule_index) {
+    const size_t n_rules = vec_rules.size();
+
     // Check for left recursion
     std::vector<bool> rules_visited(n_rules);
     std::vector<bool> rules_in_progress(n_rules);
@@ -935,16 +1279,24 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     }
 
+    // Important: vec_rules has to be moved here, not copied, because stacks contains
+    // pointers to elements of the rules, which must outlive them.
+    auto result = std::make_shared<llama_grammar_compiled>();
+    result->rules = std::move(vec_rules);
+
+    const llama_grammar_rules & rules = result->rules;
+
     // loop over alternates of start rule to build initial stacks
-    llama_grammar_stacks stacks;
-    pos = vec_rules[start_rule_index].data();
+    llama_grammar_stacks    stacks;
+    llama_grammar_stack_set seen;
+    const llama_grammar_element * pos = rules[start_rule_index].data();
     do {
         llama_grammar_stack stack;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(rules, stack, stacks, seen);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -957,31 +1309,71 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     } while (true);
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
-    // then the pointers would be invalidated when the local vec_rules goes out of scope.
+    result->stacks = std::move(stacks);
+
+    return result;
+}
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+        const llama_grammar_element ** rules,
+        size_t n_rules,
+        size_t start_rule_index) {
+    const llama_grammar_element * pos;
+
+    // copy rule definitions into vectors
+    llama_grammar_rules vec_rules(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        for (pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
+        }
+        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
+    }
+
+    auto shared = llama_grammar_compile(std::move(vec_rules), start_rule_index);
+    if (!shared) {
+        return nullptr;
+    }
+
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
-        std::move(stacks),
+        shared,
+        shared->rules,
+        shared->stacks,
         /* .partial_utf8 = */     {},
         /* .lazy =*/              false,
         /* .awaiting_trigger = */ false,
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .compiled = */         true,
     };
 }
 
-struct llama_grammar * llama_grammar_init_impl(
+// the compiled grammars parsed from a string are shared by all the grammars using the same string with the same vocab
+// (e.g. the server slots with the same JSON schema), for as long as one of them is alive
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_compile_str(
         const struct llama_vocab * vocab,
                       const char * grammar_str,
-                      const char * grammar_root,
-                              bool lazy,
-                     const char ** trigger_patterns,
-                            size_t num_trigger_patterns,
-               const llama_token * trigger_tokens,
-                            size_t num_trigger_tokens) {
+                      const char * grammar_root) {
+    using key_t = std::tuple<const llama_vocab *, std::string, std::string>;
+
+    static std::mutex                                               mutex;
+    static std::map<key_t, std::weak_ptr<llama_grammar_compiled>> compiled;
+
+    const key_t key = { vocab, grammar_str, grammar_root };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = compiled.find(key);
+        if (it != compiled.end()) {
+            if (auto result = it->second.lock()) {
+                return result;
+            }
+        }
+    }
+
     llama_grammar_parser parser;
 
     // if there is a grammar, parse it
@@ -1013,41 +1405,40 @@ struct llama_grammar * llama_grammar_init_impl(
         vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
     }
 
-    // Check for left recursion
-    std::vector<bool> rules_visited(n_rules);
-    std::vector<bool> rules_in_progress(n_rules);
-    std::vector<bool> rules_may_be_empty(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        if (rules_visited[i]) {
-            continue;
-        }
-        if (llama_grammar_detect_left_recursion(vec_rules, i, &rules_visited, &rules_in_progress, &rules_may_be_empty)) {
-            LLAMA_LOG_ERROR("unsupported grammar, left recursion detected for nonterminal at index %zu", i);
-            return nullptr;
-        }
+    auto result = llama_grammar_compile(std::move(vec_rules), start_rule_index);
+    if (!result) {
+        return nullptr;
     }
 
-    // loop over alternates of start rule to build initial stacks
-    llama_grammar_stacks stacks;
-    pos = vec_rules[start_rule_index].data();
-    do {
-        llama_grammar_stack stack;
-        if (!llama_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
-        }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!llama_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
-        }
-        if (pos->type == LLAMA_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
-        }
-    } while (true);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = compiled.begin(); it != compiled.end(); ) {
+        it = it->second.expired() ? compiled.erase(it) : std::next(it);
+    }
+
+    // another thread may have compiled the same grammar in the meantime
+    auto & entry = compiled[key];
+    if (auto other = entry.lock()) {
+        return other;
+    }
+    entry = result;
+
+    return result;
+}
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+                      const char * grammar_str,
+                      const char * grammar_root,
+                              bool lazy,
+                     const char ** trigger_patterns,
+                            size_t num_trigger_patterns,
+               const llama_token * trigger_tokens,
+                            size_t num_trigger_tokens) {
+    auto shared = llama_grammar_compile_str(vocab, grammar_str, grammar_root);
+    if (!shared) {
+        return nullptr;
+    }
 
     std::vector<llama_token>    vec_trigger_tokens;
     std::vector<llama_grammar_trigger_pattern> vec_trigger_patterns;
@@ -1062,19 +1453,18 @@ struct llama_grammar * llama_grammar_init_impl(
         trigger.regex = std::regex(trigger.pattern);
     }
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
-    // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
-        std::move(stacks),
+        shared,
+        shared->rules,
+        shared->stacks,
         /* .partial_utf8 = */     {},
         /* .lazy = */             lazy,
         /* .awaiting_trigger = */ lazy,
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .compiled = */         true,
     };
 }
 
@@ -1087,8 +1477,10 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    auto * result = new llama_grammar {
+    // the rules are shared, so the stacks can be copied as they are
+    return new llama_grammar {
         grammar.vocab,
+        grammar.shared,
         grammar.rules,
         grammar.stacks,
         grammar.partial_utf8,
@@ -1097,22 +1489,8 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        grammar.compiled,
     };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
-        }
-    }
-
-    return result;
 }
 
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
@@ -1130,6 +1508,28 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // the compiled mode is used when no partial UTF-8 sequence is pending (the trie is decoded from a clean state)
+    // the mask is computed for the whole vocab, so for a few candidates it is only worth it if it is already cached
+    const auto mask = grammar.compiled && grammar.partial_utf8.n_remain <= 0 ?
+        llama_grammar_get_mask(grammar, cur_p->size >= grammar.vocab->n_tokens()/16) : nullptr;
+
+    if (mask) {
+
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+
+            if (grammar.vocab->is_eog(id)) {
+                if (!allow_eog) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            } else if (!((*mask)[id >> 5] & (1u << (id & 31)))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+
+        return;
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -1138,7 +1538,7 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
 
     for (size_t i = 0; i < cur_p->size; ++i) {
         const llama_token id      = cur_p->data[i].id;
-        const std::string & piece = grammar.vocab->token_to_piece(id);
+        const std::string_view piece = grammar.vocab->token_to_piece(id);
 
         if (grammar.vocab->is_eog(id)) {
             if (!allow_eog) {
@@ -1161,14 +1561,14 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
 void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
-    const auto & piece = grammar.vocab->token_to_piece(token);
+    const std::string_view piece = grammar.vocab->token_to_piece(token);
 
     if (grammar.awaiting_trigger) {
         if (std::find(grammar.trigger_tokens.begin(), grammar.trigger_tokens.end(), token) != grammar.trigger_tokens.end()) {
             grammar.awaiting_trigger = false;
             grammar.trigger_buffer.clear();
             llama_grammar_accept_str(grammar, piece);
-            LLAMA_LOG_DEBUG("Grammar triggered on token %u (`%s`)", token, piece.c_str());
+            LLAMA_LOG_DEBUG("Grammar triggered on token %u (`%.*s`)", token, (int) piece.size(), piece.data());
             return;
         } else {
             grammar.trigger_buffer += piece;
@@ -1186,7 +1586,7 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
                     return;
                 }
             }
-            LLAMA_LOG_DEBUG("Grammar still awaiting trigger after token %d (`%s`)\n", token, piece.c_str());
+            LLAMA_LOG_DEBUG("Grammar still awaiting trigger after token %d (`%.*s`)\n", token, (int) piece.size(), piece.data());
             return;
         }
     }
@@ -1203,7 +1603,7 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     llama_grammar_accept_str(grammar, piece);
 }
 
-void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string & piece) {
+void llama_grammar_accept_str(struct llama_grammar & grammar, std::string_view piece) {
     // Note terminating 0 in decoded string
     const auto   decoded     = decode_utf8(piece, grammar.partial_utf8);
     const auto & code_points = decoded.first;
@@ -1214,6 +1614,6 @@ void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string
 
     grammar.partial_utf8 = decoded.second;
     if (grammar.stacks.empty()) {
-        throw std::runtime_error("Unexpected empty grammar stack after accepting piece: " + piece);
+        throw std::runtime_error("Unexpected empty grammar stack after accepting piece: " + std::string(piece));
     }
 }
@@ -3,8 +3,12 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -106,6 +110,60 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// trie over the code points of the vocab pieces (as decoded by the grammar), used by the compiled mode of
+// llama_grammar_apply_impl to match all tokens sharing a prefix against the grammar stacks at once
+struct llama_grammar_trie {
+    struct node {
+        uint32_t cpt;         // code point on the edge from the parent (unused for the root)
+        uint32_t child_begin; // children are stored contiguously, sorted by code point
+        uint32_t child_end;
+        uint32_t tok_begin;   // tokens whose full code points end at this node
+        uint32_t tok_end;
+    };
+
+    std::vector<node>               nodes;    // nodes[0] is the root
+    std::vector<llama_token>        tokens;
+    std::vector<llama_partial_utf8> partials; // trailing incomplete UTF-8 sequence of each token
+
+    uint32_t n_vocab = 0;
+};
+
+// skips the EOG tokens, the empty pieces and the invalid UTF-8 pieces (these never match the grammar)
+llama_grammar_trie llama_grammar_trie_init(const llama_vocab & vocab);
+
+struct llama_grammar_stack_hash {
+    size_t operator()(const llama_grammar_stack & stack) const;
+};
+
+struct llama_grammar_ids_hash {
+    size_t operator()(const std::vector<uint32_t> & ids) const;
+};
+
+// memoized state of the compiled mode
+// the stacks are hash-consed and the sets of stacks are interned as lists of stack ids, so that the transitions
+// and the allowed-token masks can be looked up by id
+// note: the stacks point into the rules, so the cache is only valid for the grammars sharing them
+struct llama_grammar_cache {
+    std::unordered_map<llama_grammar_stack, uint32_t, llama_grammar_stack_hash> stack_ids;
+    std::vector<const llama_grammar_stack *>                                   stacks;     // stack id -> stack (keys of stack_ids)
+    std::unordered_map<uint64_t, std::vector<uint32_t>>                        stack_next; // (stack id, code point) -> stack ids after accepting it
+
+    std::unordered_map<std::vector<uint32_t>, uint32_t, llama_grammar_ids_hash> ids;
+    std::vector<const std::vector<uint32_t> *>                                 sets;  // id -> stack ids of the set (keys of ids)
+    std::unordered_map<uint64_t, int32_t>                                      next;  // (id, code point) -> id after accepting it, -1 if rejected
+    std::map<uint32_t, std::shared_ptr<const std::vector<uint32_t>>>           masks; // id -> allowed-token bitmask over the vocab
+};
+
+// rules, initial stacks and compiled mode cache of a grammar
+// shared by its clones and by the grammars parsed from the same string, which can be used from different threads
+struct llama_grammar_compiled {
+    llama_grammar_rules  rules;
+    llama_grammar_stacks stacks;
+
+    std::mutex          mutex; // guards the cache
+    llama_grammar_cache cache;
+};
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
     std::regex  regex;
@@ -115,8 +173,10 @@ struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    std::shared_ptr<llama_grammar_compiled> shared;
+
+    const llama_grammar_rules  & rules; // shared->rules
+          llama_grammar_stacks   stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -132,6 +192,8 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // compiled mode: walk the vocab trie instead of every candidate, see llama_grammar_cache
+    bool compiled = true;
 };
 
 //
@@ -170,4 +232,4 @@ void llama_grammar_accept_impl(
 
 void llama_grammar_accept_str(
               struct llama_grammar & grammar,
-                 const std::string & piece);
+                    std::string_view   piece);
@@ -134,6 +134,40 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_lora_seq::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens = ubatch->n_tokens;
+    const int32_t n_used   = loras_seq->n_used;
+
+    GGML_ASSERT(ggml_backend_buffer_is_host(ids->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(scales->buffer));
+
+    int32_t * data_ids    = (int32_t *) ids->data;
+    float   * data_scales = (float   *) scales->data;
+
+    int64_t n_rows = 0;
+
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        // the outputs are selected in the same order as llm_graph_input_out_ids
+        if (outputs) {
+            if (ubatch->output) {
+                if (!ubatch->output[i]) {
+                    continue;
+                }
+            } else if (i != n_tokens - 1) {
+                continue;
+            }
+        }
+
+        const llama_seq_id seq_id = ubatch->seq_id ? ubatch->seq_id[i][0] : 0;
+
+        loras_seq->get_ids(seq_id, data_ids + n_rows*n_used, data_scales + n_rows*n_used);
+
+        n_rows++;
+    }
+
+    GGML_ASSERT(n_rows == ids->ne[1]);
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -400,7 +434,38 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_attn_kv_unified::add_kv_store(ggml_tensor * view, ggml_tensor * cpy, size_t nb_cell) {
+    kv_stores.push_back({ view, cpy, nb_cell });
+}
+
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
+    // point the KV cache stores to the current head
+    for (const auto & store : kv_stores) {
+        const size_t offs = kv_self->head*store.nb_cell;
+
+        for (ggml_tensor * t : { store.view, store.cpy }) {
+            t->view_offs = offs;
+            if (t->view_src->data) {
+                t->data = (char *) t->view_src->data + offs;
+            }
+        }
+    }
+
+    if (self_k_sink_shift) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(self_k_sink_shift->buffer));
+
+        int32_t * data = (int32_t *) self_k_sink_shift->data;
+
+        int64_t n = 0;
+        for (size_t i = 0; i < kv_self->sink_moves.size(); ++i) {
+            for (uint32_t j = 0; j < kv_self->sink_moves[i].n; ++j) {
+                data[n++] = kv_self->sink_shift[i];
+            }
+        }
+
+        GGML_ASSERT(n == ggml_nelements(self_k_sink_shift));
+    }
+
     if (self_kq_mask || self_kq_mask_swa) {
         const int64_t n_kv         = kv_self->n;
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -562,6 +627,7 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     backend_cpu      (params.backend_cpu),
     cvec             (params.cvec),
     loras            (params.loras),
+    loras_seq        (params.loras_seq),
     memory           (params.memory),
     cross            (params.cross),
     cb_func          (params.cb),
@@ -607,9 +673,73 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    ggml_tensor * ab_seq = build_lora_seq(w, cur);
+    if (ab_seq) {
+        res = ggml_add(ctx0, res, ab_seq);
+    }
+
     return res;
 }
 
+ggml_tensor * llm_graph_context::build_lora_seq(
+          ggml_tensor * w,
+          ggml_tensor * cur) const {
+    if (!loras_seq || loras_seq->n_used == 0 || ggml_n_dims(cur) > 2) {
+        return nullptr;
+    }
+
+    const llama_adapter_lora_weight * lw = loras_seq->get_weight(w);
+    if (lw == nullptr) {
+        return nullptr;
+    }
+
+    // the rows of cur are either all the tokens of the ubatch, or only the outputs
+    const int64_t n_rows = cur->ne[1];
+
+    llm_graph_input_lora_seq ** inp_ptr = nullptr;
+    if (n_rows == n_tokens) {
+        inp_ptr = &inp_lora_seq;
+    } else if (n_rows == n_outputs) {
+        inp_ptr = &inp_lora_seq_out;
+    } else {
+        return nullptr;
+    }
+
+    if (*inp_ptr == nullptr) {
+        auto inp = std::make_unique<llm_graph_input_lora_seq>(loras_seq, n_rows != n_tokens, n_outputs);
+
+        inp->ids = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, loras_seq->n_used, n_rows);
+        ggml_set_input(inp->ids);
+
+        inp->scales = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, loras_seq->n_used, n_rows);
+        ggml_set_input(inp->scales);
+
+        *inp_ptr = (llm_graph_input_lora_seq *) res->add_input(std::move(inp));
+    }
+
+    const auto * inp = *inp_ptr;
+
+    if (!ggml_is_contiguous(cur)) {
+        cur = ggml_cont(ctx0, cur);
+    }
+
+    // gather the adapters of each row from the stacks: [n_out, n_used, n_rows]
+    ggml_tensor * ab_cur = ggml_mul_mat_id(ctx0, lw->b,
+            ggml_mul_mat_id(ctx0, lw->a, ggml_reshape_3d(ctx0, cur, cur->ne[0], 1, n_rows), inp->ids),
+            inp->ids);
+
+    ab_cur = ggml_mul(ctx0, ab_cur, inp->scales);
+
+    ggml_tensor * res_seq = nullptr;
+    for (int32_t j = 0; j < loras_seq->n_used; ++j) {
+        ggml_tensor * ab_j = ggml_view_2d(ctx0, ab_cur, ab_cur->ne[0], n_rows, ab_cur->nb[2], j*ab_cur->nb[1]);
+
+        res_seq = res_seq ? ggml_add(ctx0, res_seq, ab_j) : ab_j;
+    }
+
+    return res_seq;
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm_id(
           ggml_tensor * w,   // ggml_tensor * as
           ggml_tensor * cur, // ggml_tensor * b
@@ -1300,6 +1430,16 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
     }
 
+    if (!kv_self->sink_moves.empty() && rope_type != LLAMA_ROPE_TYPE_NONE) {
+        int64_t n_sink_cells = 0;
+        for (const auto & move : kv_self->sink_moves) {
+            n_sink_cells += move.n;
+        }
+
+        inp->self_k_sink_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_sink_cells);
+        ggml_set_input(inp->self_k_sink_shift);
+    }
+
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
 }
 
@@ -1338,29 +1478,43 @@ ggml_tensor * llm_graph_context::build_attn(
 
         GGML_ASSERT(kv_self->size == n_ctx);
 
-        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
+        const size_t nb_cell_k = ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa);
+
+        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, nb_cell_k*kv_head);
         //cb(k_cache_view, "k_cache_view", il);
 
         // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+        ggml_tensor * k_cache_cpy = ggml_cpy(ctx0, k_cur, k_cache_view);
+        ggml_build_forward_expand(gf, k_cache_cpy);
+
+        inp->add_kv_store(k_cache_view, k_cache_cpy, nb_cell_k);
 
         v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
         ggml_tensor * v_cache_view = nullptr;
 
+        size_t nb_cell_v = 0;
+
         if (!v_trans) {
-            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
+            nb_cell_v = ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa);
+
+            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, nb_cell_v*kv_head);
         } else {
+            nb_cell_v = ggml_element_size(kv_self->v_l[il]);
+
             // note: the V cache is transposed when not using flash attention
             v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
-                    (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*ggml_element_size(kv_self->v_l[il]));
+                    (  n_ctx)*nb_cell_v,
+                    (kv_head)*nb_cell_v);
 
             v_cur = ggml_transpose(ctx0, v_cur);
         }
         //cb(v_cache_view, "v_cache_view", il);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+        ggml_tensor * v_cache_cpy = ggml_cpy(ctx0, v_cur, v_cache_view);
+        ggml_build_forward_expand(gf, v_cache_cpy);
+
+        inp->add_kv_store(v_cache_view, v_cache_cpy, nb_cell_v);
     }
 
     const bool is_swa = hparams.is_swa(il);
@@ -1377,6 +1531,65 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
+    if (inp->self_k_sink_shift) {
+        // streaming KV cache: rewrite the K of the attention sinks moved by find_slot(), before they are attended
+        // the nodes are expanded first, so that they are computed before the attention reads the cache
+        const size_t nb_head_k = ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k);
+        const size_t nb_cell_k = ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa);
+
+        // note: the swa rope params could become part of the cparams in the future
+        const float freq_base_l  = is_swa ? hparams.rope_freq_base_train_swa  : freq_base;
+        const float freq_scale_l = is_swa ? hparams.rope_freq_scale_train_swa : freq_scale;
+
+        ggml_tensor * rope_factors = kv_self->cbs.get_rope_factors(n_ctx_per_seq, il);
+
+        int64_t i_shift = 0;
+
+        for (const auto & move : kv_self->sink_moves) {
+            ggml_tensor * k_cells = ggml_view_3d(ctx0, kv_self->k_l[il],
+                    n_embd_head_k, n_head_kv, move.n,
+                    nb_head_k, nb_cell_k, nb_cell_k*move.c0);
+
+            ggml_tensor * shift = ggml_view_1d(ctx0, inp->self_k_sink_shift, move.n, ggml_element_size(inp->self_k_sink_shift)*i_shift);
+
+            i_shift += move.n;
+
+            ggml_tensor * cur = nullptr;
+
+            if (move.row >= 0) {
+                // rotate from the F32 copy of the sinks
+                ggml_tensor * k_sink = ggml_view_3d(ctx0, kv_self->k_sink_l[il],
+                        n_embd_head_k, n_head_kv, move.n,
+                        ggml_row_size(GGML_TYPE_F32, n_embd_head_k),
+                        ggml_row_size(GGML_TYPE_F32, n_embd_k_gqa),
+                        ggml_row_size(GGML_TYPE_F32, n_embd_k_gqa)*move.row);
+
+                if (move.copy) {
+                    k_sink = ggml_cpy(ctx0, k_cells, k_sink);
+                }
+
+                cur = ggml_rope_ext(ctx0, k_sink, shift, rope_factors,
+                        n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+
+                cur = ggml_cpy(ctx0, cur, k_cells);
+            } else if (ggml_is_quantized(k_cells->type)) {
+                // dequantize to f32 -> RoPE -> quantize back
+                cur = ggml_cast(ctx0, k_cells, GGML_TYPE_F32);
+                cur = ggml_rope_ext_inplace(ctx0, cur, shift, rope_factors,
+                        n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+                cur = ggml_cpy(ctx0, cur, k_cells);
+            } else {
+                cur = ggml_rope_ext_inplace(ctx0, k_cells, shift, rope_factors,
+                        n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
+                        ext_factor, attn_factor, beta_fast, beta_slow);
+            }
+
+            ggml_build_forward_expand(gf, cur);
+        }
+    }
+
     ggml_tensor * k =
         ggml_view_3d(ctx0, kv_self->k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
@@ -145,6 +145,26 @@ public:
     const int32_t n_outputs;
 };
 
+// the per-sequence LoRA adapters of the rows of an activation (all the tokens or only the outputs)
+class llm_graph_input_lora_seq : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_seq(
+            const llama_adapter_lora_seq * loras_seq,
+            bool    outputs,
+            int32_t n_outputs) : loras_seq(loras_seq), outputs(outputs), n_outputs(n_outputs) {}
+    virtual ~llm_graph_input_lora_seq() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * ids    = nullptr; // I32 [n_used, n_rows]
+    ggml_tensor * scales = nullptr; // F32 [1, n_used, n_rows]
+
+    const llama_adapter_lora_seq * loras_seq;
+
+    const bool    outputs;
+    const int32_t n_outputs;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -242,10 +262,24 @@ public:
     ggml_tensor * get_kq_mask()     const { return self_kq_mask_cnv; }
     ggml_tensor * get_kq_mask_swa() const { return self_kq_mask_swa_cnv; }
 
+    // register a view of the KV cache that the ubatch is stored into
+    // the view is moved to the current KV head in set_input(), so that the graph can be reused
+    void add_kv_store(ggml_tensor * view, ggml_tensor * cpy, size_t nb_cell);
+
     ggml_tensor * self_kq_mask         = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_cnv     = nullptr; //     [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
+    ggml_tensor * self_k_sink_shift    = nullptr; // I32 [n_sink_cells]
+
+    struct kv_store {
+        ggml_tensor * view;
+        ggml_tensor * cpy;
+
+        size_t nb_cell; // offset between two consecutive KV cells
+    };
+
+    std::vector<kv_store> kv_stores;
 
     const llama_hparams & hparams;
     const llama_cparams & cparams;
@@ -338,10 +372,11 @@ struct llm_graph_params {
     ggml_backend_sched * sched;
     ggml_backend * backend_cpu;
 
-    const llama_adapter_cvec  * cvec;
-    const llama_adapter_loras * loras;
-    const llama_memory_i      * memory;
-    const llama_cross         * cross;
+    const llama_adapter_cvec     * cvec;
+    const llama_adapter_loras    * loras;
+    const llama_adapter_lora_seq * loras_seq;
+    const llama_memory_i         * memory;
+    const llama_cross            * cross;
 
     int32_t n_outputs;
 
@@ -391,13 +426,18 @@ struct llm_graph_context {
 
     ggml_backend * backend_cpu; // TODO: needed by build_attn_mha, figure out a way to remove?
 
-    const llama_adapter_cvec  * cvec;
-    const llama_adapter_loras * loras;
-    const llama_memory_i      * memory;
-    const llama_cross         * cross;
+    const llama_adapter_cvec     * cvec;
+    const llama_adapter_loras    * loras;
+    const llama_adapter_lora_seq * loras_seq;
+    const llama_memory_i         * memory;
+    const llama_cross            * cross;
 
     const llm_graph_cb & cb_func;
 
+    // per-sequence LoRA inputs, created on first use (for all the tokens and for the outputs)
+    mutable llm_graph_input_lora_seq * inp_lora_seq     = nullptr;
+    mutable llm_graph_input_lora_seq * inp_lora_seq_out = nullptr;
+
     std::unique_ptr<llm_graph_result> res;
 
     llm_graph_context(const llm_graph_params & params);
@@ -419,6 +459,11 @@ struct llm_graph_context {
               ggml_tensor * w,
               ggml_tensor * cur) const;
 
+    // apply the per-sequence lora of w to the rows of cur (nullptr if w has no per-sequence lora)
+    ggml_tensor * build_lora_seq(
+              ggml_tensor * w,
+              ggml_tensor * cur) const;
+
     // do mat_mul_id, while optionally apply lora
     ggml_tensor * build_lora_mm_id(
               ggml_tensor * w,   // ggml_tensor * as
@@ -3,6 +3,7 @@
 #include "gguf.h"
 #include "llama.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <climits>
 #include <cstdarg>
@@ -25,6 +26,103 @@ time_meas::~time_meas() {
         }
     }
 
+llama_worker_pool::~llama_worker_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv_start.notify_all();
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+}
+
+void llama_worker_pool::parallel_for(size_t n, int32_t n_threads, const std::function<void(size_t)> & f) {
+    n_threads = (int32_t) std::min<size_t>(n, std::max(n_threads, 1));
+
+    std::unique_lock<std::mutex> lock_loop(mutex_loop, std::defer_lock);
+
+    if (n_threads <= 1 || !lock_loop.try_lock()) {
+        for (size_t i = 0; i < n; ++i) {
+            f(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        while ((int32_t) threads.size() < n_threads - 1) {
+            threads.emplace_back(&llama_worker_pool::worker, this, (int32_t) threads.size(), n_loops);
+        }
+
+        this->f   = &f;
+        n_items   = n;
+        next      = 0;
+        n_workers = n_threads - 1;
+        n_running = n_workers;
+        error     = nullptr;
+
+        n_loops++;
+    }
+    cv_start.notify_all();
+
+    run();
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&] { return n_running == 0; });
+
+        this->f = nullptr;
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void llama_worker_pool::worker(int32_t ith, uint64_t n_loops_done) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_start.wait(lock, [&] { return stop || n_loops != n_loops_done; });
+
+            if (stop) {
+                return;
+            }
+
+            n_loops_done = n_loops;
+
+            if (ith >= n_workers) {
+                continue;
+            }
+        }
+
+        run();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_running--;
+        }
+        cv_done.notify_one();
+    }
+}
+
+void llama_worker_pool::run() {
+    for (size_t i = next++; i < n_items; i = next++) {
+        try {
+            (*f)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_error);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = n_items;
+        }
+    }
+}
+
 void llama_log_set(ggml_log_callback log_callback, void * user_data) {
     ggml_log_set(log_callback, user_data);
     g_logger_state.log_callback = log_callback ? log_callback : llama_log_callback_default;
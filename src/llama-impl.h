@@ -2,7 +2,14 @@
 
 #include "ggml.h" // for ggml_log_level
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #ifdef __GNUC__
@@ -49,6 +56,46 @@ struct time_meas {
     int64_t & t_acc;
 };
 
+// persistent worker threads for the parallel loops that do not run in a graph (e.g. sampling, tokenization)
+// the threads are created on first use and wait for the next loop, instead of being spawned for each call
+struct llama_worker_pool {
+    llama_worker_pool() = default;
+    ~llama_worker_pool();
+
+    llama_worker_pool(const llama_worker_pool &) = delete;
+    llama_worker_pool & operator=(const llama_worker_pool &) = delete;
+
+    // call f(i) for i in [0, n) on up to n_threads threads, including the calling thread
+    // the first exception thrown by f is rethrown on the calling thread
+    // a loop started while another one is running on the pool runs on the calling thread only
+    void parallel_for(size_t n, int32_t n_threads, const std::function<void(size_t)> & f);
+
+private:
+    void worker(int32_t ith, uint64_t n_loops_done);
+    void run();
+
+    std::vector<std::thread> threads;
+
+    std::mutex mutex_loop; // one loop at a time
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    // current loop
+    const std::function<void(size_t)> * f = nullptr;
+
+    size_t              n_items   = 0;
+    std::atomic<size_t> next      {0};
+    int32_t             n_workers = 0; // number of threads of the pool used by the loop
+    int32_t             n_running = 0; // number of threads of the pool still running the loop
+    uint64_t            n_loops   = 0;
+    bool                stop      = false;
+
+    std::exception_ptr error;
+    std::mutex         mutex_error;
+};
+
 void replace_all(std::string & s, const std::string & search, const std::string & replace);
 
 // TODO: rename to llama_format ?
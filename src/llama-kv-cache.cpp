@@ -32,6 +32,18 @@ bool llama_kv_cache_unified::init(
     LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
             __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift);
 
+    n_sink   = 0;
+    n_window = 0;
+
+    if (cparams.n_kv_window > 0) {
+        if (!can_shift) {
+            LLAMA_LOG_WARN("%s: the streaming KV cache requires K-shift support -- disabled\n", __func__);
+        } else {
+            n_sink   = cparams.n_kv_sink;
+            n_window = cparams.n_kv_window;
+        }
+    }
+
     head = 0;
     size = kv_size;
     used = 0;
@@ -48,7 +60,7 @@ bool llama_kv_cache_unified::init(
         auto it = ctx_map.find(buft);
         if (it == ctx_map.end()) {
             ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*n_layer*ggml_tensor_overhead()),
+                /*.mem_size   =*/ size_t(3u*n_layer*ggml_tensor_overhead()),
                 /*.mem_buffer =*/ NULL,
                 /*.no_alloc   =*/ true,
             };
@@ -70,6 +82,8 @@ bool llama_kv_cache_unified::init(
     k_l.reserve(n_layer);
     v_l.reserve(n_layer);
 
+    n_seq_sink = n_window > 0 && n_sink > 0 ? cparams.n_seq_max : 0;
+
     for (int i = 0; i < n_layer; i++) {
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
@@ -101,6 +115,12 @@ bool llama_kv_cache_unified::init(
         ggml_format_name(v, "cache_v_l%d", i);
         k_l.push_back(k);
         v_l.push_back(v);
+
+        if (n_seq_sink > 0) {
+            ggml_tensor * k_sink = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd_k_gqa, n_sink*n_seq_sink);
+            ggml_format_name(k_sink, "cache_k_sink_l%d", i);
+            k_sink_l.push_back(k_sink);
+        }
     }
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
@@ -147,7 +167,11 @@ size_t llama_kv_cache_unified::total_size() const {
 llama_pos llama_kv_cache_unified::pos_max() const {
     llama_pos pos_max = -1;
     for (const auto & cell : cells) {
-        pos_max = std::max(pos_max, cell.pos);
+        if (!pos_base.empty() && !cell.is_empty()) {
+            pos_max = std::max(pos_max, cell.pos + seq_pos_base(*cell.seq_id.begin()));
+        } else {
+            pos_max = std::max(pos_max, cell.pos);
+        }
     }
 
     return pos_max;
@@ -163,6 +187,9 @@ void llama_kv_cache_unified::clear() {
     head = 0;
     used = 0;
 
+    pos_base.clear();
+    sink_pos.clear();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -171,6 +198,15 @@ void llama_kv_cache_unified::clear() {
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     uint32_t new_head = size;
 
+    seq_pos_to_cells(seq_id, p0, p1);
+
+    // the sinks might change - copy them again when they move
+    if (seq_id < 0) {
+        sink_pos.clear();
+    } else {
+        sink_pos.erase(seq_id);
+    }
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -238,6 +274,17 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    // the positions of a removed sequence start over
+    if (!pos_base.empty()) {
+        if (seq_id < 0) {
+            if (p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+                pos_base.clear();
+            }
+        } else if (pos_base.count(seq_id) && std::none_of(cells.begin(), cells.end(), [&](const llama_kv_cell & cell) { return cell.has_seq_id(seq_id); })) {
+            pos_base.erase(seq_id);
+        }
+    }
+
     return true;
 }
 
@@ -246,6 +293,10 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
         return;
     }
 
+    seq_pos_to_cells(seq_id_src, p0, p1);
+
+    sink_pos.erase(seq_id_dst);
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -290,6 +341,13 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             cells[i].seq_id.insert(seq_id_dst);
         }
     }
+
+    // note: the destination takes the positions of the source
+    if (pos_base.count(seq_id_src)) {
+        pos_base[seq_id_dst] = pos_base.at(seq_id_src);
+    } else {
+        pos_base.erase(seq_id_dst);
+    }
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
@@ -318,6 +376,12 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
         }
     }
 
+    for (auto * m : { &pos_base, &sink_pos }) {
+        for (auto it = m->begin(); it != m->end(); ) {
+            it = it->first == seq_id ? std::next(it) : m->erase(it);
+        }
+    }
+
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != size && new_head < head) {
         head = new_head;
@@ -331,6 +395,10 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
 
     uint32_t new_head = size;
 
+    seq_pos_to_cells(seq_id, p0, p1);
+
+    sink_pos.erase(seq_id);
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -387,6 +455,10 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    seq_pos_to_cells(seq_id, p0, p1);
+
+    sink_pos.erase(seq_id);
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -437,7 +509,7 @@ llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
         }
     }
 
-    return result;
+    return result + seq_pos_base(seq_id);
 }
 
 void llama_kv_cache_unified::defrag() {
@@ -478,6 +550,18 @@ void llama_kv_cache_unified::restore() {
     if (new_head != size && new_head < head) {
         head = new_head;
     }
+
+    // streaming policy: undo the evictions and the sink moves of the ubatches that were not computed
+    // the cells reused by their tokens have just been freed above
+    for (size_t i = pending.stream.size(); i > pending.n_stream_computed; --i) {
+        stream_undo(pending.stream[i - 1]);
+    }
+
+    pending.stream.clear();
+    pending.n_stream_computed = 0;
+
+    sink_moves.clear();
+    sink_shift.clear();
 }
 
 void llama_kv_cache_unified::commit() {
@@ -493,6 +577,12 @@ void llama_kv_cache_unified::commit() {
     }
 
     pending.ranges.clear();
+
+    pending.stream.clear();
+    pending.n_stream_computed = 0;
+
+    sink_moves.clear();
+    sink_shift.clear();
 }
 
 bool llama_kv_cache_unified::get_can_shift() const {
@@ -681,6 +771,15 @@ bool llama_kv_cache_unified::find_slot(
         return false;
     }
 
+    if (n_window > 0) {
+        sink_moves.clear();
+        sink_shift.clear();
+
+        pending.stream.emplace_back();
+
+        evict_window(ubatch);
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -705,6 +804,17 @@ bool llama_kv_cache_unified::find_slot(
         }
 
         if (n_tested >= size) {
+            // the evicted cells are not contiguous - keep evicting the oldest tokens until a slot is found
+            if (n_window > 0 && evict_oldest(ubatch)) {
+                n_tested = 0;
+                continue;
+            }
+
+            if (n_window > 0) {
+                stream_undo(pending.stream.back());
+                pending.stream.pop_back();
+            }
+
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
         }
@@ -725,6 +835,341 @@ bool llama_kv_cache_unified::find_slot(
 
     pending.ranges.push_back({head, head + n_tokens});
 
+    if (n_window > 0) {
+        prepare_sink_moves();
+    }
+
+    return true;
+}
+
+void llama_kv_cache_unified::ubatch_computed(uint32_t n_ahead) {
+    if (n_window > 0) {
+        GGML_ASSERT(pending.stream.size() >= n_ahead);
+
+        pending.n_stream_computed = pending.stream.size() - n_ahead;
+    }
+}
+
+void llama_kv_cache_unified::stream_rebase() {
+    struct seq_info {
+        llama_pos pos_min = std::numeric_limits<llama_pos>::max();
+        bool      shared  = false;
+    };
+
+    std::map<llama_seq_id, seq_info> seqs;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const llama_kv_cell & cell = cells[i];
+        if (cell.pos < 0) {
+            continue;
+        }
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            seq_info & info = seqs[seq_id];
+            info.pos_min = std::min(info.pos_min, cell.pos);
+            info.shared  = info.shared || cell.seq_id.size() > 1;
+        }
+    }
+
+    for (const auto & [seq_id, info] : seqs) {
+        // note: cells shared with other sequences would move for them too
+        if (info.shared || info.pos_min < (llama_pos) n_window) {
+            continue;
+        }
+
+        const llama_pos d = info.pos_min;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            if (cells[i].has_seq_id(seq_id)) {
+                cells[i].pos   -= d;
+                cells[i].delta -= d;
+            }
+        }
+
+        has_shift = true;
+
+        pos_base[seq_id] += d;
+
+        // note: the copy of the sinks keeps its rotation and its position, the next moves rotate from there
+
+        LLAMA_LOG_DEBUG("%s: rebased the positions of sequence %d by %d\n", __func__, seq_id, d);
+    }
+}
+
+llama_pos llama_kv_cache_unified::seq_pos_base(llama_seq_id seq_id) const {
+    const auto it = pos_base.find(seq_id);
+
+    return it == pos_base.end() ? 0 : it->second;
+}
+
+void llama_kv_cache_unified::seq_pos_to_cells(llama_seq_id seq_id, llama_pos & p0, llama_pos & p1) const {
+    if (seq_id < 0 || pos_base.empty()) {
+        return;
+    }
+
+    const llama_pos base = seq_pos_base(seq_id);
+
+    // negative positions keep their meaning (start and end of the sequence)
+    if (p0 > 0) {
+        p0 = std::max(0, p0 - base);
+    }
+
+    if (p1 >= 0) {
+        p1 = std::max(0, p1 - base);
+    }
+}
+
+void llama_kv_cache_unified::evict_cell(uint32_t idx, llama_seq_id seq_id) {
+    llama_kv_cell & cell = cells[idx];
+
+    pending.stream.back().evicted.push_back({ idx, seq_id, cell.pos });
+
+    cell.seq_id.erase(seq_id);
+
+    if (cell.is_empty()) {
+        used--;
+
+        cell.pos = -1;
+        cell.src = -1;
+
+        head = std::min(head, idx);
+    }
+}
+
+void llama_kv_cache_unified::stream_undo(const stream_changes & changes) {
+    for (const llama_seq_id seq_id : changes.copied) {
+        sink_pos.erase(seq_id);
+    }
+
+    for (auto it = changes.moved.rbegin(); it != changes.moved.rend(); ++it) {
+        cells[it->idx].pos = it->pos;
+    }
+
+    for (auto it = changes.evicted.rbegin(); it != changes.evicted.rend(); ++it) {
+        llama_kv_cell & cell = cells[it->idx];
+
+        if (cell.is_empty()) {
+            cell.pos = it->pos;
+            used++;
+        }
+
+        cell.seq_id.insert(it->seq_id);
+    }
+}
+
+namespace {
+
+// streaming policy: a sequence of the ubatch
+struct llama_stream_seq {
+    llama_seq_id seq_id;
+
+    llama_pos p_first; // positions of the new tokens
+    llama_pos p_last;
+
+    llama_pos p_sink = std::numeric_limits<llama_pos>::max(); // first position of the sinks (the oldest one in the cells)
+    llama_pos p_win  = std::numeric_limits<llama_pos>::max(); // oldest position left in the window
+};
+
+// the sequences of the ubatch, with the positions of their sinks
+std::vector<llama_stream_seq> llama_stream_seqs(const llama_ubatch & ubatch, const std::vector<llama_kv_cell> & cells) {
+    std::vector<llama_stream_seq> seqs;
+
+    const auto find = [&](llama_seq_id seq_id) -> llama_stream_seq * {
+        for (auto & seq : seqs) {
+            if (seq.seq_id == seq_id) {
+                return &seq;
+            }
+        }
+        return nullptr;
+    };
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        const llama_pos p0 = ubatch.pos[s*ubatch.n_seq_tokens];
+        const llama_pos p1 = ubatch.pos[s*ubatch.n_seq_tokens + ubatch.n_seq_tokens - 1];
+
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            llama_stream_seq * seq = find(ubatch.seq_id[s][j]);
+            if (seq == nullptr) {
+                seqs.push_back({ ubatch.seq_id[s][j], p0, p1 });
+            } else {
+                seq->p_first = std::min(seq->p_first, p0);
+                seq->p_last  = std::max(seq->p_last,  p1);
+            }
+        }
+    }
+
+    for (const auto & cell : cells) {
+        if (cell.pos < 0) {
+            continue;
+        }
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            llama_stream_seq * seq = find(seq_id);
+            if (seq != nullptr) {
+                seq->p_sink = std::min(seq->p_sink, cell.pos);
+            }
+        }
+    }
+
+    return seqs;
+}
+
+}
+
+void llama_kv_cache_unified::evict_window(const llama_ubatch & ubatch) {
+    auto seqs = llama_stream_seqs(ubatch, cells);
+
+    const auto find = [&](llama_seq_id seq_id) -> llama_stream_seq * {
+        for (auto & seq : seqs) {
+            if (seq.seq_id == seq_id) {
+                return &seq;
+            }
+        }
+        return nullptr;
+    };
+
+    // keep the n_sink oldest positions and the last n_window positions of each sequence
+    for (uint32_t i = 0; i < size; ++i) {
+        llama_kv_cell & cell = cells[i];
+
+        const llama_pos pos = cell.pos;
+        if (pos < 0) {
+            continue;
+        }
+
+        for (auto it = cell.seq_id.begin(); it != cell.seq_id.end(); ) {
+            llama_stream_seq * seq = find(*it++);
+            if (seq == nullptr || pos < seq->p_sink + (llama_pos) n_sink) {
+                continue;
+            }
+
+            if (pos <= seq->p_last - (llama_pos) n_window) {
+                evict_cell(i, seq->seq_id);
+            } else {
+                seq->p_win = std::min(seq->p_win, pos);
+            }
+        }
+    }
+
+    // move the sinks right before the window
+    for (const auto & seq : seqs) {
+        if (seq.p_sink == std::numeric_limits<llama_pos>::max()) {
+            continue;
+        }
+
+        const llama_pos p_sink_end = seq.p_sink + (llama_pos) n_sink;
+        const llama_pos delta      = std::min(seq.p_win, seq.p_first) - p_sink_end;
+
+        if (delta <= 0) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < size; ++i) {
+            llama_kv_cell & cell = cells[i];
+
+            // note: sinks shared between sequences are placed according to the first one
+            if (cell.pos < seq.p_sink || cell.pos >= p_sink_end || cell.is_empty() || *cell.seq_id.begin() != seq.seq_id) {
+                continue;
+            }
+
+            pending.stream.back().moved.push_back({ i, cell.pos });
+
+            cell.pos += delta;
+        }
+    }
+}
+
+void llama_kv_cache_unified::prepare_sink_moves() {
+    const auto & moved = pending.stream.back().moved;
+    if (moved.empty()) {
+        return;
+    }
+
+    // the moved cells of each sequence, with their position before the first move
+    std::map<llama_seq_id, std::vector<stream_moved>> seqs;
+
+    for (const auto & m : moved) {
+        auto & seq = seqs[*cells[m.idx].seq_id.begin()];
+        if (std::none_of(seq.begin(), seq.end(), [&](const stream_moved & other) { return other.idx == m.idx; })) {
+            seq.push_back(m);
+        }
+    }
+
+    for (auto & [seq_id, seq] : seqs) {
+        std::sort(seq.begin(), seq.end(), [](const stream_moved & a, const stream_moved & b) { return a.idx < b.idx; });
+
+        llama_pos p_old = std::numeric_limits<llama_pos>::max();
+        llama_pos p_new = std::numeric_limits<llama_pos>::max();
+
+        for (const auto & m : seq) {
+            p_old = std::min(p_old, m.pos);
+            p_new = std::min(p_new, cells[m.idx].pos);
+        }
+
+        int32_t row   = -1;
+        bool    copy  = false;
+        int32_t shift = p_new - p_old;
+
+        if ((uint32_t) seq_id < n_seq_sink) {
+            auto it = sink_pos.find(seq_id);
+            if (it == sink_pos.end()) {
+                // the cells still hold the sinks at their previous positions
+                it   = sink_pos.emplace(seq_id, p_old).first;
+                copy = true;
+
+                pending.stream.back().copied.push_back(seq_id);
+            }
+
+            row   = seq_id*n_sink;
+            shift = p_new - it->second;
+        }
+
+        // runs of consecutive cells with consecutive positions
+        for (size_t r0 = 0; r0 < seq.size(); ) {
+            size_t r1 = r0 + 1;
+            while (r1 < seq.size() && seq[r1].idx == seq[r1 - 1].idx + 1 && cells[seq[r1].idx].pos == cells[seq[r1 - 1].idx].pos + 1) {
+                r1++;
+            }
+
+            const uint32_t c0 = seq[r0].idx;
+
+            sink_moves.push_back({ c0, (uint32_t) (r1 - r0), row < 0 ? -1 : row + (cells[c0].pos - p_new), copy });
+            sink_shift.push_back(shift);
+
+            r0 = r1;
+        }
+    }
+}
+
+bool llama_kv_cache_unified::evict_oldest(const llama_ubatch & ubatch) {
+    const auto seqs = llama_stream_seqs(ubatch, cells);
+
+    uint32_t     idx_min    = size;
+    llama_seq_id seq_id_min = -1;
+    llama_pos    pos_min    = std::numeric_limits<llama_pos>::max();
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const llama_kv_cell & cell = cells[i];
+        if (cell.pos < 0 || cell.pos >= pos_min) {
+            continue;
+        }
+        for (const auto & seq : seqs) {
+            if (cell.pos >= seq.p_sink + (llama_pos) n_sink && cell.has_seq_id(seq.seq_id)) {
+                idx_min    = i;
+                seq_id_min = seq.seq_id;
+                pos_min    = cell.pos;
+                break;
+            }
+        }
+    }
+
+    if (seq_id_min < 0) {
+        return false;
+    }
+
+    evict_cell(idx_min, seq_id_min);
+
+    // move the sinks over the freed position
+    evict_window(ubatch);
+
     return true;
 }
 
@@ -938,6 +1383,24 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 
     state_write_meta(io, cell_ranges, seq_id);
     state_write_data(io, cell_ranges);
+
+    // streaming policy: the position offsets of the rebased sequences
+    {
+        std::vector<std::pair<llama_seq_id, llama_pos>> bases;
+        for (const auto & [id, base] : pos_base) {
+            if (seq_id == -1 || id == seq_id) {
+                bases.emplace_back(id, base);
+            }
+        }
+
+        const uint32_t n_base = bases.size();
+        io.write(&n_base, sizeof(n_base));
+
+        for (const auto & [id, base] : bases) {
+            io.write(&id,   sizeof(id));
+            io.write(&base, sizeof(base));
+        }
+    }
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
@@ -956,6 +1419,19 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
         }
         throw std::runtime_error("failed to restore kv cache");
     }
+
+    uint32_t n_base;
+    io.read_to(&n_base, sizeof(n_base));
+
+    for (uint32_t i = 0; i < n_base; ++i) {
+        llama_seq_id id;
+        llama_pos    base;
+
+        io.read_to(&id,   sizeof(id));
+        io.read_to(&base, sizeof(base));
+
+        pos_base[seq_id == -1 ? id : seq_id] = base;
+    }
 }
 
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
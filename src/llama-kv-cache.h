@@ -7,6 +7,7 @@
 #include "ggml-cpp.h"
 
 #include <functional>
+#include <map>
 #include <set>
 #include <vector>
 
@@ -117,8 +118,27 @@ public:
     // updates the cache head
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
+    // With the streaming policy, the tokens that leave the window of their sequence are evicted first and the
+    // attention sinks are moved right before the window (see sink_shift).
     bool find_slot(const llama_ubatch & batch);
 
+    // call after the graph of a ubatch has been computed - restore() then keeps the evictions and the sink moves
+    // that find_slot() made for it, because they are already reflected in the K data
+    // n_ahead is the number of slots found since then for the next ubatches
+    void ubatch_computed(uint32_t n_ahead = 0);
+
+    // streaming policy: rebase the positions of the sequences whose oldest position reached n_window
+    // the cells are moved back with a K-shift and the offset is kept in pos_base, so that the positions in the cells
+    // stay bounded while the positions of the sequence (as seen by the user) keep growing
+    // note: this is a periodic cost - every n_window tokens, the K of the n_sink + n_window cells of the sequence are
+    //       rotated again (one RoPE per cell and layer, i.e. one per token on average) and the next decode builds a
+    //       new graph; the K are stored rotated, so the positions cannot be bounded without rotating them
+    void stream_rebase();
+
+    // streaming policy: the position of the sequence that corresponds to position 0 in the cells
+    // the positions of the ubatches passed to find_slot() are positions in the cells
+    llama_pos seq_pos_base(llama_seq_id seq_id) const;
+
     // TODO: maybe not needed
     uint32_t get_padding(const llama_cparams & cparams) const;
 
@@ -144,11 +164,50 @@ public:
         uint32_t c1 = 0;
     };
 
+    // streaming policy: the cells changed by one find_slot() call, so that restore() can undo them
+    struct stream_evicted {
+        uint32_t     idx;
+        llama_seq_id seq_id;
+        llama_pos    pos;
+    };
+
+    struct stream_moved {
+        uint32_t  idx;
+        llama_pos pos; // position before the move
+    };
+
+    struct stream_changes {
+        std::vector<stream_evicted> evicted;
+        std::vector<stream_moved>   moved;
+        std::vector<llama_seq_id>   copied; // sequences whose sinks are copied to k_sink_l by the graph
+    };
+
     // pending cell updates that are not yet committed
     struct {
         std::vector<slot_range> ranges;
+
+        std::vector<stream_changes> stream; // one entry per find_slot() with the streaming policy
+        size_t n_stream_computed = 0;       // the first entries belong to ubatches that were computed
     } pending;
 
+    // streaming policy: the attention sinks moved by the last find_slot()
+    // the graph of the ubatch rewrites their K before the attention, rotated from the copy of their sequence in
+    // k_sink_l, so that the rounding errors do not accumulate over the moves
+    // the sinks of the sequences without a copy (seq_id >= n_seq_max) are rotated in place
+    struct sink_move {
+        uint32_t c0;   // first cell of the run
+        uint32_t n;    // number of consecutive cells
+        int32_t  row;  // first row in k_sink_l, -1 - rotate in place
+        bool     copy; // copy the cells to k_sink_l before the rotation
+
+        bool operator==(const sink_move & other) const {
+            return c0 == other.c0 && n == other.n && row == other.row && copy == other.copy;
+        }
+    };
+
+    std::vector<sink_move> sink_moves;
+    std::vector<int32_t>   sink_shift; // RoPE shift of each move
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const;
@@ -169,6 +228,18 @@ public:
     bool v_trans   = true;  // the value tensor is transposed
     bool can_shift = false;
 
+    // streaming policy - keep the first n_sink positions and the last n_window positions of each sequence
+    uint32_t n_sink   = 0;
+    uint32_t n_window = 0; // 0 - disabled
+
+    // streaming policy: non-zero position offsets of the rebased sequences (see seq_pos_base)
+    std::map<llama_seq_id, llama_pos> pos_base;
+
+    // streaming policy: the first position of the sinks copied to k_sink_l, for each sequence
+    std::map<llama_seq_id, llama_pos> sink_pos;
+
+    uint32_t n_seq_sink = 0; // number of sequences with rows in k_sink_l
+
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_impl also uses it, so it
     // cannot be freely changed after a slot has been allocated.
@@ -184,6 +255,8 @@ public:
     std::vector<ggml_tensor *> k_l; // per layer
     std::vector<ggml_tensor *> v_l;
 
+    std::vector<ggml_tensor *> k_sink_l; // per layer, F32 [n_embd_k_gqa, n_sink*n_seq_sink] (streaming policy)
+
 private:
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
@@ -196,6 +269,26 @@ private:
 
     bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
     bool state_read_data(llama_io_read_i & io, uint32_t cell_count);
+
+    // streaming policy: evict the tokens that leave the window of the sequences in the ubatch, then move their sinks
+    // right before the oldest token left in the window
+    void evict_window(const llama_ubatch & ubatch);
+
+    // streaming policy: evict the oldest token of the sequences in the ubatch that is not a sink
+    // returns false if there is nothing to evict
+    bool evict_oldest(const llama_ubatch & ubatch);
+
+    // streaming policy: remove a sequence from a cell and record it in the last pending.stream entry
+    void evict_cell(uint32_t idx, llama_seq_id seq_id);
+
+    // streaming policy: prepare sink_moves from the sinks moved by find_slot()
+    void prepare_sink_moves();
+
+    // streaming policy: undo the changes recorded by find_slot()
+    void stream_undo(const stream_changes & changes);
+
+    // translate a position range of a sequence to positions in the cells (for the seq_* calls)
+    void seq_pos_to_cells(llama_seq_id seq_id, llama_pos & p0, llama_pos & p1) const;
 };
 
 // TODO: temporary reusing llama_kv_cache_unified -- implement recurrent cache and simplify llama_kv_cache_unified
@@ -3,8 +3,10 @@
 #include "llama-impl.h"
 #include "llama-vocab.h"
 #include "llama-grammar.h"
+#include "llama-context.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cfloat>
 #include <chrono>
@@ -12,11 +14,16 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <functional>
 #include <numeric>
 #include <random>
 #include <unordered_map>
 #include <stdexcept>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 template<typename T>
 struct ring_buffer {
@@ -225,7 +232,13 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 }
 
-static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
+// scratch buffers of the bucket sort of top-k, kept by the samplers to avoid allocating them on each call
+struct llama_sampler_top_k_buf {
+    std::vector<int>              bucket_idx;
+    std::vector<llama_token_data> tokens;
+};
+
+static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k, llama_sampler_top_k_buf & buf) {
     // TODO: move bucket sort to separate function so that top_p/typical/softmax first is equally fast
     // if (k >= (int32_t)cur_p->size) {
     //     return;
@@ -251,8 +264,13 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
             constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
             constexpr float bucket_inter = -bucket_low * bucket_scale;
 
-            std::vector<int> bucket_idx(cur_p->size);
-            std::vector<int> histo(nbuckets, 0);
+            if (buf.bucket_idx.size() < cur_p->size) {
+                buf.bucket_idx.resize(cur_p->size);
+            }
+
+            int * bucket_idx = buf.bucket_idx.data();
+
+            std::array<int, nbuckets> histo {};
 
             for (int i = 0; i < (int)cur_p->size; ++i) {
                 const float val = cur_p->data[i].logit;
@@ -269,12 +287,16 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
                     break;
                 }
             }
-            std::vector<llama_token_data> tmp_tokens(nhave);
-            auto * ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
+            if (buf.tokens.size() < (size_t) nhave) {
+                buf.tokens.resize(nhave);
+            }
+
+            llama_token_data * tmp_tokens = buf.tokens.data();
+
+            auto * ptr = tmp_tokens;
+            std::array<llama_token_data *, nbuckets> bucket_ptrs;
             for (int j = nbuckets - 1; j >= ib; --j) {
-                bucket_ptrs.push_back(ptr);
+                bucket_ptrs[nbuckets - 1 - j] = ptr;
                 ptr += histo[j];
             }
             for (int i = 0; i < (int)cur_p->size; ++i) {
@@ -284,7 +306,7 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
                 }
             }
 
-            ptr = tmp_tokens.data();
+            ptr = tmp_tokens;
             int ndone = 0;
             for (int j = nbuckets - 1; j > ib; --j) {
                 std::sort(ptr, ptr + histo[j], comp);
@@ -293,7 +315,7 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
             }
             std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
 
-            std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
+            std::memcpy(cur_p->data, tmp_tokens, k*sizeof(llama_token_data));
 
         }
         cur_p->sorted = true;
@@ -376,34 +398,9 @@ void llama_sampler_free(struct llama_sampler * smpl) {
 }
 
 llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-
-    const int n_vocab = llama_vocab_n_tokens(vocab);
-
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-
-    llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
-        /* .selected   = */ -1,
-        /* .sorted     = */ false,
-    };
+    llama_token token = LLAMA_TOKEN_NULL;
 
-    llama_sampler_apply(smpl, &cur_p);
-
-    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
-
-    auto token = cur_p.data[cur_p.selected].id;
-
-    llama_sampler_accept(smpl, token);
+    llama_sampler_sample_batch(&smpl, ctx, &idx, &token, 1);
 
     return token;
 }
@@ -484,6 +481,7 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
         /* .ctx   = */ new llama_sampler_chain {
             /* .params      = */ params,
             /* .samplers    = */ {},
+            /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
         }
@@ -655,6 +653,8 @@ struct llama_sampler * llama_sampler_init_softmax() {
 
 struct llama_sampler_top_k {
     const int32_t k;
+
+    llama_sampler_top_k_buf buf;
 };
 
 static const char * llama_sampler_top_k_name(const struct llama_sampler * /*smpl*/) {
@@ -662,8 +662,8 @@ static const char * llama_sampler_top_k_name(const struct llama_sampler * /*smpl
 }
 
 static void llama_sampler_top_k_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
-    const auto * ctx = (llama_sampler_top_k *) smpl->ctx;
-    llama_sampler_top_k_impl(cur_p, ctx->k);
+    auto * ctx = (llama_sampler_top_k *) smpl->ctx;
+    llama_sampler_top_k_impl(cur_p, ctx->k, ctx->buf);
 }
 
 static struct llama_sampler * llama_sampler_top_k_clone(const struct llama_sampler * smpl) {
@@ -688,7 +688,8 @@ struct llama_sampler * llama_sampler_init_top_k(int32_t k) {
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_top_k_i,
         /* .ctx   = */ new llama_sampler_top_k {
-            /* .k = */ k,
+            /* .k   = */ k,
+            /* .buf = */ {},
         }
     );
 }
@@ -1221,6 +1222,8 @@ struct llama_sampler_mirostat {
     float mu;
 
     std::mt19937 rng;
+
+    llama_sampler_top_k_buf buf;
 };
 
 static const char * llama_sampler_mirostat_name(const struct llama_sampler * /*smpl*/) {
@@ -1248,7 +1251,7 @@ static void llama_sampler_mirostat_apply(struct llama_sampler * smpl, llama_toke
     float epsilon_hat = s_hat - 1;
     float k = powf((epsilon_hat * powf(2, ctx->mu)) / (1 - powf(ctx->n_vocab, -epsilon_hat)), 1 / s_hat);
 
-    llama_sampler_top_k_impl(cur_p, std::max(int(k), 1));
+    llama_sampler_top_k_impl(cur_p, std::max(int(k), 1), ctx->buf);
     llama_sampler_softmax_impl(cur_p);
 
     const int idx = llama_sample_dist(cur_p, ctx->rng);
@@ -1310,6 +1313,7 @@ struct llama_sampler * llama_sampler_init_mirostat(int32_t n_vocab, uint32_t see
             /* .m        = */ m,
             /* .mu       = */ 2.0f*tau,
             /* .rng      = */ std::mt19937(seed_cur),
+            /* .buf      = */ {},
         }
     );
 }
@@ -1607,8 +1611,47 @@ struct llama_sampler_penalties {
 
     ring_buffer<llama_token> prev;
 
-    // a frequency map to count token occurrences
-    std::unordered_map<llama_token, int> token_count;
+    // number of occurrences of each token in the window, indexed by token id (grown on demand)
+    std::vector<int32_t> token_count;
+
+    // the tokens with a non-zero count, and the position of each token in this list (-1 if absent)
+    std::vector<llama_token> active;
+    std::vector<int32_t>     active_pos;
+
+    void count_add(llama_token token) {
+        if (token < 0) {
+            return;
+        }
+
+        if ((size_t) token >= token_count.size()) {
+            token_count.resize(token + 1, 0);
+            active_pos .resize(token + 1, -1);
+        }
+
+        if (token_count[token]++ == 0) {
+            active_pos[token] = active.size();
+            active.push_back(token);
+        }
+    }
+
+    void count_sub(llama_token token) {
+        if (token < 0) {
+            return;
+        }
+
+        assert((size_t) token < token_count.size() && token_count[token] > 0);
+
+        if (--token_count[token] == 0) {
+            // swap-remove from the active list
+            const int32_t pos = active_pos[token];
+
+            active[pos] = active.back();
+            active_pos[active[pos]] = pos;
+            active.pop_back();
+
+            active_pos[token] = -1;
+        }
+    }
 };
 
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
@@ -1621,23 +1664,18 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
-    ctx->token_count[token]++;
+    ctx->count_add(token);
 
     // if the ring buffer is full, remove the oldest token
     if (ctx->prev.size() >= (size_t) ctx->penalty_last_n) {
-        const auto old = ctx->prev.front();
-
-        ctx->token_count[old]--;
-        if (ctx->token_count[old] == 0) {
-            ctx->token_count.erase(old);
-        }
+        ctx->count_sub(ctx->prev.front());
     }
 
     ctx->prev.push_back(token);
 
 #if 0
     // sanity check
-    std::unordered_map<llama_token, int> tmp;
+    std::vector<int32_t> tmp(ctx->token_count.size(), 0);
     for (int i = 0; i < std::min<int>(ctx->penalty_last_n, ctx->prev.size()); ++i) {
         tmp[ctx->prev.rat(i)]++;
     }
@@ -1646,6 +1684,20 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
 #endif
 }
 
+static void llama_sampler_penalties_apply_one(const llama_sampler_penalties * ctx, llama_token_data & cur, int count) {
+    assert(count > 0 && count <= ctx->penalty_last_n);
+
+    // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+    // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+    if (cur.logit <= 0) {
+        cur.logit *= ctx->penalty_repeat;
+    } else {
+        cur.logit /= ctx->penalty_repeat;
+    }
+
+    cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+}
+
 static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
 
@@ -1654,26 +1706,33 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
+    if (ctx->active.empty()) {
+        return;
+    }
 
-        assert(count > 0 && count <= ctx->penalty_last_n);
+    // fast path: the candidates are laid out by token id (e.g. the full vocab straight from the logits),
+    //            so only the tokens in the window have to be visited
+    bool by_id = ctx->active.size() < cur_p->size;
+    for (size_t i = 0; i < ctx->active.size() && by_id; ++i) {
+        const llama_token token = ctx->active[i];
+        by_id = (size_t) token < cur_p->size && cur_p->data[token].id == token;
+    }
 
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
-        } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+    if (by_id) {
+        for (const llama_token token : ctx->active) {
+            llama_sampler_penalties_apply_one(ctx, cur_p->data[token], ctx->token_count[token]);
         }
+    } else {
+        const size_t n_count = ctx->token_count.size();
+
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+            if (id < 0 || (size_t) id >= n_count || ctx->token_count[id] == 0) {
+                continue;
+            }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+            llama_sampler_penalties_apply_one(ctx, cur_p->data[i], ctx->token_count[id]);
+        }
     }
 
     cur_p->sorted = false;
@@ -1683,6 +1742,8 @@ static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
     ctx->prev.clear();
     ctx->token_count.clear();
+    ctx->active.clear();
+    ctx->active_pos.clear();
 }
 
 static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_sampler * smpl) {
@@ -1697,7 +1758,10 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
+        result_ctx->active      = ctx->active;
+        result_ctx->active_pos  = ctx->active_pos;
     }
 
     return result;
@@ -1732,6 +1796,8 @@ struct llama_sampler * llama_sampler_init_penalties(
             /* .penalty_present = */ penalty_present,
             /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
             /* .token_count     = */ {},
+            /* .active          = */ {},
+            /* .active_pos      = */ {},
         }
     );
 }
@@ -2499,6 +2565,438 @@ struct llama_sampler * llama_sampler_init_infill(const struct llama_vocab * voca
     );
 }
 
+// sampling from the logits
+
+// the candidates are filled with plain indexed stores into a presized buffer, which the compiler can vectorize
+static void llama_token_data_fill(llama_token_data * data, const float * logits, int32_t n) {
+    for (int32_t i = 0; i < n; ++i) {
+        data[i].id    = i;
+        data[i].logit = logits[i];
+        data[i].p     = 0.0f;
+    }
+}
+
+// the generic loops below are written so that the compiler vectorizes them for the target ISA (SSE, NEON) without -ffast-math
+// on x86-64, libllama is usually built for the baseline ISA, so AVX2 variants are selected at runtime
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LLAMA_LOGITS_AVX2
+
+static bool llama_logits_has_avx2() {
+    static const bool has_avx2 = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+
+    return has_avx2;
+}
+
+__attribute__((target("avx2")))
+static float llama_logits_max_avx2(const float * logits, int32_t n) {
+    __m256 mx = _mm256_set1_ps(-INFINITY);
+
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        mx = _mm256_max_ps(mx, _mm256_loadu_ps(logits + i));
+    }
+
+    float tmp[8];
+    _mm256_storeu_ps(tmp, mx);
+
+    float res = tmp[0];
+    for (int32_t j = 1; j < 8; ++j) {
+        res = std::max(res, tmp[j]);
+    }
+    for (; i < n; ++i) {
+        res = std::max(res, logits[i]);
+    }
+
+    return res;
+}
+
+__attribute__((target("avx2")))
+static size_t llama_logits_select_ge_avx2(const float * logits, int32_t n, float thr, llama_token_data * out) {
+    const __m256 vthr = _mm256_set1_ps(thr);
+
+    size_t n_out = 0;
+
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const uint32_t m0 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i +  0), vthr, _CMP_GE_OQ));
+        const uint32_t m1 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i +  8), vthr, _CMP_GE_OQ));
+        const uint32_t m2 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i + 16), vthr, _CMP_GE_OQ));
+        const uint32_t m3 = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i + 24), vthr, _CMP_GE_OQ));
+
+        for (uint32_t mask = m0 | (m1 << 8) | (m2 << 16) | (m3 << 24); mask != 0; mask &= mask - 1) {
+            const int32_t j = i + __builtin_ctz(mask);
+            out[n_out++] = llama_token_data{j, logits[j], 0.0f};
+        }
+    }
+    for (; i < n; ++i) {
+        if (logits[i] >= thr) {
+            out[n_out++] = llama_token_data{i, logits[i], 0.0f};
+        }
+    }
+
+    return n_out;
+}
+#endif
+
+static float llama_logits_max(const float * logits, int32_t n) {
+#ifdef LLAMA_LOGITS_AVX2
+    if (llama_logits_has_avx2()) {
+        return llama_logits_max_avx2(logits, n);
+    }
+#endif
+
+    constexpr int32_t n_lanes = 8;
+
+    float mx[n_lanes];
+    for (int32_t j = 0; j < n_lanes; ++j) {
+        mx[j] = -INFINITY;
+    }
+
+    int32_t i = 0;
+    for (; i + n_lanes <= n; i += n_lanes) {
+        for (int32_t j = 0; j < n_lanes; ++j) {
+            mx[j] = logits[i + j] > mx[j] ? logits[i + j] : mx[j];
+        }
+    }
+    for (; i < n; ++i) {
+        mx[0] = logits[i] > mx[0] ? logits[i] : mx[0];
+    }
+
+    float res = mx[0];
+    for (int32_t j = 1; j < n_lanes; ++j) {
+        res = std::max(res, mx[j]);
+    }
+
+    return res;
+}
+
+// copy the logits >= thr to out, in the order of the vocabulary
+// the blocks without any such logit are skipped with a vectorized count
+static size_t llama_logits_select_ge(const float * logits, int32_t n, float thr, llama_token_data * out) {
+#ifdef LLAMA_LOGITS_AVX2
+    if (llama_logits_has_avx2()) {
+        return llama_logits_select_ge_avx2(logits, n, thr, out);
+    }
+#endif
+
+    constexpr int32_t n_block = 64;
+
+    size_t n_out = 0;
+
+    for (int32_t i0 = 0; i0 < n; i0 += n_block) {
+        const int32_t i1 = std::min(i0 + n_block, n);
+
+        int32_t cnt = 0;
+        for (int32_t i = i0; i < i1; ++i) {
+            cnt += logits[i] >= thr;
+        }
+
+        if (cnt == 0) {
+            continue;
+        }
+
+        for (int32_t i = i0; i < i1; ++i) {
+            if (logits[i] >= thr) {
+                out[n_out++] = llama_token_data{i, logits[i], 0.0f};
+            }
+        }
+    }
+
+    return n_out;
+}
+
+// top-k on the logits: equivalent to filling the candidates and applying llama_sampler_top_k_impl
+// the threshold of the k-th logit is estimated from a strided probe of the logits, so that only the logits above it are
+// selected and sorted - returns false if the vocabulary or k are not suited for this, the candidates are then not set
+static bool llama_logits_top_k(const float * logits, int32_t n, int32_t k, llama_token_data_array * cur_p) {
+    constexpr int32_t n_probe = 1024;
+
+    if (k <= 0 || n < 8*n_probe || k > n/64) {
+        return false;
+    }
+
+    const int32_t stride = n/n_probe;
+
+    std::array<float, n_probe> probe;
+    for (int32_t j = 0; j < n_probe; ++j) {
+        probe[j] = logits[j*stride];
+    }
+
+    // expected number of logits above the r-th largest probe: r*stride
+    int32_t r = k/stride + 4;
+
+    while (r < n_probe) {
+        std::nth_element(probe.begin(), probe.begin() + r, probe.end(), std::greater<float>());
+
+        const size_t n_sel = llama_logits_select_ge(logits, n, probe[r], cur_p->data);
+
+        if (n_sel >= (size_t) k) {
+            auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+                return a.logit > b.logit;
+            };
+
+            std::nth_element(cur_p->data, cur_p->data + k - 1, cur_p->data + n_sel, comp);
+            std::sort(cur_p->data, cur_p->data + k, comp);
+
+            cur_p->size   = k;
+            cur_p->sorted = true;
+
+            return true;
+        }
+
+        // unlucky probe - lower the threshold
+        r *= 4;
+    }
+
+    return false;
+}
+
+// min-p on the logits: equivalent to filling the candidates and applying the unsorted min-p
+static bool llama_logits_min_p(const float * logits, int32_t n, float p, size_t min_keep, llama_token_data_array * cur_p) {
+    const float min_logit = llama_logits_max(logits, n) + logf(p);
+
+    const size_t n_sel = llama_logits_select_ge(logits, n, min_logit, cur_p->data);
+
+    if (n_sel < min_keep) {
+        return false;
+    }
+
+    cur_p->size   = n_sel;
+    cur_p->sorted = false;
+
+    return true;
+}
+
+// samplers that leave the candidates unchanged, given their parameters
+static bool llama_sampler_is_noop(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_logit_bias_i) {
+        return ((const llama_sampler_logit_bias *) smpl->ctx)->logit_bias.empty();
+    }
+
+    if (smpl->iface == &llama_sampler_penalties_i) {
+        const auto * ctx = (const llama_sampler_penalties *) smpl->ctx;
+        return ctx->penalty_last_n == 0 || (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f);
+    }
+
+    if (smpl->iface == &llama_sampler_dry_i) {
+        const auto * ctx = (const llama_sampler_dry *) smpl->ctx;
+        return ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0;
+    }
+
+    if (smpl->iface == &llama_sampler_typical_i) {
+        return ((const llama_sampler_typical *) smpl->ctx)->p >= 1.0f;
+    }
+
+    if (smpl->iface == &llama_sampler_top_p_i) {
+        return ((const llama_sampler_top_p *) smpl->ctx)->p >= 1.0f;
+    }
+
+    if (smpl->iface == &llama_sampler_min_p_i) {
+        return ((const llama_sampler_min_p *) smpl->ctx)->p <= 0.0f;
+    }
+
+    return false;
+}
+
+// apply the first samplers of the chain directly on the logits
+// returns the number of applied samplers, or -1 if the candidates of the full vocabulary are needed
+static int32_t llama_sampler_chain_apply_logits(const llama_sampler_chain * chain, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    const int32_t n_samplers = chain->samplers.size();
+
+    for (int32_t i = 0; i < n_samplers; ++i) {
+        const auto * smpl = chain->samplers[i];
+
+        if (llama_sampler_is_noop(smpl)) {
+            continue;
+        }
+
+        if (smpl->iface == &llama_sampler_top_k_i) {
+            const auto * ctx = (const llama_sampler_top_k *) smpl->ctx;
+            return llama_logits_top_k(logits, n_vocab, ctx->k, cur_p) ? i + 1 : -1;
+        }
+
+        if (smpl->iface == &llama_sampler_min_p_i) {
+            const auto * ctx = (const llama_sampler_min_p *) smpl->ctx;
+            return llama_logits_min_p(logits, n_vocab, ctx->p, ctx->min_keep, cur_p) ? i + 1 : -1;
+        }
+
+        break;
+    }
+
+    return -1;
+}
+
+void llama_sampler_apply_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    cur_p->selected = -1;
+
+    if (smpl->iface == &llama_sampler_chain_i) {
+        auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+        time_meas tm(chain->t_sample_us, chain->params.no_perf);
+
+        const int32_t i0 = llama_sampler_chain_apply_logits(chain, logits, n_vocab, cur_p);
+        if (i0 >= 0) {
+            for (size_t i = i0; i < chain->samplers.size(); ++i) {
+                llama_sampler_apply(chain->samplers[i], cur_p);
+            }
+
+            return;
+        }
+    }
+
+    llama_token_data_fill(cur_p->data, logits, n_vocab);
+
+    cur_p->size   = n_vocab;
+    cur_p->sorted = false;
+
+    llama_sampler_apply(smpl, cur_p);
+}
+
+// the first maximum, as selected by the greedy sampler
+static int32_t llama_logits_argmax(const float * logits, int32_t n) {
+    const float max_logit = llama_logits_max(logits, n);
+
+    for (int32_t i = 0; i < n; ++i) {
+        if (logits[i] == max_logit) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+// samplers that only select the most likely token
+static bool llama_sampler_is_greedy(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_greedy_i) {
+        return true;
+    }
+
+    if (smpl->iface == &llama_sampler_chain_i) {
+        const auto * chain = (const llama_sampler_chain *) smpl->ctx;
+
+        if (chain->samplers.empty() || chain->samplers.back()->iface != &llama_sampler_greedy_i) {
+            return false;
+        }
+
+        for (size_t i = 0; i + 1 < chain->samplers.size(); ++i) {
+            if (!llama_sampler_is_noop(chain->samplers[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// a chain keeps the candidates buffer between the calls, other samplers use a temporary one
+static std::vector<llama_token_data> & llama_sampler_cur(struct llama_sampler * smpl, std::vector<llama_token_data> & cur_tmp, size_t n) {
+    auto & cur = smpl->iface == &llama_sampler_chain_i ? ((llama_sampler_chain *) smpl->ctx)->cur : cur_tmp;
+
+    if (cur.size() < n) {
+        cur.resize(n);
+    }
+
+    return cur;
+}
+
+llama_token llama_sampler_sample_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab) {
+    if (llama_sampler_is_greedy(smpl)) {
+        const llama_token token = llama_logits_argmax(logits, n_vocab);
+
+        llama_sampler_accept(smpl, token);
+
+        return token;
+    }
+
+    std::vector<llama_token_data> cur_tmp;
+
+    auto & cur = llama_sampler_cur(smpl, cur_tmp, n_vocab);
+
+    llama_token_data_array cur_p = {
+        /* .data       = */ cur.data(),
+        /* .size       = */ 0,
+        /* .selected   = */ -1,
+        /* .sorted     = */ false,
+    };
+
+    llama_sampler_apply_logits(smpl, logits, n_vocab, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+// sample from the k candidates of the top-k logits output
+static llama_token llama_sampler_sample_top_k(struct llama_sampler * smpl, const llama_token_data * top, int32_t k) {
+    std::vector<llama_token_data> cur_tmp;
+
+    auto & cur = llama_sampler_cur(smpl, cur_tmp, k);
+
+    std::copy(top, top + k, cur.begin());
+
+    llama_token_data_array cur_p = {
+        /* .data       = */ cur.data(),
+        /* .size       = */ (size_t) k,
+        /* .selected   = */ -1,
+        /* .sorted     = */ true,
+    };
+
+    llama_sampler_apply(smpl, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+void llama_sampler_sample_batch(struct llama_sampler ** smpls, struct llama_context * ctx, const int32_t * idxs, llama_token * tokens, int32_t n) {
+    if (n <= 0) {
+        return;
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const int32_t k       = ctx->n_logits_top_k();
+
+    // the outputs are looked up (and the context synchronized) on the calling thread, the workers only read them
+    std::vector<const float *>            logits(n, nullptr);
+    std::vector<const llama_token_data *> top   (n, nullptr);
+
+    for (int32_t i = 0; i < n; ++i) {
+        if (k > 0) {
+            top[i] = llama_get_logits_top_k_ith(ctx, idxs[i]);
+            GGML_ASSERT(top[i] != nullptr);
+        } else {
+            logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+            GGML_ASSERT(logits[i] != nullptr);
+        }
+    }
+
+    const auto sample = [&](size_t i) {
+        tokens[i] = k > 0 ? llama_sampler_sample_top_k  (smpls[i], top[i], k)
+                          : llama_sampler_sample_logits(smpls[i], logits[i], n_vocab);
+    };
+
+    if (n == 1) {
+        sample(0);
+        return;
+    }
+
+    ctx->parallel_for(n, sample);
+}
+
 // utils
 
 uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
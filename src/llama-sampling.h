@@ -16,6 +16,9 @@ struct llama_sampler_chain {
 
     std::vector<struct llama_sampler *> samplers;
 
+    // candidates of llama_sampler_sample, reused across the calls
+    std::vector<llama_token_data> cur;
+
     // timing
 
     mutable int64_t t_sample_us;
@@ -23,6 +26,9 @@ struct llama_sampler_chain {
     mutable int32_t n_sample;
 };
 
+// sample a token from the logits of all the tokens of the vocabulary (used by llama_sampler_sample)
+llama_token llama_sampler_sample_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab);
+
 struct llama_sampler * llama_sampler_init_dry_testing(
                          int32_t   context_size,
                            float   dry_multiplier,
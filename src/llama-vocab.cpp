@@ -1,20 +1,25 @@
 #include "llama-vocab.h"
 
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-model-loader.h"
 
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 #include <cctype>
 
@@ -268,9 +273,71 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    int32_t left_id; // symbol ids at the time the bigram was queued
+    int32_t right_id;
+    int32_t id;      // symbol id of the merge result
     int rank;
-    size_t size;
+};
+
+// LRU cache of the tokens of the pre-tokenized words
+// sharded by the word hash so that concurrent sessions rarely contend for the same lock
+struct llm_tokenizer_bpe_cache {
+    static constexpr size_t n_shards       = 16;
+    static constexpr size_t n_words_shard  = 4096;
+    static constexpr size_t max_word_len   = 128;
+
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        if (word.size() > max_word_len) {
+            return false;
+        }
+
+        auto & shard = shards[std::hash<std::string>{}(word) % n_shards];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.map.find(word);
+        if (it == shard.map.end()) {
+            return false;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (word.size() > max_word_len) {
+            return;
+        }
+
+        auto & shard = shards[std::hash<std::string>{}(word) % n_shards];
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.map.find(word) != shard.map.end()) {
+            return;
+        }
+
+        if (shard.lru.size() >= n_words_shard) {
+            shard.map.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+
+        shard.lru.emplace_front(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+        shard.map.emplace(word, shard.lru.begin());
+    }
+
+private:
+    using entry = std::pair<std::string, std::vector<llama_token>>;
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> lru;
+        std::unordered_map<std::string, std::list<entry>::iterator> map;
+    };
+
+    std::array<shard, n_shards> shards;
 };
 
 struct llm_tokenizer_bpe : llm_tokenizer {
@@ -425,9 +492,110 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        // the pre-tokenizers whose regexes start a word at a space followed by a letter, and never match a letter
+        // together with the space after it - a long text can be tokenized in chunks split at such a space
+        // note: SuperBPE splits only digits, so its words (and merges) span the spaces
+        switch (vocab.get_pre_type()) {
+            case LLAMA_VOCAB_PRE_TYPE_DEFAULT:
+            case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
+            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
+            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
+            case LLAMA_VOCAB_PRE_TYPE_FALCON:
+            case LLAMA_VOCAB_PRE_TYPE_MPT:
+            case LLAMA_VOCAB_PRE_TYPE_STARCODER:
+            case LLAMA_VOCAB_PRE_TYPE_GPT2:
+            case LLAMA_VOCAB_PRE_TYPE_REFACT:
+            case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
+            case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
+            case LLAMA_VOCAB_PRE_TYPE_QWEN2:
+            case LLAMA_VOCAB_PRE_TYPE_OLMO:
+            case LLAMA_VOCAB_PRE_TYPE_DBRX:
+            case LLAMA_VOCAB_PRE_TYPE_SMAUG:
+            case LLAMA_VOCAB_PRE_TYPE_PORO:
+            case LLAMA_VOCAB_PRE_TYPE_CHATGLM3:
+            case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
+            case LLAMA_VOCAB_PRE_TYPE_VIKING:
+            case LLAMA_VOCAB_PRE_TYPE_JAIS:
+            case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
+            case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
+            case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
+            case LLAMA_VOCAB_PRE_TYPE_BLOOM:
+            case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
+            case LLAMA_VOCAB_PRE_TYPE_EXAONE:
+            case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
+            case LLAMA_VOCAB_PRE_TYPE_MINERVA:
+            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
+            case LLAMA_VOCAB_PRE_TYPE_GPT4O:
+            case LLAMA_VOCAB_PRE_TYPE_TRILLION:
+            case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
+                can_split = true;
+                break;
+            default:
+                can_split = false;
+                break;
+        }
+
+        // integer form of the merges, so that the session does not build strings for each bigram
+        // the texts that take part in a merge but are not tokens get ids past the vocab
+        n_vocab = vocab.n_tokens();
+
+        const auto bpe_merges = vocab.get_bpe_merges();
+        for (size_t rank = 0; rank < bpe_merges.size(); ++rank) {
+            const auto & left  = bpe_merges[rank].first;
+            const auto & right = bpe_merges[rank].second;
+            if (left.empty() || right.empty()) {
+                continue;
+            }
+
+            const uint64_t key = (uint64_t) add_symbol(vocab, left) << 32 | (uint32_t) add_symbol(vocab, right);
+
+            merges.emplace(key, std::make_pair((int) rank, add_symbol(vocab, left + right)));
+        }
+    }
+
+    // id of a symbol text: a token id, an id past the vocab, or -1 if the text is not part of any merge
+    int32_t find_symbol(const llama_vocab & vocab, const std::string & text) const {
+        const llama_token id = vocab.text_to_token(text);
+        if (id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
+        const auto it = symbol_ids.find(text);
+        return it == symbol_ids.end() ? -1 : it->second;
+    }
+
+    // (rank, merged id) of the merge of two symbols, or (-1, -1)
+    std::pair<int, int32_t> find_merge(int32_t left_id, int32_t right_id) const {
+        if (left_id < 0 || right_id < 0) {
+            return { -1, -1 };
+        }
+        const auto it = merges.find((uint64_t) left_id << 32 | (uint32_t) right_id);
+        return it == merges.end() ? std::make_pair(-1, (int32_t) -1) : it->second;
     }
 
     std::vector<std::string> regex_exprs;
+
+    // true if a long text can be tokenized in chunks split at a space between two letters (see tokenize_parallel)
+    bool can_split = false;
+
+    int32_t n_vocab = 0;
+
+    // (left id << 32 | right id) -> (rank, merged id)
+    std::unordered_map<uint64_t, std::pair<int, int32_t>> merges;
+
+    // ids of the merge texts that are not tokens
+    std::unordered_map<std::string, int32_t> symbol_ids;
+
+    mutable llm_tokenizer_bpe_cache cache;
+
+private:
+    int32_t add_symbol(const llama_vocab & vocab, const std::string & text) {
+        const int32_t id = find_symbol(vocab, text);
+        if (id >= 0) {
+            return id;
+        }
+        return symbol_ids.emplace(text, n_vocab + (int32_t) symbol_ids.size()).first->second;
+    }
 };
 
 struct llm_tokenizer_bpe_session {
@@ -471,133 +639,167 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (tokenizer.cache.get(word, output)) {
+                continue;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            const size_t n_output = output.size();
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+            tokenize_word(word, output);
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+            tokenizer.cache.put(word, output.data() + n_output, output.size() - n_output);
+        }
+    }
+
+    // chunks of at least this size are tokenized in parallel by tokenize_parallel()
+    static constexpr size_t n_chunk_min = 16*1024;
+
+    // tokenize a long text in chunks on n_threads threads of the pool
+    // the chunks are split on a space between two ASCII letters: for the pre-tokenizers with can_split, no regex
+    // matches a letter together with the space after it, so each split point is a word boundary of the whole text
+    // and the result is the same
+    void tokenize_parallel(const std::string & text, std::vector<llama_token> & output, int32_t n_threads, llama_worker_pool & workers) {
+        const auto is_alpha = [](char c) {
+            return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+        };
+
+        // a few chunks per thread to balance the load
+        const size_t n_chunk = std::max(n_chunk_min, text.size() / (4*n_threads));
+
+        std::vector<size_t> bounds = { 0 };
+        for (size_t pos = n_chunk; pos + 1 < text.size(); ) {
+            if (text[pos] == ' ' && is_alpha(text[pos - 1]) && is_alpha(text[pos + 1])) {
+                bounds.push_back(pos);
+                pos += n_chunk;
+            } else {
+                pos++;
             }
+        }
+        bounds.push_back(text.size());
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        const size_t n_chunks = bounds.size() - 1;
+        if (n_threads <= 1 || n_chunks == 1) {
+            tokenize(text, output);
+            return;
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        std::vector<std::vector<llama_token>> results(n_chunks);
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        workers.parallel_for(n_chunks, n_threads, [&](size_t i) {
+            llm_tokenizer_bpe_session session(vocab, tokenizer);
+            session.tokenize(text.substr(bounds[i], bounds[i + 1] - bounds[i]), results[i]);
+        });
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        for (const auto & res : results) {
+            output.insert(output.end(), res.begin(), res.end());
+        }
+    }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
+
+        int index = 0;
+        size_t offset = 0;
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            symbol_ids.push_back(vocab.text_to_token(word));
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(tokenizer.find_symbol(vocab, std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            if (symbol_ids[bigram.left] != bigram.left_id || symbol_ids[bigram.right] != bigram.right_id) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
+
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
+        if (symbols.empty()) {
+            return;
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (int i = 0; i != -1; i = symbols[i].next) {
+            const auto & symbol = symbols[i];
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            if (symbol_ids[i] >= 0 && symbol_ids[i] < tokenizer.n_vocab) {
+                output.push_back(symbol_ids[i]);
+                continue;
+            }
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
-                    }
-                } else {
-                    output.push_back(token);
+            for (size_t j = 0; j < symbol.n; ++j) {
+                std::string byte_str(1, symbol.text[j]);
+                auto token_multibyte = vocab.text_to_token(byte_str);
+                if (token_multibyte != LLAMA_TOKEN_NULL) {
+                    output.push_back(token_multibyte);
                 }
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        const auto merge = tokenizer.find_merge(symbol_ids[left], symbol_ids[right]);
 
-        if (rank_found < 0) {
+        if (merge.first < 0) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left     = left;
+        bigram.right    = right;
+        bigram.left_id  = symbol_ids[left];
+        bigram.right_id = symbol_ids[right];
+        bigram.id       = merge.second;
+        bigram.rank     = merge.first;
 
         work_queue.push(bigram);
     }
@@ -606,7 +808,7 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<int32_t> symbol_ids;
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1267,7 +1469,15 @@ struct llama_vocab::impl {
     std::vector<token_data>                      id_to_token;
 
     std::vector<llama_token> cache_special_tokens;
-    std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+    // llama_token_to_piece(special = true) of all the tokens, stored back to back with a terminating 0 after each piece
+    std::string           cache_piece_data;
+    std::vector<uint32_t> cache_piece_offs; // n_tokens + 1 offsets into cache_piece_data
+
+    std::once_flag     grammar_trie_once;
+    llama_grammar_trie grammar_trie;
+
+    // worker threads of tokenize_batch() and of the tokenization of long texts
+    mutable llama_worker_pool workers;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1318,7 +1528,8 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads = 1) const;
 
     int32_t tokenize(
                    const char * text,
@@ -1337,7 +1548,7 @@ struct llama_vocab::impl {
                          bool   special) const;
 
     // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    std::string_view token_to_piece(llama_token token) const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -2015,19 +2226,20 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
     // build token to piece cache
     {
-        size_t size_cache = 0;
-
-        std::vector<std::string> cache(n_tokens);
+        std::string           data;
+        std::vector<uint32_t> offs(n_tokens + 1);
 
         for (uint32_t id = 0; id < n_tokens; ++id) {
-            cache[id] = token_to_piece_for_cache(id, true);
-
-            size_cache += cache[id].size();
+            offs[id] = data.size();
+            data += token_to_piece_for_cache(id, true);
+            data += '\0';
         }
+        offs[n_tokens] = data.size();
 
-        std::swap(cache_token_to_piece, cache);
+        std::swap(cache_piece_data, data);
+        std::swap(cache_piece_offs, offs);
 
-        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+        LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, cache_piece_data.size() / 1024.0 / 1024.0);
     }
 
     // Handle per token attributes
@@ -2356,7 +2568,8 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2434,7 +2647,12 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        if (n_threads > 1 && text.size() >= 2*llm_tokenizer_bpe_session::n_chunk_min &&
+                            static_cast<const llm_tokenizer_bpe *>(tokenizer.get())->can_split) {
+                            session.tokenize_parallel(text, output, n_threads, workers);
+                        } else {
+                            session.tokenize(text, output);
+                        }
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         session.append(fragment.token, output);
                     }
@@ -2551,13 +2769,9 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     };
 
     // if we have a cache - use it
-    {
-        const auto & cache = cache_token_to_piece;
-
-        if (!cache.empty()) {
-            const auto & result = cache.at(token);
-            return _try_copy(result.data(), result.size());
-        }
+    if (!cache_piece_offs.empty()) {
+        const auto result = token_to_piece(token);
+        return _try_copy(result.data(), result.size());
     }
 
     if (0 <= token && token < (int32_t) id_to_token.size()) {
@@ -2613,8 +2827,10 @@ int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t
     return 0;
 }
 
-const std::string & llama_vocab::impl::token_to_piece(llama_token token) const {
-    return cache_token_to_piece.at(token);
+std::string_view llama_vocab::impl::token_to_piece(llama_token token) const {
+    const uint32_t offs = cache_piece_offs.at(token);
+    const uint32_t size = cache_piece_offs.at(token + 1) - offs - 1;
+    return std::string_view(cache_piece_data.data() + offs, size);
 }
 
 int32_t llama_vocab::impl::detokenize(
@@ -2992,6 +3208,17 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+std::vector<std::pair<std::string, std::string>> llama_vocab::get_bpe_merges() const {
+    std::vector<std::pair<std::string, std::string>> result;
+    for (const auto & it : pimpl->bpe_ranks) {
+        if ((size_t) it.second >= result.size()) {
+            result.resize(it.second + 1);
+        }
+        result[it.second] = it.first;
+    }
+    return result;
+}
+
 int32_t llama_vocab::tokenize(
                   const char * text,
                      int32_t   text_len,
@@ -3019,10 +3246,50 @@ std::vector<llama_token> llama_vocab::tokenize(
     return pimpl->tokenize(raw_text, add_special, parse_special);
 }
 
-const std::string & llama_vocab::token_to_piece(llama_token token) const {
+std::vector<std::vector<llama_token>> llama_vocab::tokenize_batch(
+        const std::vector<std::string> & raw_texts,
+        bool add_special,
+        bool parse_special,
+        int32_t n_threads) const {
+    if (n_threads <= 0) {
+        n_threads = std::thread::hardware_concurrency();
+    }
+
+    std::vector<std::vector<llama_token>> res(raw_texts.size());
+
+    if (raw_texts.size() == 1) {
+        // a single text is split into chunks instead
+        res[0] = pimpl->tokenize(raw_texts[0], add_special, parse_special, n_threads);
+        return res;
+    }
+
+    pimpl->workers.parallel_for(raw_texts.size(), n_threads, [&](size_t i) {
+        res[i] = pimpl->tokenize(raw_texts[i], add_special, parse_special);
+    });
+
+    return res;
+}
+
+std::string_view llama_vocab::token_to_piece(llama_token token) const {
+    return pimpl->token_to_piece(token);
+}
+
+std::string_view llama_vocab::token_to_piece(llama_token token, bool special) const {
+    static const int attr_special = LLAMA_TOKEN_ATTR_UNKNOWN | LLAMA_TOKEN_ATTR_CONTROL;
+    if (!special && (token_get_attr(token) & attr_special)) {
+        return {};
+    }
     return pimpl->token_to_piece(token);
 }
 
+const llama_grammar_trie & llama_vocab::grammar_trie() const {
+    std::call_once(pimpl->grammar_trie_once, [this]() {
+        pimpl->grammar_trie = llama_grammar_trie_init(*this);
+    });
+
+    return pimpl->grammar_trie;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -3271,6 +3538,48 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+const char * llama_vocab_get_piece(
+    const struct llama_vocab * vocab,
+                 llama_token   token,
+                        bool   special,
+                     int32_t * len) {
+    const auto piece = vocab->token_to_piece(token, special);
+    *len = piece.size();
+    return piece.empty() ? "" : piece.data();
+}
+
+int32_t llama_tokenize_batch(
+    const struct llama_vocab * vocab,
+                 const char ** texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                 llama_token ** tokens,
+               const int32_t * n_tokens_max,
+                     int32_t * n_tokens,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    std::vector<std::string> raw_texts(n_texts);
+    for (int32_t i = 0; i < n_texts; ++i) {
+        raw_texts[i].assign(texts[i], text_lens[i]);
+    }
+
+    const auto res = vocab->tokenize_batch(raw_texts, add_special, parse_special, n_threads);
+
+    int32_t ret = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        if (n_tokens_max[i] < (int32_t) res[i].size()) {
+            n_tokens[i] = -((int32_t) res[i].size());
+            ret = -1;
+            continue;
+        }
+        std::copy(res[i].begin(), res[i].end(), tokens[i]);
+        n_tokens[i] = res[i].size();
+    }
+
+    return ret;
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -3,11 +3,13 @@
 #include "llama.h"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_trie;
 
 struct llama_vocab {
     struct token_data {
@@ -81,6 +83,9 @@ struct llama_vocab {
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
 
+    // the (left, right) pair of each merge, indexed by rank - unused ranks are left empty
+    std::vector<std::pair<std::string, std::string>> get_bpe_merges() const;
+
     int32_t tokenize(
                    const char * text,
                       int32_t   text_len,
@@ -94,6 +99,13 @@ struct llama_vocab {
                          bool   add_special,
                          bool   parse_special = false) const;
 
+    // tokenize the texts on n_threads threads (<= 0 for all the cores), a single long text is split into chunks
+    std::vector<std::vector<llama_token>> tokenize_batch(
+            const std::vector<std::string> & raw_texts,
+                                      bool   add_special,
+                                      bool   parse_special,
+                                   int32_t   n_threads) const;
+
     // does not write null-terminator to buf
     int32_t token_to_piece(
                   llama_token   token,
@@ -102,8 +114,14 @@ struct llama_vocab {
                       int32_t   lstrip,
                          bool   special) const;
 
-    // use cached data
-    const std::string & token_to_piece(llama_token token) const;
+    // use cached data, the pieces are null-terminated
+    std::string_view token_to_piece(llama_token token) const;
+
+    // same as token_to_piece(token, buf, length, 0, special) without the copy
+    std::string_view token_to_piece(llama_token token, bool special) const;
+
+    // code point trie over the cached pieces, built on first use (see llama-grammar.cpp)
+    const llama_grammar_trie & grammar_trie() const;
 
     int32_t detokenize(
             const llama_token * tokens,
@@ -215,31 +215,11 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -352,12 +332,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// max_digits = 1 is the Qwen2 variant of the regex: \p{N} instead of \p{N}{1,3}
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, const size_t max_digits = 3) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -429,7 +408,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -492,6 +471,50 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
+// simple regexes matching a run of a single character class: X, X+, X{min_len,max_len} and \s?X+
+template <typename F>
+static std::vector<size_t> unicode_regex_split_custom_class(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets,
+        const F & is_class, const size_t min_len, const size_t max_len, const bool space_prefix = false) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        // the text between two matches is a separate word, same as in unicode_regex_split_stl
+        size_t prev_end = offset_ini;
+        for (size_t pos = offset_ini; pos < offset_end; ) {
+            size_t end = pos;
+            if (space_prefix && pos + 1 < offset_end && unicode_cpt_flags_from_cpt(cpts[pos]).is_whitespace && is_class(cpts[pos + 1])) {
+                end = pos + 1;
+            }
+            const size_t ini = end;
+            while (end < offset_end && end - ini < max_len && is_class(cpts[end])) {
+                end++;
+            }
+            if (end - ini == 0 || end - ini < min_len) {
+                pos++;
+                continue;
+            }
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+            bpe_offsets.push_back(end - pos);
+            prev_end = pos = end;
+        }
+
+        if (offset_end > prev_end) {
+            bpe_offsets.push_back(offset_end - prev_end);
+        }
+    }
+
+    return bpe_offsets;
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -552,17 +575,83 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
+    // character classes as seen by unicode_regex_split_stl: non-ASCII whitespaces are collapsed to \s
+    const auto is_number = [](const uint32_t cpt) {
+        return (bool) unicode_cpt_flags_from_cpt(cpt).is_number;
+    };
+    const auto is_letter = [](const uint32_t cpt) {
+        return (bool) unicode_cpt_flags_from_cpt(cpt).is_letter;
+    };
+    const auto is_punctuation = [](const uint32_t cpt) {
+        return (bool) unicode_cpt_flags_from_cpt(cpt).is_punctuation;
+    };
+    const auto is_digit = [](const uint32_t cpt) {
+        return '0' <= cpt && cpt <= '9';
+    };
+    const auto is_newline = [](const uint32_t cpt) {
+        return cpt == '\r' || cpt == '\n';
+    };
+    // [\p{P}\$\+<=>\^~\|`]
+    const auto is_punctuation_falcon = [](const uint32_t cpt) {
+        switch (cpt) {
+            case '$': case '+': case '<': case '=': case '>': case '^': case '~': case '|': case '`':
+                return true;
+            default:
+                return (bool) unicode_cpt_flags_from_cpt(cpt).is_punctuation;
+        }
+    };
+    // [\p{P}\$\+<=>\^~\|]
+    const auto is_punctuation_default = [&](const uint32_t cpt) {
+        return cpt != '`' && is_punctuation_falcon(cpt);
+    };
+    // [一-龥ࠀ-一가-퟿]
+    const auto is_cjk = [](const uint32_t cpt) {
+        return ((0x0800 <= cpt && cpt <= 0x9FA5) || (0xAC00 <= cpt && cpt <= 0xD7FF)) && !unicode_cpt_flags_from_cpt(cpt).is_whitespace;
+    };
+
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
-    }
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets, 1);
+    } else if (regex_expr == "\\p{N}") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_number, 1, 1);
+    } else if (regex_expr == "\\p{N}+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_number, 1, SIZE_MAX);
+    } else if (regex_expr == "\\p{N}{1,3}") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_number, 1, 3);
+    } else if (regex_expr == "[0-9][0-9][0-9]") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_digit, 3, 3);
+    } else if (regex_expr == "[\r\n]") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_newline, 1, 1);
+    } else if (regex_expr == "\\s?\\p{L}+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_letter, 1, SIZE_MAX, true);
+    } else if (regex_expr == "\\s?\\p{P}+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_punctuation, 1, SIZE_MAX, true);
+    } else if (regex_expr == "[\\p{P}\\$\\+<=>\\^~\\|`]+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_punctuation_falcon, 1, SIZE_MAX);
+    } else if (regex_expr == "[\\p{P}\\$\\+<=>\\^~\\|]+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_punctuation_default, 1, SIZE_MAX);
+    } else if (regex_expr == "[一-龥ࠀ-一가-퟿]+") {
+        bpe_offsets = unicode_regex_split_custom_class(cpts, offsets, is_cjk, 1, SIZE_MAX);
+    }
+
+    // the other regexes of llm_tokenizer_bpe fall back to std::wregex in unicode_regex_split:
+    //   - gpt-4o, tekken, bailingmoe: the whole regex
+    //   - deepseek-llm: the large letter class, the ASCII / full-width punctuation class and "\\s+$"
+    //   - deepseek3-llm: all but "\\p{N}{1,3}"
+    //   - bloom, poro, gpt3-finnish, viking: " ?[^(\\s|.,!?…。，、।۔،)]+"
+    //   - chameleon: all but the gpt2 regex and "\\p{N}"
+    //   - superbpe: the digit groups lookahead "(?=(\\d{3})+(?!\\d))"
 
     return bpe_offsets;
 }
@@ -667,7 +756,7 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -739,11 +828,13 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        if (use_custom) {
+            auto tmp = unicode_regex_split_custom(cpts, regex_expr, bpe_offsets);
 
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
+            if (!tmp.empty()) {
+                bpe_offsets = std::move(tmp);
+                continue;
+            }
         }
 
         // fallback to general-purpose std::regex / std::wregex
@@ -833,17 +924,28 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
+    // byte-level encoding of the words: each UTF-8 byte is mapped to its printable codepoint
+    static const auto byte_to_utf8 = [] {
+        std::vector<std::string> res(256);
+        for (int ch = 0; ch < 256; ++ch) {
+            res[ch] = unicode_byte_to_utf8(ch);
+        }
+        return res;
+    }();
+
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
     size_t start = 0;
     for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
+        std::string & word = bpe_words.emplace_back();
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                word += byte_to_utf8[(uint8_t) c];
+            }
         }
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
@@ -1,6 +1,12 @@
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
+#include <string>
+
+#include "ggml.h"
+#include "gguf.h"
 
 #include "get-model.h"
 
@@ -19,3 +25,223 @@ char * get_model_or_exit(int argc, char *argv[]) {
 
     return model_path;
 }
+
+bool make_random_model(const char * fname_vocab, const char * fname_out, int n_embd, int n_layer) {
+    const int n_head    = 4;
+    const int n_head_kv = 2;
+    const int n_ff      = 2*n_embd;
+    const int n_embd_kv = n_embd/n_head*n_head_kv;
+
+    gguf_init_params gparams = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ nullptr,
+    };
+
+    gguf_context * src = gguf_init_from_file(fname_vocab, gparams);
+    if (src == nullptr) {
+        fprintf(stderr, "%s: failed to read vocab from '%s'\n", __func__, fname_vocab);
+        return false;
+    }
+
+    const int64_t key_tokens = gguf_find_key(src, "tokenizer.ggml.tokens");
+    if (key_tokens < 0) {
+        fprintf(stderr, "%s: '%s' has no tokens\n", __func__, fname_vocab);
+        gguf_free(src);
+        return false;
+    }
+
+    const int64_t n_vocab = gguf_get_arr_n(src, key_tokens);
+
+    gguf_context * dst = gguf_init_empty();
+
+    gguf_set_kv(dst, src);
+    gguf_free(src);
+
+    gguf_set_val_str(dst, "general.architecture", "llama");
+    gguf_set_val_str(dst, "general.name",         "random");
+    gguf_set_val_u32(dst, "general.file_type",    0);
+
+    gguf_set_val_u32(dst, "llama.context_length",                  4096);
+    gguf_set_val_u32(dst, "llama.embedding_length",                n_embd);
+    gguf_set_val_u32(dst, "llama.block_count",                     n_layer);
+    gguf_set_val_u32(dst, "llama.feed_forward_length",             n_ff);
+    gguf_set_val_u32(dst, "llama.attention.head_count",            n_head);
+    gguf_set_val_u32(dst, "llama.attention.head_count_kv",         n_head_kv);
+    gguf_set_val_u32(dst, "llama.rope.dimension_count",            n_embd/n_head);
+    gguf_set_val_f32(dst, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    const size_t n_elements = 2*n_vocab*n_embd + n_embd + n_layer*(2*n_embd + 2*n_embd*n_embd + 2*n_embd*n_embd_kv + 3*n_embd*n_ff);
+
+    ggml_init_params params = {
+        /*.mem_size   = */ n_elements*sizeof(float) + (3 + 9*n_layer)*ggml_tensor_overhead(),
+        /*.mem_buffer = */ nullptr,
+        /*.no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    // norms are ones, matrices have a unit variance output for a unit variance input
+    const auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng)/sqrtf(ne0) : 1.0f;
+        }
+
+        gguf_add_tensor(dst, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0);
+        add(blk + "attn_q.weight",      n_embd, n_embd);
+        add(blk + "attn_k.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_v.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_output.weight", n_embd, n_embd);
+        add(blk + "ffn_norm.weight",    n_embd, 0);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff);
+        add(blk + "ffn_up.weight",      n_embd, n_ff);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd);
+    }
+
+    const bool ok = gguf_write_to_file(dst, fname_out, false);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out);
+    }
+
+    ggml_free(ctx);
+    gguf_free(dst);
+
+    return ok;
+}
+
+bool make_random_lora(const char * fname_model, const char * fname_out, int rank, int seed, bool embd) {
+    ggml_context * meta = nullptr;
+
+    gguf_init_params gparams = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &meta,
+    };
+
+    gguf_context * src = gguf_init_from_file(fname_model, gparams);
+    if (src == nullptr) {
+        fprintf(stderr, "%s: failed to read '%s'\n", __func__, fname_model);
+        return false;
+    }
+
+    gguf_context * dst = gguf_init_empty();
+
+    gguf_set_val_str(dst, "general.type",         "adapter");
+    gguf_set_val_str(dst, "general.architecture", gguf_get_val_str(src, gguf_find_key(src, "general.architecture")));
+    gguf_set_val_str(dst, "adapter.type",         "lora");
+    gguf_set_val_f32(dst, "adapter.lora.alpha",   2.0f*rank);
+
+    size_t n_elements = 0;
+    for (ggml_tensor * t = ggml_get_first_tensor(meta); t; t = ggml_get_next_tensor(meta, t)) {
+        n_elements += rank*(t->ne[0] + t->ne[1]);
+    }
+
+    ggml_init_params params = {
+        /*.mem_size   = */ n_elements*sizeof(ggml_fp16_t) + 2*gguf_get_n_tensors(src)*ggml_tensor_overhead(),
+        /*.mem_buffer = */ nullptr,
+        /*.no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    const auto fill = [&](ggml_tensor * t, float std) {
+        ggml_fp16_t * data = (ggml_fp16_t *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ggml_fp32_to_fp16(std*dist(rng));
+        }
+    };
+
+    for (ggml_tensor * t = ggml_get_first_tensor(meta); t; t = ggml_get_next_tensor(meta, t)) {
+        const std::string name = ggml_get_name(t);
+
+        const bool is_token_embd = name == "token_embd.weight";
+
+        if (ggml_n_dims(t) != 2 || (is_token_embd && !embd)) {
+            continue;
+        }
+
+        // the token embeddings have non-transposed A and B: a [rank, n_vocab], b [rank, n_embd]
+        ggml_tensor * a = is_token_embd ? ggml_new_tensor_2d(ctx, GGML_TYPE_F16, rank, t->ne[1]) : ggml_new_tensor_2d(ctx, GGML_TYPE_F16, t->ne[0], rank);
+        ggml_tensor * b = is_token_embd ? ggml_new_tensor_2d(ctx, GGML_TYPE_F16, rank, t->ne[0]) : ggml_new_tensor_2d(ctx, GGML_TYPE_F16, rank, t->ne[1]);
+
+        ggml_set_name(a, (name + ".lora_a").c_str());
+        ggml_set_name(b, (name + ".lora_b").c_str());
+
+        // the update is small compared to the weights
+        fill(a, 1.0f/sqrtf(a->ne[0]));
+        fill(b, 0.1f/sqrtf(rank));
+
+        gguf_add_tensor(dst, a);
+        gguf_add_tensor(dst, b);
+    }
+
+    const bool ok = gguf_write_to_file(dst, fname_out, false);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out);
+    }
+
+    ggml_free(ctx);
+    ggml_free(meta);
+    gguf_free(dst);
+    gguf_free(src);
+
+    return ok;
+}
+
+llama_model * load_random_model(int argc, char ** argv, const char * fname, int n_layer) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file>\n", argv[0]);
+        return nullptr;
+    }
+
+    if (!make_random_model(argv[1], fname, 64, n_layer)) {
+        return nullptr;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname);
+        llama_backend_free();
+        remove(fname);
+    }
+
+    return model;
+}
+
+void free_random_model(llama_model * model, const char * fname) {
+    llama_model_free(model);
+    llama_backend_free();
+
+    remove(fname);
+}
+
+llama_context_params random_model_cparams(uint32_t n_ctx, uint32_t n_batch, uint32_t n_ubatch, uint32_t n_seq_max) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx     = n_ctx;
+    cparams.n_batch   = n_batch;
+    cparams.n_ubatch  = n_ubatch;
+    cparams.n_seq_max = n_seq_max;
+
+    return cparams;
+}
@@ -1,2 +1,22 @@
 #pragma once
+
+#include "llama.h"
+
 char * get_model_or_exit(int, char*[]);
+
+// write a small llama model with random weights, using the vocab of a vocab-only model (e.g. models/ggml-vocab-llama-spm.gguf)
+bool make_random_model(const char * fname_vocab, const char * fname_out, int n_embd = 64, int n_layer = 2);
+
+// write a random LoRA adapter (F16, like the adapters used by export-lora) for the matrices of the layers of a model
+// with embd, the adapter also modifies the token embeddings
+bool make_random_lora(const char * fname_model, const char * fname_out, int rank, int seed, bool embd = false);
+
+// setup of the tests that run a random model: write it to fname from the vocab given as the first argument,
+// init the backend and load it - nullptr (after printing the usage) if there is no argument or on failure
+llama_model * load_random_model(int argc, char ** argv, const char * fname, int n_layer = 2);
+
+// free the model of load_random_model and the backend, and remove the model file
+void free_random_model(llama_model * model, const char * fname);
+
+// context params of the tests on random models
+llama_context_params random_model_cparams(uint32_t n_ctx, uint32_t n_batch, uint32_t n_ubatch, uint32_t n_seq_max);
@@ -4,14 +4,26 @@
 
 #include "unicode.h"
 #include "llama-grammar.h"
+#include "llama-vocab.h"
 #include "json-schema-to-grammar.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
 #include <string>
+#include <thread>
 #include <vector>
 
 using json = nlohmann::ordered_json;
 
+// optional vocab (first argument) used to check the compiled mode of llama_grammar_apply_impl
+static const llama_vocab * vocab = nullptr;
+
+static int64_t t_apply_us[2] = { 0, 0 }; // per-candidate, compiled
+static int64_t n_apply       = 0;
+
 static llama_grammar * build_grammar(const std::string & grammar_str) {
     return llama_grammar_init_impl(nullptr, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
 }
@@ -53,6 +65,111 @@ static bool match_string(const std::string & input, llama_grammar * grammar) {
     return false;
 }
 
+// applies the grammar to the full vocab at every token of the passing strings, with and without the compiled mode,
+// and checks that both reject the same candidates
+static void test_compiled(const std::string & grammar_str, const std::vector<std::string> & passing_strings) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token_data> cur[2];
+
+    for (const auto & test_string : passing_strings) {
+        std::vector<llama_token> tokens(test_string.size() + 1);
+        const int n_tokens = llama_tokenize(vocab, test_string.c_str(), test_string.size(), tokens.data(), tokens.size(), false, false);
+        assert(n_tokens >= 0);
+        tokens.resize(n_tokens);
+
+        llama_grammar * grammars[2];
+        for (int m = 0; m < 2; ++m) {
+            grammars[m] = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+            grammars[m]->compiled = m == 1;
+        }
+
+        for (const llama_token token : tokens) {
+            for (int m = 0; m < 2; ++m) {
+                cur[m].clear();
+                for (llama_token id = 0; id < n_vocab; ++id) {
+                    cur[m].push_back({ id, 0.0f, 0.0f });
+                }
+                llama_token_data_array cur_p = { cur[m].data(), cur[m].size(), -1, false };
+
+                const auto t_start = std::chrono::high_resolution_clock::now();
+                llama_grammar_apply_impl(*grammars[m], &cur_p);
+                t_apply_us[m] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t_start).count();
+            }
+            n_apply++;
+
+            for (int id = 0; id < n_vocab; ++id) {
+                if (std::isinf(cur[0][id].logit) != std::isinf(cur[1][id].logit)) {
+                    fprintf(stderr, "  ❌ compiled mode mismatch for token %d (`%s`) in \"%s\"\n",
+                            id, std::string(vocab->token_to_piece(id)).c_str(), test_string.c_str());
+                    assert(false);
+                }
+            }
+            assert(!std::isinf(cur[1][token].logit));
+
+            for (int m = 0; m < 2; ++m) {
+                llama_grammar_accept_impl(*grammars[m], token);
+            }
+        }
+
+        for (int m = 0; m < 2; ++m) {
+            llama_grammar_free_impl(grammars[m]);
+        }
+    }
+}
+
+// several threads share the compiled grammar (and its cache) of the same grammar string, each with its own stacks
+static void test_compiled_concurrent(const std::string & grammar_str, const std::vector<std::string> & passing_strings) {
+    fprintf(stderr, "⚫ Testing the compiled mode from several threads\n");
+
+    const int n_vocab   = llama_vocab_n_tokens(vocab);
+    const int n_threads = 4;
+
+    std::vector<std::thread> threads;
+    for (int ith = 0; ith < n_threads; ++ith) {
+        threads.emplace_back([&]() {
+            std::vector<llama_token_data> cur[2];
+
+            for (const auto & test_string : passing_strings) {
+                std::vector<llama_token> tokens(test_string.size() + 1);
+                tokens.resize(llama_tokenize(vocab, test_string.c_str(), test_string.size(), tokens.data(), tokens.size(), false, false));
+
+                llama_grammar * grammars[2];
+                for (int m = 0; m < 2; ++m) {
+                    grammars[m] = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+                    grammars[m]->compiled = m == 1;
+                }
+
+                for (const llama_token token : tokens) {
+                    for (int m = 0; m < 2; ++m) {
+                        cur[m].clear();
+                        for (llama_token id = 0; id < n_vocab; ++id) {
+                            cur[m].push_back({ id, 0.0f, 0.0f });
+                        }
+                        llama_token_data_array cur_p = { cur[m].data(), cur[m].size(), -1, false };
+                        llama_grammar_apply_impl(*grammars[m], &cur_p);
+                    }
+                    for (int id = 0; id < n_vocab; ++id) {
+                        assert(std::isinf(cur[0][id].logit) == std::isinf(cur[1][id].logit));
+                    }
+                    for (int m = 0; m < 2; ++m) {
+                        llama_grammar_accept_impl(*grammars[m], token);
+                    }
+                }
+
+                for (int m = 0; m < 2; ++m) {
+                    llama_grammar_free_impl(grammars[m]);
+                }
+            }
+        });
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+
+    fprintf(stderr, "  ✅︎\n");
+}
+
 static void test(const std::string & test_desc, const std::string & grammar_str, const std::vector<std::string> & passing_strings, const std::vector<std::string> & failing_strings) {
     fprintf(stderr, "⚫ Testing %s\n%s\n", test_desc.c_str(), grammar_str.c_str());
     fflush(stderr);
@@ -124,6 +241,10 @@ static void test(const std::string & test_desc, const std::string & grammar_str,
 
     // Clean up allocated memory
     llama_grammar_free_impl(grammar);
+
+    if (vocab) {
+        test_compiled(grammar_str, passing_strings);
+    }
 }
 static void test_grammar(const std::string & test_desc, const std::string & grammar_str, const std::vector<std::string> & passing_strings, const std::vector<std::string> & failing_strings) {
     test(test_desc + ". Grammar: " + grammar_str, grammar_str, passing_strings, failing_strings);
@@ -1292,7 +1413,125 @@ static void test_json_schema() {
     );
 }
 
-int main() {
+// nested alternates sharing the same prefix: the grammar has to follow both alternates of every level at once,
+// so the number of stacks doubles with each level of nesting
+static json nested_schema(int depth) {
+    if (depth == 0) {
+        return {{"type", "integer"}};
+    }
+    json alternates = json::array();
+    for (const char * key : { "id", "name" }) {
+        alternates.push_back({
+            {"type", "object"},
+            {"properties", {
+                {"child", nested_schema(depth - 1)},
+                {key,     {{"type", "integer"}}},
+            }},
+            {"required", json::array({ "child" })},
+        });
+    }
+    return {{"anyOf", alternates}};
+}
+
+static std::string nested_string(int depth) {
+    if (depth == 0) {
+        return "0";
+    }
+    return "{\"child\": " + nested_string(depth - 1) + ", \"id\": " + std::to_string(depth) + "}";
+}
+
+// stacks as (rule, element) indices, to compare the stacks of different grammars
+static std::vector<std::vector<std::pair<size_t, size_t>>> stacks_indices(llama_grammar * grammar) {
+    const auto & rules = llama_grammar_get_rules(grammar);
+
+    std::vector<std::vector<std::pair<size_t, size_t>>> result;
+    for (const auto & stack : llama_grammar_get_stacks(grammar)) {
+        auto & indices = result.emplace_back();
+        for (const auto * pos : stack) {
+            for (size_t ir = 0; ir < rules.size(); ++ir) {
+                if (pos >= rules[ir].data() && pos < rules[ir].data() + rules[ir].size()) {
+                    indices.emplace_back(ir, pos - rules[ir].data());
+                    break;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// accepts the code points of deeply nested JSON with and without the compiled mode, checks that both end up
+// with the same stacks and reports the per code point cost
+static void test_stress_nested_json_schema() {
+    fprintf(stderr, "⚫ Testing nested JSON schemas (stress)\n");
+
+    for (int depth : { 1, 2, 4, 6, 8 }) {
+        const std::string grammar_str = json_schema_to_grammar(nested_schema(depth), true);
+        const std::string input       = nested_string(depth);
+        const auto        cpts        = unicode_cpts_from_utf8(input);
+
+        llama_grammar * grammars[2];
+        for (int m = 0; m < 2; ++m) {
+            grammars[m] = build_grammar(grammar_str);
+            grammars[m]->compiled = m == 1;
+        }
+
+        const llama_grammar_stacks stacks_org = llama_grammar_get_stacks(grammars[1]); // copy
+
+        int64_t t_us[2]    = { 0, 0 };
+        size_t  max_stacks = 0;
+
+        for (const auto & cpt : cpts) {
+            for (int m = 0; m < 2; ++m) {
+                const auto t_start = std::chrono::high_resolution_clock::now();
+                llama_grammar_accept(grammars[m], cpt);
+                t_us[m] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t_start).count();
+            }
+            assert(stacks_indices(grammars[0]) == stacks_indices(grammars[1]));
+            assert(!llama_grammar_get_stacks(grammars[1]).empty());
+
+            max_stacks = std::max(max_stacks, llama_grammar_get_stacks(grammars[1]).size());
+        }
+
+        // the same input again, now with the memoized transitions
+        llama_grammar_get_stacks(grammars[1]) = stacks_org;
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+        for (const auto & cpt : cpts) {
+            llama_grammar_accept(grammars[1], cpt);
+        }
+        const int64_t t_memo_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t_start).count();
+
+        fprintf(stdout, "  depth %2d: %4zu code points, max %4zu stacks: %8.2f us/cpt direct, %8.2f us/cpt compiled, %6.2f us/cpt memoized\n",
+                depth, cpts.size(), max_stacks, (double) t_us[0]/cpts.size(), (double) t_us[1]/cpts.size(), (double) t_memo_us/cpts.size());
+
+        for (int m = 0; m < 2; ++m) {
+            llama_grammar_free_impl(grammars[m]);
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    llama_model * model = nullptr;
+
+    if (argc > 1) {
+        llama_backend_init();
+
+        auto mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+
+        model = llama_model_load_from_file(argv[1], mparams);
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+            return 1;
+        }
+        vocab = llama_model_get_vocab(model);
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+        const auto & trie = vocab->grammar_trie();
+        fprintf(stdout, "Built the grammar trie: %zu nodes, %zu tokens in %.2f ms\n", trie.nodes.size(), trie.tokens.size(),
+                std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count());
+    }
+
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
     test_complex_grammar();
@@ -1302,6 +1541,20 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_stress_nested_json_schema();
+
+    if (vocab) {
+        test_compiled_concurrent(json_schema_to_grammar(nested_schema(3), true), { nested_string(3) });
+    }
+
+    if (model) {
+        fprintf(stdout, "Grammar apply over %" PRId64 " tokens: %.3f ms/token per-candidate, %.3f ms/token compiled (%.1fx)\n", n_apply,
+                1e-3*t_apply_us[0]/n_apply, 1e-3*t_apply_us[1]/n_apply, (double) t_apply_us[0]/std::max<int64_t>(t_apply_us[1], 1));
+
+        llama_model_free(model);
+        llama_backend_free();
+    }
+
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
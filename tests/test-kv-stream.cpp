@@ -0,0 +1,158 @@
+// stream a sequence through the streaming KV cache (attention sinks + sliding window) for several windows, check
+// that the memory stays bounded and compare the logits with a reference that decodes the sinks and the window only
+#include "llama.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const int k_n_sink   = 4;
+static const int k_n_window = 124;
+static const int k_n_tokens = 8*k_n_window;
+
+static llama_token make_token(int pos, int n_vocab) {
+    return (pos*7919 + 13) % n_vocab;
+}
+
+// reference: the sinks right before the window and the window at its positions, decoded in one batch
+// with a single layer, the K and V of a token depend only on the token and its position, so the logits of the last
+// token are the ones of the streamed sequence
+static std::vector<float> eval_ref(llama_model * model, int p_last, int n_used, int n_vocab) {
+    auto cparams = random_model_cparams(256, 256, 256, 1);
+    cparams.type_k = GGML_TYPE_F32;
+    cparams.type_v = GGML_TYPE_F32;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    const int w0 = std::max(k_n_sink, p_last - (n_used - k_n_sink) + 1);
+
+    llama_batch batch = llama_batch_init(n_used, 0, 1);
+
+    const auto add = [&](llama_token token, llama_pos pos, bool output) {
+        const int j = batch.n_tokens++;
+
+        batch.token   [j]    = token;
+        batch.pos     [j]    = pos;
+        batch.n_seq_id[j]    = 1;
+        batch.seq_id  [j][0] = 0;
+        batch.logits  [j]    = output;
+    };
+
+    for (int i = 0; i < k_n_sink; ++i) {
+        add(make_token(i, n_vocab), w0 - k_n_sink + i, false);
+    }
+    for (int p = w0; p <= p_last; ++p) {
+        add(make_token(p, n_vocab), p, p == p_last);
+    }
+
+    assert(llama_decode(ctx, batch) == 0);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + n_vocab);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    const char * fname = "test-kv-stream.gguf";
+
+    llama_model * model = load_random_model(argc, argv, fname, 1);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    auto cparams = random_model_cparams(k_n_sink + k_n_window, 128, 128, 1);
+    cparams.n_kv_sink   = k_n_sink;
+    cparams.n_kv_window = k_n_window;
+    cparams.type_k      = GGML_TYPE_F32;
+    cparams.type_v      = GGML_TYPE_F32;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    assert(llama_n_kv_sink  (ctx) == k_n_sink);
+    assert(llama_n_kv_window(ctx) == k_n_window);
+
+    llama_batch batch = llama_batch_init(16, 0, 1);
+
+    size_t state_size_max = 0;
+
+    int n_decode = 0;
+
+    // one token at a time for the first half, then 16 tokens per ubatch
+    for (int p = 0; p < k_n_tokens; ) {
+        const int n = p < k_n_tokens/2 ? 1 : std::min(16, k_n_tokens - p);
+
+        batch.n_tokens = 0;
+        for (int i = 0; i < n; ++i) {
+            batch.token   [i]    = make_token(p + i, n_vocab);
+            batch.pos     [i]    = p + i;
+            batch.n_seq_id[i]    = 1;
+            batch.seq_id  [i][0] = 0;
+            batch.logits  [i]    = i == n - 1;
+            batch.n_tokens++;
+        }
+
+        assert(llama_decode(ctx, batch) == 0);
+        n_decode++;
+
+        p += n;
+
+        // the positions of the sequence keep growing, the cells stay within the sinks and the window
+        const int n_used = llama_kv_self_used_cells(ctx);
+
+        assert(llama_kv_self_seq_pos_max(ctx, 0) == p - 1);
+        assert(n_used <= k_n_sink + k_n_window);
+
+        // the state of the sequence has a bounded size once its positions were rebased (their offset is saved too)
+        if (p == 3*k_n_window) {
+            state_size_max = llama_state_seq_get_size(ctx, 0);
+        } else if (p > 3*k_n_window) {
+            assert(llama_state_seq_get_size(ctx, 0) <= state_size_max);
+        }
+
+        // compare with the reference once per window, and at the end
+        if (p % k_n_window < n || p == k_n_tokens) {
+            const std::vector<float> ref = eval_ref(model, p - 1, n_used, n_vocab);
+
+            const float * logits = llama_get_logits_ith(ctx, -1);
+
+            double max_diff = 0.0;
+            for (int k = 0; k < n_vocab; ++k) {
+                max_diff = std::max(max_diff, (double) fabs(logits[k] - ref[k]));
+            }
+
+            fprintf(stderr, "%s: pos = %4d, n_used = %3d: max diff = %g\n", __func__, p - 1, n_used, max_diff);
+            assert(max_diff < 1e-3);
+        }
+    }
+
+    // past the first window, the graph of a decode is reused while the sinks move: only the rebases and the first
+    // copy of the sinks change it
+    const int n_reused = llama_perf_context(ctx).n_reused;
+
+    fprintf(stderr, "%s: %d decodes, %d graphs reused\n", __func__, n_decode, n_reused);
+    assert(n_reused > n_decode*3/4);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    free_random_model(model, fname);
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
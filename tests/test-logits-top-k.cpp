@@ -0,0 +1,143 @@
+// check the top-k logits output against an argsort of the full logits
+#include "llama.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <vector>
+
+static const int k_top_k     = 16;
+static const int k_n_tokens  = 96;
+static const int k_n_seq     = 3;
+
+// tokens of 3 sequences, interleaved and out of order, with an output every 5th token
+static void make_batch(llama_batch & batch, int n_vocab) {
+    batch.n_tokens = 0;
+
+    for (int i = 0; i < k_n_tokens; ++i) {
+        const int j = (i*37) % k_n_tokens;
+
+        batch.token   [i]    = (j*7919) % n_vocab;
+        batch.pos     [i]    = j / k_n_seq;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = j % k_n_seq;
+        batch.logits  [i]    = i % 5 == 0;
+
+        batch.n_tokens++;
+    }
+}
+
+// compare the top-k of output i with the reference full logits
+static void check_top_k(llama_context * ctx, int i, const std::vector<float> & ref, int k) {
+    const int n_vocab = ref.size();
+
+    const llama_token_data * top = llama_get_logits_top_k_ith(ctx, i);
+    assert(top != nullptr);
+
+    std::vector<int> idx(n_vocab);
+    std::iota(idx.begin(), idx.end(), 0);
+    std::stable_sort(idx.begin(), idx.end(), [&](int a, int b) { return ref[a] > ref[b]; });
+
+    const float max_l = ref[idx[0]];
+
+    double sum = 0.0;
+    for (const float l : ref) {
+        sum += exp(l - max_l);
+    }
+
+    for (int j = 0; j < k; ++j) {
+        assert(top[j].logit == ref[idx[j]]);
+        assert(top[j].logit == ref[top[j].id]);
+        assert(fabs(top[j].p - exp(ref[top[j].id] - max_l)/sum) < 1e-6);
+    }
+}
+
+int main(int argc, char ** argv) {
+    const char * fname = "test-logits-top-k.gguf";
+
+    llama_model * model = load_random_model(argc, argv, fname);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    const auto cparams = random_model_cparams(256, 128, 32, k_n_seq);
+
+    llama_batch batch = llama_batch_init(k_n_tokens, 0, 1);
+    make_batch(batch, n_vocab);
+
+    // reference: full logits
+    std::vector<std::vector<float>> ref(k_n_tokens);
+    {
+        llama_context * ctx = llama_init_from_model(model, cparams);
+        assert(llama_decode(ctx, batch) == 0);
+        assert(llama_n_logits_top_k(ctx) == 0);
+
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                const float * logits = llama_get_logits_ith(ctx, i);
+                ref[i].assign(logits, logits + n_vocab);
+            }
+        }
+
+        llama_free(ctx);
+    }
+
+    std::vector<uint8_t> state;
+
+    {
+        llama_context * ctx = llama_init_from_model(model, cparams);
+        llama_set_logits_top_k(ctx, k_top_k);
+
+        assert(llama_decode(ctx, batch) == 0);
+
+        // changing k applies to the next decode only - the current outputs keep their k
+        llama_set_logits_top_k(ctx, k_top_k/2);
+        assert(llama_n_logits_top_k(ctx) == k_top_k);
+
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                assert(llama_get_logits_ith(ctx, i) == nullptr);
+                check_top_k(ctx, i, ref[i], k_top_k);
+            }
+        }
+
+        state.resize(llama_state_get_size(ctx));
+        assert(llama_state_get_data(ctx, state.data(), state.size()) == state.size());
+
+        llama_free(ctx);
+    }
+
+    // the top-k outputs are restored with the state, with their k
+    {
+        llama_context * ctx = llama_init_from_model(model, cparams);
+        llama_set_logits_top_k(ctx, k_top_k/4);
+
+        assert(llama_state_set_data(ctx, state.data(), state.size()) == state.size());
+        assert(llama_n_logits_top_k(ctx) == k_top_k);
+
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                check_top_k(ctx, i, ref[i], k_top_k);
+            }
+        }
+
+        llama_free(ctx);
+    }
+
+    llama_batch_free(batch);
+    free_random_model(model, fname);
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
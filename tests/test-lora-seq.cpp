@@ -0,0 +1,176 @@
+// check the per-sequence LoRA adapters against the same adapters applied to the whole context
+#include "llama.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const int k_n_tokens = 24; // per sequence
+static const int k_n_seq    = 4;
+
+struct lora_config {
+    std::vector<std::pair<llama_adapter_lora *, float>> adapters;
+};
+
+static llama_token make_token(int s, int i, int n_vocab) {
+    return ((s + 1)*7919 + i*104729) % n_vocab;
+}
+
+// the tokens of all the sequences, interleaved, with an output for each token
+static void make_batch(llama_batch & batch, int n_vocab) {
+    batch.n_tokens = 0;
+
+    for (int i = 0; i < k_n_tokens; ++i) {
+        for (int s = 0; s < k_n_seq; ++s) {
+            const int j = batch.n_tokens++;
+
+            batch.token   [j]    = make_token(s, i, n_vocab);
+            batch.pos     [j]    = i;
+            batch.n_seq_id[j]    = 1;
+            batch.seq_id  [j][0] = s;
+            batch.logits  [j]    = true;
+        }
+    }
+}
+
+// reference: the tokens of sequence s alone, with its adapters applied to the context
+static std::vector<float> eval_ref(llama_model * model, llama_context_params cparams, const lora_config & config, int s, int n_vocab) {
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    for (const auto & it : config.adapters) {
+        assert(llama_set_adapter_lora(ctx, it.first, it.second) == 0);
+    }
+
+    llama_batch batch = llama_batch_init(k_n_tokens, 0, 1);
+    for (int i = 0; i < k_n_tokens; ++i) {
+        batch.token   [i]    = make_token(s, i, n_vocab);
+        batch.pos     [i]    = i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = 0;
+        batch.logits  [i]    = true;
+    }
+    batch.n_tokens = k_n_tokens;
+
+    assert(llama_decode(ctx, batch) == 0);
+
+    std::vector<float> res;
+    for (int i = 0; i < k_n_tokens; ++i) {
+        const float * logits = llama_get_logits_ith(ctx, i);
+        res.insert(res.end(), logits, logits + n_vocab);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    const char * fname        = "test-lora-seq.gguf";
+    const char * fname_lora[] = { "test-lora-seq-a.gguf", "test-lora-seq-b.gguf", "test-lora-seq-embd.gguf" };
+
+    llama_model * model = load_random_model(argc, argv, fname);
+    if (model == nullptr ||
+        !make_random_lora(fname, fname_lora[0], 8, 1) ||
+        !make_random_lora(fname, fname_lora[1], 4, 2) ||
+        !make_random_lora(fname, fname_lora[2], 4, 3, true)) {
+        return 1;
+    }
+
+    llama_adapter_lora * lora_a    = llama_adapter_lora_init(model, fname_lora[0]);
+    llama_adapter_lora * lora_b    = llama_adapter_lora_init(model, fname_lora[1]);
+    llama_adapter_lora * lora_embd = llama_adapter_lora_init(model, fname_lora[2]);
+    assert(lora_a && lora_b && lora_embd);
+
+    assert( llama_adapter_lora_supports_seq(lora_a));
+    assert(!llama_adapter_lora_supports_seq(lora_embd));
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    const auto cparams = random_model_cparams(256, 128, 32, k_n_seq);
+
+    // the context adapters of each phase are applied to all the sequences, on top of their own adapters
+    const std::vector<lora_config> ctx_configs = {
+        { {} },
+        { { { lora_b, 0.5f } } },
+    };
+
+    const std::vector<lora_config> seq_configs = {
+        { {} },
+        { { { lora_a, 1.0f } } },
+        { { { lora_a, 0.5f }, { lora_b, 1.0f } } },
+        { { { lora_b, -1.0f } } },
+    };
+
+    llama_batch batch = llama_batch_init(k_n_tokens*k_n_seq, 0, 1);
+    make_batch(batch, n_vocab);
+
+    for (const auto & ctx_config : ctx_configs) {
+        llama_context * ctx = llama_init_from_model(model, cparams);
+        assert(ctx != nullptr);
+
+        // the token embeddings cannot be modified per sequence
+        assert(llama_set_adapter_lora_seq(ctx, lora_embd, 0, 1.0f) == -1);
+        assert(llama_set_adapter_lora_seq(ctx, lora_a, k_n_seq, 1.0f) == -1);
+
+        for (const auto & it : ctx_config.adapters) {
+            assert(llama_set_adapter_lora(ctx, it.first, it.second) == 0);
+        }
+
+        for (int s = 0; s < k_n_seq; ++s) {
+            for (const auto & it : seq_configs[s].adapters) {
+                assert(llama_set_adapter_lora_seq(ctx, it.first, s, it.second) == 0);
+            }
+        }
+
+        assert(llama_decode(ctx, batch) == 0);
+
+        for (int s = 0; s < k_n_seq; ++s) {
+            // the scales of an adapter applied both to the context and to the sequence add up
+            lora_config config = ctx_config;
+            for (const auto & it : seq_configs[s].adapters) {
+                auto pos = std::find_if(config.adapters.begin(), config.adapters.end(), [&](const auto & c) { return c.first == it.first; });
+                if (pos != config.adapters.end()) {
+                    pos->second += it.second;
+                } else {
+                    config.adapters.push_back(it);
+                }
+            }
+
+            const std::vector<float> ref = eval_ref(model, cparams, config, s, n_vocab);
+
+            double max_diff = 0.0;
+            for (int i = 0; i < k_n_tokens; ++i) {
+                const float * logits = llama_get_logits_ith(ctx, i*k_n_seq + s);
+                for (int k = 0; k < n_vocab; ++k) {
+                    max_diff = std::max(max_diff, (double) fabs(logits[k] - ref[i*n_vocab + k]));
+                }
+            }
+
+            fprintf(stderr, "%s: n_ctx_adapters = %zu, seq %d: max diff = %g\n", __func__, ctx_config.adapters.size(), s, max_diff);
+            assert(max_diff < 1e-2);
+        }
+
+        llama_free(ctx);
+    }
+
+    llama_batch_free(batch);
+    free_random_model(model, fname);
+
+    for (const char * f : fname_lora) {
+        remove(f);
+    }
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+// check the batched sampling across sequences against sampling the sequences one at a time
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const int k_n_seq    = 8;
+static const int k_n_prompt = 4;
+static const int k_n_steps  = 16;
+
+// a different sampler chain for each sequence
+static llama_sampler * make_sampler(int s) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    const uint32_t seed = 1234 + s;
+
+    switch (s % 4) {
+        case 0:
+            llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+            break;
+        case 1:
+            llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+            llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+            break;
+        case 2:
+            llama_sampler_chain_add(smpl, llama_sampler_init_penalties(64, 1.3f, 0.1f, 0.1f));
+            llama_sampler_chain_add(smpl, llama_sampler_init_min_p(0.05f, 1));
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+            break;
+        case 3:
+            llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
+            llama_sampler_chain_add(smpl, llama_sampler_init_temp(1.5f));
+            llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+            break;
+    }
+
+    return smpl;
+}
+
+static common_sampler * make_common_sampler(const llama_model * model, int s) {
+    common_params_sampling params;
+
+    params.seed           = 4321 + s;
+    params.penalty_repeat = 1.1f;
+
+    if (s % 2 == 1) {
+        params.grammar = "root ::= [a-z ]*";
+    }
+
+    return common_sampler_init(model, params);
+}
+
+int main(int argc, char ** argv) {
+    const char * fname = "test-sampling-batch.gguf";
+
+    llama_model * model = load_random_model(argc, argv, fname);
+    if (model == nullptr) {
+        return 1;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    auto cparams = random_model_cparams(512, 64, 64, k_n_seq);
+    cparams.n_threads = 4;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    // two identical sets of samplers: one is sampled in a batch, the other one sequence by sequence
+    std::vector<llama_sampler *> smpls_batch;
+    std::vector<llama_sampler *> smpls_seq;
+
+    std::vector<common_sampler *> gsmpls_batch;
+    std::vector<common_sampler *> gsmpls_seq;
+
+    for (int s = 0; s < k_n_seq; ++s) {
+        smpls_batch.push_back(make_sampler(s));
+        smpls_seq  .push_back(make_sampler(s));
+
+        gsmpls_batch.push_back(make_common_sampler(model, s));
+        gsmpls_seq  .push_back(make_common_sampler(model, s));
+    }
+
+    llama_batch batch = llama_batch_init(k_n_seq*k_n_prompt, 0, 1);
+
+    for (int s = 0; s < k_n_seq; ++s) {
+        for (int i = 0; i < k_n_prompt; ++i) {
+            common_batch_add(batch, (s*7919 + i*104729) % n_vocab, i, { s }, i == k_n_prompt - 1);
+        }
+    }
+
+    std::vector<int32_t> idxs(k_n_seq);
+    for (int s = 0; s < k_n_seq; ++s) {
+        idxs[s] = (s + 1)*k_n_prompt - 1;
+    }
+
+    std::vector<llama_token> tokens(k_n_seq);
+
+    int n_past = k_n_prompt;
+
+    // the top-k logits output is enabled for the second half of the steps
+    for (int step = 0; step < k_n_steps; ++step) {
+        assert(llama_decode(ctx, batch) == 0);
+
+        const bool top_k = step >= k_n_steps/2;
+
+        llama_sampler_sample_batch(smpls_batch.data(), ctx, idxs.data(), tokens.data(), k_n_seq);
+
+        for (int s = 0; s < k_n_seq; ++s) {
+            const llama_token token = llama_sampler_sample(smpls_seq[s], ctx, idxs[s]);
+            if (token != tokens[s]) {
+                fprintf(stderr, "%s: step %d, seq %d: batch token %d != sequential token %d\n", __func__, step, s, tokens[s], token);
+                return 1;
+            }
+        }
+
+        // the common samplers need the full logits
+        if (!top_k) {
+            const std::vector<int> gidxs(idxs.begin(), idxs.end());
+
+            const auto gtokens = common_sampler_sample_batch(gsmpls_batch, ctx, gidxs);
+
+            for (int s = 0; s < k_n_seq; ++s) {
+                const llama_token token = common_sampler_sample(gsmpls_seq[s], ctx, idxs[s]);
+                if (token != gtokens[s]) {
+                    fprintf(stderr, "%s: step %d, seq %d: common batch token %d != sequential token %d\n", __func__, step, s, gtokens[s], token);
+                    return 1;
+                }
+
+                common_sampler_accept(gsmpls_batch[s], gtokens[s], true);
+                common_sampler_accept(gsmpls_seq  [s], token,      true);
+            }
+        }
+
+        if (step + 1 == k_n_steps/2) {
+            llama_set_logits_top_k(ctx, 32);
+        }
+
+        common_batch_clear(batch);
+        for (int s = 0; s < k_n_seq; ++s) {
+            common_batch_add(batch, tokens[s], n_past, { s }, true);
+            idxs[s] = s;
+        }
+        n_past++;
+    }
+
+    for (int s = 0; s < k_n_seq; ++s) {
+        llama_sampler_free(smpls_batch[s]);
+        llama_sampler_free(smpls_seq[s]);
+
+        common_sampler_free(gsmpls_batch[s]);
+        common_sampler_free(gsmpls_seq[s]);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    free_random_model(model, fname);
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
@@ -7,9 +7,11 @@
 
 #include <algorithm>
 #include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
+extern llama_token llama_sampler_sample_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab);
 extern struct llama_sampler * llama_sampler_init_dry_testing(int32_t context_size, float dry_multiplier, float dry_base, int32_t dry_allowed_length, int32_t dry_penalty_last_n, const std::vector<std::vector<llama_token>>& seq_breakers);
 
 static void dump(const llama_token_data_array * cur_p) {
@@ -158,6 +160,83 @@ static void test_penalties(
     tester.check();
 }
 
+// sliding window with a long random sequence: compare against counts recomputed from scratch,
+// for candidates both laid out by token id and shuffled/truncated (e.g. after top-k)
+static void test_penalties_window(int32_t n_vocab, int32_t penalty_last_n, int n_steps) {
+    const float penalty_repeat  = 1.5f;
+    const float penalty_freq    = 0.25f;
+    const float penalty_present = 0.5f;
+
+    std::mt19937 rng(1234);
+
+    auto * sampler = llama_sampler_init_penalties(penalty_last_n, penalty_repeat, penalty_freq, penalty_present);
+
+    std::vector<llama_token> history;
+
+    for (int step = 0; step < n_steps; ++step) {
+        // skewed towards the low ids so that tokens repeat within the window
+        const llama_token token = (rng() % 4 == 0) ? rng() % n_vocab : rng() % 8;
+
+        llama_sampler_accept(sampler, token);
+        history.push_back(token);
+
+        if (step == n_steps/2) {
+            // the clone must carry the window state over
+            auto * clone = llama_sampler_clone(sampler);
+            llama_sampler_free(sampler);
+            sampler = clone;
+        }
+
+        std::vector<int> count(n_vocab, 0);
+        for (size_t i = history.size() > (size_t) penalty_last_n ? history.size() - penalty_last_n : 0; i < history.size(); ++i) {
+            count[history[i]]++;
+        }
+
+        std::vector<llama_token_data> cur;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur.push_back({ id, float(id % 7) - 3.0f, 0.0f });
+        }
+
+        for (const bool shuffle : { false, true }) {
+            std::vector<llama_token_data> data = cur;
+            if (shuffle) {
+                std::shuffle(data.begin(), data.end(), rng);
+                data.resize(n_vocab/2);
+            }
+
+            llama_token_data_array cur_p = { data.data(), data.size(), -1, true };
+            llama_sampler_apply(sampler, &cur_p);
+
+            GGML_ASSERT(!cur_p.sorted);
+
+            for (size_t i = 0; i < cur_p.size; ++i) {
+                const llama_token id = cur_p.data[i].id;
+
+                float logit = cur[id].logit;
+                if (count[id] > 0) {
+                    logit = logit <= 0 ? logit * penalty_repeat : logit / penalty_repeat;
+                    logit -= float(count[id]) * penalty_freq + penalty_present;
+                }
+
+                GGML_ASSERT(fabs(cur_p.data[i].logit - logit) < 1e-5);
+            }
+        }
+    }
+
+    // after a reset nothing is penalized
+    llama_sampler_reset(sampler);
+    {
+        std::vector<llama_token_data> data = { { 0, 1.0f, 0.0f }, { 1, 2.0f, 0.0f } };
+        llama_token_data_array cur_p = { data.data(), data.size(), -1, true };
+        llama_sampler_apply(sampler, &cur_p);
+        GGML_ASSERT(data[0].logit == 1.0f && data[1].logit == 2.0f && cur_p.sorted);
+    }
+
+    llama_sampler_free(sampler);
+
+    printf("test_penalties_window: n_vocab = %d, penalty_last_n = %d, n_steps = %d OK\n", n_vocab, penalty_last_n, n_steps);
+}
+
 static void test_dry(
     const std::vector<float> & probs, const std::vector<llama_token> & last_tokens,
     const std::vector<float> & expected_probs, float dry_multiplier, float dry_base,
@@ -267,6 +346,46 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// the candidates selected from the logits must match the ones of the full vocabulary
+static void test_apply_logits(const char * name, int n_vocab, const std::vector<llama_sampler *> & samplers) {
+    std::vector<float> logits(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        logits[i] = 20.0f*((double)(rand())/RAND_MAX - 0.5);
+    }
+
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    for (auto * smpl : samplers) {
+        llama_sampler_chain_add(chain, smpl);
+    }
+
+    std::vector<llama_token_data> cur_ref(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        cur_ref[i] = llama_token_data{i, logits[i], 0.0f};
+    }
+    llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+    llama_sampler_apply(chain, &cur_p_ref);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    llama_token_data_array cur_p = { cur.data(), 0, -1, false };
+    llama_sampler_apply_logits(chain, logits.data(), n_vocab, &cur_p);
+
+    llama_sampler_free(chain);
+
+    printf("apply_logits %-24s n_vocab = %6d: %zu candidates\n", name, n_vocab, cur_p.size);
+
+    GGML_ASSERT(cur_p.size == cur_p_ref.size);
+    GGML_ASSERT(cur_p.sorted == cur_p_ref.sorted);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        const float logit = cur_p_ref.data[i].logit;
+
+        // the order of the tokens with equal logits is unspecified
+        const bool tie = (i > 0 && cur_p_ref.data[i - 1].logit == logit) || (i + 1 < cur_p.size && cur_p_ref.data[i + 1].logit == logit);
+
+        GGML_ASSERT(cur_p.data[i].logit == logit);
+        GGML_ASSERT(cur_p.data[i].id == cur_p_ref.data[i].id || tie);
+    }
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -305,6 +424,39 @@ static void test_perf() {
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
 }
 
+// full sampling of a token from the logits, as done by llama_sampler_sample for each generated token
+static void bench_sample(int32_t top_k, const char * name, int n_iter) {
+    for (const int n_vocab : { 32000, 128256, 151936, 262144 }) {
+        std::vector<float> logits(n_vocab);
+        for (int i = 0; i < n_vocab; i++) {
+            logits[i] = 20.0f*((double)(rand())/RAND_MAX - 0.5);
+        }
+
+        llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.95f, 1));
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(0.8f));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(0));
+
+        llama_sampler_sample_logits(chain, logits.data(), n_vocab);
+
+        const int64_t t_start = ggml_time_us();
+        for (int i = 0; i < n_iter; i++) {
+            llama_sampler_sample_logits(chain, logits.data(), n_vocab);
+        }
+        const int64_t t_end = ggml_time_us();
+
+        llama_sampler_free(chain);
+
+        printf("%-32s n_vocab = %6d: %10.0f ns/sample\n", name, n_vocab, 1e3*(t_end - t_start) / n_iter);
+    }
+}
+
+static void test_perf_sample() {
+    bench_sample(40,   "sample (top_k = 40)",   64);
+    bench_sample(1000, "sample (top_k = 1000)", 64);
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -352,6 +504,10 @@ int main(void) {
     test_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_penalties_window(64,   1,  200);
+    test_penalties_window(64,   16, 500);
+    test_penalties_window(1000, 64, 500);
+
 
     test_dry({0.25f, 0.25f, 0.25f, 0.25f}, {0, 1}, {0.25f, 0.25f, 0.25f, 0.25f}, 1.0f, 1.1f, 2, 4, {});
     test_dry({0.25f, 0.25f, 0.25f, 0.25f}, {0, 1, 2, 0, 1}, {0.296923f, 0.296923f, 0.296923f, 0.109232f}, 1.0f, 1.1f, 2, 5, {});
@@ -391,9 +547,18 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    for (const int n_vocab : { 1000, 32000, 262144 }) {
+        test_apply_logits("top_k",                 n_vocab, { llama_sampler_init_top_k(40) });
+        test_apply_logits("top_k (large k)",       n_vocab, { llama_sampler_init_top_k(n_vocab/2) });
+        test_apply_logits("min_p",                 n_vocab, { llama_sampler_init_min_p(0.05f, 1), llama_sampler_init_top_p(0.9f, 1) });
+        test_apply_logits("penalties, top_k",      n_vocab, { llama_sampler_init_penalties(64, 1.0f, 0.0f, 0.0f), llama_sampler_init_top_k(100), llama_sampler_init_temp(0.8f) });
+        test_apply_logits("top_p, top_k",          n_vocab, { llama_sampler_init_top_p(0.5f, 1), llama_sampler_init_top_k(40) });
+    }
+
     printf("OK\n");
 
     test_perf();
+    test_perf_sample();
 
     return 0;
 }
@@ -252,6 +252,79 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // batched tokenization, and a long text tokenized in parallel chunks
+    if (!k_tests.empty()) {
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        std::vector<std::string> texts;
+        for (const auto & test_kv : k_tests) {
+            texts.push_back(test_kv.first);
+        }
+
+        const auto res_batch = common_tokenize_batch(vocab, texts, add_special, false, 4);
+
+        size_t i = 0;
+        for (const auto & test_kv : k_tests) {
+            if (res_batch[i++] != test_kv.second) {
+                fprintf(stderr, "%s : failed batched test: '%s'\n", __func__, test_kv.first.c_str());
+                success = false;
+            }
+        }
+
+        std::string text;
+        while (text.size() < 256*1024) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+                text += " and ";
+            }
+        }
+
+        const auto res_serial   = common_tokenize(vocab, text, add_special, false);
+        const auto res_parallel = common_tokenize_batch(vocab, { text }, add_special, false, 4)[0];
+
+        if (res_serial != res_parallel) {
+            fprintf(stderr, "%s : failed parallel test: %zu tokens instead of %zu\n", __func__, res_parallel.size(), res_serial.size());
+            success = false;
+        }
+    }
+
+    // zero-copy pieces and streaming detokenization
+    if (!k_tests.empty()) {
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        std::vector<char> buf(256);
+        for (llama_token id = 0; id < llama_vocab_n_tokens(vocab); ++id) {
+            for (const bool special : { false, true }) {
+                int32_t n_chars = llama_token_to_piece(vocab, id, buf.data(), buf.size(), 0, special);
+                if (n_chars < 0) {
+                    buf.resize(-n_chars);
+                    n_chars = llama_token_to_piece(vocab, id, buf.data(), buf.size(), 0, special);
+                }
+
+                if (std::string_view(buf.data(), n_chars) != common_token_piece(vocab, id, special)) {
+                    fprintf(stderr, "%s : failed piece test for token %d\n", __func__, id);
+                    success = false;
+                }
+            }
+        }
+
+        for (const auto & test_kv : k_tests) {
+            common_detokenizer detok(vocab);
+
+            std::string pieces;
+            std::string streamed;
+            for (const auto & tok : test_kv.second) {
+                pieces   += common_token_to_piece(vocab, tok);
+                streamed += detok.push(tok);
+            }
+
+            if (detok.text() != pieces || streamed + std::string(detok.pending()) != pieces || detok.pending().size() >= 4) {
+                fprintf(stderr, "%s : failed streaming detokenization test: '%s'\n", __func__, test_kv.first.c_str());
+                success = false;
+            }
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
@@ -282,6 +355,21 @@ int main(int argc, char **argv) {
 
         fprintf(stderr, "%s : tokens: %zu\n", __func__, res.size());
 
+        {
+            const auto t_start = ggml_time_us();
+
+            const auto res_parallel = common_tokenize_batch(llama_model_get_vocab(model), { text }, add_special, false, nthread)[0];
+
+            const auto t_end = ggml_time_us();
+
+            fprintf(stderr, "%s : tokenized in %.3f ms (cpp, %d threads)\n", __func__, (t_end - t_start) / 1000.0, nthread);
+
+            if (res_parallel != res) {
+                fprintf(stderr, "%s : error: the parallel tokenization differs\n", __func__);
+                success = false;
+            }
+        }
+
         {
             const std::string fname_out = fname_text + ".tokcpp";
 
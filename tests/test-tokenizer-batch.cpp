@@ -0,0 +1,190 @@
+// check that llama_tokenize_batch gives the same tokens as llama_tokenize, in particular for a long text that is
+// tokenized in parallel chunks
+#include "llama.h"
+#include "common.h"
+#include "gguf.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// a long text with words, punctuation, numbers, several spaces, new lines and non-ASCII characters
+static std::string make_text(size_t size) {
+    static const char * k_lines[] = {
+        "The quick brown fox jumps over the lazy dog, and then it runs away.",
+        "In 2024 there were 1234567 tokens in 89 files - about 13870 tokens per file!",
+        "  indented   text\twith tabs and    several spaces\n\n",
+        "Ünïcödé wörds like naïve café, Straße and Ångström sit between the ASCII ones.",
+        "日本語のテキスト and 中文 text, 한국어 too: привет мир, γειά σου κόσμε.",
+        "def main(args): return [x**2 for x in args if x % 3 == 0]  # list comprehension",
+        "She said: \"I'll go, you're staying, we've been there, they'd know.\"\r\n",
+        "emoji 🦙🔥 and symbols → ∑ ∞ ≠ are rare; <tags> & {braces} [brackets] too.",
+    };
+
+    std::string text;
+    for (size_t i = 0; text.size() < size; ++i) {
+        text += k_lines[i % (sizeof(k_lines)/sizeof(k_lines[0]))];
+        text += i % 3 == 0 ? "\n" : " ";
+    }
+
+    return text;
+}
+
+// a SuperBPE variant of a byte-level BPE vocab: its pre-tokenizer does not split at the spaces, and extra merges
+// of the ASCII letters with the space after them cross the word boundaries of the other pre-tokenizers
+static bool make_superbpe_vocab(const char * fname_vocab, const char * fname_out) {
+    gguf_init_params gparams = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ nullptr,
+    };
+
+    gguf_context * src = gguf_init_from_file(fname_vocab, gparams);
+    if (src == nullptr) {
+        fprintf(stderr, "%s: failed to read vocab from '%s'\n", __func__, fname_vocab);
+        return false;
+    }
+
+    gguf_context * dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+    gguf_free(src);
+
+    gguf_set_val_str(dst, "tokenizer.ggml.pre", "superbpe");
+
+    const auto append_str = [&](const char * key, const std::vector<std::string> & strs_new, bool front) {
+        const int64_t id = gguf_find_key(dst, key);
+
+        std::vector<std::string> strs;
+        for (size_t i = 0; i < gguf_get_arr_n(dst, id); ++i) {
+            strs.push_back(gguf_get_arr_str(dst, id, i));
+        }
+        strs.insert(front ? strs.begin() : strs.end(), strs_new.begin(), strs_new.end());
+
+        std::vector<const char *> data;
+        for (const auto & s : strs) {
+            data.push_back(s.c_str());
+        }
+        gguf_set_arr_str(dst, key, data.data(), data.size());
+    };
+
+    // "Ġ" is the byte-level form of the space
+    std::vector<std::string> tokens;
+    std::vector<std::string> merges;
+    for (const char * c = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"; *c; ++c) {
+        tokens.push_back(std::string(1, *c) + "\xC4\xA0");
+        merges.push_back(std::string(1, *c) + " \xC4\xA0");
+    }
+
+    append_str("tokenizer.ggml.tokens", tokens, false);
+    append_str("tokenizer.ggml.merges", merges, true);
+
+    {
+        const int64_t id = gguf_find_key(dst, "tokenizer.ggml.token_type");
+        if (id >= 0) {
+            const int32_t * types = (const int32_t *) gguf_get_arr_data(dst, id);
+
+            std::vector<int32_t> data(types, types + gguf_get_arr_n(dst, id));
+            data.insert(data.end(), tokens.size(), LLAMA_TOKEN_TYPE_NORMAL);
+            gguf_set_arr_data(dst, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, data.data(), data.size());
+        }
+    }
+
+    const bool ok = gguf_write_to_file(dst, fname_out, false);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out);
+    }
+
+    gguf_free(dst);
+
+    return ok;
+}
+
+static bool test_vocab(const char * fname, const std::string & text) {
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(fname, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname);
+        return false;
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    bool success = true;
+
+    // a long text, split in chunks
+    {
+        const auto res_serial   = common_tokenize(vocab, text, false, false);
+        const auto res_parallel = common_tokenize_batch(vocab, { text }, false, false, 4)[0];
+
+        if (res_serial != res_parallel) {
+            size_t i = 0;
+            while (i < res_serial.size() && i < res_parallel.size() && res_serial[i] == res_parallel[i]) {
+                i++;
+            }
+            fprintf(stderr, "%s: '%s': the parallel tokens differ from token %zu (%zu tokens instead of %zu)\n",
+                __func__, fname, i, res_parallel.size(), res_serial.size());
+            success = false;
+        }
+    }
+
+    // a batch of short texts
+    {
+        std::vector<std::string> texts;
+        for (size_t pos = 0; pos < 8*1024; pos += 97) {
+            texts.push_back(text.substr(pos, 200));
+        }
+
+        const auto res_batch = common_tokenize_batch(vocab, texts, true, false, 4);
+
+        for (size_t i = 0; i < texts.size(); ++i) {
+            if (res_batch[i] != common_tokenize(vocab, texts[i], true, false)) {
+                fprintf(stderr, "%s: '%s': the batched tokens of text %zu differ\n", __func__, fname, i);
+                success = false;
+            }
+        }
+    }
+
+    llama_model_free(model);
+
+    fprintf(stderr, "%s: '%s': %s\n", __func__, fname, success ? "OK" : "FAILED");
+
+    return success;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab-file> [<vocab-file> ...]\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    // several chunks for each of the threads
+    const std::string text = make_text(256*1024);
+
+    bool success = true;
+
+    for (int i = 1; i < argc; ++i) {
+        success = test_vocab(argv[i], text) && success;
+
+        const std::string fname = argv[i];
+        if (fname.find("ggml-vocab-gpt-2.gguf") != std::string::npos) {
+            const char * fname_superbpe = "test-tokenizer-batch-superbpe.gguf";
+
+            success = make_superbpe_vocab(argv[i], fname_superbpe) && test_vocab(fname_superbpe, text) && success;
+
+            remove(fname_superbpe);
+        }
+    }
+
+    llama_backend_free();
+
+    if (!success) {
+        return 1;
+    }
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
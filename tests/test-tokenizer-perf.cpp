@@ -0,0 +1,242 @@
+// checks the custom pre-tokenizer regex splitters against std::regex, on random text and on the texts of the
+// vocab tests given as arguments (models/ggml-vocab-*.gguf.inp)
+// with --bench <vocab-file>, also measures the tokenization throughput on ~1 MB of text (not run by ctest)
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "common.h"
+#include "unicode.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// pre-tokenizer regexes with a custom implementation in unicode.cpp (see llm_tokenizer_bpe)
+static const std::vector<std::vector<std::string>> k_regex_exprs = {
+    { // gpt2
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    },
+    { // llama3
+        "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    },
+    { // qwen2
+        "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    },
+    { // deepseek-coder
+        "[\r\n]",
+        "\\s?\\p{L}+",
+        "\\s?\\p{P}+",
+        "[一-龥ࠀ-一가-퟿]+",
+        "\\p{N}",
+    },
+    { // falcon
+        "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        "[0-9][0-9][0-9]",
+    },
+    { // starcoder
+        "\\p{N}",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+    },
+    { // default
+        "[\\p{P}\\$\\+<=>\\^~\\|]+",
+        "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+        "\\p{N}+",
+        "[0-9][0-9][0-9]",
+    },
+    {
+        "\\p{N}+",
+        "\\p{N}{1,3}",
+    },
+};
+
+// random text over codepoints that exercise the character classes of the regexes above
+static std::string random_text(std::mt19937 & rng, size_t n_cpts) {
+    static const std::vector<uint32_t> k_cpts = {
+        ' ', ' ', ' ', ' ', '\t', '\n', '\n', '\r', '\v', '\f', '\'', '\'', '`', '$', '+', '<', '=', '>', '^', '~', '|', '!', '?', '.', ',', '_', '-', '(', ')', '{', '}', '[', ']', '\\', '/', '@', '#', '%', '&', '*', ':', ';', '"',
+        '0', '1', '2', '3', '9', 'a', 'b', 'e', 'l', 'm', 'r', 's', 't', 'v', 'd', 'A', 'L', 'S', 'T', 'Z',
+        0x00A0, 0x0085, 0x1680, 0x2003, 0x2028, 0x3000,           // non-ASCII whitespaces
+        0x00B2, 0x00BD, 0x0660, 0x0967, 0x2160, 0xFF10,           // non-ASCII numbers
+        0x00E4, 0x00DF, 0x0416, 0x05D0, 0x0627, 0x1F08, 0x3042, 0x30AB, 0x4E00, 0x4F60, 0x9FA5, 0x9FA6, 0xAC00, 0xD55C, // letters
+        0x0800, 0x0815, 0x0301, 0x200D, 0xFE0F,                   // marks and format characters
+        0x00A1, 0x00BF, 0x2014, 0x2026, 0x3001, 0x3002, 0xFF01, 0xFF0C, // punctuation
+        0x00A9, 0x20AC, 0x2713, 0x1F600, 0x1F999,                 // symbols
+        0xFFFD, 0xE000,
+    };
+
+    std::string res;
+    for (size_t i = 0; i < n_cpts; ++i) {
+        res += unicode_cpt_to_utf8(k_cpts[rng() % k_cpts.size()]);
+    }
+
+    return res;
+}
+
+static void test_regex_split_custom() {
+    fprintf(stderr, "%s : checking the custom regex splitters against std::regex\n", __func__);
+
+    std::mt19937 rng(42);
+
+    for (const auto & regex_exprs : k_regex_exprs) {
+        for (int i = 0; i < 1000; ++i) {
+            const std::string text = random_text(rng, 1 + rng() % 64);
+
+            const auto res_custom = unicode_regex_split(text, regex_exprs, true);
+            const auto res_stl    = unicode_regex_split(text, regex_exprs, false);
+
+            if (res_custom != res_stl) {
+                fprintf(stderr, "%s : mismatch for regex '%s' on text '%s'\n", __func__, regex_exprs.back().c_str(), text.c_str());
+                for (const auto & word : res_custom) {
+                    fprintf(stderr, "  custom: '%s'\n", word.c_str());
+                }
+                for (const auto & word : res_stl) {
+                    fprintf(stderr, "  stl:    '%s'\n", word.c_str());
+                }
+            }
+            assert(res_custom == res_stl);
+        }
+    }
+}
+
+// the texts of the vocab tests are real tokenizer inputs - the custom splitters of the pre-tokenizers whose vocab
+// files are not in models/ (e.g. llama3, qwen2) are only checked here
+static void test_regex_split_custom_texts(const std::vector<std::string> & fnames_inp) {
+    const std::string sep = "\n__ggml_vocab_test__\n";
+
+    for (const auto & fname : fnames_inp) {
+        fprintf(stderr, "%s : checking the custom regex splitters against std::regex on '%s'\n", __func__, fname.c_str());
+
+        std::ifstream ifs(fname);
+        assert(ifs && "could not open the texts");
+
+        const std::string all((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+        std::vector<std::string> texts = { all };
+        for (size_t pos = 0; pos < all.size(); ) {
+            size_t end = all.find(sep, pos);
+            if (end == std::string::npos) {
+                end = all.size();
+            }
+            texts.push_back(all.substr(pos, end - pos));
+            pos = end + sep.size();
+        }
+
+        for (const auto & regex_exprs : k_regex_exprs) {
+            for (const auto & text : texts) {
+                const auto res_custom = unicode_regex_split(text, regex_exprs, true);
+                const auto res_stl    = unicode_regex_split(text, regex_exprs, false);
+
+                if (res_custom != res_stl) {
+                    fprintf(stderr, "%s : mismatch for regex '%s' on text '%s'\n", __func__, regex_exprs.back().c_str(), text.c_str());
+                }
+                assert(res_custom == res_stl);
+            }
+        }
+    }
+}
+
+static double mb_per_s(size_t n_bytes, std::chrono::steady_clock::time_point t_start) {
+    const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    return n_bytes / t / 1e6;
+}
+
+// tokenization throughput of a mix of prose, code and non-latin text
+static void test_tokenize_perf(const llama_vocab * vocab) {
+    static const std::vector<std::string> k_chunks = {
+        "The quick brown fox jumps over the lazy dog. ",
+        "It's 2025 and we've got 1234567 tokens to process, don't we? ",
+        "    for (int i = 0; i < n; ++i) {\n        sum += a[i] * b[i];\n    }\n",
+        "Привет, как дела? ",
+        "我想在apple工作1314151天～ ",
+        "🦙 llama.cpp 🚀 ",
+        "\n\n\t",
+    };
+
+    std::mt19937 rng(42);
+
+    std::string text;
+    while (text.size() < 1024*1024) {
+        text += k_chunks[rng() % k_chunks.size()];
+    }
+
+    std::vector<llama_token> tokens(text.size() + 16);
+
+    for (const char * pass : { "cold", "warm" }) {
+        const auto t_start = std::chrono::steady_clock::now();
+
+        const int32_t n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), false, false);
+        assert(n_tokens > 0);
+
+        fprintf(stderr, "%s : %s cache: %zu bytes -> %d tokens, %.2f MB/s\n", __func__, pass, text.size(), n_tokens, mb_per_s(text.size(), t_start));
+    }
+
+    {
+        const int n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        const auto t_start = std::chrono::steady_clock::now();
+
+        const auto res = common_tokenize_batch(vocab, { text }, false, false, n_threads)[0];
+
+        fprintf(stderr, "%s : %d threads: %zu tokens, %.2f MB/s\n", __func__, n_threads, res.size(), mb_per_s(text.size(), t_start));
+
+        assert(res == common_tokenize(vocab, text, false, false));
+    }
+
+    for (const bool use_custom : { false, true }) {
+        const auto t_start = std::chrono::steady_clock::now();
+
+        const auto words = unicode_regex_split(text, k_regex_exprs[0], use_custom);
+
+        fprintf(stderr, "%s : gpt2 pre-tokenizer (%s): %zu words, %.2f MB/s\n", __func__, use_custom ? "custom" : "std::regex", words.size(), mb_per_s(text.size(), t_start));
+    }
+}
+
+int main(int argc, char ** argv) {
+    const char * fname_bench = nullptr;
+
+    std::vector<std::string> fnames_inp;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--bench" && i + 1 < argc) {
+            fname_bench = argv[++i];
+        } else if (std::string(argv[i]).rfind("--", 0) == 0) {
+            fprintf(stderr, "usage: %s [<vocab-test-texts> ...] [--bench <vocab-file>]\n", argv[0]);
+            return 1;
+        } else {
+            fnames_inp.push_back(argv[i]);
+        }
+    }
+
+    test_regex_split_custom();
+    test_regex_split_custom_texts(fnames_inp);
+
+    if (fname_bench) {
+        llama_backend_init();
+
+        auto mparams = llama_model_default_params();
+        mparams.vocab_only = true;
+
+        llama_model * model = llama_model_load_from_file(fname_bench, mparams);
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname_bench);
+            return 1;
+        }
+
+        test_tokenize_perf(llama_model_get_vocab(model));
+
+        llama_model_free(model);
+        llama_backend_free();
+    }
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}